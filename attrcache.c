@@ -0,0 +1,282 @@
+/*
+   Attribute cache of the emulated clients
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+/*
+ * The attributes each traced client would have cached, per object as a
+ * kernel client keeps them per inode, so that a replay can leave out the
+ * GETATTR, ACCESS and LOOKUP calls such a client would not have sent.
+ *
+ * Attributes stay fresh for a timeout that starts at acregmin, or
+ * acdirmin for a directory. Every time fresh attributes come in after
+ * the timeout, the timeout doubles up to acregmax or acdirmax if they did
+ * not change, and goes back to its minimum if they did, as the Linux
+ * client does. Time is the traced time of the ops, in usec.
+ *
+ * The cache is shared by the workers, which may replay ops of the same
+ * client, and striped over ATTRCACHE_STRIPES locks.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <nfsc/libnfs.h>
+#include <nfsc/libnfs-raw.h>
+#include <nfsc/libnfs-raw-nfs.h>
+#include "attrcache.h"
+#include "fhcache.h"
+
+#define ATTRCACHE_STRIPE_BITS	6
+#define ATTRCACHE_STRIPES	(1 << ATTRCACHE_STRIPE_BITS)
+#define ATTRCACHE_TABLE_SIZE	256
+
+struct attr_entry {
+	struct attr_entry *next;
+	uint32_t hash;
+	int client;
+	uint32_t fh_len;
+	char fh[FHCACHE_FHSIZE];
+
+	fattr3 attr;
+	uint64_t fetched;
+	uint64_t timeo;
+
+	int has_access;
+	uint32_t access_desired;
+	uint32_t access;
+};
+
+struct attr_stripe {
+	pthread_mutex_t lock;
+	struct attr_entry **buckets;
+	uint32_t size;
+	uint32_t count;
+} __attribute__((aligned(64)));
+
+struct attrcache {
+	uint64_t regmin, regmax;
+	uint64_t dirmin, dirmax;
+	struct attr_stripe stripe[ATTRCACHE_STRIPES];
+};
+
+static uint32_t attr_hash(int client, const char *fh, uint32_t len)
+{
+	uint32_t h = 2166136261U ^ (uint32_t)client;
+	uint32_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)fh[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+static struct attr_stripe *stripe_of(struct attrcache *c, uint32_t hash)
+{
+	return &c->stripe[hash >> (32 - ATTRCACHE_STRIPE_BITS)];
+}
+
+static struct attr_entry *find_entry(struct attr_stripe *s, uint32_t hash, int client,
+				     const char *fh, uint32_t len)
+{
+	struct attr_entry *e;
+
+	for (e = s->buckets[hash & (s->size - 1)]; e != NULL; e = e->next) {
+		if (e->hash == hash && e->client == client && e->fh_len == len &&
+		    memcmp(e->fh, fh, len) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void stripe_resize(struct attr_stripe *s)
+{
+	struct attr_entry **old = s->buckets, *e, *next;
+	uint32_t i, old_size = s->size;
+
+	s->size = old_size ? old_size * 2 : ATTRCACHE_TABLE_SIZE;
+	s->buckets = calloc(s->size, sizeof(struct attr_entry *));
+	if (s->buckets == NULL) {
+		fprintf(stderr, "CALLOC failed to allocate the attribute cache\n");
+		exit(10);
+	}
+	for (i = 0; i < old_size; i++) {
+		for (e = old[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = s->buckets[e->hash & (s->size - 1)];
+			s->buckets[e->hash & (s->size - 1)] = e;
+		}
+	}
+	free(old);
+}
+
+static int attr_fresh(const struct attr_entry *e, uint64_t now)
+{
+	return now < e->fetched + e->timeo;
+}
+
+void attrcache_update(struct attrcache *c, int client, const char *fh, uint32_t len,
+		      const fattr3 *attr, uint64_t now)
+{
+	uint32_t hash = attr_hash(client, fh, len);
+	struct attr_stripe *s = stripe_of(c, hash);
+	uint64_t min, max;
+	struct attr_entry *e;
+
+	if (len > FHCACHE_FHSIZE) {
+		return;
+	}
+	if (attr->type == NF3DIR) {
+		min = c->dirmin;
+		max = c->dirmax;
+	} else {
+		min = c->regmin;
+		max = c->regmax;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	e = find_entry(s, hash, client, fh, len);
+	if (e == NULL) {
+		if ((s->count + 1) * 4 > s->size * 3) {
+			stripe_resize(s);
+		}
+		e = malloc(sizeof(struct attr_entry));
+		if (e == NULL) {
+			fprintf(stderr, "MALLOC failed to allocate cached attributes\n");
+			exit(10);
+		}
+		e->hash   = hash;
+		e->client = client;
+		e->fh_len = len;
+		memcpy(e->fh, fh, len);
+		e->timeo  = min;
+		e->has_access = 0;
+		e->next = s->buckets[hash & (s->size - 1)];
+		s->buckets[hash & (s->size - 1)] = e;
+		s->count++;
+	} else if (e->attr.size != attr->size ||
+		   e->attr.mtime.seconds != attr->mtime.seconds ||
+		   e->attr.mtime.nseconds != attr->mtime.nseconds ||
+		   e->attr.ctime.seconds != attr->ctime.seconds ||
+		   e->attr.ctime.nseconds != attr->ctime.nseconds) {
+		/* changed behind the client's back */
+		e->timeo = min;
+		e->has_access = 0;
+	} else if (!attr_fresh(e, now)) {
+		e->timeo = e->timeo * 2 > max ? max : e->timeo * 2;
+		if (e->timeo < min) {
+			e->timeo = min;
+		}
+	}
+	e->attr    = *attr;
+	e->fetched = now;
+	pthread_mutex_unlock(&s->lock);
+}
+
+int attrcache_getattr(struct attrcache *c, int client, const char *fh, uint32_t len,
+		      uint64_t now, fattr3 *attr)
+{
+	uint32_t hash = attr_hash(client, fh, len);
+	struct attr_stripe *s = stripe_of(c, hash);
+	struct attr_entry *e;
+	int fresh;
+
+	pthread_mutex_lock(&s->lock);
+	e = find_entry(s, hash, client, fh, len);
+	fresh = e != NULL && attr_fresh(e, now);
+	if (fresh && attr != NULL) {
+		*attr = e->attr;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return fresh;
+}
+
+void attrcache_set_access(struct attrcache *c, int client, const char *fh, uint32_t len,
+			  uint32_t desired, uint32_t access, uint64_t now)
+{
+	uint32_t hash = attr_hash(client, fh, len);
+	struct attr_stripe *s = stripe_of(c, hash);
+	struct attr_entry *e;
+
+	pthread_mutex_lock(&s->lock);
+	e = find_entry(s, hash, client, fh, len);
+	if (e != NULL && attr_fresh(e, now)) {
+		e->has_access     = 1;
+		e->access_desired = desired;
+		e->access         = access;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+int attrcache_access(struct attrcache *c, int client, const char *fh, uint32_t len,
+		     uint32_t desired, uint64_t now, uint32_t *access)
+{
+	uint32_t hash = attr_hash(client, fh, len);
+	struct attr_stripe *s = stripe_of(c, hash);
+	struct attr_entry *e;
+	int fresh;
+
+	pthread_mutex_lock(&s->lock);
+	e = find_entry(s, hash, client, fh, len);
+	fresh = e != NULL && attr_fresh(e, now) && e->has_access &&
+		(desired & ~e->access_desired) == 0;
+	if (fresh && access != NULL) {
+		*access = e->access & desired;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return fresh;
+}
+
+struct attrcache *attrcache_new(const struct attrcache_timeo *timeo)
+{
+	struct attrcache *c;
+	int i;
+
+	if (posix_memalign((void **)&c, 64, sizeof(struct attrcache)) != 0) {
+		fprintf(stderr, "Failed to allocate the attribute cache\n");
+		exit(10);
+	}
+	memset(c, 0, sizeof(struct attrcache));
+	c->regmin = timeo->acregmin * 1000000ULL;
+	c->regmax = timeo->acregmax * 1000000ULL;
+	c->dirmin = timeo->acdirmin * 1000000ULL;
+	c->dirmax = timeo->acdirmax * 1000000ULL;
+	for (i = 0; i < ATTRCACHE_STRIPES; i++) {
+		pthread_mutex_init(&c->stripe[i].lock, NULL);
+		stripe_resize(&c->stripe[i]);
+	}
+	return c;
+}
+
+void attrcache_free(struct attrcache *c)
+{
+	struct attr_entry *e, *next;
+	uint32_t i, j;
+
+	for (i = 0; i < ATTRCACHE_STRIPES; i++) {
+		for (j = 0; j < c->stripe[i].size; j++) {
+			for (e = c->stripe[i].buckets[j]; e != NULL; e = next) {
+				next = e->next;
+				free(e);
+			}
+		}
+		free(c->stripe[i].buckets);
+		pthread_mutex_destroy(&c->stripe[i].lock);
+	}
+	free(c);
+}
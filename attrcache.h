@@ -0,0 +1,49 @@
+/*
+   Attribute cache of the emulated clients
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#ifndef _ATTRCACHE_H_
+#define _ATTRCACHE_H_
+
+#include <stdint.h>
+
+struct attrcache;
+struct fattr3;
+
+/* the timeouts of the attributes of files and directories, in seconds */
+struct attrcache_timeo {
+	int acregmin;
+	int acregmax;
+	int acdirmin;
+	int acdirmax;
+};
+
+struct attrcache *attrcache_new(const struct attrcache_timeo *timeo);
+void attrcache_free(struct attrcache *c);
+
+/*
+ * The attributes of the object with handle fh, as traced client client
+ * has them cached at time now, in usec. Lookups return 1 and fill in
+ * what they are asked for while the attributes are fresh, 0 otherwise.
+ */
+void attrcache_update(struct attrcache *c, int client, const char *fh, uint32_t len,
+		      const struct fattr3 *attr, uint64_t now);
+int attrcache_getattr(struct attrcache *c, int client, const char *fh, uint32_t len,
+		      uint64_t now, struct fattr3 *attr);
+
+/* ACCESS results, kept for as long as the attributes are fresh */
+void attrcache_set_access(struct attrcache *c, int client, const char *fh, uint32_t len,
+			  uint32_t desired, uint32_t access, uint64_t now);
+int attrcache_access(struct attrcache *c, int client, const char *fh, uint32_t len,
+		     uint32_t desired, uint64_t now, uint32_t *access);
+
+#endif /* _ATTRCACHE_H_ */
@@ -0,0 +1,595 @@
+/*
+   Microbenchmarks of the handle cache, trace parsing and op dispatch
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <popt.h>
+#include <zlib.h>
+
+#include "fhcache.h"
+#include "trace.h"
+
+/*
+ * Each benchmark runs --repeat times over the same inputs, made up from
+ * --seed, and its fastest run is reported as a line
+ *
+ *     @B name count ns/op ops/sec
+ *
+ * to be compared from one build to the next.
+ *
+ * The handle cache is filled with three sets of paths: "tree", 100
+ * directories of 100 directories holding --entries entries in all, as an
+ * export of home or project directories, "deep", chains of directories 16
+ * levels deep, and "sorted", one directory of names inserted in sorted
+ * order, these two with a tenth of the entries. Each set is inserted
+ * parents first, looked up in a shuffled order, looked up by names that
+ * are not cached, and deleted children first.
+ *
+ * Traces are a made up mix of ops over the "tree" paths, parsed as text
+ * and as a binary trace. Dispatch is what every op of a replay goes
+ * through besides its call: its name looked up and its status checked.
+ */
+
+#define DEEP_LEVELS	16
+#define TREE_FANOUT	100
+#define MISSES_MAX	(1 << 20)
+
+static struct {
+	int entries;
+	int lines;
+	int repeat;
+	int seed;
+	const char *only;
+	const char *dir;
+} options = {
+	.entries = 10000000,
+	.lines   = 1000000,
+	.repeat  = 3,
+	.seed    = 1,
+	.dir     = "/tmp",
+};
+
+/* what the compiler may not optimize away */
+static volatile uint64_t sink;
+
+static uint64_t clock_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static void *xmalloc(size_t len)
+{
+	void *p = malloc(len);
+
+	if (p == NULL) {
+		fprintf(stderr, "MALLOC failed to allocate %zu bytes\n", len);
+		exit(10);
+	}
+	return p;
+}
+
+static int selected(const char *name)
+{
+	return options.only == NULL || strstr(name, options.only) != NULL;
+}
+
+static void report(const char *name, uint64_t count, uint64_t nsec)
+{
+	if (nsec == 0) {
+		nsec = 1;
+	}
+	printf("@B %s %" PRIu64 " %.1f %.0f\n", name, count,
+	       (double)nsec / count, count * 1.0e9 / nsec);
+	fflush(stdout);
+}
+
+/* the best of the runs of each phase of a benchmark */
+struct best {
+	uint64_t nsec;
+};
+
+static void best_add(struct best *b, uint64_t nsec)
+{
+	if (b->nsec == 0 || nsec < b->nsec) {
+		b->nsec = nsec;
+	}
+}
+
+/*
+ * Path sets, made in full before they are timed. Entry i of a set only
+ * has parents among the entries before it.
+ */
+struct paths {
+	uint64_t count;
+	uint64_t *off;
+	char *data;
+	size_t size, used;
+};
+
+static void deep_path(char *buf, uint64_t i)
+{
+	int n = sprintf(buf, "/c%" PRIu64, i / DEEP_LEVELS);
+	unsigned l;
+
+	for (l = 1; l <= i % DEEP_LEVELS; l++) {
+		n += sprintf(buf + n, "/l%u", l);
+	}
+}
+
+static void sorted_path(char *buf, uint64_t i)
+{
+	if (i == 0) {
+		strcpy(buf, "/sorted");
+	} else {
+		sprintf(buf, "/sorted/f%010" PRIu64, i);
+	}
+}
+
+static void tree_path(char *buf, uint64_t i)
+{
+	uint64_t dirs = TREE_FANOUT * TREE_FANOUT, f;
+
+	if (i < TREE_FANOUT) {
+		sprintf(buf, "/d%02u", (unsigned)i);
+	} else if (i < TREE_FANOUT + dirs) {
+		i -= TREE_FANOUT;
+		sprintf(buf, "/d%02u/d%02u", (unsigned)(i / TREE_FANOUT),
+			(unsigned)(i % TREE_FANOUT));
+	} else {
+		f = i - TREE_FANOUT - dirs;
+		sprintf(buf, "/d%02u/d%02u/f%" PRIu64, (unsigned)(f % dirs / TREE_FANOUT),
+			(unsigned)(f % TREE_FANOUT), f / dirs);
+	}
+}
+
+/* entries first to first + count of a set, with suffix added to each */
+static void paths_make(struct paths *p, uint64_t first, uint64_t count,
+		       void (*make)(char *buf, uint64_t i), const char *suffix)
+{
+	char buf[1024];
+	size_t len;
+	uint64_t i;
+
+	memset(p, 0, sizeof(*p));
+	p->count = count;
+	p->off   = xmalloc(count * sizeof(uint64_t));
+	for (i = 0; i < count; i++) {
+		make(buf, first + i);
+		strcat(buf, suffix);
+		len = strlen(buf) + 1;
+		if (p->used + len > p->size) {
+			p->size = p->size ? p->size * 2 : 1024 * 1024;
+			p->data = realloc(p->data, p->size);
+			if (p->data == NULL) {
+				fprintf(stderr, "REALLOC failed to allocate %zu bytes\n", p->size);
+				exit(10);
+			}
+		}
+		memcpy(p->data + p->used, buf, len);
+		p->off[i] = p->used;
+		p->used  += len;
+	}
+}
+
+static const char *paths_get(const struct paths *p, uint64_t i)
+{
+	return p->data + p->off[i];
+}
+
+static void paths_free(struct paths *p)
+{
+	free(p->off);
+	free(p->data);
+}
+
+/* the order lookups go in, the same for every run */
+static uint32_t *shuffled(uint64_t count)
+{
+	uint32_t *order = xmalloc(count * sizeof(uint32_t)), t;
+	uint64_t s = (uint64_t)options.seed * 0x9e3779b97f4a7c15ULL | 1, i, j;
+
+	for (i = 0; i < count; i++) {
+		order[i] = i;
+	}
+	for (i = count - 1; i > 0; i--) {
+		j = xorshift(&s) % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	return order;
+}
+
+static void bench_fhcache(const char *set, uint64_t count,
+			  void (*make)(char *buf, uint64_t i))
+{
+	struct best insert = { 0 }, hit = { 0 }, miss = { 0 }, del = { 0 };
+	struct fhcache_handle h;
+	struct paths paths, misses;
+	struct fhcache *c;
+	char name[64], export[64], fh[32];
+	uint64_t i, t, found, nmisses;
+	uint32_t *order;
+	int run;
+
+	snprintf(name, sizeof(name), "fhcache/%s", set);
+	if (!selected(name) || count == 0) {
+		return;
+	}
+	nmisses = count < MISSES_MAX ? count : MISSES_MAX;
+	paths_make(&paths, 0, count, make, "");
+	paths_make(&misses, count - nmisses, nmisses, make, "~");
+	order = shuffled(count);
+	memset(fh, 0, sizeof(fh));
+
+	for (run = 0; run < options.repeat; run++) {
+		snprintf(export, sizeof(export), "/%s/%d", set, run);
+		c = fhcache_get("bench", export, "root", 4);
+
+		t = clock_nsec();
+		for (i = 0; i < count; i++) {
+			memcpy(fh, &i, sizeof(i));
+			fhcache_insert(c, paths_get(&paths, i), fh, sizeof(fh), 0);
+		}
+		best_add(&insert, clock_nsec() - t);
+
+		found = 0;
+		t = clock_nsec();
+		for (i = 0; i < count; i++) {
+			found += fhcache_lookup(c, paths_get(&paths, order[i]), &h);
+		}
+		best_add(&hit, clock_nsec() - t);
+		if (found != count) {
+			fprintf(stderr, "%s: %" PRIu64 " of %" PRIu64 " paths found\n",
+				name, found, count);
+			exit(1);
+		}
+
+		t = clock_nsec();
+		for (i = 0; i < nmisses; i++) {
+			found += fhcache_lookup(c, paths_get(&misses, order[i] % nmisses), &h);
+		}
+		best_add(&miss, clock_nsec() - t);
+		if (found != count) {
+			fprintf(stderr, "%s: paths found that were not cached\n", name);
+			exit(1);
+		}
+
+		t = clock_nsec();
+		for (i = count; i > 0; i--) {
+			fhcache_delete(c, paths_get(&paths, i - 1));
+		}
+		best_add(&del, clock_nsec() - t);
+		sink += h.len;
+
+		fhcache_put(c);
+	}
+
+	snprintf(name, sizeof(name), "fhcache/%s/insert", set);
+	report(name, count, insert.nsec);
+	snprintf(name, sizeof(name), "fhcache/%s/lookup", set);
+	report(name, count, hit.nsec);
+	snprintf(name, sizeof(name), "fhcache/%s/lookup-miss", set);
+	report(name, nmisses, miss.nsec);
+	snprintf(name, sizeof(name), "fhcache/%s/delete", set);
+	report(name, count, del.nsec);
+
+	free(order);
+	paths_free(&misses);
+	paths_free(&paths);
+}
+
+/* the ops of the made up traces, out of 256 */
+static const struct {
+	int opcode;
+	int weight;
+} trace_mix[] = {
+	{ OP_GETATTR3,     50 },
+	{ OP_LOOKUP3,      50 },
+	{ OP_ACCESS3,      25 },
+	{ OP_READ3,        65 },
+	{ OP_WRITE3,       40 },
+	{ OP_CREATE3,       8 },
+	{ OP_REMOVE3,       8 },
+	{ OP_READDIRPLUS3,  5 },
+	{ OP_SETATTR3,      2 },
+	{ OP_RENAME3,       3 },
+};
+
+/* a text trace of ops over the "tree" paths, as a server sees them */
+static int make_text_trace(const char *path, uint64_t lines)
+{
+	uint64_t s = (uint64_t)options.seed * 0x9e3779b97f4a7c15ULL | 1, i, r, files;
+	char fname[256], fname2[sizeof(fname) + 8];
+	unsigned j;
+	int pick;
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s. %s\n", path, strerror(errno));
+		return -1;
+	}
+	files = (uint64_t)options.entries > TREE_FANOUT * (TREE_FANOUT + 1) ?
+		options.entries - TREE_FANOUT * (TREE_FANOUT + 1) : 1;
+	for (i = 0; i < lines; i++) {
+		r = xorshift(&s);
+		tree_path(fname, TREE_FANOUT * (TREE_FANOUT + 1) + (r >> 16) % files);
+		pick = r >> 8 & 0xff;
+		for (j = 0; pick >= trace_mix[j].weight; j++) {
+			pick -= trace_mix[j].weight;
+		}
+
+		fprintf(f, "%" PRIu64 ".%06" PRIu64 " %" PRIu64 " %s ",
+			i / 1000, i % 1000 * 1000, r % 64 + 1,
+			trace_op_name(trace_mix[j].opcode));
+		switch (trace_mix[j].opcode) {
+		case OP_LOOKUP3:
+			fprintf(f, "\"%s\" 0x%08x\n", fname, r & 1 ? 0 : 2);
+			break;
+		case OP_ACCESS3:
+			fprintf(f, "\"%s\" 0 31 0x00000000\n", fname);
+			break;
+		case OP_READ3:
+			fprintf(f, "\"%s\" %" PRIu64 " 32768 0x00000000\n",
+				fname, (r >> 32 & 0xff) * 32768);
+			break;
+		case OP_WRITE3:
+			fprintf(f, "\"%s\" %" PRIu64 " 32768 2 0x00000000\n",
+				fname, (r >> 32 & 0xff) * 32768);
+			break;
+		case OP_READDIRPLUS3:
+			*strrchr(fname, '/') = 0;
+			fprintf(f, "\"%s\" *\n", fname);
+			break;
+		case OP_RENAME3:
+			snprintf(fname2, sizeof(fname2), "%s.tmp", fname);
+			fprintf(f, "\"%s\" \"%s\" 0x00000000\n", fname2, fname);
+			break;
+		default:
+			fprintf(f, "\"%s\" 0x00000000\n", fname);
+			break;
+		}
+	}
+	if (fclose(f) != 0) {
+		fprintf(stderr, "Failed to write %s. %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* read the whole of a trace, the ops go nowhere */
+static uint64_t read_trace(const char *path, uint64_t *count)
+{
+	struct dbench_op op;
+	struct trace *trace;
+	uint64_t t;
+	int ret;
+
+	*count = 0;
+	t = clock_nsec();
+	trace = trace_open(path);
+	if (trace == NULL) {
+		exit(1);
+	}
+	while ((ret = trace_next(trace, &op)) > 0) {
+		sink += op.opcode;
+		trace_release(trace, op.line);
+		(*count)++;
+	}
+	trace_close(trace);
+	t = clock_nsec() - t;
+	if (ret < 0) {
+		exit(1);
+	}
+	return t;
+}
+
+static int convert_trace(const char *text, const char *bin)
+{
+	struct trace_writer *w;
+	struct dbench_op op;
+	struct trace *trace;
+	int ret;
+
+	trace = trace_open(text);
+	if (trace == NULL) {
+		return -1;
+	}
+	w = trace_writer_open(bin, Z_DEFAULT_COMPRESSION);
+	if (w == NULL) {
+		trace_close(trace);
+		return -1;
+	}
+	while ((ret = trace_next(trace, &op)) > 0) {
+		if (trace_writer_add(w, &op) != 0) {
+			ret = -1;
+			break;
+		}
+		trace_release(trace, op.line);
+	}
+	if (trace_writer_close(w) != 0) {
+		ret = -1;
+	}
+	trace_close(trace);
+	return ret;
+}
+
+static void bench_trace(void)
+{
+	struct best text = { 0 }, bin = { 0 };
+	char *text_path, *bin_path;
+	uint64_t count = 0;
+	int run;
+
+	if (!selected("trace/") || options.lines == 0) {
+		return;
+	}
+	if (asprintf(&text_path, "%s/nfs-bench-%d.txt", options.dir, (int)getpid()) < 0 ||
+	    asprintf(&bin_path, "%s/nfs-bench-%d.bin", options.dir, (int)getpid()) < 0) {
+		exit(10);
+	}
+	if (make_text_trace(text_path, options.lines) != 0 ||
+	    convert_trace(text_path, bin_path) != 0) {
+		unlink(text_path);
+		unlink(bin_path);
+		exit(1);
+	}
+
+	for (run = 0; run < options.repeat; run++) {
+		if (selected("trace/text")) {
+			best_add(&text, read_trace(text_path, &count));
+		}
+		if (selected("trace/bin")) {
+			best_add(&bin, read_trace(bin_path, &count));
+		}
+	}
+	if (text.nsec) {
+		report("trace/text", options.lines, text.nsec);
+	}
+	if (bin.nsec) {
+		report("trace/bin", options.lines, bin.nsec);
+	}
+
+	unlink(text_path);
+	unlink(bin_path);
+	free(text_path);
+	free(bin_path);
+}
+
+/* the names and statuses of ops, in the proportions of a replay */
+static void bench_dispatch(void)
+{
+	static const char *statuses[] = {
+		"0x00000000", "0x00000000", "0x00000000", "0x00000002", "*",
+	};
+	struct best lookup = { 0 }, check = { 0 };
+	uint64_t s = (uint64_t)options.seed * 0x9e3779b97f4a7c15ULL | 1, i, t, n;
+	const char **names;
+	int *lens, *results, run, ok;
+	const char **expected;
+
+	n = options.lines;
+	if (n == 0 || !(selected("dispatch/op-lookup") || selected("dispatch/status"))) {
+		return;
+	}
+	names    = xmalloc(n * sizeof(char *));
+	lens     = xmalloc(n * sizeof(int));
+	results  = xmalloc(n * sizeof(int));
+	expected = xmalloc(n * sizeof(char *));
+	for (i = 0; i < n; i++) {
+		/* half of the ops are among the first few, as in most traces */
+		t = xorshift(&s);
+		names[i]    = trace_op_name(t & 1 ? 1 + (t >> 1) % 6 : 1 + (t >> 1) % (OP_MAX - 1));
+		lens[i]     = strlen(names[i]);
+		expected[i] = statuses[(t >> 8) % 5];
+		results[i]  = (t >> 16) % 8 == 0 ? 2 : 0;
+	}
+
+	for (run = 0; run < options.repeat; run++) {
+		ok = 0;
+		t = clock_nsec();
+		for (i = 0; i < n; i++) {
+			ok += trace_op_lookup(names[i], lens[i]);
+		}
+		best_add(&lookup, clock_nsec() - t);
+		sink += ok;
+
+		ok = 0;
+		t = clock_nsec();
+		for (i = 0; i < n; i++) {
+			ok += trace_check_status(results[i], expected[i]);
+		}
+		best_add(&check, clock_nsec() - t);
+		sink += ok;
+	}
+	if (selected("dispatch/op-lookup")) {
+		report("dispatch/op-lookup", n, lookup.nsec);
+	}
+	if (selected("dispatch/status")) {
+		report("dispatch/status", n, check.nsec);
+	}
+
+	free(names);
+	free(lens);
+	free(results);
+	free(expected);
+}
+
+static void show_usage(void)
+{
+	printf("usage: nfs-bench [OPTIONS]\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	int opt;
+	poptContext pc;
+	struct poptOption popt_options[] = {
+		POPT_AUTOHELP
+		{ "entries", 'n', POPT_ARG_INT, &options.entries, 0,
+		  "handles in the tree set, a tenth of it in the others", "count" },
+		{ "lines", 'l', POPT_ARG_INT, &options.lines, 0,
+		  "ops in the trace and dispatch benchmarks", "count" },
+		{ "repeat", 'r', POPT_ARG_INT, &options.repeat, 0,
+		  "runs of each benchmark, the fastest is reported", "count" },
+		{ "seed", 's', POPT_ARG_INT, &options.seed, 0,
+		  "seed of the made up paths and traces", "integer" },
+		{ "only", 'o', POPT_ARG_STRING, &options.only, 0,
+		  "run the benchmarks whose name has this in it", "string" },
+		{ "dir", 'd', POPT_ARG_STRING, &options.dir, 0,
+		  "directory for the trace files", "directory" },
+		POPT_TABLEEND
+	};
+
+	pc = poptGetContext(argv[0], argc, argv, popt_options, 0);
+	while ((opt = poptGetNextOpt(pc)) != -1) {
+		fprintf(stderr, "Invalid option %s: %s\n",
+			poptBadOption(pc, 0), poptStrerror(opt));
+		show_usage();
+		exit(1);
+	}
+	poptFreeContext(pc);
+	if (options.entries < 0 || options.lines < 0 || options.repeat < 1) {
+		show_usage();
+		exit(1);
+	}
+
+	bench_dispatch();
+	bench_trace();
+	bench_fhcache("sorted", options.entries / 10, sorted_path);
+	bench_fhcache("deep", options.entries / 10, deep_path);
+	bench_fhcache("tree", options.entries, tree_path);
+
+	return 0;
+}
@@ -0,0 +1,1922 @@
+/*
+   Handle cache shared by the connections to an export
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+/*
+ * Every connection to an export shares one cache of the handles looked
+ * up on it, so that a handle one worker has learnt is used by all the
+ * others rather than looked up again.
+ *
+ * The cache is a tree of directory entries, each with the handle of its
+ * name in its parent directory, indexed by open addressing hash tables
+ * keyed by (parent, name). Keys are spread over FHCACHE_SHARDS shards by
+ * the top bits of their hash, each with its own table, lock and sequence
+ * count. A lookup takes no lock: it probes the table of the shard, copies
+ * the handle out and starts over if the sequence count says the shard
+ * changed meanwhile. A change locks the shards of the entries it touches
+ * and of their parents, which list their children, and bumps their
+ * counts. Lookups may still be reading what a change takes away, so
+ * entries and names are reused rather than freed and tables that were
+ * outgrown are kept aside, until the cache itself goes.
+ *
+ * An entry found without a lock may be dropped, or evicted, and reused
+ * for another name before it is used. Every entry thus has a generation,
+ * bumped when it is freed, and what is found is a reference to an entry
+ * of a given generation: a lookup checks the generation of each
+ * directory it goes through, and a change checks the generations of the
+ * entries it was given once it holds their locks.
+ *
+ * With a memory budget, each shard evicts the entries that were not
+ * looked up lately once it takes more than its share, CLOCK style.
+ *
+ * An entry may also be negative: a name its directory was found not to
+ * have. Lookups of a path stop at it, as they do at a name that is not
+ * cached, and directories count their negative entries so that they are
+ * quickly forgotten when a name is created in them.
+ *
+ * Next to the tree, the cache maps the handles of a trace to the live
+ * handles of the same objects, for replays by handle. That map has
+ * shards of its own, keyed by the traced handle, with the same locks,
+ * sequence counts and reuse of what a lookup may still read, and counts
+ * against the same budget.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fhcache.h"
+
+#define FHCACHE_SHARD_BITS	6
+#define FHCACHE_SHARDS		(1 << FHCACHE_SHARD_BITS)
+#define FHCACHE_TABLE_SIZE	64
+#define ARENA_CHUNK		(1024 * 1024)
+
+/*
+ * Lookups read what a change may be writing and find out afterwards,
+ * which the thread sanitizer cannot know.
+ */
+#define SEQ_READER __attribute__((no_sanitize_thread))
+
+/*
+ * An interned name, shared by the entries with that name. Once the last
+ * of them is gone it is reused for a name of the same size class.
+ */
+struct fhcache_name {
+	struct fhcache_name *next;
+	uint32_t hash;
+	uint32_t len;
+	uint32_t refs;
+	char name[];
+};
+
+/* size classes of the names kept for reuse, up to NFS3's 255 bytes */
+#define NAME_CLASS	16
+#define NAME_CLASSES	((sizeof(struct fhcache_name) + 256) / NAME_CLASS + 2)
+
+struct fhcache_entry {
+	struct fhcache_entry *parent;
+	struct fhcache_entry *children;
+	struct fhcache_entry *next;
+	struct fhcache_entry **pprev;
+	struct fhcache_name *name;
+	uint32_t hash;
+	uint32_t gen;
+	uint32_t fh_len;
+	uint32_t negatives;
+	uint8_t ref;
+	uint8_t negative;
+	int64_t size;
+	char fh[FHCACHE_FHSIZE];
+};
+
+/* a slot of a table, with the hash of its entry */
+struct fhcache_slot {
+	uint32_t hash;
+	struct fhcache_entry *entry;
+};
+
+struct fhcache_table {
+	uint32_t size;
+	struct fhcache_table *retired;
+	struct fhcache_slot slot[];
+};
+
+/* chunks memory is carved from */
+struct fhcache_arena {
+	void **chunks;
+	uint32_t nchunks;
+	char *next;
+	size_t left;
+};
+
+struct fhcache_shard {
+	pthread_mutex_t lock;
+	uint32_t seq;
+	uint32_t count;
+	uint32_t hand;
+	struct fhcache_table *table;
+	struct fhcache_entry *unused;
+	struct fhcache_arena arena;
+	size_t bytes;
+	uint64_t evictions;
+} __attribute__((aligned(64)));
+
+/* a traced handle and the live handle it stands for */
+struct fhcache_mapping {
+	struct fhcache_mapping *next;
+	uint32_t key_len;
+	uint32_t fh_len;
+	uint8_t ref;
+	char key[FHCACHE_FHSIZE];
+	char fh[FHCACHE_FHSIZE];
+};
+
+struct fhcache_map_slot {
+	uint32_t hash;
+	struct fhcache_mapping *mapping;
+};
+
+struct fhcache_map_table {
+	uint32_t size;
+	struct fhcache_map_table *retired;
+	struct fhcache_map_slot slot[];
+};
+
+/* a shard of the map, its table allocated when it gets its first mapping */
+struct fhcache_map_shard {
+	pthread_mutex_t lock;
+	uint32_t seq;
+	uint32_t count;
+	uint32_t hand;
+	struct fhcache_map_table *table;
+	struct fhcache_mapping *unused;
+	struct fhcache_arena arena;
+	size_t bytes;
+	uint64_t evictions;
+} __attribute__((aligned(64)));
+
+struct fhcache {
+	struct fhcache *next;
+	char *key;
+	int refs;
+	struct fhcache_entry *root;
+	size_t shard_budget;
+
+	pthread_mutex_t names_lock;
+	struct fhcache_name **names;
+	uint32_t names_size;
+	uint32_t names_count;
+	struct fhcache_name *names_unused[NAME_CLASSES];
+	struct fhcache_arena names_arena;
+
+	struct fhcache_shard shard[FHCACHE_SHARDS];
+	struct fhcache_map_shard map[FHCACHE_SHARDS];
+};
+
+static pthread_mutex_t fhcaches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fhcache *fhcaches;
+
+static uint32_t name_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+static uint32_t entry_hash(const struct fhcache_entry *parent, uint32_t hash)
+{
+	return hash ^ (uint32_t)(((uintptr_t)parent * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static struct fhcache_shard *shard_of(struct fhcache *c, uint32_t hash)
+{
+	return &c->shard[hash >> (32 - FHCACHE_SHARD_BITS)];
+}
+
+/*
+ * Entries are carved out of large chunks, per shard, and names in chunks
+ * of their own, so that filling the cache costs a malloc() per megabyte
+ * rather than a few per entry.
+ */
+static void *arena_chunk(struct fhcache_arena *a, size_t size)
+{
+	void **chunks;
+
+	chunks = realloc(a->chunks, (a->nchunks + 1) * sizeof(void *));
+	if (chunks == NULL) {
+		fprintf(stderr, "REALLOC failed to grow the handle cache arena\n");
+		exit(10);
+	}
+	a->chunks = chunks;
+	a->chunks[a->nchunks] = malloc(size);
+	if (a->chunks[a->nchunks] == NULL) {
+		fprintf(stderr, "MALLOC failed to allocate a handle cache chunk\n");
+		exit(10);
+	}
+	return a->chunks[a->nchunks++];
+}
+
+/* what does not fit in a chunk gets one of its own */
+static void *arena_alloc(struct fhcache_arena *a, size_t size)
+{
+	size = (size + 7) & ~7;
+	if (size > ARENA_CHUNK) {
+		return arena_chunk(a, size);
+	}
+	if (size > a->left) {
+		a->next = arena_chunk(a, ARENA_CHUNK);
+		a->left = ARENA_CHUNK;
+	}
+	a->next += size;
+	a->left -= size;
+
+	return a->next - size;
+}
+
+static void arena_free(struct fhcache_arena *a)
+{
+	uint32_t i;
+
+	for (i = 0; i < a->nchunks; i++) {
+		free(a->chunks[i]);
+	}
+	free(a->chunks);
+}
+
+/* the memory a name of len bytes takes */
+static size_t name_size(size_t len)
+{
+	return (sizeof(struct fhcache_name) + len + NAME_CLASS) & ~(NAME_CLASS - 1);
+}
+
+static void names_resize(struct fhcache *c)
+{
+	struct fhcache_name **old = c->names;
+	uint32_t i, j, mask, old_size = c->names_size;
+
+	c->names_size = old_size ? old_size * 2 : 1024;
+	c->names = calloc(c->names_size, sizeof(struct fhcache_name *));
+	if (c->names == NULL) {
+		fprintf(stderr, "CALLOC failed to allocate the name table\n");
+		exit(10);
+	}
+
+	mask = c->names_size - 1;
+	for (i = 0; i < old_size; i++) {
+		if (old[i] == NULL) {
+			continue;
+		}
+		for (j = old[i]->hash & mask; c->names[j]; j = (j + 1) & mask)
+			;
+		c->names[j] = old[i];
+	}
+	free(old);
+}
+
+/* the one copy of name, with a reference taken on it */
+static struct fhcache_name *intern_name(struct fhcache *c, const char *name, size_t len)
+{
+	uint32_t hash = name_hash(name, len);
+	size_t size = name_size(len);
+	struct fhcache_name *n;
+	uint32_t i, mask;
+
+	pthread_mutex_lock(&c->names_lock);
+	if ((c->names_count + 1) * 4 > c->names_size * 3) {
+		names_resize(c);
+	}
+
+	mask = c->names_size - 1;
+	for (i = hash & mask; (n = c->names[i]) != NULL; i = (i + 1) & mask) {
+		if (n->hash == hash && n->len == len &&
+		    memcmp(n->name, name, len) == 0) {
+			n->refs++;
+			pthread_mutex_unlock(&c->names_lock);
+			return n;
+		}
+	}
+
+	n = size / NAME_CLASS < NAME_CLASSES ? c->names_unused[size / NAME_CLASS] : NULL;
+	if (n != NULL) {
+		c->names_unused[size / NAME_CLASS] = n->next;
+	} else {
+		n = arena_alloc(&c->names_arena, size);
+	}
+	n->hash = hash;
+	n->len  = len;
+	n->refs = 1;
+	memcpy(n->name, name, len);
+	n->name[len] = 0;
+
+	c->names[i] = n;
+	c->names_count++;
+	pthread_mutex_unlock(&c->names_lock);
+
+	return n;
+}
+
+static void release_name(struct fhcache *c, struct fhcache_name *n)
+{
+	uint32_t i, j, mask, home;
+
+	pthread_mutex_lock(&c->names_lock);
+	if (--n->refs > 0) {
+		pthread_mutex_unlock(&c->names_lock);
+		return;
+	}
+
+	mask = c->names_size - 1;
+	for (i = n->hash & mask; c->names[i] != n; i = (i + 1) & mask)
+		;
+	for (j = (i + 1) & mask; c->names[j] != NULL; j = (j + 1) & mask) {
+		home = c->names[j]->hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			c->names[i] = c->names[j];
+			i = j;
+		}
+	}
+	c->names[i] = NULL;
+	c->names_count--;
+
+	i = name_size(n->len) / NAME_CLASS;
+	if (i < NAME_CLASSES) {
+		n->next = c->names_unused[i];
+		c->names_unused[i] = n;
+	}
+	pthread_mutex_unlock(&c->names_lock);
+}
+
+static struct fhcache_table *new_table(uint32_t size)
+{
+	struct fhcache_table *t;
+
+	t = calloc(1, sizeof(struct fhcache_table) + size * sizeof(struct fhcache_slot));
+	if (t == NULL) {
+		fprintf(stderr, "CALLOC failed to allocate the handle cache\n");
+		exit(10);
+	}
+	t->size = size;
+	return t;
+}
+
+/*
+ * Sequence counts. The count of a shard is odd while it changes, and a
+ * lookup that saw it odd, or saw it change, has to start over.
+ */
+static SEQ_READER uint32_t read_begin(uint32_t *count)
+{
+	uint32_t seq;
+
+	while ((seq = __atomic_load_n(count, __ATOMIC_ACQUIRE)) & 1) {
+		sched_yield();
+	}
+	return seq;
+}
+
+static SEQ_READER int read_retry(uint32_t *count, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(count, __ATOMIC_RELAXED) != seq;
+}
+
+static void write_begin(uint32_t *count)
+{
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(uint32_t *count)
+{
+	__atomic_store_n(count, *count + 1, __ATOMIC_RELEASE);
+}
+
+/* name in dir, as found in t */
+static SEQ_READER struct fhcache_entry *probe(const struct fhcache_table *t,
+					      const struct fhcache_entry *dir,
+					      const char *name, size_t len, uint32_t hash)
+{
+	const struct fhcache_name *n;
+	struct fhcache_entry *e;
+	uint32_t i, j, k, mask = t->size - 1;
+
+	for (i = hash & mask, j = 0; j < t->size; i = (i + 1) & mask, j++) {
+		e = __atomic_load_n(&t->slot[i].entry, __ATOMIC_ACQUIRE);
+		if (e == NULL) {
+			break;
+		}
+		if (t->slot[i].hash != hash || e->parent != dir) {
+			continue;
+		}
+		n = e->name;
+		if (n->len != len) {
+			continue;
+		}
+		for (k = 0; k < len && n->name[k] == name[k]; k++)
+			;
+		if (k == len) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static SEQ_READER void copy_handle(const struct fhcache_entry *e, struct fhcache_handle *h)
+{
+	uint32_t i, len = e->fh_len;
+
+	if (len > FHCACHE_FHSIZE) {
+		len = FHCACHE_FHSIZE;
+	}
+	for (i = 0; i < len; i++) {
+		h->data[i] = e->fh[i];
+	}
+	h->len  = len;
+	h->size = e->size;
+}
+
+/*
+ * The entry of name in dir, its generation and whether it is negative,
+ * with its handle copied to h if not NULL. The entry is marked as used,
+ * for the eviction to spare.
+ */
+static SEQ_READER struct fhcache_entry *find_child(struct fhcache *c,
+						   const struct fhcache_entry *dir,
+						   const char *name, size_t len, uint32_t *gen,
+						   uint8_t *negative, struct fhcache_handle *h)
+{
+	uint32_t seq, hash = entry_hash(dir, name_hash(name, len));
+	struct fhcache_shard *s = shard_of(c, hash);
+	struct fhcache_entry *e;
+
+	do {
+		seq = read_begin(&s->seq);
+		e = probe(__atomic_load_n(&s->table, __ATOMIC_ACQUIRE), dir, name, len, hash);
+		if (e != NULL) {
+			*gen = e->gen;
+			*negative = e->negative;
+			if (h != NULL) {
+				copy_handle(e, h);
+			}
+		}
+	} while (read_retry(&s->seq, seq));
+
+	if (e != NULL && !__atomic_load_n(&e->ref, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+	}
+	return e;
+}
+
+/* the next component of a path, NULL at its end */
+const char *fhcache_component(const char *path, size_t *len)
+{
+	while (*path == '/') path++;
+
+	*len = strchrnul(path, '/') - path;
+	if (*len == 0) {
+		return NULL;
+	}
+	return path;
+}
+
+/*
+ * Walk path down from the root as far as it is cached, to the entry ref
+ * is set to. Returns the first component that is not cached, NULL if the
+ * whole path is.
+ */
+static SEQ_READER const char *walk(struct fhcache *c, const char *path,
+			struct fhcache_ref *ref, struct fhcache_handle *h)
+{
+	struct fhcache_entry *e, *child;
+	const char *start, *name;
+	uint32_t gen, child_gen;
+	uint8_t negative;
+	size_t len, tail;
+	int last;
+
+	while (path[0] == '.') path++;
+	start = path;
+
+again:
+	e    = c->root;
+	gen  = 0;
+	path = start;
+	while ((name = fhcache_component(path, &len)) != NULL) {
+		last  = fhcache_component(name + len, &tail) == NULL;
+		child = find_child(c, e, name, len, &child_gen, &negative, last ? h : NULL);
+		if (child == NULL || negative) {
+			break;
+		}
+		/* e was freed, and child found under whatever it is now */
+		if (__atomic_load_n(&e->gen, __ATOMIC_ACQUIRE) != gen) {
+			goto again;
+		}
+		e    = child;
+		gen  = child_gen;
+		path = name + len;
+	}
+	if (e == c->root && h != NULL) {
+		copy_handle(e, h);
+	}
+	ref->entry = e;
+	ref->gen   = gen;
+	return name;
+}
+
+const char *fhcache_walk(struct fhcache *c, const char *path, struct fhcache_handle *h)
+{
+	struct fhcache_ref ref;
+
+	return walk(c, path, &ref, h);
+}
+
+int fhcache_lookup(struct fhcache *c, const char *path, struct fhcache_handle *h)
+{
+	return fhcache_walk(c, path, h) == NULL;
+}
+
+int fhcache_find(struct fhcache *c, const char *path, struct fhcache_ref *ref)
+{
+	return walk(c, path, ref, NULL) == NULL;
+}
+
+/*
+ * Changes. They lock the shards they need in address order, and check
+ * that the entries they were given are still what they were found as
+ * before touching them.
+ */
+struct shard_set {
+	struct fhcache_shard *s[4];
+	int n;
+};
+
+static void shards_add(struct shard_set *set, struct fhcache_shard *s)
+{
+	int i, j;
+
+	for (i = 0; i < set->n && set->s[i] < s; i++)
+		;
+	if (i < set->n && set->s[i] == s) {
+		return;
+	}
+	for (j = set->n; j > i; j--) {
+		set->s[j] = set->s[j - 1];
+	}
+	set->s[i] = s;
+	set->n++;
+}
+
+static int shards_held(const struct shard_set *set, const struct fhcache_shard *s)
+{
+	int i;
+
+	for (i = 0; i < set->n; i++) {
+		if (set->s[i] == s) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void shards_lock(struct shard_set *set)
+{
+	int i;
+
+	for (i = 0; i < set->n; i++) {
+		pthread_mutex_lock(&set->s[i]->lock);
+		write_begin(&set->s[i]->seq);
+	}
+}
+
+static void shards_unlock(struct shard_set *set)
+{
+	int i;
+
+	for (i = set->n - 1; i >= 0; i--) {
+		write_end(&set->s[i]->seq);
+		pthread_mutex_unlock(&set->s[i]->lock);
+	}
+}
+
+/* the slot of (parent, name) in t, or the empty slot where it would go */
+static struct fhcache_slot *table_slot(struct fhcache_table *t, const struct fhcache_entry *parent,
+				       const struct fhcache_name *name, uint32_t hash)
+{
+	uint32_t mask = t->size - 1;
+	uint32_t i = hash & mask;
+	struct fhcache_slot *slot;
+
+	for (;; i = (i + 1) & mask) {
+		slot = &t->slot[i];
+		if (slot->entry == NULL) {
+			return slot;
+		}
+		if (slot->hash == hash && slot->entry->parent == parent &&
+		    slot->entry->name == name) {
+			return slot;
+		}
+	}
+}
+
+/*
+ * The shard of an entry as it is before it is locked. A rename may move
+ * the entry to another shard meanwhile, which the change finds out once
+ * it holds the locks, and starts over.
+ */
+static struct fhcache_shard *entry_shard(struct fhcache *c, const struct fhcache_entry *e)
+{
+	return shard_of(c, __atomic_load_n(&e->hash, __ATOMIC_RELAXED));
+}
+
+/*
+ * Is ref still cached as it was found, with the shards in set locked.
+ * Returns -1 if its entry moved to a shard that is not.
+ */
+static int ref_valid(struct fhcache *c, const struct shard_set *set,
+		     const struct fhcache_ref *ref)
+{
+	struct fhcache_entry *e = ref->entry;
+
+	if (e == c->root) {
+		return 1;
+	}
+	if (__atomic_load_n(&e->gen, __ATOMIC_RELAXED) != ref->gen) {
+		return 0;
+	}
+	if (!shards_held(set, entry_shard(c, e))) {
+		return -1;
+	}
+	return table_slot(shard_of(c, e->hash)->table,
+			  e->parent, e->name, e->hash)->entry == e;
+}
+
+static void shard_resize(struct fhcache_shard *s)
+{
+	struct fhcache_table *old = s->table, *t;
+	uint32_t i, j, mask;
+
+	t = new_table(old->size * 2);
+	mask = t->size - 1;
+	for (i = 0; i < old->size; i++) {
+		if (old->slot[i].entry == NULL) {
+			continue;
+		}
+		for (j = old->slot[i].hash & mask; t->slot[j].entry; j = (j + 1) & mask)
+			;
+		t->slot[j] = old->slot[i];
+	}
+	t->retired = old;
+	__atomic_store_n(&s->table, t, __ATOMIC_RELEASE);
+}
+
+/* the memory an entry takes, as counted against the budget */
+static size_t entry_bytes(const struct fhcache_entry *e)
+{
+	return sizeof(struct fhcache_entry) + name_size(e->name->len);
+}
+
+/*
+ * The memory of a shard. Bytes change under the lock of their shard and
+ * are read without it by the map shard of the same index, see
+ * pair_bytes().
+ */
+static size_t shard_bytes(const struct fhcache_shard *s)
+{
+	const struct fhcache_table *t = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&s->bytes, __ATOMIC_RELAXED) +
+		t->size * sizeof(struct fhcache_slot);
+}
+
+static size_t map_bytes(const struct fhcache_map_shard *s)
+{
+	const struct fhcache_map_table *t = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&s->bytes, __ATOMIC_RELAXED) +
+		(t != NULL ? t->size * sizeof(struct fhcache_map_slot) : 0);
+}
+
+/*
+ * The share of the budget of shard i covers map shard i as well, so that
+ * the map of traced handles is bounded with the tree. Either evicts its
+ * own entries while the two take more than that share together.
+ */
+static size_t pair_bytes(struct fhcache *c, int i)
+{
+	return shard_bytes(&c->shard[i]) + map_bytes(&c->map[i]);
+}
+
+static struct fhcache_entry *new_entry(struct fhcache_shard *s)
+{
+	struct fhcache_entry *e = s->unused;
+
+	if (e != NULL) {
+		s->unused = e->next;
+		return e;
+	}
+	e = arena_alloc(&s->arena, sizeof(struct fhcache_entry));
+	e->gen = 0;
+	return e;
+}
+
+static void free_entry(struct fhcache *c, struct fhcache_shard *s, struct fhcache_entry *e)
+{
+	release_name(c, e->name);
+	__atomic_store_n(&e->gen, e->gen + 1, __ATOMIC_RELEASE);
+	e->next = s->unused;
+	s->unused = e;
+}
+
+static void set_handle(struct fhcache_entry *e, const char *fh, uint32_t len)
+{
+	if (fh != NULL) {
+		memcpy(e->fh, fh, len);
+	}
+	e->fh_len = len;
+}
+
+/* put e in the table of its shard, and in its directory */
+static void hash_entry(struct fhcache *c, struct fhcache_entry *e)
+{
+	struct fhcache_shard *s = shard_of(c, e->hash);
+	struct fhcache_slot *slot;
+
+	if ((s->count + 1) * 4 > s->table->size * 3) {
+		shard_resize(s);
+	}
+	slot = table_slot(s->table, e->parent, e->name, e->hash);
+	slot->hash = e->hash;
+	__atomic_store_n(&slot->entry, e, __ATOMIC_RELEASE);
+	s->count++;
+	__atomic_store_n(&s->bytes, s->bytes + entry_bytes(e), __ATOMIC_RELAXED);
+
+	if (e->negative) {
+		e->parent->negatives++;
+	}
+	e->next  = e->parent->children;
+	e->pprev = &e->parent->children;
+	if (e->next != NULL) {
+		e->next->pprev = &e->next;
+	}
+	e->parent->children = e;
+}
+
+/* take e out of the table of its shard, and out of its directory */
+static void unhash_entry(struct fhcache *c, struct fhcache_entry *e)
+{
+	struct fhcache_shard *s = shard_of(c, e->hash);
+	struct fhcache_table *t = s->table;
+	struct fhcache_slot *next;
+	uint32_t mask, i, j, home;
+
+	*e->pprev = e->next;
+	if (e->next != NULL) {
+		e->next->pprev = e->pprev;
+	}
+	if (e->negative) {
+		e->parent->negatives--;
+	}
+
+	i = table_slot(t, e->parent, e->name, e->hash) - t->slot;
+	s->count--;
+	__atomic_store_n(&s->bytes, s->bytes - entry_bytes(e), __ATOMIC_RELAXED);
+
+	/* move back the entries that probed past the freed slot */
+	mask = t->size - 1;
+	for (j = (i + 1) & mask; ; j = (j + 1) & mask) {
+		next = &t->slot[j];
+		if (next->entry == NULL) {
+			break;
+		}
+		home = next->hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			t->slot[i].hash = next->hash;
+			__atomic_store_n(&t->slot[i].entry, next->entry, __ATOMIC_RELEASE);
+			i = j;
+		}
+	}
+	__atomic_store_n(&t->slot[i].entry, NULL, __ATOMIC_RELEASE);
+}
+
+/*
+ * CLOCK eviction. The hand of a shard goes round its table, clearing the
+ * mark of the entries looked up since it last passed them and evicting
+ * the others, until the shard is back within its share of the budget or
+ * the hand went round once, which spares what was just inserted. Only
+ * entries with nothing cached below them go, so a directory stays for as
+ * long as something in it does. s and the shards in held are locked; the
+ * shard of the directory of an entry is only tried if it is not among
+ * them, as waiting for it could deadlock.
+ */
+static void shard_evict(struct fhcache *c, struct fhcache_shard *s, const struct shard_set *held)
+{
+	struct fhcache_table *t = s->table;
+	uint32_t steps, mask = t->size - 1;
+	struct fhcache_shard *ps;
+	struct fhcache_entry *e;
+	int trylock;
+
+	for (steps = 0; pair_bytes(c, s - c->shard) > c->shard_budget && steps < t->size;
+	     steps++) {
+		s->hand &= mask;
+		e = t->slot[s->hand].entry;
+		if (e == NULL || e->children != NULL) {
+			s->hand++;
+			continue;
+		}
+		if (__atomic_load_n(&e->ref, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&e->ref, 0, __ATOMIC_RELAXED);
+			s->hand++;
+			continue;
+		}
+
+		ps = entry_shard(c, e->parent);
+		trylock = !shards_held(held, ps);
+		if (trylock) {
+			if (pthread_mutex_trylock(&ps->lock) != 0) {
+				s->hand++;
+				continue;
+			}
+			if (entry_shard(c, e->parent) != ps) {
+				pthread_mutex_unlock(&ps->lock);
+				s->hand++;
+				continue;
+			}
+			write_begin(&ps->seq);
+		}
+		/* the slot the hand is at gets the next entry of the probe */
+		unhash_entry(c, e);
+		free_entry(c, s, e);
+		s->evictions++;
+		if (trylock) {
+			write_end(&ps->seq);
+			pthread_mutex_unlock(&ps->lock);
+		}
+	}
+}
+
+/* forget ref and everything cached below it */
+static void drop_entry(struct fhcache *c, const struct fhcache_ref *ref)
+{
+	struct fhcache_entry *e = ref->entry;
+	struct fhcache_shard *s;
+	struct fhcache_ref child;
+	struct shard_set set;
+	int valid;
+
+	for (;;) {
+		s = entry_shard(c, e);
+		set.n = 0;
+		shards_add(&set, s);
+		child.entry = NULL;
+		pthread_mutex_lock(&s->lock);
+		valid = ref_valid(c, &set, ref);
+		if (valid > 0 && e->children != NULL) {
+			child.entry = e->children;
+			child.gen   = child.entry->gen;
+		}
+		pthread_mutex_unlock(&s->lock);
+		if (valid == 0) {
+			return;
+		}
+		if (valid < 0) {
+			continue;
+		}
+		if (child.entry != NULL) {
+			drop_entry(c, &child);
+			continue;
+		}
+
+		shards_add(&set, entry_shard(c, __atomic_load_n(&e->parent, __ATOMIC_RELAXED)));
+		shards_lock(&set);
+		valid = ref_valid(c, &set, ref);
+		if (valid > 0 && !shards_held(&set, entry_shard(c, e->parent))) {
+			valid = -1;
+		}
+		if (valid > 0 && e->children == NULL) {
+			unhash_entry(c, e);
+			free_entry(c, s, e);
+			valid = 0;
+		}
+		shards_unlock(&set);
+		if (valid == 0) {
+			return;
+		}
+	}
+}
+
+/*
+ * Cache the handle of name in dir, or that dir has no such name if fh is
+ * NULL, and set child, if not NULL, to its entry. The reference on name
+ * is handed over.
+ */
+static int insert_child(struct fhcache *c, const struct fhcache_ref *dir,
+			struct fhcache_name *name, const char *fh, uint32_t fh_len,
+			int64_t size, struct fhcache_ref *child)
+{
+	uint32_t hash = entry_hash(dir->entry, name->hash);
+	struct fhcache_shard *s = shard_of(c, hash);
+	struct fhcache_entry *e = NULL;
+	struct shard_set set;
+	int valid;
+
+	for (;;) {
+		set.n = 0;
+		shards_add(&set, s);
+		shards_add(&set, entry_shard(c, dir->entry));
+		shards_lock(&set);
+		valid = ref_valid(c, &set, dir);
+		if (valid >= 0) {
+			break;
+		}
+		shards_unlock(&set);
+	}
+	if (valid) {
+		e = table_slot(s->table, dir->entry, name, hash)->entry;
+		if (e == NULL) {
+			e = new_entry(s);
+			__atomic_store_n(&e->parent, dir->entry, __ATOMIC_RELAXED);
+			__atomic_store_n(&e->hash, hash, __ATOMIC_RELAXED);
+			e->children = NULL;
+			e->negatives = 0;
+			e->name     = name;
+			e->ref      = 1;
+			e->negative = fh == NULL;
+			e->size     = size;
+			set_handle(e, fh, fh_len);
+			hash_entry(c, e);
+			name = NULL;
+		} else if (fh != NULL) {
+			if (e->negative) {
+				e->negative = 0;
+				dir->entry->negatives--;
+			}
+			set_handle(e, fh, fh_len);
+			__atomic_store_n(&e->ref, 1, __ATOMIC_RELAXED);
+		}
+		if (child != NULL) {
+			child->entry = e;
+			child->gen   = e->gen;
+		}
+		if (c->shard_budget != 0) {
+			shard_evict(c, s, &set);
+		}
+	}
+	shards_unlock(&set);
+
+	if (name != NULL) {
+		release_name(c, name);
+	}
+	return e != NULL ? 0 : -1;
+}
+
+int fhcache_insert_child(struct fhcache *c, const struct fhcache_ref *dir,
+			 const char *name, size_t len,
+			 const char *fh, uint32_t fh_len, int64_t size)
+{
+	if (fh_len > FHCACHE_FHSIZE) {
+		fprintf(stderr, "handle of '%.*s' is %u bytes long, ignoring it\n",
+			(int)len, name, fh_len);
+		return -1;
+	}
+	return insert_child(c, dir, intern_name(c, name, len), fh, fh_len, size, NULL);
+}
+
+/*
+ * Cache the handle of a path. Its directory has to be cached already,
+ * which it is when the handle comes from a reply to a call on it.
+ */
+void fhcache_insert(struct fhcache *c, const char *path,
+		    const char *fh, uint32_t fh_len, int64_t size)
+{
+	struct fhcache_ref ref;
+	const char *rest, *leaf;
+	struct shard_set set;
+	size_t len, tail;
+	int valid;
+
+	rest = walk(c, path, &ref, NULL);
+	if (rest == NULL) {
+		/* the root handle stays the one the export was mounted with */
+		if (ref.entry == c->root || fh_len > FHCACHE_FHSIZE) {
+			return;
+		}
+		do {
+			set.n = 0;
+			shards_add(&set, entry_shard(c, ref.entry));
+			shards_lock(&set);
+			valid = ref_valid(c, &set, &ref);
+			if (valid > 0) {
+				set_handle(ref.entry, fh, fh_len);
+			}
+			shards_unlock(&set);
+		} while (valid < 0);
+		return;
+	}
+
+	leaf = fhcache_component(rest, &len);
+	if (fhcache_component(leaf + len, &tail) != NULL) {
+		return;
+	}
+	fhcache_insert_child(c, &ref, leaf, len, fh, fh_len, size);
+}
+
+void fhcache_delete(struct fhcache *c, const char *path)
+{
+	struct fhcache_ref ref;
+
+	if (!fhcache_find(c, path, &ref) || ref.entry == c->root) {
+		return;
+	}
+	drop_entry(c, &ref);
+}
+
+/* is path a name its directory was found not to have */
+int fhcache_negative(struct fhcache *c, const char *path)
+{
+	const char *rest, *leaf;
+	struct fhcache_ref dir;
+	uint8_t negative;
+	size_t len, tail;
+	uint32_t gen;
+
+	rest = walk(c, path, &dir, NULL);
+	if (rest == NULL) {
+		return 0;
+	}
+	leaf = fhcache_component(rest, &len);
+	if (fhcache_component(leaf + len, &tail) != NULL) {
+		return 0;
+	}
+	return find_child(c, dir.entry, leaf, len, &gen, &negative, NULL) != NULL && negative;
+}
+
+/* remember that path does not exist, its directory being cached */
+void fhcache_insert_negative(struct fhcache *c, const char *path)
+{
+	const char *rest, *leaf;
+	struct fhcache_ref ref;
+	size_t len, tail;
+
+	rest = walk(c, path, &ref, NULL);
+	if (rest == NULL) {
+		/* it did exist, and so might what was cached below it */
+		if (ref.entry != c->root) {
+			drop_entry(c, &ref);
+		}
+		return;
+	}
+	leaf = fhcache_component(rest, &len);
+	if (fhcache_component(leaf + len, &tail) != NULL) {
+		return;
+	}
+	insert_child(c, &ref, intern_name(c, leaf, len), NULL, 0, 0, NULL);
+}
+
+/* forget the names the directory path was found not to have */
+void fhcache_drop_negatives(struct fhcache *c, const char *path)
+{
+	struct fhcache_ref dir, child;
+	struct fhcache_entry *e;
+	struct fhcache_shard *s;
+	struct shard_set set;
+	int valid;
+
+	if (!fhcache_find(c, path, &dir)) {
+		return;
+	}
+	for (;;) {
+		s = entry_shard(c, dir.entry);
+		set.n = 0;
+		shards_add(&set, s);
+		child.entry = NULL;
+		pthread_mutex_lock(&s->lock);
+		valid = ref_valid(c, &set, &dir);
+		if (valid > 0 && dir.entry->negatives > 0) {
+			for (e = dir.entry->children; e != NULL && !e->negative; e = e->next)
+				;
+			child.entry = e;
+			child.gen   = e != NULL ? e->gen : 0;
+		}
+		pthread_mutex_unlock(&s->lock);
+		if (valid < 0) {
+			continue;
+		}
+		if (child.entry == NULL) {
+			return;
+		}
+		drop_entry(c, &child);
+	}
+}
+
+/* is e dir or below it, as far as it can tell without a lock */
+static SEQ_READER int entry_below(const struct fhcache_entry *e, const struct fhcache_entry *dir)
+{
+	for (; e != NULL; e = __atomic_load_n(&e->parent, __ATOMIC_RELAXED)) {
+		if (e == dir) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Move the entry of old to new, with everything cached below it. What
+ * new was before is gone, and if the directory of new is not cached, the
+ * entry is dropped instead.
+ */
+void fhcache_rename(struct fhcache *c, const char *old, const char *new)
+{
+	struct fhcache_ref t, dir, target;
+	struct fhcache_name *n, *old_name;
+	const char *leaf, *name;
+	struct fhcache_shard *s;
+	struct shard_set set;
+	size_t len = 0, l;
+	int valid, moved = 0;
+	uint8_t negative;
+	uint32_t hash;
+
+	if (!fhcache_find(c, old, &t)) {
+		/* whatever new was, it is not what it was cached as anymore */
+		fhcache_delete(c, new);
+		return;
+	}
+	if (t.entry == c->root) {
+		return;
+	}
+
+	for (leaf = NULL, name = new; (name = fhcache_component(name, &l)) != NULL; name += l) {
+		leaf = name;
+		len  = l;
+	}
+	if (leaf == NULL) {
+		return;
+	}
+
+	if (!fhcache_find(c, strndupa(new, leaf - new), &dir) ||
+	    entry_below(dir.entry, t.entry)) {
+		drop_entry(c, &t);
+		return;
+	}
+	target.entry = find_child(c, dir.entry, leaf, len, &target.gen, &negative, NULL);
+	if (target.entry != NULL) {
+		if (entry_below(t.entry, target.entry)) {
+			return;
+		}
+		drop_entry(c, &target);
+	}
+
+	n = intern_name(c, leaf, len);
+	hash = entry_hash(dir.entry, n->hash);
+	s = shard_of(c, hash);
+
+	for (;;) {
+		set.n = 0;
+		shards_add(&set, entry_shard(c, t.entry));
+		shards_add(&set, entry_shard(c, __atomic_load_n(&t.entry->parent, __ATOMIC_RELAXED)));
+		shards_add(&set, s);
+		shards_add(&set, entry_shard(c, dir.entry));
+		shards_lock(&set);
+		valid = ref_valid(c, &set, &t);
+		if (valid > 0 && !shards_held(&set, entry_shard(c, t.entry->parent))) {
+			valid = -1;
+		}
+		if (valid > 0) {
+			valid = ref_valid(c, &set, &dir);
+		}
+		if (valid >= 0) {
+			break;
+		}
+		shards_unlock(&set);
+	}
+	if (valid && table_slot(s->table, dir.entry, n, hash)->entry == NULL) {
+		unhash_entry(c, t.entry);
+		old_name = t.entry->name;
+		__atomic_store_n(&t.entry->parent, dir.entry, __ATOMIC_RELAXED);
+		__atomic_store_n(&t.entry->hash, hash, __ATOMIC_RELAXED);
+		t.entry->name = n;
+		hash_entry(c, t.entry);
+		n = old_name;
+		moved = 1;
+	}
+	shards_unlock(&set);
+	release_name(c, n);
+
+	/* someone cached new meanwhile */
+	if (!moved) {
+		drop_entry(c, &t);
+	}
+}
+
+/*
+ * The map of traced handles. Lookups take no lock, like the ones of the
+ * tree, and changes lock the one shard of the traced handle.
+ */
+static struct fhcache_map_shard *map_shard_of(struct fhcache *c, uint32_t hash)
+{
+	return &c->map[hash >> (32 - FHCACHE_SHARD_BITS)];
+}
+
+static struct fhcache_map_table *new_map_table(uint32_t size)
+{
+	struct fhcache_map_table *t;
+
+	t = calloc(1, sizeof(struct fhcache_map_table) + size * sizeof(struct fhcache_map_slot));
+	if (t == NULL) {
+		fprintf(stderr, "CALLOC failed to allocate the handle map\n");
+		exit(10);
+	}
+	t->size = size;
+	return t;
+}
+
+/* the mapping of key in t, as found without the lock */
+static SEQ_READER struct fhcache_mapping *map_probe(const struct fhcache_map_table *t,
+						    const char *key, uint32_t len,
+						    uint32_t hash)
+{
+	struct fhcache_mapping *m;
+	uint32_t i, j, k, mask = t->size - 1;
+
+	for (i = hash & mask, j = 0; j < t->size; i = (i + 1) & mask, j++) {
+		m = __atomic_load_n(&t->slot[i].mapping, __ATOMIC_ACQUIRE);
+		if (m == NULL) {
+			break;
+		}
+		if (t->slot[i].hash != hash || m->key_len != len) {
+			continue;
+		}
+		for (k = 0; k < len && m->key[k] == key[k]; k++)
+			;
+		if (k == len) {
+			return m;
+		}
+	}
+	return NULL;
+}
+
+/* the slot of key in t, or the empty slot where it would go */
+static struct fhcache_map_slot *map_slot(struct fhcache_map_table *t, const char *key,
+					 uint32_t len, uint32_t hash)
+{
+	uint32_t mask = t->size - 1;
+	uint32_t i = hash & mask;
+	struct fhcache_map_slot *slot;
+
+	for (;; i = (i + 1) & mask) {
+		slot = &t->slot[i];
+		if (slot->mapping == NULL) {
+			return slot;
+		}
+		if (slot->hash == hash && slot->mapping->key_len == len &&
+		    memcmp(slot->mapping->key, key, len) == 0) {
+			return slot;
+		}
+	}
+}
+
+static void map_resize(struct fhcache_map_shard *s)
+{
+	struct fhcache_map_table *old = s->table, *t;
+	uint32_t i, j, mask;
+
+	t = new_map_table(old->size * 2);
+	mask = t->size - 1;
+	for (i = 0; i < old->size; i++) {
+		if (old->slot[i].mapping == NULL) {
+			continue;
+		}
+		for (j = old->slot[i].hash & mask; t->slot[j].mapping; j = (j + 1) & mask)
+			;
+		t->slot[j] = old->slot[i];
+	}
+	t->retired = old;
+	__atomic_store_n(&s->table, t, __ATOMIC_RELEASE);
+}
+
+/* take the mapping in slot i of the table of s out, for reuse */
+static void map_unhash(struct fhcache_map_shard *s, uint32_t i)
+{
+	struct fhcache_map_table *t = s->table;
+	struct fhcache_mapping *m = t->slot[i].mapping;
+	struct fhcache_map_slot *next;
+	uint32_t mask, j, home;
+
+	s->count--;
+	__atomic_store_n(&s->bytes, s->bytes - sizeof(struct fhcache_mapping),
+			 __ATOMIC_RELAXED);
+
+	/* move back the mappings that probed past the freed slot */
+	mask = t->size - 1;
+	for (j = (i + 1) & mask; ; j = (j + 1) & mask) {
+		next = &t->slot[j];
+		if (next->mapping == NULL) {
+			break;
+		}
+		home = next->hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			t->slot[i].hash = next->hash;
+			__atomic_store_n(&t->slot[i].mapping, next->mapping, __ATOMIC_RELEASE);
+			i = j;
+		}
+	}
+	__atomic_store_n(&t->slot[i].mapping, NULL, __ATOMIC_RELEASE);
+	m->next = s->unused;
+	s->unused = m;
+}
+
+/* CLOCK eviction of the mappings, as shard_evict() does for entries */
+static void map_evict(struct fhcache *c, struct fhcache_map_shard *s)
+{
+	struct fhcache_map_table *t = s->table;
+	uint32_t steps, mask = t->size - 1;
+	struct fhcache_mapping *m;
+
+	for (steps = 0; pair_bytes(c, s - c->map) > c->shard_budget && steps < t->size;
+	     steps++) {
+		s->hand &= mask;
+		m = t->slot[s->hand].mapping;
+		if (m == NULL) {
+			s->hand++;
+			continue;
+		}
+		if (__atomic_load_n(&m->ref, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&m->ref, 0, __ATOMIC_RELAXED);
+			s->hand++;
+			continue;
+		}
+		/* the slot the hand is at gets the next mapping of the probe */
+		map_unhash(s, s->hand);
+		s->evictions++;
+	}
+}
+
+SEQ_READER int fhcache_map_lookup(struct fhcache *c, const char *key, uint32_t len,
+				  struct fhcache_handle *h)
+{
+	uint32_t hash = name_hash(key, len), seq, i, fh_len;
+	struct fhcache_map_shard *s = map_shard_of(c, hash);
+	const struct fhcache_map_table *t;
+	struct fhcache_mapping *m;
+
+	if (len > FHCACHE_FHSIZE) {
+		return 0;
+	}
+	do {
+		seq = read_begin(&s->seq);
+		t = __atomic_load_n(&s->table, __ATOMIC_ACQUIRE);
+		m = t != NULL ? map_probe(t, key, len, hash) : NULL;
+		if (m != NULL && h != NULL) {
+			fh_len = m->fh_len;
+			if (fh_len > FHCACHE_FHSIZE) {
+				fh_len = FHCACHE_FHSIZE;
+			}
+			for (i = 0; i < fh_len; i++) {
+				h->data[i] = m->fh[i];
+			}
+			h->len  = fh_len;
+			h->size = 0;
+		}
+	} while (read_retry(&s->seq, seq));
+
+	/* marked as used, for the eviction to spare */
+	if (m != NULL && !__atomic_load_n(&m->ref, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&m->ref, 1, __ATOMIC_RELAXED);
+	}
+	return m != NULL;
+}
+
+void fhcache_map_insert(struct fhcache *c, const char *key, uint32_t len,
+			const char *fh, uint32_t fh_len)
+{
+	uint32_t hash = name_hash(key, len);
+	struct fhcache_map_shard *s = map_shard_of(c, hash);
+	struct fhcache_map_slot *slot;
+	struct fhcache_mapping *m;
+
+	if (len > FHCACHE_FHSIZE || fh_len > FHCACHE_FHSIZE) {
+		fprintf(stderr, "handle is %u bytes long in fhcache_map_insert\n",
+			len > fh_len ? len : fh_len);
+		return;
+	}
+
+	pthread_mutex_lock(&s->lock);
+	write_begin(&s->seq);
+	if (s->table == NULL) {
+		__atomic_store_n(&s->table, new_map_table(FHCACHE_TABLE_SIZE), __ATOMIC_RELEASE);
+	} else if ((s->count + 1) * 4 > s->table->size * 3) {
+		map_resize(s);
+	}
+	slot = map_slot(s->table, key, len, hash);
+	m = slot->mapping;
+	if (m == NULL) {
+		m = s->unused;
+		if (m != NULL) {
+			s->unused = m->next;
+		} else {
+			m = arena_alloc(&s->arena, sizeof(struct fhcache_mapping));
+		}
+		memcpy(m->key, key, len);
+		m->key_len = len;
+	}
+	memcpy(m->fh, fh, fh_len);
+	m->fh_len = fh_len;
+	__atomic_store_n(&m->ref, 1, __ATOMIC_RELAXED);
+	if (slot->mapping == NULL) {
+		slot->hash = hash;
+		__atomic_store_n(&slot->mapping, m, __ATOMIC_RELEASE);
+		s->count++;
+		__atomic_store_n(&s->bytes, s->bytes + sizeof(struct fhcache_mapping),
+				 __ATOMIC_RELAXED);
+	}
+	if (c->shard_budget != 0) {
+		map_evict(c, s);
+	}
+	write_end(&s->seq);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void fhcache_map_delete(struct fhcache *c, const char *key, uint32_t len)
+{
+	uint32_t hash = name_hash(key, len);
+	struct fhcache_map_shard *s = map_shard_of(c, hash);
+	struct fhcache_map_slot *slot;
+
+	if (len > FHCACHE_FHSIZE) {
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	slot = s->table != NULL ? map_slot(s->table, key, len, hash) : NULL;
+	if (slot != NULL && slot->mapping != NULL) {
+		write_begin(&s->seq);
+		map_unhash(s, slot - s->table->slot);
+		write_end(&s->seq);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+void fhcache_set_budget(struct fhcache *c, size_t bytes)
+{
+	c->shard_budget = bytes / FHCACHE_SHARDS;
+}
+
+void fhcache_stats(struct fhcache *c, struct fhcache_stats *st)
+{
+	struct fhcache_map_shard *m;
+	struct fhcache_shard *s;
+	int i;
+
+	memset(st, 0, sizeof(struct fhcache_stats));
+	for (i = 0; i < FHCACHE_SHARDS; i++) {
+		s = &c->shard[i];
+		pthread_mutex_lock(&s->lock);
+		st->entries   += s->count;
+		st->bytes     += shard_bytes(s);
+		st->evictions += s->evictions;
+		pthread_mutex_unlock(&s->lock);
+
+		m = &c->map[i];
+		pthread_mutex_lock(&m->lock);
+		st->entries   += m->count;
+		st->bytes     += map_bytes(m);
+		st->evictions += m->evictions;
+		pthread_mutex_unlock(&m->lock);
+	}
+}
+
+/*
+ * Snapshots. A snapshot lists the cached entries with every directory
+ * ahead of the entries below it, so that it loads in a single pass:
+ *
+ *   header:  "NFSFHCAC" version:u32 count:u32 root_len:u32 root
+ *   entry:   parent:u32 name_len:u32 fh_len:u32 size:u64 name fh
+ *   map:     mappings:u32
+ *   mapping: key_len:u32 fh_len:u32 key fh
+ *
+ * where parent is 0 for the root and i for the i-th entry, and the
+ * mappings are the traced handles of the map with their live handles.
+ * All fields are little endian. Negative entries are left out. A
+ * snapshot is only loaded into the cache of an export with the same
+ * root handle. Version 1 snapshots have no map.
+ */
+#define FHCACHE_MAGIC		"NFSFHCAC"
+#define FHCACHE_VERSION		2
+#define SNAP_HEADER_LEN		20
+#define SNAP_ENTRY_LEN		20
+#define SNAP_MAPPING_LEN	8
+
+/* a name as NFSv3 has them: 1 to 255 bytes, no '/', not "." or ".." */
+static int snap_name_valid(const unsigned char *name, uint32_t len)
+{
+	if (len == 0 || len > 255 || memchr(name, '/', len) != NULL) {
+		return 0;
+	}
+	return !(name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')));
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+	put_u32(p, v);
+	put_u32(p + 4, v >> 32);
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+	return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+struct snapshot {
+	FILE *f;
+	uint32_t count;
+	int failed;
+};
+
+static void save_entry(struct snapshot *snap, const struct fhcache_entry *e, uint32_t parent)
+{
+	unsigned char hdr[SNAP_ENTRY_LEN];
+	const struct fhcache_entry *child;
+	uint32_t index = ++snap->count;
+
+	put_u32(&hdr[0], parent);
+	put_u32(&hdr[4], e->name->len);
+	put_u32(&hdr[8], e->fh_len);
+	put_u64(&hdr[12], e->size);
+	if (fwrite(hdr, sizeof(hdr), 1, snap->f) != 1 ||
+	    fwrite(e->name->name, 1, e->name->len, snap->f) != e->name->len ||
+	    fwrite(e->fh, 1, e->fh_len, snap->f) != e->fh_len) {
+		snap->failed = 1;
+	}
+
+	for (child = e->children; child != NULL; child = child->next) {
+		if (!child->negative) {
+			save_entry(snap, child, index);
+		}
+	}
+}
+
+static void save_map(struct snapshot *snap, struct fhcache *c)
+{
+	unsigned char hdr[SNAP_MAPPING_LEN];
+	const struct fhcache_map_table *t;
+	const struct fhcache_mapping *m;
+	uint32_t count = 0, i;
+	int j;
+
+	for (j = 0; j < FHCACHE_SHARDS; j++) {
+		count += c->map[j].count;
+	}
+	put_u32(&hdr[0], count);
+	if (fwrite(hdr, 4, 1, snap->f) != 1) {
+		snap->failed = 1;
+	}
+
+	for (j = 0; j < FHCACHE_SHARDS; j++) {
+		t = c->map[j].table;
+		for (i = 0; t != NULL && i < t->size; i++) {
+			m = t->slot[i].mapping;
+			if (m == NULL) {
+				continue;
+			}
+			put_u32(&hdr[0], m->key_len);
+			put_u32(&hdr[4], m->fh_len);
+			if (fwrite(hdr, sizeof(hdr), 1, snap->f) != 1 ||
+			    fwrite(m->key, 1, m->key_len, snap->f) != m->key_len ||
+			    fwrite(m->fh, 1, m->fh_len, snap->f) != m->fh_len) {
+				snap->failed = 1;
+			}
+			snap->count++;
+		}
+	}
+}
+
+/* write the cache to path, returns the number of entries and mappings or -1 */
+int fhcache_save(struct fhcache *c, const char *path)
+{
+	unsigned char hdr[SNAP_HEADER_LEN];
+	const struct fhcache_entry *e;
+	struct snapshot snap;
+	uint32_t entries;
+	char *tmp;
+
+	if (asprintf(&tmp, "%s.tmp", path) < 0) {
+		fprintf(stderr, "Failed to allocate the snapshot name\n");
+		exit(10);
+	}
+	snap.f = fopen(tmp, "w");
+	if (snap.f == NULL) {
+		fprintf(stderr, "Failed to open %s. %s\n", tmp, strerror(errno));
+		free(tmp);
+		return -1;
+	}
+	snap.count  = 0;
+	snap.failed = 0;
+
+	memcpy(hdr, FHCACHE_MAGIC, 8);
+	put_u32(&hdr[8], FHCACHE_VERSION);
+	put_u32(&hdr[12], 0);
+	put_u32(&hdr[16], c->root->fh_len);
+	if (fwrite(hdr, sizeof(hdr), 1, snap.f) != 1 ||
+	    fwrite(c->root->fh, 1, c->root->fh_len, snap.f) != c->root->fh_len) {
+		snap.failed = 1;
+	}
+	for (e = c->root->children; e != NULL; e = e->next) {
+		if (!e->negative) {
+			save_entry(&snap, e, 0);
+		}
+	}
+
+	entries = snap.count;
+	save_map(&snap, c);
+
+	put_u32(&hdr[12], entries);
+	if (fseek(snap.f, 12, SEEK_SET) != 0 ||
+	    fwrite(&hdr[12], 4, 1, snap.f) != 1) {
+		snap.failed = 1;
+	}
+	if (fclose(snap.f) != 0) {
+		snap.failed = 1;
+	}
+	if (snap.failed || rename(tmp, path) != 0) {
+		fprintf(stderr, "Failed to write %s. %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+
+	return snap.count;
+}
+
+/* the mappings from p on, returns the number loaded */
+static int load_map(struct fhcache *c, const char *path,
+		    const unsigned char *p, const unsigned char *end)
+{
+	uint32_t i, count, key_len, fh_len;
+
+	if (end - p < 4) {
+		fprintf(stderr, "%s is truncated\n", path);
+		return 0;
+	}
+	count = get_u32(p);
+	p += 4;
+
+	for (i = 0; i < count; i++) {
+		if (end - p < SNAP_MAPPING_LEN) {
+			break;
+		}
+		key_len = get_u32(&p[0]);
+		fh_len  = get_u32(&p[4]);
+		p += SNAP_MAPPING_LEN;
+		if (key_len == 0 || key_len > FHCACHE_FHSIZE || fh_len > FHCACHE_FHSIZE ||
+		    (size_t)(end - p) < (size_t)key_len + fh_len) {
+			break;
+		}
+		fhcache_map_insert(c, (const char *)p, key_len,
+				   (const char *)p + key_len, fh_len);
+		p += key_len + fh_len;
+	}
+	if (i < count) {
+		fprintf(stderr, "%s is corrupt after %u mappings\n", path, i);
+	}
+	return i;
+}
+
+/*
+ * Fill the cache from the snapshot at path, returns the number of
+ * entries and mappings loaded, 0 if there is no snapshot yet, or -1.
+ */
+int fhcache_load(struct fhcache *c, const char *path)
+{
+	const unsigned char *map, *p, *end;
+	struct fhcache_ref *entries;
+	uint32_t i, count, parent, name_len, fh_len, root_len, version;
+	uint64_t size;
+	struct stat st;
+	int fd, loaded = -1;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		fprintf(stderr, "Failed to open %s. %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) != 0 || st.st_size < SNAP_HEADER_LEN) {
+		fprintf(stderr, "%s is not a handle cache snapshot\n", path);
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to mmap %s. %s\n", path, strerror(errno));
+		return -1;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	end = map + st.st_size;
+
+	version = get_u32(&map[8]);
+	if (memcmp(map, FHCACHE_MAGIC, 8) != 0 || version < 1 || version > FHCACHE_VERSION) {
+		fprintf(stderr, "%s is not a handle cache snapshot\n", path);
+		goto out;
+	}
+	count    = get_u32(&map[12]);
+	root_len = get_u32(&map[16]);
+	p = map + SNAP_HEADER_LEN;
+	if (root_len != c->root->fh_len || (size_t)(end - p) < root_len ||
+	    memcmp(p, c->root->fh, root_len) != 0) {
+		fprintf(stderr, "%s was taken of another export, ignoring it\n", path);
+		goto out;
+	}
+	p += root_len;
+
+	if (count > (end - p) / SNAP_ENTRY_LEN) {
+		fprintf(stderr, "%s is truncated\n", path);
+		goto out;
+	}
+	entries = malloc((count + 1) * sizeof(struct fhcache_ref));
+	if (entries == NULL) {
+		fprintf(stderr, "MALLOC failed to allocate %u snapshot entries\n", count);
+		exit(10);
+	}
+	entries[0].entry = c->root;
+	entries[0].gen   = 0;
+
+	for (loaded = 0, i = 1; i <= count; i++) {
+		if (end - p < SNAP_ENTRY_LEN) {
+			break;
+		}
+		parent   = get_u32(&p[0]);
+		name_len = get_u32(&p[4]);
+		fh_len   = get_u32(&p[8]);
+		size     = get_u64(&p[12]);
+		p += SNAP_ENTRY_LEN;
+		if (parent >= i || (size_t)(end - p) < (size_t)name_len + fh_len ||
+		    !snap_name_valid(p, name_len)) {
+			break;
+		}
+		/* the entries of an evicted directory are left out */
+		entries[i].entry = NULL;
+		if (entries[parent].entry != NULL && fh_len <= FHCACHE_FHSIZE &&
+		    insert_child(c, &entries[parent],
+				 intern_name(c, (const char *)p, name_len),
+				 (const char *)p + name_len, fh_len, size, &entries[i]) == 0) {
+			loaded++;
+		}
+		p += name_len + fh_len;
+	}
+	if (i <= count) {
+		fprintf(stderr, "%s is corrupt after %u entries\n", path, i - 1);
+	} else if (version >= 2) {
+		loaded += load_map(c, path, p, end);
+	}
+	free(entries);
+out:
+	munmap((void *)map, st.st_size);
+	return loaded;
+}
+
+static struct fhcache *fhcache_new(char *key, const char *fh, uint32_t len)
+{
+	struct fhcache_entry *root;
+	struct fhcache_name *n;
+	struct fhcache *c;
+	int i;
+
+	if (posix_memalign((void **)&c, 64, sizeof(struct fhcache)) != 0) {
+		fprintf(stderr, "Failed to allocate the handle cache\n");
+		exit(10);
+	}
+	memset(c, 0, sizeof(struct fhcache));
+	c->key  = key;
+	c->refs = 1;
+	pthread_mutex_init(&c->names_lock, NULL);
+	for (i = 0; i < FHCACHE_SHARDS; i++) {
+		pthread_mutex_init(&c->shard[i].lock, NULL);
+		c->shard[i].table = new_table(FHCACHE_TABLE_SIZE);
+		pthread_mutex_init(&c->map[i].lock, NULL);
+	}
+
+	if (len > FHCACHE_FHSIZE) {
+		fprintf(stderr, "root handle is %u bytes long, ignoring it\n", len);
+		len = 0;
+	}
+	n = intern_name(c, "", 0);
+	root = new_entry(shard_of(c, entry_hash(NULL, n->hash)));
+	memset(root, 0, sizeof(struct fhcache_entry));
+	root->name = n;
+	root->hash = entry_hash(NULL, n->hash);
+	set_handle(root, fh, len);
+	c->root = root;
+
+	return c;
+}
+
+struct fhcache *fhcache_get(const char *server, const char *export,
+			    const char *fh, uint32_t len)
+{
+	struct fhcache *c;
+	char *key;
+
+	if (asprintf(&key, "%s:%s", server, export) < 0) {
+		fprintf(stderr, "Failed to allocate the handle cache key\n");
+		exit(10);
+	}
+
+	pthread_mutex_lock(&fhcaches_lock);
+	for (c = fhcaches; c != NULL; c = c->next) {
+		if (strcmp(c->key, key) == 0) {
+			break;
+		}
+	}
+	if (c != NULL) {
+		c->refs++;
+		free(key);
+	} else {
+		c = fhcache_new(key, fh, len);
+		c->next  = fhcaches;
+		fhcaches = c;
+	}
+	pthread_mutex_unlock(&fhcaches_lock);
+
+	return c;
+}
+
+void fhcache_put(struct fhcache *c)
+{
+	struct fhcache_map_table *mt, *mretired;
+	struct fhcache_table *t, *retired;
+	struct fhcache **p;
+	int i;
+
+	pthread_mutex_lock(&fhcaches_lock);
+	if (--c->refs > 0) {
+		pthread_mutex_unlock(&fhcaches_lock);
+		return;
+	}
+	for (p = &fhcaches; *p != c; p = &(*p)->next)
+		;
+	*p = c->next;
+	pthread_mutex_unlock(&fhcaches_lock);
+
+	for (i = 0; i < FHCACHE_SHARDS; i++) {
+		for (t = c->shard[i].table; t != NULL; t = retired) {
+			retired = t->retired;
+			free(t);
+		}
+		arena_free(&c->shard[i].arena);
+		pthread_mutex_destroy(&c->shard[i].lock);
+
+		for (mt = c->map[i].table; mt != NULL; mt = mretired) {
+			mretired = mt->retired;
+			free(mt);
+		}
+		arena_free(&c->map[i].arena);
+		pthread_mutex_destroy(&c->map[i].lock);
+	}
+	free(c->names);
+	arena_free(&c->names_arena);
+	pthread_mutex_destroy(&c->names_lock);
+	free(c->key);
+	free(c);
+}
@@ -0,0 +1,100 @@
+/*
+   Handle cache shared by the connections to an export
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#ifndef _FHCACHE_H_
+#define _FHCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* the largest NFSv3 handle */
+#define FHCACHE_FHSIZE	64
+
+struct fhcache;
+struct fhcache_entry;
+
+/*
+ * An entry as found by a lookup. It stays valid until the entry is
+ * dropped or evicted, which changes that take one check for.
+ */
+struct fhcache_ref {
+	struct fhcache_entry *entry;
+	uint32_t gen;
+};
+
+/* a handle as copied out of the cache */
+struct fhcache_handle {
+	uint32_t len;
+	int64_t size;
+	char data[FHCACHE_FHSIZE];
+};
+
+/* the cache of server:export, created with the root handle fh */
+struct fhcache *fhcache_get(const char *server, const char *export,
+			    const char *fh, uint32_t len);
+void fhcache_put(struct fhcache *c);
+
+const char *fhcache_component(const char *path, size_t *len);
+
+/*
+ * Lookups. They take no lock and fill in *h, if not NULL, only when the
+ * whole path is cached. fhcache_walk() returns the first component of
+ * path that is not cached, or NULL.
+ */
+const char *fhcache_walk(struct fhcache *c, const char *path, struct fhcache_handle *h);
+int fhcache_lookup(struct fhcache *c, const char *path, struct fhcache_handle *h);
+int fhcache_find(struct fhcache *c, const char *path, struct fhcache_ref *ref);
+
+/* changes */
+int fhcache_insert_child(struct fhcache *c, const struct fhcache_ref *dir,
+			 const char *name, size_t len,
+			 const char *fh, uint32_t fh_len, int64_t size);
+void fhcache_insert(struct fhcache *c, const char *path,
+		    const char *fh, uint32_t fh_len, int64_t size);
+void fhcache_delete(struct fhcache *c, const char *path);
+void fhcache_rename(struct fhcache *c, const char *old, const char *new);
+
+/* names found not to exist, which lookups of a path stop at */
+int fhcache_negative(struct fhcache *c, const char *path);
+void fhcache_insert_negative(struct fhcache *c, const char *path);
+void fhcache_drop_negatives(struct fhcache *c, const char *path);
+
+/*
+ * Traced handles, as found in a trace, mapped to the live handles of the
+ * same objects. Lookups take no lock and copy the live handle to *h.
+ */
+int fhcache_map_lookup(struct fhcache *c, const char *key, uint32_t len,
+		       struct fhcache_handle *h);
+void fhcache_map_insert(struct fhcache *c, const char *key, uint32_t len,
+			const char *fh, uint32_t fh_len);
+void fhcache_map_delete(struct fhcache *c, const char *key, uint32_t len);
+
+/*
+ * Memory. With a budget, entries and traced handle mappings that were
+ * not looked up lately are evicted to stay within it, and looked up
+ * again when needed.
+ */
+struct fhcache_stats {
+	uint64_t entries;
+	uint64_t bytes;
+	uint64_t evictions;
+};
+
+void fhcache_set_budget(struct fhcache *c, size_t bytes);
+void fhcache_stats(struct fhcache *c, struct fhcache_stats *st);
+
+/* snapshots, taken and loaded while nothing else uses the cache */
+int fhcache_save(struct fhcache *c, const char *path);
+int fhcache_load(struct fhcache *c, const char *path);
+
+#endif /* _FHCACHE_H_ */
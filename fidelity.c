@@ -0,0 +1,406 @@
+/*
+   How closely a replay reproduced the load of its trace
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+/*
+ * The ops of a replay are compared with the trace per op type and per
+ * traced client: the time between an op and the one before it of the
+ * same type or client (in trace order, so an op replayed before the one
+ * it followed in the trace counts as reordered), the latencies, and the
+ * mean number of ops in flight, their summed latency over the time the
+ * trace or the replay took.
+ *
+ * The issue lag of an op is how long after it was due it went out. A lag
+ * that stays low is the server keeping up, one that grows is the replayer
+ * falling behind: workers too busy, or a queue depth too small for the
+ * traced concurrency. The lag of the first FIDELITY_LAG_OPS ops of a
+ * group is compared with a moving mean over the last ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fidelity.h"
+#include "hist.h"
+#include "trace.h"
+
+#define FIDELITY_LAG_OPS	64
+#define FIDELITY_LAG_GROWTH	10.0e-3		/* secs */
+#define FIDELITY_CLIENTS	256
+
+/* issue lag at the start and lately */
+struct lag_trend {
+	uint64_t count;
+	double first;
+	double recent;
+};
+
+struct fid_op_type {
+	struct hist gap[2];		/* traced and replayed, ns */
+	struct hist lat[2];
+	struct hist lag;
+	uint64_t last[2];		/* usec */
+	uint64_t reordered;
+	struct lag_trend trend;
+};
+
+struct fid_client {
+	struct fid_client *next;
+	int client;
+	uint64_t count;
+	uint64_t last[2];		/* usec */
+	double gap[2];			/* summed, secs */
+	double lat[2];
+	uint64_t traced_lats;
+	double lag, lag_max;
+	struct lag_trend trend;
+};
+
+struct fidelity {
+	int timed;
+	uint64_t count;
+
+	/* what the trace and the replay took, usec */
+	uint64_t traced_start, traced_end;
+	uint64_t replay_start, replay_end;
+
+	struct fid_op_type ops[OP_MAX];
+	struct lag_trend trend;
+	double lag, lag_max;
+
+	struct fid_client **clients;
+	unsigned nclients;
+	unsigned size;
+};
+
+static void trend_add(struct lag_trend *t, double lag)
+{
+	if (t->count < FIDELITY_LAG_OPS) {
+		t->first += (lag - t->first) / (t->count + 1);
+		t->recent = t->first;
+	} else {
+		t->recent += (lag - t->recent) / FIDELITY_LAG_OPS;
+	}
+	t->count++;
+}
+
+static double trend_growth(const struct lag_trend *t)
+{
+	return t->count > FIDELITY_LAG_OPS ? t->recent - t->first : 0;
+}
+
+static void clients_resize(struct fidelity *f)
+{
+	struct fid_client **old = f->clients, *c, *next;
+	unsigned i, old_size = f->size;
+
+	f->size = old_size ? old_size * 2 : FIDELITY_CLIENTS;
+	f->clients = calloc(f->size, sizeof(struct fid_client *));
+	if (f->clients == NULL) {
+		fprintf(stderr, "CALLOC failed to allocate the fidelity clients\n");
+		exit(10);
+	}
+	for (i = 0; i < old_size; i++) {
+		for (c = old[i]; c != NULL; c = next) {
+			next = c->next;
+			c->next = f->clients[(unsigned)c->client & (f->size - 1)];
+			f->clients[(unsigned)c->client & (f->size - 1)] = c;
+		}
+	}
+	free(old);
+}
+
+static struct fid_client *client_get(struct fidelity *f, int client)
+{
+	struct fid_client *c;
+	unsigned b = (unsigned)client & (f->size - 1);
+
+	for (c = f->clients[b]; c != NULL; c = c->next) {
+		if (c->client == client) {
+			return c;
+		}
+	}
+	if (f->nclients + 1 > f->size) {
+		clients_resize(f);
+		b = (unsigned)client & (f->size - 1);
+	}
+	c = calloc(1, sizeof(struct fid_client));
+	if (c == NULL) {
+		fprintf(stderr, "CALLOC failed to allocate a fidelity client\n");
+		exit(10);
+	}
+	c->client = client;
+	c->next = f->clients[b];
+	f->clients[b] = c;
+	f->nclients++;
+	return c;
+}
+
+void fidelity_add(struct fidelity *f, const struct fidelity_op *op)
+{
+	struct fid_op_type *t = &f->ops[op->opcode];
+	struct fid_client *c = client_get(f, op->client);
+	uint64_t done = op->issued + op->latency / 1000;
+	double lag = op->issued > op->due ? (op->issued - op->due) * 1.0e-6 : 0;
+
+	if (f->count == 0 || op->traced < f->traced_start) {
+		f->traced_start = op->traced;
+	}
+	if (op->traced + op->traced_lat > f->traced_end) {
+		f->traced_end = op->traced + op->traced_lat;
+	}
+	if (f->count == 0 || op->issued < f->replay_start) {
+		f->replay_start = op->issued;
+	}
+	if (done > f->replay_end) {
+		f->replay_end = done;
+	}
+	f->count++;
+
+	if (t->lat[1].count > 0) {
+		hist_record(&t->gap[0], op->traced > t->last[0] ?
+			    (op->traced - t->last[0]) * 1000 : 0);
+		if (op->issued >= t->last[1]) {
+			hist_record(&t->gap[1], (op->issued - t->last[1]) * 1000);
+		} else {
+			hist_record(&t->gap[1], 0);
+			t->reordered++;
+		}
+	}
+	t->last[0] = op->traced;
+	t->last[1] = op->issued;
+	if (op->traced_lat > 0) {
+		hist_record(&t->lat[0], op->traced_lat * 1000);
+	}
+	hist_record(&t->lat[1], op->latency);
+
+	if (c->count > 0) {
+		c->gap[0] += op->traced > c->last[0] ? (op->traced - c->last[0]) * 1.0e-6 : 0;
+		c->gap[1] += op->issued > c->last[1] ? (op->issued - c->last[1]) * 1.0e-6 : 0;
+	}
+	c->last[0] = op->traced;
+	c->last[1] = op->issued;
+	if (op->traced_lat > 0) {
+		c->lat[0] += op->traced_lat * 1.0e-6;
+		c->traced_lats++;
+	}
+	c->lat[1] += op->latency * 1.0e-9;
+	c->count++;
+
+	if (!f->timed) {
+		return;
+	}
+	hist_record(&t->lag, lag * 1.0e9);
+	trend_add(&t->trend, lag);
+	trend_add(&c->trend, lag);
+	trend_add(&f->trend, lag);
+	c->lag += lag;
+	if (lag > c->lag_max) {
+		c->lag_max = lag;
+	}
+	f->lag += lag;
+	if (lag > f->lag_max) {
+		f->lag_max = lag;
+	}
+}
+
+/* mean ops in flight over a span in usec, of latencies summed in secs */
+static double concurrency(double busy, uint64_t span)
+{
+	return span > 0 ? busy / (span * 1.0e-6) : 0;
+}
+
+static void print_ms(const struct hist *h, double p)
+{
+	if (h->count == 0) {
+		printf("         -");
+	} else if (p < 0) {
+		printf(" %9.03f", 1.0e-6 * h->sum / h->count);
+	} else {
+		printf(" %9.03f", 1.0e-6 * hist_percentile(h, p));
+	}
+}
+
+static int client_cmp(const void *a, const void *b)
+{
+	const struct fid_client *x = *(const struct fid_client * const *)a;
+	const struct fid_client *y = *(const struct fid_client * const *)b;
+
+	return (x->client > y->client) - (x->client < y->client);
+}
+
+void fidelity_report(struct fidelity *f)
+{
+	uint64_t traced_span = f->traced_end - f->traced_start;
+	uint64_t replay_span = f->replay_end - f->replay_start;
+	struct fid_client **sorted, *c;
+	unsigned i, n;
+	int behind = 0;
+
+	if (f->count == 0) {
+		return;
+	}
+
+	printf("\nReplay fidelity, traced vs replayed, in ms\n");
+	printf("\n Inter-arrival          Count    AvgGap    Replay    p99Gap    Replay"
+	       " Reordered    AvgLag    p99Lag    MaxLag\n");
+	printf(" ------------------------------------------------------------"
+	       "--------------------------------------------\n");
+	for (i = 0; i < OP_MAX; i++) {
+		const struct fid_op_type *t = &f->ops[i];
+
+		if (t->lat[1].count == 0) {
+			continue;
+		}
+		printf(" %-22s %7lu", trace_op_name(i), (unsigned long)t->lat[1].count);
+		print_ms(&t->gap[0], -1);
+		print_ms(&t->gap[1], -1);
+		print_ms(&t->gap[0], 0.99);
+		print_ms(&t->gap[1], 0.99);
+		printf(" %9lu", (unsigned long)t->reordered);
+		print_ms(&t->lag, -1);
+		print_ms(&t->lag, 0.99);
+		if (t->lag.count > 0) {
+			printf(" %9.03f", 1.0e-6 * t->lag.max);
+		} else {
+			printf("         -");
+		}
+		if (trend_growth(&t->trend) > FIDELITY_LAG_GROWTH) {
+			printf("  lag grew %.03f", 1000 * trend_growth(&t->trend));
+		}
+		printf("\n");
+	}
+
+	printf("\n Latency                AvgLat    Replay    p50Lat    Replay"
+	       "    p99Lat    Replay   InFlight    Replay\n");
+	printf(" ------------------------------------------------------------"
+	       "----------------------------------\n");
+	for (i = 0; i < OP_MAX; i++) {
+		const struct fid_op_type *t = &f->ops[i];
+
+		if (t->lat[1].count == 0) {
+			continue;
+		}
+		printf(" %-22s", trace_op_name(i));
+		print_ms(&t->lat[0], -1);
+		print_ms(&t->lat[1], -1);
+		print_ms(&t->lat[0], 0.5);
+		print_ms(&t->lat[1], 0.5);
+		print_ms(&t->lat[0], 0.99);
+		print_ms(&t->lat[1], 0.99);
+		if (t->lat[0].count > 0) {
+			printf(" %10.2f", concurrency(1.0e-9 * t->lat[0].sum, traced_span));
+		} else {
+			printf("          -");
+		}
+		printf(" %9.2f\n", concurrency(1.0e-9 * t->lat[1].sum, replay_span));
+	}
+
+	sorted = malloc(f->nclients * sizeof(struct fid_client *));
+	if (sorted == NULL) {
+		fprintf(stderr, "MALLOC failed to sort the fidelity clients\n");
+		exit(10);
+	}
+	for (i = 0, n = 0; i < f->size; i++) {
+		for (c = f->clients[i]; c != NULL; c = c->next) {
+			sorted[n++] = c;
+		}
+	}
+	qsort(sorted, n, sizeof(struct fid_client *), client_cmp);
+
+	printf("\n Client       Count    AvgGap    Replay    AvgLat    Replay"
+	       "   InFlight    Replay    AvgLag    MaxLag\n");
+	printf(" ------------------------------------------------------------"
+	       "--------------------------------------\n");
+	for (i = 0; i < n; i++) {
+		c = sorted[i];
+		printf(" %-8d %9lu", c->client, (unsigned long)c->count);
+		if (c->count > 1) {
+			printf(" %9.03f %9.03f", 1000 * c->gap[0] / (c->count - 1),
+			       1000 * c->gap[1] / (c->count - 1));
+		} else {
+			printf("         -         -");
+		}
+		if (c->traced_lats > 0) {
+			printf(" %9.03f", 1000 * c->lat[0] / c->traced_lats);
+		} else {
+			printf("         -");
+		}
+		printf(" %9.03f", 1000 * c->lat[1] / c->count);
+		if (c->traced_lats > 0) {
+			printf(" %10.2f", concurrency(c->lat[0], traced_span));
+		} else {
+			printf("          -");
+		}
+		printf(" %9.2f", concurrency(c->lat[1], replay_span));
+		if (f->timed) {
+			printf(" %9.03f %9.03f", 1000 * c->lag / c->count, 1000 * c->lag_max);
+		} else {
+			printf("         -         -");
+		}
+		if (trend_growth(&c->trend) > FIDELITY_LAG_GROWTH) {
+			printf("  lag grew %.03f", 1000 * trend_growth(&c->trend));
+		}
+		printf("\n");
+	}
+	free(sorted);
+
+	printf("\nTraced %.3f secs, replayed in %.3f secs\n",
+	       traced_span * 1.0e-6, replay_span * 1.0e-6);
+	if (!f->timed) {
+		printf("Ops were sent as fast as they could be, replay with --speed to compare the pace\n");
+		return;
+	}
+	printf("Issue lag: avg %.03f ms, max %.03f ms, first %.03f ms, lately %.03f ms\n",
+	       1000 * f->lag / f->count, 1000 * f->lag_max,
+	       1000 * f->trend.first, 1000 * f->trend.recent);
+	behind = trend_growth(&f->trend) > FIDELITY_LAG_GROWTH;
+	if (behind) {
+		printf("The replayer fell behind the trace: issue lag grew by %.03f ms. "
+		       "Latencies were measured under less load than was traced; "
+		       "try more --nprocs or a deeper --queue-depth\n",
+		       1000 * trend_growth(&f->trend));
+	} else {
+		printf("The replayer kept up with the trace\n");
+	}
+}
+
+struct fidelity *fidelity_new(int timed)
+{
+	struct fidelity *f;
+
+	f = calloc(1, sizeof(struct fidelity));
+	if (f == NULL) {
+		fprintf(stderr, "Failed to allocate the fidelity report\n");
+		exit(10);
+	}
+	f->timed = timed;
+	clients_resize(f);
+	return f;
+}
+
+void fidelity_free(struct fidelity *f)
+{
+	struct fid_client *c, *next;
+	unsigned i;
+
+	for (i = 0; i < f->size; i++) {
+		for (c = f->clients[i]; c != NULL; c = next) {
+			next = c->next;
+			free(c);
+		}
+	}
+	free(f->clients);
+	free(f);
+}
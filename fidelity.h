@@ -0,0 +1,42 @@
+/*
+   How closely a replay reproduced the load of its trace
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#ifndef _FIDELITY_H_
+#define _FIDELITY_H_
+
+#include <stdint.h>
+
+/* an op as it was traced and as it was replayed */
+struct fidelity_op {
+	int opcode;
+	int client;
+	uint64_t traced;	/* usec since the start of the trace */
+	uint64_t traced_lat;	/* usec, 0 if the trace does not say */
+	uint64_t due;		/* usec since the start of the replay */
+	uint64_t issued;
+	uint64_t latency;	/* ns */
+};
+
+struct fidelity;
+
+/*
+ * Ops are added in trace order, by one thread at a time. timed is set
+ * when ops were due at their traced time or at a target rate, and their
+ * issue lag means something.
+ */
+struct fidelity *fidelity_new(int timed);
+void fidelity_add(struct fidelity *f, const struct fidelity_op *op);
+void fidelity_report(struct fidelity *f);
+void fidelity_free(struct fidelity *f);
+
+#endif /* _FIDELITY_H_ */
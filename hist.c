@@ -0,0 +1,96 @@
+/*
+   Log-linear latency histograms
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include "hist.h"
+
+void hist_merge(struct hist *to, const struct hist *from)
+{
+	unsigned i;
+
+	if (from->count == 0) {
+		return;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		to->bucket[i] += from->bucket[i];
+	}
+	to->count += from->count;
+	to->sum   += from->sum;
+	if (from->max > to->max) {
+		to->max = from->max;
+	}
+}
+
+void hist_snapshot(struct hist *to, const struct hist *from)
+{
+	unsigned i;
+
+	to->count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	to->sum   = __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+	to->max   = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		to->bucket[i] = __atomic_load_n(&from->bucket[i], __ATOMIC_RELAXED);
+	}
+}
+
+/* the highest value that falls in bucket i */
+static uint64_t bucket_high(unsigned i)
+{
+	unsigned shift;
+
+	if (i < HIST_SUB) {
+		return i;
+	}
+	shift = (i - HIST_SUB) / (HIST_SUB / 2) + 1;
+	return ((uint64_t)((i - HIST_SUB) % (HIST_SUB / 2) + HIST_SUB / 2 + 1) << shift) - 1;
+}
+
+void hist_diff(struct hist *to, const struct hist *now, const struct hist *before)
+{
+	unsigned i;
+
+	to->count = now->count - before->count;
+	to->sum   = now->sum - before->sum;
+	to->max   = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		to->bucket[i] = now->bucket[i] - before->bucket[i];
+		if (to->bucket[i] != 0) {
+			to->max = bucket_high(i);
+		}
+	}
+	if (to->max > now->max) {
+		to->max = now->max;
+	}
+}
+
+uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t rank, seen = 0;
+	unsigned i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+	rank = p * h->count;
+	if (rank >= h->count) {
+		return h->max;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->bucket[i];
+		if (seen > rank) {
+			break;
+		}
+	}
+	/* no bucket goes beyond the largest value in it */
+	return bucket_high(i) < h->max ? bucket_high(i) : h->max;
+}
@@ -0,0 +1,94 @@
+/*
+   Log-linear latency histograms
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS	7
+#define HIST_SUB	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS	40
+#define HIST_BUCKETS	(HIST_SUB + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_SUB / 2)
+
+/*
+ * Values in ns, as in HdrHistogram: below HIST_SUB each value has its
+ * bucket, above it every power of two is split in HIST_SUB / 2 buckets,
+ * so a bucket is within 1/HIST_SUB of the values in it. Values from
+ * 2^HIST_MAX_BITS ns, about 18 minutes, go to the last bucket.
+ *
+ * A histogram is written by one thread, and histograms are merged once
+ * the threads are done with them.
+ */
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+static inline unsigned hist_bucket(uint64_t v)
+{
+	unsigned shift;
+
+	if (v < HIST_SUB) {
+		return v;
+	}
+	if (v >> HIST_MAX_BITS) {
+		return HIST_BUCKETS - 1;
+	}
+	shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+	return HIST_SUB + (shift - 1) * (HIST_SUB / 2) + (v >> shift) - HIST_SUB / 2;
+}
+
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+	h->bucket[hist_bucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+/*
+ * For a histogram another thread samples while it is written: the
+ * writer records with hist_record_live(), which costs it the same plain
+ * stores, and the sampler copies it with hist_snapshot().
+ */
+static inline void hist_record_live(struct hist *h, uint64_t v)
+{
+	unsigned b = hist_bucket(v);
+
+	__atomic_store_n(&h->bucket[b], h->bucket[b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+	if (v > h->max) {
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+	}
+}
+
+void hist_snapshot(struct hist *to, const struct hist *from);
+
+/*
+ * What was recorded between two snapshots; its max is the top of the
+ * highest bucket with anything in it.
+ */
+void hist_diff(struct hist *to, const struct hist *now, const struct hist *before);
+
+void hist_merge(struct hist *to, const struct hist *from);
+
+/* the value at or below which fraction p of the values are, 0 if none */
+uint64_t hist_percentile(const struct hist *h, double p);
+
+#endif /* _HIST_H_ */
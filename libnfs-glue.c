@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -40,7 +41,11 @@
 #include <nfsc/libnfs-raw.h>
 #include <nfsc/libnfs-raw-nfs.h>
 #include <nfsc/libnfs-raw-nlm.h>
+#include "attrcache.h"
+#include "fhcache.h"
 #include "libnfs-glue.h"
+#include "payload.h"
+#include "trace.h"
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 #define _U_ __attribute__((unused))
@@ -68,43 +73,35 @@ typedef struct nfsio {
 	tree_t *fhandles;
 } nfsio;*/
 
+static nfsstat3 lookup_name(struct nfsio *nfsio, const struct trace_fh *dir_fh,
+			    const struct trace_fh *res_fh, const char *name,
+			    fattr3 *attributes);
+
 static void set_xid_value(struct nfsio *nfsio)
 {
 	nfsio->xid += nfsio->xid_stride;
 	rpc_set_next_xid(nfs_get_rpc_context(nfsio->nfs), nfsio->xid);
 }
 
-static void free_node(tree_t *t)
-{
-	free(discard_const(t->key.data.data_val));
-	free(discard_const(t->fh.data.data_val));
-	free(t);
-}
+/* a handle copied out of the cache for a call, see op_fhandle() */
+struct fh_copy {
+	nfs_fh3 fh;
+	struct fhcache_handle h;
+};
 
-static tree_t *find_fhandle(tree_t *tree, const char *key)
+static nfs_fh3 *fh_copy(struct fh_copy *copy)
 {
-	int i;
-
-	if (tree == NULL) {
-		return NULL;
-	}
-
-	i = strcmp(key, tree->key.data.data_val);
-	if (i == 0) {
-		return tree;
-	}
-	if (i < 0) {
-		return find_fhandle(tree->left, key);
-	}
-
-	return find_fhandle(tree->right, key);
+	copy->fh.data.data_len = copy->h.len;
+	copy->fh.data.data_val = copy->h.data;
+	return &copy->fh;
 }
 
-static nfs_fh3 *recursive_lookup_fhandle(struct nfsio *nfsio, const char *name)
+static nfs_fh3 *recursive_lookup_fhandle(struct nfsio *nfsio, const char *name,
+					 struct fh_copy *copy)
 {
-	tree_t *t;
-	char *strp;
-	char *tmpname;
+	const char *rest, *last = NULL;
+	struct timespec start, end;
+	size_t len;
 	nfsstat3 ret;
 
 	while (name[0] == '.') name++;
@@ -113,219 +110,129 @@ static nfs_fh3 *recursive_lookup_fhandle(struct nfsio *nfsio, const char *name)
 		return NULL;
 	}
 
-	tmpname = strdup(name);
-	strp = rindex(tmpname, '/');
-	if (strp == NULL) {
-		free(tmpname);
-		return NULL;
+	/* look up the components that are not cached yet, one by one */
+	for (;;) {
+		rest = fhcache_walk(nfsio->cache, name, &copy->h);
+		if (rest == NULL) {
+			return fh_copy(copy);
+		}
+		if (rest == last) {
+			return NULL;
+		}
+		last = rest;
+		fhcache_component(rest, &len);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = lookup_name(nfsio, NULL, NULL,
+				  strndupa(name, rest + len - name), NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		nfsio->resolve_lookups++;
+		nfsio->resolve_time += (end.tv_sec - start.tv_sec) +
+				       (end.tv_nsec - start.tv_nsec) * 1.0e-9;
+		if (ret != 0) {
+			return NULL;
+		}
 	}
-	*strp = 0;
-
-	recursive_lookup_fhandle(nfsio, tmpname);
-	free(tmpname);
+}
 
-	t = find_fhandle(nfsio->fhandles, name);
-	if (t != NULL) {
-		return &t->fh;
+static nfs_fh3 *lookup_fhandle(struct nfsio *nfsio, const char *name, struct fh_copy *copy)
+{
+	if (!fhcache_lookup(nfsio->cache, name, &copy->h)) {
+		nfsio->cache_misses++;
+		return recursive_lookup_fhandle(nfsio, name, copy);
 	}
+	nfsio->cache_hits++;
+	return fh_copy(copy);
+}
 
-	ret = nfsio_lookup(nfsio, name, NULL);
-	if (ret != 0) {
+/*
+ * Handle mode. Traced file handles map straight to the handles of the
+ * same objects on the replay server, learnt from the replies to replayed
+ * LOOKUP, CREATE, MKDIR and SYMLINK calls. The map is kept in the handle
+ * cache of the export, for every connection to use what one learnt. Only
+ * a handle the map has not seen yet is resolved through its path, once.
+ */
+static nfs_fh3 *fhmap_find(struct nfsio *nfsio, const struct trace_fh *key,
+			   struct fh_copy *copy)
+{
+	if (!fhcache_map_lookup(nfsio->cache, (const char *)key->data, key->len, &copy->h)) {
 		return NULL;
 	}
-
-	t = find_fhandle(nfsio->fhandles, name);
-	if (t != NULL) {
-		return &t->fh;
-	}
-
-	return NULL;
+	return fh_copy(copy);
 }
 
-static nfs_fh3 *lookup_fhandle(struct nfsio *nfsio, const char *name, off_t *off)
+void nfsio_set_handles(struct nfsio *nfsio, const struct trace_fh *fh,
+		       const struct trace_fh *fh2, const struct trace_fh *res_fh)
 {
-	tree_t *t;
-
-	while (name[0] == '.') name++;
-
-	if (name[0] == 0) {
-		name = "/";
-	}
-
-	t = find_fhandle(nfsio->fhandles, name);
-	if (t == NULL) {
-		return recursive_lookup_fhandle(nfsio, name);
-	}
-
-	if (off) {
-		*off = t->file_size;
-	}
-
-	return &t->fh;
+	nfsio->fh     = fh;
+	nfsio->fh2    = fh2;
+	nfsio->res_fh = res_fh;
 }
 
-static void delete_fhandle(struct nfsio *nfsio, const char *name)
+/* the entries the traced reply of the current READDIRPLUS3 listed */
+void nfsio_set_dirents(struct nfsio *nfsio, const struct trace_dirent *dirents, int n)
 {
-	tree_t *t;
-
-	while (name[0] == '.') name++;
-
-	t = find_fhandle(nfsio->fhandles, name);
-	if (t == NULL) {
-		return;
-	}
-
-	/* we have a left child */
-	if (t->left) {
-		tree_t *tmp_tree;
-
-		for(tmp_tree=t->left;tmp_tree->right;tmp_tree=tmp_tree->right)
-			;
-		tmp_tree->right = t->right;
-		if (t->right) {
-			t->right->parent = tmp_tree;
-		}
+	nfsio->dirents  = dirents;
+	nfsio->ndirents = n;
+}
 
-		if (t->parent == NULL) {
-			nfsio->fhandles = tmp_tree;
-			tmp_tree->parent = NULL;
-			free_node(t);
-			return;
-		}
+void nfsio_set_client(struct nfsio *nfsio, int client, uint64_t now)
+{
+	nfsio->client = client;
+	nfsio->now    = now;
+}
 
-		if (t->parent->left == t) {
-			t->parent->left = t->left;
-			if (t->left) {
-				t->left->parent = t->parent;
-			}
-			free_node(t);
-			return;
-		}
+/*
+ * Handle of the object an op works on: the live handle of the traced
+ * handle tfh in handle mode, or the handle of name otherwise.
+ */
+static nfs_fh3 *op_fhandle(struct nfsio *nfsio, const struct trace_fh *tfh, const char *name,
+			   struct fh_copy *copy)
+{
+	nfs_fh3 *fh;
 
-		t->parent->right = t->left;
-		if (t->left) {
-			t->left->parent = t->parent;
-		}
-		free_node(t);
-		return;
+	if (!nfsio->handle_mode || tfh == NULL) {
+		return lookup_fhandle(nfsio, name, copy);
 	}
 
-	/* we only have a right child */
-	if (t->right) {
-		tree_t *tmp_tree;
-
-		for(tmp_tree=t->right;tmp_tree->left;tmp_tree=tmp_tree->left)
-			;
-		tmp_tree->left = t->left;
-		if (t->left) {
-			t->left->parent = tmp_tree;
-		}
-
-		if (t->parent == NULL) {
-			nfsio->fhandles = tmp_tree;
-			tmp_tree->parent = NULL;
-			free_node(t);
-			return;
-		}
-
-		if (t->parent->left == t) {
-			t->parent->left = t->right;
-			if (t->right) {
-				t->right->parent = t->parent;
-			}
-			free_node(t);
-			return;
-		}
-
-		t->parent->right = t->right;
-		if (t->right) {
-			t->right->parent = t->parent;
-		}
-		free_node(t);
-		return;
+	fh = fhmap_find(nfsio, tfh, copy);
+	if (fh != NULL) {
+		return fh;
 	}
-
-	/* we are a leaf node */
-	if (t->parent == NULL) {
-		nfsio->fhandles = NULL;
-	} else {
-		if (t->parent->left == t) {
-			t->parent->left = NULL;
-		} else {
-			t->parent->right = NULL;
-		}
+	fh = lookup_fhandle(nfsio, name, copy);
+	if (fh != NULL) {
+		fhcache_map_insert(nfsio->cache, (const char *)tfh->data, tfh->len,
+				   fh->data.data_val, fh->data.data_len);
 	}
-	free_node(t);
-	return;
+	return fh;
 }
 
-static void insert_fhandle(struct nfsio *nfsio, const char *name, const char *fhandle, int length, off_t off)
+/*
+ * Handle of the directory name lives in, tfh being its traced handle.
+ * *leaf is pointed at the last component of name.
+ */
+static nfs_fh3 *dir_fhandle(struct nfsio *nfsio, const struct trace_fh *tfh,
+			    const char *name, char **leaf, struct fh_copy *copy)
 {
-	tree_t *tmp_t;
-	tree_t *t;
-	int i;
-
-	while (name[0] == '.') name++;
+	char *ptr, *dir;
 
-	t = malloc(sizeof(tree_t));
-	if (t == NULL) {
-		fprintf(stderr, "MALLOC failed to allocate tree_t in insert_fhandle\n");
-		exit(10);
-	}
-
-	t->key.data.data_val = strdup(name);
-	if (t->key.data.data_val == NULL) {
-		fprintf(stderr, "STRDUP failed to allocate key in insert_fhandle\n");
-		exit(10);
-	}
-	t->key.data.data_len = strlen(name);
-
-
-	t->fh.data.data_val = malloc(length);
-	if (t->key.data.data_val == NULL) {
-		fprintf(stderr, "MALLOC failed to allocate fhandle in insert_fhandle\n");
-		exit(10);
+	ptr = rindex(name, '/');
+	if (ptr == NULL) {
+		fprintf(stderr, "name '%s' did not contain '/'\n", name);
+		return NULL;
 	}
-	memcpy(discard_const(t->fh.data.data_val), fhandle, length);
-	t->fh.data.data_len = length;
+	*leaf = ptr + 1;
 
-	t->file_size = off;
-	t->left   = NULL;
-	t->right  = NULL;
-	t->parent = NULL;
-
-	if (nfsio->fhandles == NULL) {
-		nfsio->fhandles = t;
-		return;
-	}
+	if (nfsio->handle_mode && tfh != NULL) {
+		nfs_fh3 *fh = fhmap_find(nfsio, tfh, copy);
 
-	tmp_t = nfsio->fhandles;
-again:
-	i = strcmp(t->key.data.data_val, tmp_t->key.data.data_val);
-	if (i == 0) {
-		free(discard_const(tmp_t->fh.data.data_val));
-		tmp_t->fh.data.data_len = t->fh.data.data_len;
-		tmp_t->fh.data.data_val  = t->fh.data.data_val;
-		free(discard_const(t->key.data.data_val));
-		free(t);
-		return;
-	}
-	if (i < 0) {
-		if (tmp_t->left == NULL) {
-			tmp_t->left = t;
-			t->parent = tmp_t;
-			return;
+		if (fh != NULL) {
+			return fh;
 		}
-		tmp_t = tmp_t->left;
-		goto again;
 	}
-	if (tmp_t->right == NULL) {
-		tmp_t->right = t;
-		t->parent = tmp_t;
-		return;
-	}
-	tmp_t = tmp_t->right;
-	goto again;
+
+	dir = strndupa(name, ptr - name);
+	return op_fhandle(nfsio, tfh, dir, copy);
 }
 
 
@@ -385,14 +292,100 @@ struct nfsio_cb_data {
 	const char *name, *old_name;
 	fattr3 *attributes;
 	uint32_t *access;
-	nfs_fh3 *fh;
+	struct fh_copy fh, fh2;
 	nfs3_dirent_cb rd_cb;
 	void *private_data;
+	const struct trace_fh *res_fh;
+
+	/* READDIRPLUS in handle mode: the traced entries, and where to look next */
+	const struct trace_dirent *dirents;
+	int ndirents, next_dirent;
+
+	/* attribute cache emulation: who called when, on which object */
+	int client;
+	uint64_t now;
+	struct fhcache_handle obj;
+	uint32_t desired;
+
+	/* READ and WRITE: the data and where it goes in the file */
+	struct iobuf *iobuf;
+	char *buf;
+	uint64_t file;
+	uint64_t offset;
+	uint32_t bytes;		/* as the replies say they moved */
+
+	/* an op sent in chunks: the calls it waits for, or the op of a chunk */
+	int pending;
+	struct nfsio_cb_data *parent;
+
+	rpc_cb cb;
+	nfsio_done_cb done;
+	void *done_data;
+	struct timespec start;
 
 	int is_finished;
 	int status;
 };
 
+/* remember the handle a reply gave us for cb_data->name */
+static void record_fhandle(struct nfsio_cb_data *cb_data, const char *fhandle,
+			   int length, off_t off)
+{
+	if (cb_data->nfsio->handle_mode && cb_data->res_fh != NULL) {
+		fhcache_map_insert(cb_data->nfsio->cache, (const char *)cb_data->res_fh->data,
+				   cb_data->res_fh->len, fhandle, length);
+		return;
+	}
+	fhcache_insert(cb_data->nfsio->cache, cb_data->name, fhandle, length, off);
+}
+
+/* forget the handle of an object that was removed */
+static void forget_fhandle(struct nfsio_cb_data *cb_data)
+{
+	if (cb_data->nfsio->handle_mode && cb_data->res_fh != NULL) {
+		fhcache_map_delete(cb_data->nfsio->cache, (const char *)cb_data->res_fh->data,
+				   cb_data->res_fh->len);
+	}
+	fhcache_delete(cb_data->nfsio->cache, cb_data->name);
+}
+
+/* the emulated client caches the attributes a reply carried for fh */
+static void remember_attrs(struct nfsio_cb_data *cb_data, const char *fh, uint32_t len,
+			   const post_op_attr *attr)
+{
+	if (cb_data->nfsio->attrs == NULL || !attr->attributes_follow || len == 0) {
+		return;
+	}
+	attrcache_update(cb_data->nfsio->attrs, cb_data->client, fh, len,
+			 &attr->post_op_attr_u.attributes, cb_data->now);
+}
+
+/* the object a call is about, for the attributes in its reply */
+static void remember_obj(struct nfsio_cb_data *cb_data, const nfs_fh3 *fh)
+{
+	if (cb_data->nfsio->attrs == NULL || fh->data.data_len > FHCACHE_FHSIZE) {
+		return;
+	}
+	cb_data->obj.len = fh->data.data_len;
+	memcpy(cb_data->obj.data, fh->data.data_val, fh->data.data_len);
+}
+
+/*
+ * A name was created in the directory of path, which may now have the
+ * names it was found not to have.
+ */
+static void forget_negatives(struct nfsio_cb_data *cb_data, const char *path)
+{
+	const char *slash;
+
+	if (!cb_data->nfsio->negative_cache) {
+		return;
+	}
+	slash = strrchr(path, '/');
+	fhcache_drop_negatives(cb_data->nfsio->cache,
+			       slash != NULL ? strndupa(path, slash - path) : "");
+}
+
 static void nfsio_wait_for_rpc_reply(struct rpc_context *rpc, struct nfsio_cb_data *cb_data)
 {
 	struct pollfd pfd;
@@ -412,9 +405,311 @@ static void nfsio_wait_for_rpc_reply(struct rpc_context *rpc, struct nfsio_cb_da
 	}
 }
 
-static void nfsio_wait_for_nfs_reply(struct nfs_context *nfs, struct nfsio_cb_data *cb_data)
+void nfsio_set_completion(struct nfsio *nfsio, nfsio_done_cb done, void *private_data)
+{
+	nfsio->done      = done;
+	nfsio->done_data = private_data;
+}
+
+/*
+ * Start a call whose reply is decoded by cb. A call made while a
+ * completion is set takes it and is asynchronous: its cb_data comes from
+ * the heap and lives until the completion has run. Any other call,
+ * including the lookups made to resolve the handles of an asynchronous
+ * one, uses the caller's local cb_data and waits for its reply.
+ */
+static struct nfsio_cb_data *nfsio_cb_data_init(struct nfsio *nfsio,
+						struct nfsio_cb_data *local, rpc_cb cb)
+{
+	struct nfsio_cb_data *cb_data = local;
+
+	if (nfsio->done != NULL) {
+		cb_data = malloc(sizeof(struct nfsio_cb_data));
+		if (cb_data == NULL) {
+			fprintf(stderr, "MALLOC failed to allocate cb_data\n");
+			exit(10);
+		}
+	}
+	memset(cb_data, 0, sizeof(struct nfsio_cb_data));
+	cb_data->nfsio     = nfsio;
+	cb_data->cb        = cb;
+	cb_data->done      = nfsio->done;
+	cb_data->done_data = nfsio->done_data;
+	cb_data->client    = nfsio->client;
+	cb_data->now       = nfsio->now;
+
+	if (cb_data->done != NULL) {
+		nfsio->done = NULL;
+		nfsio->inflight++;
+	}
+	return cb_data;
+}
+
+struct iobuf {
+	struct iobuf *next;
+	size_t size;
+	char *data;
+};
+
+/*
+ * The file the data of a READ or WRITE belongs to, by its live handle so
+ * that it stays the same across renames and links.
+ */
+static uint64_t payload_file(const nfs_fh3 *fh)
+{
+	uint64_t h = 14695981039346656037ULL;
+	u_int i;
+
+	for (i = 0; i < fh->data.data_len; i++) {
+		h ^= (unsigned char)fh->data.data_val[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void iobuf_free(struct nfsio *nfsio)
+{
+	struct iobuf *b;
+
+	while ((b = nfsio->iobufs) != NULL) {
+		nfsio->iobufs = b->next;
+		free(b->data);
+		free(b);
+	}
+}
+
+/*
+ * A buffer of at least len bytes. They all have the size of the largest
+ * asked for so far, smaller ones are freed as they come back.
+ */
+static struct iobuf *iobuf_get(struct nfsio *nfsio, size_t len)
+{
+	struct iobuf *b;
+
+	if (len > nfsio->iobuf_size) {
+		nfsio->iobuf_size = (len + 4095) & ~(size_t)4095;
+		iobuf_free(nfsio);
+	}
+	b = nfsio->iobufs;
+	if (b != NULL) {
+		nfsio->iobufs = b->next;
+		return b;
+	}
+
+	b = malloc(sizeof(struct iobuf));
+	if (b == NULL || posix_memalign((void **)&b->data, 4096, nfsio->iobuf_size) != 0) {
+		fprintf(stderr, "Failed to allocate a %zu byte I/O buffer\n", nfsio->iobuf_size);
+		exit(10);
+	}
+	b->size = nfsio->iobuf_size;
+	return b;
+}
+
+static void iobuf_put(struct nfsio *nfsio, struct iobuf *b)
+{
+	if (b == NULL) {
+		return;
+	}
+	if (b->size < nfsio->iobuf_size) {
+		free(b->data);
+		free(b);
+		return;
+	}
+	b->next = nfsio->iobufs;
+	nfsio->iobufs = b;
+}
+
+static void nfsio_complete(struct nfsio_cb_data *cb_data, double latency)
+{
+	iobuf_put(cb_data->nfsio, cb_data->iobuf);
+	cb_data->nfsio->inflight--;
+	cb_data->done(cb_data->status, latency,
+		      cb_data->status == NFS3_OK ? cb_data->bytes : 0,
+		      cb_data->done_data);
+	free(cb_data);
+}
+
+/*
+ * libnfs callback of every call: decode the reply with cb_data->cb and
+ * complete an asynchronous call once it is finished.
+ */
+static void nfsio_rpc_cb(struct rpc_context *rpc, int status, void *data,
+			 void *private_data)
+{
+	struct nfsio_cb_data *cb_data = private_data, *chunk;
+	struct timespec now;
+
+	cb_data->cb(rpc, status, data, cb_data);
+
+	/* the op of a chunk finishes with its last chunk, failed if any failed */
+	if (cb_data->parent != NULL) {
+		chunk   = cb_data;
+		cb_data = chunk->parent;
+		if (chunk->status != NFS3_OK && cb_data->status == NFS3_OK) {
+			cb_data->status = chunk->status;
+		}
+		cb_data->bytes += chunk->bytes;
+		free(chunk);
+		if (--cb_data->pending > 0) {
+			return;
+		}
+		cb_data->is_finished = 1;
+	}
+
+	if (!cb_data->is_finished || cb_data->done == NULL) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nfsio_complete(cb_data, (now.tv_sec - cb_data->start.tv_sec) +
+				(now.tv_nsec - cb_data->start.tv_nsec) * 1.0e-9);
+}
+
+/* the call was answered without being sent */
+static int nfsio_answered(struct nfsio_cb_data *cb_data, int status)
+{
+	cb_data->status = status;
+	if (cb_data->done != NULL) {
+		nfsio_complete(cb_data, 0);
+	} else {
+		iobuf_put(cb_data->nfsio, cb_data->iobuf);
+	}
+	return status;
+}
+
+/* the call failed before it was sent */
+static int nfsio_failed(struct nfsio_cb_data *cb_data, int status)
+{
+	return nfsio_answered(cb_data, status);
+}
+
+/*
+ * The call was sent, wait for the reply unless it is asynchronous. Its
+ * latency counts from here, after the lookups that resolved its handles.
+ */
+static int nfsio_sent(struct rpc_context *rpc, struct nfsio_cb_data *cb_data)
+{
+	clock_gettime(CLOCK_MONOTONIC, &cb_data->start);
+	if (cb_data->done != NULL) {
+		return NFS3_OK;
+	}
+	nfsio_wait_for_rpc_reply(rpc, cb_data);
+	iobuf_put(cb_data->nfsio, cb_data->iobuf);
+	return cb_data->status;
+}
+
+static uint32_t chunk_size(uint32_t pref, uint32_t max)
+{
+	return pref != 0 && pref < max ? pref : max;
+}
+
+/*
+ * Send a READ, or a WRITE of data, that is larger than the server takes
+ * in one call as calls of chunk bytes, all in flight at once. cb_data
+ * stands for the whole op and finishes when the last of them does.
+ */
+static int nfsio_send_chunks(struct nfsio *nfsio, struct nfsio_cb_data *cb_data,
+			     nfs_fh3 *fh, uint32_t len, uint32_t chunk,
+			     char *data, int stable)
+{
+	struct rpc_context *rpc = nfs_get_rpc_context(nfsio->nfs);
+	struct nfsio_cb_data *c;
+	uint32_t done, n;
+	int ret;
+
+	/* held until all are sent */
+	cb_data->pending = 1;
+
+	for (done = 0; done < len; done += n) {
+		n = len - done < chunk ? len - done : chunk;
+
+		c = malloc(sizeof(struct nfsio_cb_data));
+		if (c == NULL) {
+			fprintf(stderr, "MALLOC failed to allocate cb_data\n");
+			exit(10);
+		}
+		*c = *cb_data;
+		c->parent = cb_data;
+		c->done   = NULL;
+		c->iobuf  = NULL;
+		c->buf    = cb_data->buf != NULL ? cb_data->buf + done : NULL;
+		c->offset = cb_data->offset + done;
+		c->bytes  = 0;
+
+		set_xid_value(nfsio);
+		if (data == NULL) {
+			ret = rpc_nfs_read_async(rpc, nfsio_rpc_cb, fh, c->offset, n, c);
+		} else {
+			ret = rpc_nfs_write_async(rpc, nfsio_rpc_cb, fh, data + done,
+						  c->offset, n, stable, c);
+		}
+		if (ret) {
+			fprintf(stderr, "failed to send %s\n", data == NULL ? "read" : "write");
+			free(c);
+			cb_data->status = NFS3ERR_SERVERFAULT;
+			break;
+		}
+		cb_data->pending++;
+	}
+
+	if (--cb_data->pending == 0) {
+		return nfsio_answered(cb_data, cb_data->status);
+	}
+	return nfsio_sent(rpc, cb_data);
+}
+
+/*
+ * Event loop support: the sockets of the connection are kept registered
+ * in epfd with their rpc_context as data.ptr, for nfsio_epoll_service().
+ * Call again before each wait, the events libnfs waits for change.
+ */
+int nfsio_epoll_update(struct nfsio *nfsio, int epfd)
 {
-	return nfsio_wait_for_rpc_reply(nfs_get_rpc_context(nfs), cb_data);
+	struct rpc_context *rpc[2];
+	struct epoll_event ev;
+	int i, fd, op;
+
+	rpc[0] = nfs_get_rpc_context(nfsio->nfs);
+	rpc[1] = nfsio->nlm;
+
+	for (i = 0; i < 2; i++) {
+		if (rpc[i] == NULL) {
+			continue;
+		}
+		fd = rpc_get_fd(rpc[i]);
+		ev.events   = rpc_which_events(rpc[i]);
+		ev.data.ptr = rpc[i];
+		if (fd == nfsio->ep_fd[i] && ev.events == nfsio->ep_events[i]) {
+			continue;
+		}
+
+		op = EPOLL_CTL_MOD;
+		if (fd != nfsio->ep_fd[i]) {
+			if (nfsio->ep_fd[i] != -1) {
+				epoll_ctl(epfd, EPOLL_CTL_DEL, nfsio->ep_fd[i], NULL);
+			}
+			op = EPOLL_CTL_ADD;
+		}
+		if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+			fprintf(stderr, "Failed to watch fd %d. %s\n", fd, strerror(errno));
+			return -1;
+		}
+		nfsio->ep_fd[i]     = fd;
+		nfsio->ep_events[i] = ev.events;
+	}
+	return 0;
+}
+
+int nfsio_epoll_service(struct nfsio *nfsio, struct epoll_event *ev)
+{
+	struct rpc_context *rpc = ev->data.ptr;
+
+	if (rpc_service(rpc, ev->events) < 0) {
+		fprintf(stderr, "rpc_service failed with %d calls in flight. %s\n",
+			nfsio->inflight, rpc_get_error(rpc));
+		return -1;
+	}
+	return 0;
 }
 
 void nfsio_disconnect(struct nfsio *nfsio)
@@ -428,6 +723,10 @@ void nfsio_disconnect(struct nfsio *nfsio)
 		nfsio->nlm = NULL;
 	}
 
+	if (nfsio->cache != NULL) {
+		fhcache_put(nfsio->cache);
+	}
+	iobuf_free(nfsio);
 	free(nfsio);
 }
 
@@ -456,6 +755,8 @@ struct nfsio *do_nfsio_connect (const char *server, const char *export) {
 	return NULL;
     }
     memset (nfsio, 0, sizeof (struct nfsio));
+    nfsio->ep_fd[0] = -1;
+    nfsio->ep_fd[1] = -1;
 
     nfsio->nfs = nfs_init_context ();
     if (nfsio->nfs == NULL) {
@@ -470,8 +771,8 @@ struct nfsio *do_nfsio_connect (const char *server, const char *export) {
     }
 
     root_fh = nfs_get_rootfh (nfsio->nfs);
-    insert_fhandle (nfsio, "/", root_fh->data.data_val, root_fh->data.data_len,
-		    0);
+    nfsio->cache = fhcache_get (server, export, root_fh->data.data_val,
+				root_fh->data.data_len);
 
     return nfsio;
 }
@@ -514,6 +815,8 @@ struct nfsio *nfsio_connect(const char *url, int child, int initial_xid, int xid
 
 	nfsio->xid        = initial_xid;
 	nfsio->xid_stride = xid_stride;
+	nfsio->ep_fd[0]   = -1;
+	nfsio->ep_fd[1]   = -1;
 	nfsio->nfs = nfs_init_context();
 
 	if (nfs_mount(nfsio->nfs, server, export) != 0) {
@@ -532,10 +835,15 @@ struct nfsio *nfsio_connect(const char *url, int child, int initial_xid, int xid
 	free(child_name);
 
 	root_fh = nfs_get_rootfh(nfsio->nfs);
-	insert_fhandle(nfsio, "/",
-			      root_fh->data.data_val,
-			      root_fh->data.data_len,
-			      0);
+	nfsio->cache = fhcache_get(server, export,
+				   root_fh->data.data_val,
+				   root_fh->data.data_len);
+
+	/* reads and writes larger than the server takes are sent in chunks */
+	if (nfsio_fsinfo(nfsio) != NFS3_OK) {
+		fprintf(stderr, "FSINFO failed, READs and WRITEs are sent as traced\n");
+	}
+
 	if (nlm) {
 		struct nfsio_cb_data cb_data;
 
@@ -578,6 +886,13 @@ static void nfsio_getattr_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
+	if (cb_data->nfsio->attrs != NULL && cb_data->obj.len != 0) {
+		attrcache_update(cb_data->nfsio->attrs, cb_data->client,
+				 cb_data->obj.data, cb_data->obj.len,
+				 &GETATTR3res->GETATTR3res_u.resok.obj_attributes,
+				 cb_data->now);
+	}
+
 	if (cb_data->attributes) {
 		memcpy(cb_data->attributes,
 			&GETATTR3res->GETATTR3res_u.resok.obj_attributes,
@@ -590,27 +905,34 @@ static void nfsio_getattr_cb(struct rpc_context *rpc _U_, int status,
 nfsstat3 nfsio_getattr(struct nfsio *nfsio, const char *name, fattr3 *attributes)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_getattr_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_getattr\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
+	}
+
+	/* a client does not ask for the attributes it has fresh */
+	if (nfsio->attrs != NULL &&
+	    attrcache_getattr(nfsio->attrs, nfsio->client, fh->data.data_val,
+			      fh->data.data_len, nfsio->now, attributes)) {
+		nfsio->getattrs_saved++;
+		return nfsio_answered(cb_data, NFS3_OK);
 	}
+	remember_obj(cb_data, fh);
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.attributes = attributes;
+	cb_data->attributes = attributes;
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_getattr_async(nfs_get_rpc_context(nfsio->nfs),
-		nfsio_getattr_cb, fh, &cb_data)) {
+		nfsio_rpc_cb, fh, cb_data)) {
 		fprintf(stderr, "failed to send getattr\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_lookup_cb(struct rpc_context *rpc _U_, int status,
@@ -625,14 +947,21 @@ static void nfsio_lookup_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 	if (LOOKUP3res->status != NFS3_OK) {
+		if (LOOKUP3res->status == NFS3ERR_NOENT && cb_data->nfsio->negative_cache) {
+			fhcache_insert_negative(cb_data->nfsio->cache, cb_data->name);
+		}
 		cb_data->status = LOOKUP3res->status;
 		return;
 	}
 
-	insert_fhandle(cb_data->nfsio, cb_data->name,
+	record_fhandle(cb_data,
 			LOOKUP3res->LOOKUP3res_u.resok.object.data.data_val,
 			LOOKUP3res->LOOKUP3res_u.resok.object.data.data_len,
 			LOOKUP3res->LOOKUP3res_u.resok.obj_attributes.post_op_attr_u.attributes.size);
+	remember_attrs(cb_data,
+			LOOKUP3res->LOOKUP3res_u.resok.object.data.data_val,
+			LOOKUP3res->LOOKUP3res_u.resok.object.data.data_len,
+			&LOOKUP3res->LOOKUP3res_u.resok.obj_attributes);
 
 	if (cb_data->attributes) {
 		memcpy(cb_data->attributes,
@@ -643,49 +972,76 @@ static void nfsio_lookup_cb(struct rpc_context *rpc _U_, int status,
 	cb_data->status = NFS3_OK;
 }
 
-nfsstat3 nfsio_lookup(struct nfsio *nfsio, const char *name, fattr3 *attributes)
+/*
+ * Whether the emulated client has the object name, or the one of the
+ * traced handle res_fh, with fresh attributes, which fill in attributes.
+ */
+static int lookup_cached(struct nfsio *nfsio, const struct trace_fh *res_fh,
+			 const char *name, fattr3 *attributes)
+{
+	struct fhcache_handle h;
+
+	if (nfsio->handle_mode && res_fh != NULL) {
+		if (!fhcache_map_lookup(nfsio->cache, (const char *)res_fh->data,
+					res_fh->len, &h)) {
+			return 0;
+		}
+	} else if (!fhcache_lookup(nfsio->cache, name, &h)) {
+		return 0;
+	}
+	return attrcache_getattr(nfsio->attrs, nfsio->client, h.data, h.len,
+				 nfsio->now, attributes);
+}
+
+/*
+ * Lookups made to resolve a path pass no traced handles, the ones of the
+ * op being replayed do.
+ */
+static nfsstat3 lookup_name(struct nfsio *nfsio, const struct trace_fh *dir_fh,
+			    const struct trace_fh *res_fh, const char *name,
+			    fattr3 *attributes)
 {
-	char *tmp_name;
 	char *ptr;
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 
-	tmp_name = strdupa(name);
-	if (tmp_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_lookup\n");
-		return NFS3ERR_SERVERFAULT;
-	}
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_lookup_cb);
 
-	ptr = rindex(tmp_name, '/');
-	if (ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_lookup\n");
-		return NFS3ERR_SERVERFAULT;
+	/* a client that remembers what it did not find does not ask again */
+	if (nfsio->negative_cache && fhcache_negative(nfsio->cache, name)) {
+		nfsio->lookups_saved++;
+		return nfsio_answered(cb_data, NFS3ERR_NOENT);
 	}
 
-	*ptr = 0;
-	ptr++;
+	/* nor looks up what it has in its dentry cache with fresh attributes */
+	if (nfsio->attrs != NULL && lookup_cached(nfsio, res_fh, name, attributes)) {
+		nfsio->attr_lookups_saved++;
+		return nfsio_answered(cb_data, NFS3_OK);
+	}
 
-	fh = lookup_fhandle(nfsio, tmp_name, NULL);
+	fh = dir_fhandle(nfsio, dir_fh, name, &ptr, &cb_data->fh);
 	if (fh == NULL) {
-		fprintf(stderr, "failed to fetch parent handle for '%s' in nfsio_lookup\n", tmp_name);
-		return NFS3ERR_SERVERFAULT;
+		fprintf(stderr, "failed to fetch parent handle for '%s' in nfsio_lookup\n", name);
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.name = discard_const(name);
-	cb_data.attributes = attributes;
+	cb_data->name = discard_const(name);
+	cb_data->attributes = attributes;
+	cb_data->res_fh = res_fh;
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_lookup_async(nfs_get_rpc_context(nfsio->nfs),
-		nfsio_lookup_cb, fh, ptr, &cb_data)) {
+		nfsio_rpc_cb, fh, ptr, cb_data)) {
 		fprintf(stderr, "failed to send lookup for '%s' "
-			"in nfsio_lookup\n", tmp_name);
-		return NFS3ERR_SERVERFAULT;
+			"in nfsio_lookup\n", name);
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
+}
 
-	return cb_data.status;
+nfsstat3 nfsio_lookup(struct nfsio *nfsio, const char *name, fattr3 *attributes)
+{
+	return lookup_name(nfsio, nfsio->fh, nfsio->res_fh, name, attributes);
 }
 
 static void nfsio_access_cb(struct rpc_context *rpc _U_, int status,
@@ -704,6 +1060,14 @@ static void nfsio_access_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
+	if (cb_data->nfsio->attrs != NULL && cb_data->obj.len != 0) {
+		remember_attrs(cb_data, cb_data->obj.data, cb_data->obj.len,
+				&ACCESS3res->ACCESS3res_u.resok.obj_attributes);
+		attrcache_set_access(cb_data->nfsio->attrs, cb_data->client,
+				     cb_data->obj.data, cb_data->obj.len, cb_data->desired,
+				     ACCESS3res->ACCESS3res_u.resok.access, cb_data->now);
+	}
+
 	if (cb_data->access) {
 		*cb_data->access = ACCESS3res->ACCESS3res_u.resok.access;
 	}
@@ -714,27 +1078,34 @@ static void nfsio_access_cb(struct rpc_context *rpc _U_, int status,
 nfsstat3 nfsio_access(struct nfsio *nfsio, const char *name, uint32_t desired, uint32_t *access)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
+
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_access_cb);
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_access\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.access = access;
+	if (nfsio->attrs != NULL &&
+	    attrcache_access(nfsio->attrs, nfsio->client, fh->data.data_val,
+			     fh->data.data_len, desired, nfsio->now, access)) {
+		nfsio->accesses_saved++;
+		return nfsio_answered(cb_data, NFS3_OK);
+	}
+	remember_obj(cb_data, fh);
+
+	cb_data->access  = access;
+	cb_data->desired = desired;
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_access_async(nfs_get_rpc_context(nfsio->nfs),
-				 nfsio_access_cb, fh, desired, &cb_data)) {
+				 nfsio_rpc_cb, fh, desired, cb_data)) {
 		fprintf(stderr, "failed to send access\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 
@@ -754,10 +1125,15 @@ static void nfsio_create_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
-	insert_fhandle(cb_data->nfsio, cb_data->name,
+	forget_negatives(cb_data, cb_data->name);
+	record_fhandle(cb_data,
 			CREATE3res->CREATE3res_u.resok.obj.post_op_fh3_u.handle.data.data_val,
 			CREATE3res->CREATE3res_u.resok.obj.post_op_fh3_u.handle.data.data_len,
 			CREATE3res->CREATE3res_u.resok.obj_attributes.post_op_attr_u.attributes.size);
+	remember_attrs(cb_data,
+			CREATE3res->CREATE3res_u.resok.obj.post_op_fh3_u.handle.data.data_val,
+			CREATE3res->CREATE3res_u.resok.obj.post_op_fh3_u.handle.data.data_len,
+			&CREATE3res->CREATE3res_u.resok.obj_attributes);
 
 	cb_data->status = NFS3_OK;
 }
@@ -765,29 +1141,16 @@ static void nfsio_create_cb(struct rpc_context *rpc _U_, int status,
 nfsstat3 nfsio_create(struct nfsio *nfsio, const char *name)
 {
 	struct CREATE3args CREATE3args;
-	char *tmp_name, *ptr;
+	char *ptr;
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
-
-	tmp_name = strdupa(name);
-	if (tmp_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_create\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	ptr = rindex(tmp_name, '/');
-	if (ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_create\n");
-		return NFS3ERR_SERVERFAULT;
-	}
+	struct nfsio_cb_data local, *cb_data;
 
-	*ptr = 0;
-	ptr++;
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_create_cb);
 
-	fh = lookup_fhandle(nfsio, tmp_name, NULL);
+	fh = dir_fhandle(nfsio, nfsio->fh, name, &ptr, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch parent handle in nfsio_create\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
 	memset(&CREATE3args, 0, sizeof(CREATE3args));
@@ -805,19 +1168,16 @@ nfsstat3 nfsio_create(struct nfsio *nfsio, const char *name)
 	CREATE3args.how.createhow3_u.obj_attributes.atime.set_it = FALSE;
 	CREATE3args.how.createhow3_u.obj_attributes.mtime.set_it = FALSE;
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.name = discard_const(name);
+	cb_data->res_fh = nfsio->res_fh;
+	cb_data->name = discard_const(name);
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_create_async(nfs_get_rpc_context(nfsio->nfs),
-				 nfsio_create_cb, &CREATE3args, &cb_data)) {
+				 nfsio_rpc_cb, &CREATE3args, cb_data)) {
 		fprintf(stderr, "failed to send create\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_remove_cb(struct rpc_context *rpc _U_, int status,
@@ -836,51 +1196,35 @@ static void nfsio_remove_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
-	delete_fhandle(cb_data->nfsio, cb_data->name);
+	forget_fhandle(cb_data);
 
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_remove(struct nfsio *nfsio, const char *name)
 {
-	char *tmp_name, *ptr;
+	char *ptr;
 	nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
-
-	tmp_name = strdupa(name);
-	if (tmp_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_remove\n");
-		return NFS3ERR_SERVERFAULT;
-	}
+	struct nfsio_cb_data local, *cb_data;
 
-	ptr = rindex(tmp_name, '/');
-	if (ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_remove\n");
-		return NFS3ERR_SERVERFAULT;
-	}
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_remove_cb);
 
-	*ptr = 0;
-	ptr++;
-
-	fh = lookup_fhandle(nfsio, tmp_name, NULL);
+	fh = dir_fhandle(nfsio, nfsio->fh, name, &ptr, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch parent handle in nfsio_remove\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.name = discard_const(name);
+	cb_data->res_fh = nfsio->res_fh;
+	cb_data->name = discard_const(name);
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_remove_async(nfs_get_rpc_context(nfsio->nfs),
-				 nfsio_remove_cb, fh, ptr, &cb_data)) {
+				 nfsio_rpc_cb, fh, ptr, cb_data)) {
 		fprintf(stderr, "failed to send remove\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_write_cb(struct rpc_context *rpc _U_, int status,
@@ -899,38 +1243,57 @@ static void nfsio_write_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
+	/* the client's own changes come back in the wcc data */
+	remember_attrs(cb_data, cb_data->obj.data, cb_data->obj.len,
+		       &WRITE3res->WRITE3res_u.resok.file_wcc.after);
+
+	cb_data->bytes  = WRITE3res->WRITE3res_u.resok.count;
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_write(struct nfsio *nfsio, const char *name, char *buf, uint64_t offset, int len, int stable)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
+
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_write_cb);
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_write\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
+	remember_obj(cb_data, fh);
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
+	/* no data of the caller's, write what READs expect to find */
+	if (buf == NULL) {
+		cb_data->iobuf = iobuf_get(nfsio, len);
+		buf = cb_data->iobuf->data;
+		payload_fill(buf, payload_file(fh), offset, len);
+	}
+
+	if (nfsio->wtmax != 0 && (uint32_t)len > nfsio->wtmax) {
+		cb_data->offset = offset;
+		return nfsio_send_chunks(nfsio, cb_data, fh, len,
+					 chunk_size(nfsio->wtpref, nfsio->wtmax), buf, stable);
+	}
 
 	set_xid_value(nfsio);
-	if (rpc_nfs_write_async(nfs_get_rpc_context(nfsio->nfs), nfsio_write_cb,
-				fh, buf, offset, len, stable, &cb_data)) {
+	if (rpc_nfs_write_async(nfs_get_rpc_context(nfsio->nfs), nfsio_rpc_cb,
+				fh, buf, offset, len, stable, cb_data)) {
 		fprintf(stderr, "failed to send write\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_read_cb(struct rpc_context *rpc _U_, int status,
        void *data, void *private_data) {
 	struct READ3res *READ3res = data;
 	struct nfsio_cb_data *cb_data = private_data;
+	uint64_t bad;
+	uint32_t count;
+	char *payload;
 
 	cb_data->is_finished = 1;
 
@@ -943,32 +1306,56 @@ static void nfsio_read_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
+	payload = READ3res->READ3res_u.resok.data.data_val;
+	count   = READ3res->READ3res_u.resok.data.data_len;
+	if (cb_data->nfsio->verify) {
+		cb_data->nfsio->reads_verified++;
+		if (payload_check(payload, cb_data->file, cb_data->offset, count, &bad) != 0) {
+			if (cb_data->nfsio->verify_errors++ == 0) {
+				fprintf(stderr, "READ of '%s' at %" PRIu64 " returned other "
+					"data than was written at %" PRIu64 "\n",
+					cb_data->name, cb_data->offset, bad);
+			}
+		}
+	}
+	if (cb_data->buf != NULL) {
+		memcpy(cb_data->buf, payload, count);
+	}
+
+	cb_data->bytes  = count;
 	cb_data->status = NFS3_OK;
 }
 
-nfsstat3 nfsio_read(struct nfsio *nfsio, const char *name, char *buf _U_, uint64_t offset, int len)
+nfsstat3 nfsio_read(struct nfsio *nfsio, const char *name, char *buf, uint64_t offset, int len)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
+
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_read_cb);
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_read\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
+	cb_data->name   = discard_const(name);
+	cb_data->buf    = buf;
+	cb_data->file   = payload_file(fh);
+	cb_data->offset = offset;
+
+	if (nfsio->rtmax != 0 && (uint32_t)len > nfsio->rtmax) {
+		return nfsio_send_chunks(nfsio, cb_data, fh, len,
+					 chunk_size(nfsio->rtpref, nfsio->rtmax), NULL, 0);
+	}
 
 	set_xid_value(nfsio);
-	if (rpc_nfs_read_async(nfs_get_rpc_context(nfsio->nfs), nfsio_read_cb,
-			fh, offset, len, &cb_data)) {
+	if (rpc_nfs_read_async(nfs_get_rpc_context(nfsio->nfs), nfsio_rpc_cb,
+			fh, offset, len, cb_data)) {
 		fprintf(stderr, "failed to send read\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 void nfsio_lock_cb(struct rpc_context *rpc _U_, int status, void *data,
@@ -994,18 +1381,18 @@ void nfsio_lock_cb(struct rpc_context *rpc _U_, int status, void *data,
 nlmstat4 nfsio_lock(struct nfsio *nfsio, const char *name, uint64_t offset, int len)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 	struct NLM4_LOCKargs NLM4_LOCKargs;
 	uint32_t cookie = time(NULL) ^ getpid();
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_lock_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_lock\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
 
 	memset(&NLM4_LOCKargs, 0, sizeof(NLM4_LOCKargs));
 	NLM4_LOCKargs.cookie.data.data_len  = sizeof(cookie);
@@ -1022,14 +1409,12 @@ nlmstat4 nfsio_lock(struct nfsio *nfsio, const char *name, uint64_t offset, int
 	NLM4_LOCKargs.reclaim = 0;
 	NLM4_LOCKargs.state = 0;
 
-	if (rpc_nlm4_lock_async(nfsio->nlm, nfsio_lock_cb,
-			&NLM4_LOCKargs, &cb_data)) {
+	if (rpc_nlm4_lock_async(nfsio->nlm, nfsio_rpc_cb,
+			&NLM4_LOCKargs, cb_data)) {
 		fprintf(stderr, "failed to send lock\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_rpc_reply(nfsio->nlm, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfsio->nlm, cb_data);
 }
 
 void nfsio_unlock_cb(struct rpc_context *rpc _U_, int status, void *data,
@@ -1055,18 +1440,18 @@ void nfsio_unlock_cb(struct rpc_context *rpc _U_, int status, void *data,
 nlmstat4 nfsio_unlock(struct nfsio *nfsio, const char *name, uint64_t offset, int len)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 	struct NLM4_UNLOCKargs NLM4_UNLOCKargs;
 	uint32_t cookie = time(NULL) ^ getpid();
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_unlock_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_unlock\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
 
 	memset(&NLM4_UNLOCKargs, 0, sizeof(NLM4_UNLOCKargs));
 	NLM4_UNLOCKargs.cookie.data.data_len  = sizeof(cookie);
@@ -1079,14 +1464,12 @@ nlmstat4 nfsio_unlock(struct nfsio *nfsio, const char *name, uint64_t offset, in
 	NLM4_UNLOCKargs.lock.l_offset = offset;
 	NLM4_UNLOCKargs.lock.l_len    = len;
 
-	if (rpc_nlm4_unlock_async(nfsio->nlm, nfsio_unlock_cb,
-			&NLM4_UNLOCKargs, &cb_data)) {
+	if (rpc_nlm4_unlock_async(nfsio->nlm, nfsio_rpc_cb,
+			&NLM4_UNLOCKargs, cb_data)) {
 		fprintf(stderr, "failed to send unlock\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_rpc_reply(nfsio->nlm, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfsio->nlm, cb_data);
 }
 
 void nfsio_test_cb(struct rpc_context *rpc _U_, int status, void *data,
@@ -1112,18 +1495,18 @@ void nfsio_test_cb(struct rpc_context *rpc _U_, int status, void *data,
 nlmstat4 nfsio_test(struct nfsio *nfsio, const char *name, uint64_t offset, int len)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 	struct NLM4_TESTargs NLM4_TESTargs;
 	uint32_t cookie = time(NULL) ^ getpid();
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_test_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_test\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
 
 	memset(&NLM4_TESTargs, 0, sizeof(NLM4_TESTargs));
 	NLM4_TESTargs.cookie.data.data_len  = sizeof(cookie);
@@ -1137,14 +1520,12 @@ nlmstat4 nfsio_test(struct nfsio *nfsio, const char *name, uint64_t offset, int
 	NLM4_TESTargs.lock.l_offset = offset;
 	NLM4_TESTargs.lock.l_len    = len;
 
-	if (rpc_nlm4_test_async(nfsio->nlm, nfsio_test_cb,
-			&NLM4_TESTargs, &cb_data)) {
+	if (rpc_nlm4_test_async(nfsio->nlm, nfsio_rpc_cb,
+			&NLM4_TESTargs, cb_data)) {
 		fprintf(stderr, "failed to send test\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_rpc_reply(nfsio->nlm, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfsio->nlm, cb_data);
 }
 static void nfsio_commit_cb(struct rpc_context *rpc _U_, int status,
        void *data, void *private_data) {
@@ -1168,32 +1549,31 @@ static void nfsio_commit_cb(struct rpc_context *rpc _U_, int status,
 nfsstat3 nfsio_commit(struct nfsio *nfsio, const char *name)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_commit_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_commit\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_commit_async(nfs_get_rpc_context(nfsio->nfs),
-				 nfsio_commit_cb, fh, &cb_data)) {
+				 nfsio_rpc_cb, fh, cb_data)) {
 		fprintf(stderr, "failed to send commit\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_fsinfo_cb(struct rpc_context *rpc _U_, int status,
        void *data, void *private_data) {
 	struct FSINFO3res *FSINFO3res = data;
 	struct nfsio_cb_data *cb_data = private_data;
+	FSINFO3resok *resok;
 
 	cb_data->is_finished = 1;
 
@@ -1206,32 +1586,36 @@ static void nfsio_fsinfo_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
+	resok = &FSINFO3res->FSINFO3res_u.resok;
+	cb_data->nfsio->rtmax  = resok->rtmax;
+	cb_data->nfsio->rtpref = resok->rtpref;
+	cb_data->nfsio->wtmax  = resok->wtmax;
+	cb_data->nfsio->wtpref = resok->wtpref;
+
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_fsinfo(struct nfsio *nfsio)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
+
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_fsinfo_cb);
 
-	fh = lookup_fhandle(nfsio, "/", NULL);
+	fh = op_fhandle(nfsio, nfsio->fh, "/", &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_fsinfo\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_fsinfo_async(nfs_get_rpc_context(nfsio->nfs),
-				 nfsio_fsinfo_cb, fh, &cb_data)) {
+				 nfsio_rpc_cb, fh, cb_data)) {
 		fprintf(stderr, "failed to send fsinfo\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 
@@ -1257,26 +1641,24 @@ static void nfsio_fsstat_cb(struct rpc_context *rpc _U_, int status,
 nfsstat3 nfsio_fsstat(struct nfsio *nfsio)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
+
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_fsstat_cb);
 
-	fh = lookup_fhandle(nfsio, "/", NULL);
+	fh = op_fhandle(nfsio, nfsio->fh, "/", &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_fsstat\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_fsstat_async(nfs_get_rpc_context(nfsio->nfs),
-				 nfsio_fsstat_cb, fh, &cb_data)) {
+				 nfsio_rpc_cb, fh, cb_data)) {
 		fprintf(stderr, "failed to send fsstat\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_pathconf_cb(struct rpc_context *rpc _U_, int status,
@@ -1301,26 +1683,24 @@ static void nfsio_pathconf_cb(struct rpc_context *rpc _U_, int status,
 nfsstat3 nfsio_pathconf(struct nfsio *nfsio, char *name)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_pathconf_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_pathconf\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_pathconf_async(nfs_get_rpc_context(nfsio->nfs),
-		nfsio_pathconf_cb, fh, &cb_data)) {
+		nfsio_rpc_cb, fh, cb_data)) {
 		fprintf(stderr, "failed to send pathconf\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_symlink_cb(struct rpc_context *rpc _U_, int status,
@@ -1339,40 +1719,32 @@ static void nfsio_symlink_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
-	insert_fhandle(cb_data->nfsio, cb_data->name,
+	forget_negatives(cb_data, cb_data->name);
+	record_fhandle(cb_data,
 		       SYMLINK3res->SYMLINK3res_u.resok.obj.post_op_fh3_u.handle.data.data_val,
 		       SYMLINK3res->SYMLINK3res_u.resok.obj.post_op_fh3_u.handle.data.data_len,
 		       0);
+	remember_attrs(cb_data,
+		       SYMLINK3res->SYMLINK3res_u.resok.obj.post_op_fh3_u.handle.data.data_val,
+		       SYMLINK3res->SYMLINK3res_u.resok.obj.post_op_fh3_u.handle.data.data_len,
+		       &SYMLINK3res->SYMLINK3res_u.resok.obj_attributes);
 
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_symlink(struct nfsio *nfsio, const char *old, const char *new)
 {
-	char *tmp_name, *ptr;
+	char *ptr;
 	nfs_fh3 *fh;
 	struct SYMLINK3args SYMLINK3args;
-	struct nfsio_cb_data cb_data;
-
-	tmp_name = strdupa(old);
-	if (tmp_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_symlink\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	ptr = rindex(tmp_name, '/');
-	if (ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_symlink\n");
-		return NFS3ERR_SERVERFAULT;
-	}
+	struct nfsio_cb_data local, *cb_data;
 
-	*ptr = 0;
-	ptr++;
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_symlink_cb);
 
-	fh = lookup_fhandle(nfsio, tmp_name, NULL);
+	fh = dir_fhandle(nfsio, nfsio->fh, old, &ptr, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch parent handle in nfsio_symlink\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
 	memset(&SYMLINK3args, 0, sizeof(SYMLINK3args));
@@ -1390,19 +1762,16 @@ nfsstat3 nfsio_symlink(struct nfsio *nfsio, const char *old, const char *new)
 	SYMLINK3args.symlink.symlink_attributes.mtime.set_it = FALSE;
 	SYMLINK3args.symlink.symlink_data     = discard_const(new);
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.name  = discard_const(old);
+	cb_data->res_fh = nfsio->res_fh;
+	cb_data->name  = discard_const(old);
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_symlink_async(nfs_get_rpc_context(nfsio->nfs),
-		nfsio_symlink_cb, &SYMLINK3args, &cb_data)) {
+		nfsio_rpc_cb, &SYMLINK3args, cb_data)) {
 		fprintf(stderr, "failed to send symlink\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_link_cb(struct rpc_context *rpc _U_, int status,
@@ -1421,55 +1790,40 @@ static void nfsio_link_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
+	forget_negatives(cb_data, cb_data->name);
+
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_link(struct nfsio *nfsio, const char *old, const char *new)
 {
-	char *tmp_name, *ptr;
+	char *ptr;
 	nfs_fh3 *fh, *new_fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 
-	tmp_name = strdupa(old);
-	if (tmp_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_link\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	ptr = rindex(tmp_name, '/');
-	if (ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_link\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	*ptr = 0;
-	ptr++;
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_link_cb);
 
-	fh = lookup_fhandle(nfsio, tmp_name, NULL);
+	fh = dir_fhandle(nfsio, nfsio->fh2, old, &ptr, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch parent handle in nfsio_link\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	new_fh = lookup_fhandle(nfsio, new, NULL);
+	new_fh = op_fhandle(nfsio, nfsio->fh, new, &cb_data->fh2);
 	if (new_fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_link\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.name  = ptr;
+	cb_data->name  = discard_const(old);
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_link_async(nfs_get_rpc_context(nfsio->nfs),
-			       nfsio_link_cb, new_fh, fh, ptr, &cb_data)) {
+			       nfsio_rpc_cb, new_fh, fh, ptr, cb_data)) {
 		fprintf(stderr, "failed to send link\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_readlink_cb(struct rpc_context *rpc _U_, int status,
@@ -1494,29 +1848,27 @@ static void nfsio_readlink_cb(struct rpc_context *rpc _U_, int status,
 nfsstat3 nfsio_readlink(struct nfsio *nfsio, char *name)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 	READLINK3args READLINK3args;
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_readlink_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_readlink\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
 	READLINK3args.symlink = *fh;
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_readlink_async(nfs_get_rpc_context(nfsio->nfs),
-		nfsio_readlink_cb, &READLINK3args, &cb_data)) {
+		nfsio_rpc_cb, &READLINK3args, cb_data)) {
 		fprintf(stderr, "failed to send readlink\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_rmdir_cb(struct rpc_context *rpc _U_, int status,
@@ -1535,51 +1887,35 @@ static void nfsio_rmdir_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
-	delete_fhandle(cb_data->nfsio, cb_data->name);
+	forget_fhandle(cb_data);
 
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_rmdir(struct nfsio *nfsio, const char *name)
 {
-	char *tmp_name, *ptr;
+	char *ptr;
 	nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 
-	tmp_name = strdupa(name);
-	if (tmp_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_rmdir\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	ptr = rindex(tmp_name, '/');
-	if (ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_rmdir\n");
-		return NFS3ERR_SERVERFAULT;
-	}
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_rmdir_cb);
 
-	*ptr = 0;
-	ptr++;
-
-	fh = lookup_fhandle(nfsio, tmp_name, NULL);
+	fh = dir_fhandle(nfsio, nfsio->fh, name, &ptr, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch parent handle in nfsio_rmdir\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.name = discard_const(name);
+	cb_data->res_fh = nfsio->res_fh;
+	cb_data->name = discard_const(name);
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_rmdir_async(nfs_get_rpc_context(nfsio->nfs),
-				 nfsio_rmdir_cb, fh, ptr, &cb_data)) {
+				 nfsio_rpc_cb, fh, ptr, cb_data)) {
 		fprintf(stderr, "failed to send rmdir\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_mkdir_cb(struct rpc_context *rpc _U_, int status,
@@ -1598,10 +1934,15 @@ static void nfsio_mkdir_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
-	insert_fhandle(cb_data->nfsio, cb_data->name,
+	forget_negatives(cb_data, cb_data->name);
+	record_fhandle(cb_data,
 			MKDIR3res->MKDIR3res_u.resok.obj.post_op_fh3_u.handle.data.data_val,
 			MKDIR3res->MKDIR3res_u.resok.obj.post_op_fh3_u.handle.data.data_len,
 			0);
+	remember_attrs(cb_data,
+			MKDIR3res->MKDIR3res_u.resok.obj.post_op_fh3_u.handle.data.data_val,
+			MKDIR3res->MKDIR3res_u.resok.obj.post_op_fh3_u.handle.data.data_len,
+			&MKDIR3res->MKDIR3res_u.resok.obj_attributes);
 
 	cb_data->status = NFS3_OK;
 }
@@ -1609,29 +1950,16 @@ static void nfsio_mkdir_cb(struct rpc_context *rpc _U_, int status,
 nfsstat3 nfsio_mkdir(struct nfsio *nfsio, const char *name)
 {
 	struct MKDIR3args MKDIR3args;
-	char *tmp_name, *ptr;
+	char *ptr;
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 
-	tmp_name = strdupa(name);
-	if (tmp_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_mkdir\n");
-		return NFS3ERR_SERVERFAULT;
-	}
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_mkdir_cb);
 
-	ptr = rindex(tmp_name, '/');
-	if (ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_mkdir\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	*ptr = 0;
-	ptr++;
-
-	fh = lookup_fhandle(nfsio, tmp_name, NULL);
+	fh = dir_fhandle(nfsio, nfsio->fh, name, &ptr, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch parent handle in nfsio_mkdir\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
 	memset(&MKDIR3args, 0, sizeof(MKDIR3args));
@@ -1648,26 +1976,52 @@ nfsstat3 nfsio_mkdir(struct nfsio *nfsio, const char *name)
 	MKDIR3args.attributes.atime.set_it = FALSE;
 	MKDIR3args.attributes.mtime.set_it = FALSE;
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.name = discard_const(name);
+	cb_data->res_fh = nfsio->res_fh;
+	cb_data->name = discard_const(name);
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_mkdir_async(nfs_get_rpc_context(nfsio->nfs),
-				 nfsio_mkdir_cb, &MKDIR3args, &cb_data)) {
+				 nfsio_rpc_cb, &MKDIR3args, cb_data)) {
 		fprintf(stderr, "failed to send mkdir\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
+}
+
+/*
+ * Map the traced handle of the entry called name to the live handle fh.
+ * Servers list a directory in much the same order each time, so the
+ * search starts after the last entry found.
+ */
+static void map_dirent(struct nfsio_cb_data *cb_data, const char *name,
+		       const nfs_fh3 *fh)
+{
+	const struct trace_dirent *d;
+	int i, n = cb_data->ndirents;
 
-	return cb_data.status;
+	for (i = 0; i < n; i++) {
+		d = &cb_data->dirents[(cb_data->next_dirent + i) % n];
+		if (d->name != NULL && strcmp(d->name, name) == 0) {
+			break;
+		}
+	}
+	if (i == n) {
+		return;
+	}
+	cb_data->next_dirent = (cb_data->next_dirent + i + 1) % n;
+	if (d->fh != NULL) {
+		fhcache_map_insert(cb_data->nfsio->cache, (const char *)d->fh->data,
+				   d->fh->len, fh->data.data_val, fh->data.data_len);
+	}
 }
 
 static void nfsio_readdirplus_cb(struct rpc_context *rpc _U_, int status,
        void *data, void *private_data) {
 	struct READDIRPLUS3res *READDIRPLUS3res = data;
 	struct nfsio_cb_data *cb_data = private_data;
-	entryplus3 *e;
+	entryplus3 *e, *last = NULL;
+	struct fhcache_ref dir;
+	int cached;
 
 	cb_data->is_finished = 1;
 
@@ -1680,33 +2034,11 @@ static void nfsio_readdirplus_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
-	if (READDIRPLUS3res->READDIRPLUS3res_u.resok.reply.eof == 0) {
-		for(e = READDIRPLUS3res->READDIRPLUS3res_u.resok.reply.entries;
-			e->nextentry;
-			e = e->nextentry){
-		}
-
-		set_xid_value(cb_data->nfsio);
-		if (rpc_nfs_readdirplus_async(
-				nfs_get_rpc_context(cb_data->nfsio->nfs),
-				nfsio_readdirplus_cb,
-				cb_data->fh,
-				e->cookie,
-				(char *)&READDIRPLUS3res->READDIRPLUS3res_u.resok.cookieverf,
-				8000, cb_data)) {
-			fprintf(stderr, "failed to send readdirplus\n");
-			cb_data->status = NFS3ERR_SERVERFAULT;
-			return;
-		}
-		cb_data->is_finished = 0;
-		nfsio_wait_for_nfs_reply(cb_data->nfsio->nfs, cb_data);
-	}
-
 	/* Record the dir/file name to filehandle mappings */
+	cached = fhcache_find(cb_data->nfsio->cache, cb_data->name, &dir);
 	for(e = READDIRPLUS3res->READDIRPLUS3res_u.resok.reply.entries;
 		e; e = e->nextentry){
-		char *new_name;
-
+		last = e;
 		if(!strcmp(e->name, ".")){
 			continue;
 		}
@@ -1716,53 +2048,93 @@ static void nfsio_readdirplus_cb(struct rpc_context *rpc _U_, int status,
 		if(e->name_handle.handle_follows == 0){
 			continue;
 		}
-		if (asprintf(&new_name, "%s/%s", cb_data->name, e->name) < 0) {
-			exit(1);
+		if (cached) {
+			fhcache_insert_child(cb_data->nfsio->cache, &dir, e->name, strlen(e->name),
+				e->name_handle.post_op_fh3_u.handle.data.data_val,
+				e->name_handle.post_op_fh3_u.handle.data.data_len,
+				0 /*qqq*/
+			);
+		}
+		if (cb_data->ndirents > 0) {
+			map_dirent(cb_data, e->name, &e->name_handle.post_op_fh3_u.handle);
 		}
-		insert_fhandle(cb_data->nfsio, new_name,
+		remember_attrs(cb_data,
 			e->name_handle.post_op_fh3_u.handle.data.data_val,
 			e->name_handle.post_op_fh3_u.handle.data.data_len,
-			0 /*qqq*/
-		);
-		free(new_name);
+			&e->name_attributes);
 
 		if (cb_data->rd_cb) {
 			cb_data->rd_cb(e, cb_data->private_data);
 		}
 	}
 
+	/*
+	 * Ask for the next page with the same cb_data and stay unfinished,
+	 * whoever waits on the call keeps waiting for the last page.
+	 */
+	if (READDIRPLUS3res->READDIRPLUS3res_u.resok.reply.eof == 0 &&
+	    last != NULL) {
+		set_xid_value(cb_data->nfsio);
+		if (rpc_nfs_readdirplus_async(
+				nfs_get_rpc_context(cb_data->nfsio->nfs),
+				nfsio_rpc_cb,
+				&cb_data->fh.fh,
+				last->cookie,
+				(char *)&READDIRPLUS3res->READDIRPLUS3res_u.resok.cookieverf,
+				8000, cb_data)) {
+			fprintf(stderr, "failed to send readdirplus\n");
+			cb_data->status = NFS3ERR_SERVERFAULT;
+			return;
+		}
+		cb_data->is_finished = 0;
+		return;
+	}
+
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_readdirplus(struct nfsio *nfsio, const char *name, nfs3_dirent_cb cb, void *private_data)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 	cookieverf3 cv;
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_readdirplus_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle for '%s' in nfsio_readdirplus\n", name);
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
+	}
+
+	if (fh->data.data_len > NFS3_FHSIZE) {
+		fprintf(stderr, "handle for '%s' too long in nfsio_readdirplus\n", name);
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
 	memset(&cv, 0, sizeof(cv));
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.fh    = fh;
-	cb_data.name  = name;
-	cb_data.rd_cb = cb;
-	cb_data.private_data = private_data;
+	/* the next pages go out after fh may have left the handle map */
+	if (fh != &cb_data->fh.fh) {
+		memcpy(cb_data->fh.h.data, fh->data.data_val, fh->data.data_len);
+		cb_data->fh.h.len = fh->data.data_len;
+		fh = fh_copy(&cb_data->fh);
+	}
+	cb_data->name  = name;
+	cb_data->rd_cb = cb;
+	cb_data->private_data = private_data;
+	/* a READDIRPLUS3 of the trace, not one of a DELTREE walking the tree */
+	if (nfsio->handle_mode && cb == NULL) {
+		cb_data->dirents  = nfsio->dirents;
+		cb_data->ndirents = nfsio->ndirents;
+	}
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_readdirplus_async(nfs_get_rpc_context(nfsio->nfs),
-		nfsio_readdirplus_cb, fh, 0, (char *)&cv, 8000, &cb_data)) {
+		nfsio_rpc_cb, fh, 0, (char *)&cv, 8000, cb_data)) {
 		fprintf(stderr, "failed to send readdirplus\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 
@@ -1770,7 +2142,6 @@ static void nfsio_rename_cb(struct rpc_context *rpc _U_, int status,
        void *data, void *private_data) {
 	struct RENAME3res *RENAME3res = data;
 	struct nfsio_cb_data *cb_data = private_data;
-	nfs_fh3 *old_fh;
 
 	cb_data->is_finished = 1;
 
@@ -1783,84 +2154,49 @@ static void nfsio_rename_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
-	old_fh = lookup_fhandle(cb_data->nfsio, cb_data->old_name, NULL);
-	delete_fhandle(cb_data->nfsio, cb_data->old_name);
-	insert_fhandle(cb_data->nfsio, cb_data->name,
-			old_fh->data.data_val,
-			old_fh->data.data_len,
-			0 /* FIXME */
-		);
+	/*
+	 * The object keeps its handle, so the handle map stays as it is and
+	 * only the path moves, along with everything below it.
+	 */
+	forget_negatives(cb_data, cb_data->name);
+	fhcache_rename(cb_data->nfsio->cache, cb_data->old_name, cb_data->name);
 
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_rename(struct nfsio *nfsio, const char *old, const char *new)
 {
-	char *tmp_old_name;
-	char *tmp_new_name;
 	nfs_fh3 *old_fh, *new_fh;
 	char *old_ptr, *new_ptr;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 
-	tmp_old_name = strdupa(old);
-	if (tmp_old_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_rename\n");
-		return NFS3ERR_SERVERFAULT;
-	}
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_rename_cb);
 
-	old_ptr = rindex(tmp_old_name, '/');
-	if (old_ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_rename\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	*old_ptr = 0;
-	old_ptr++;
-
-	old_fh = lookup_fhandle(nfsio, tmp_old_name, NULL);
+	old_fh = dir_fhandle(nfsio, nfsio->fh, old, &old_ptr, &cb_data->fh);
 	if (old_fh == NULL) {
 		fprintf(stderr, "failed to fetch parent handle in nfsio_rename\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	tmp_new_name = strdupa(new);
-	if (tmp_new_name == NULL) {
-		fprintf(stderr, "failed to strdup name in nfsio_rename\n");
-		return NFS3ERR_SERVERFAULT;
-	}
-
-	new_ptr = rindex(tmp_new_name, '/');
-	if (new_ptr == NULL) {
-		fprintf(stderr, "name did not contain '/' in nfsio_rename\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	*new_ptr = 0;
-	new_ptr++;
-
-	new_fh = lookup_fhandle(nfsio, tmp_new_name, NULL);
+	new_fh = dir_fhandle(nfsio, nfsio->fh2, new, &new_ptr, &cb_data->fh2);
 	if (new_fh == NULL) {
 		fprintf(stderr, "failed to fetch parent handle in nfsio_rename\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio    = nfsio;
-	cb_data.name     = discard_const(new);
-	cb_data.old_name = discard_const(old);
+	cb_data->name     = discard_const(new);
+	cb_data->old_name = discard_const(old);
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_rename_async(nfs_get_rpc_context(nfsio->nfs),
-			nfsio_rename_cb,
+			nfsio_rpc_cb,
 			old_fh, old_ptr,
 			new_fh, new_ptr,
-			&cb_data)) {
+			cb_data)) {
 		fprintf(stderr, "failed to send rename\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 static void nfsio_setattr_cb(struct rpc_context *rpc _U_, int status,
@@ -1879,27 +2215,31 @@ static void nfsio_setattr_cb(struct rpc_context *rpc _U_, int status,
 		return;
 	}
 
+	remember_attrs(cb_data, cb_data->obj.data, cb_data->obj.len,
+		       &SETATTR3res->SETATTR3res_u.resok.obj_wcc.after);
+
 	cb_data->status = NFS3_OK;
 }
 
 nfsstat3 nfsio_setattr(struct nfsio *nfsio, const char *name, fattr3 *attributes)
 {
 	struct nfs_fh3 *fh;
-	struct nfsio_cb_data cb_data;
+	struct nfsio_cb_data local, *cb_data;
 	struct SETATTR3args args;
 	struct timeval tv;
 
 	gettimeofday(&tv, NULL);
 
-	fh = lookup_fhandle(nfsio, name, NULL);
+	cb_data = nfsio_cb_data_init(nfsio, &local, nfsio_setattr_cb);
+
+	fh = op_fhandle(nfsio, nfsio->fh, name, &cb_data->fh);
 	if (fh == NULL) {
 		fprintf(stderr, "failed to fetch handle in nfsio_setattr\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
+	remember_obj(cb_data, fh);
 
-	memset(&cb_data, 0, sizeof(cb_data));
-	cb_data.nfsio = nfsio;
-	cb_data.attributes = attributes;
+	cb_data->attributes = attributes;
 
 	memset(&args, 0, sizeof(args));
 	args.object = *fh;
@@ -1907,13 +2247,11 @@ nfsstat3 nfsio_setattr(struct nfsio *nfsio, const char *name, fattr3 *attributes
 
 	set_xid_value(nfsio);
 	if (rpc_nfs_setattr_async(nfs_get_rpc_context(nfsio->nfs),
-		nfsio_setattr_cb, &args, &cb_data)) {
+		nfsio_rpc_cb, &args, cb_data)) {
 		fprintf(stderr, "failed to send setattr\n");
-		return NFS3ERR_SERVERFAULT;
+		return nfsio_failed(cb_data, NFS3ERR_SERVERFAULT);
 	}
-	nfsio_wait_for_nfs_reply(nfsio->nfs, &cb_data);
-
-	return cb_data.status;
+	return nfsio_sent(nfs_get_rpc_context(nfsio->nfs), cb_data);
 }
 
 //#endif /* HAVE_LIBNFS */
@@ -1,11 +1,14 @@
-typedef struct _tree_t {
-    nfs_fh3 key;
-    nfs_fh3 fh;
-    off_t  file_size;
-    struct _tree_t *parent;
-    struct _tree_t *left;
-    struct _tree_t *right;
-} tree_t;
+struct fhcache;
+struct attrcache;
+struct trace_fh;
+struct iobuf;
+
+/*
+ * completion of an asynchronous call, see nfsio_set_completion(); bytes is
+ * the data a READ or WRITE moved by the server's reply, 0 for other calls
+ */
+typedef void (*nfsio_done_cb)(int status, double latency, uint32_t bytes,
+			      void *private_data);
 
 typedef struct nfsio {
     struct nfs_context *nfs;
@@ -13,7 +16,59 @@ typedef struct nfsio {
     int child;
     unsigned long xid;
     int xid_stride;
-    tree_t *fhandles;
+    struct fhcache *cache;
+    unsigned long cache_hits;
+    unsigned long cache_misses;
+
+    /* LOOKUPs sent to resolve the handles of ops, and the secs they took */
+    unsigned long resolve_lookups;
+    double resolve_time;
+
+    /* client emulation: LOOKUPs of names known not to exist are not sent */
+    int negative_cache;
+    unsigned long lookups_saved;
+
+    /*
+     * client emulation: GETATTR, ACCESS and LOOKUP are answered from the
+     * attributes traced client client has cached at traced time now, see
+     * nfsio_set_client(). attrs is NULL when the emulation is off.
+     */
+    struct attrcache *attrs;
+    int client;
+    uint64_t now;
+    unsigned long getattrs_saved;
+    unsigned long accesses_saved;
+    unsigned long attr_lookups_saved;
+
+    /* transfer sizes from FSINFO, 0 until the server told them */
+    uint32_t rtmax, rtpref;
+    uint32_t wtmax, wtpref;
+
+    /* data of the WRITEs in flight, in page aligned buffers recycled at completion */
+    struct iobuf *iobufs;
+    size_t iobuf_size;
+
+    /* READs check the data they return against what WRITEs wrote */
+    int verify;
+    unsigned long reads_verified;
+    unsigned long verify_errors;
+
+    /* handle mode: traced handles of the current op, see nfsio_set_handles() */
+    int handle_mode;
+    const struct trace_fh *fh;
+    const struct trace_fh *fh2;
+    const struct trace_fh *res_fh;
+    const struct trace_dirent *dirents;
+    int ndirents;
+
+    /* completion for the next call, and the calls still waiting for one */
+    nfsio_done_cb done;
+    void *done_data;
+    int inflight;
+
+    /* sockets as registered by nfsio_epoll_update() */
+    int ep_fd[2];
+    uint32_t ep_events[2];
 } nfsio;
 
 
@@ -21,6 +76,14 @@ struct nfsio *nfsio_connect(const char *url, int child, int initial_xid, int xid
 struct nfsio *do_nfsio_connect (const char *server, const char *export);
 
 void nfsio_disconnect(struct nfsio *nfsio);
+void nfsio_set_handles(struct nfsio *nfsio, const struct trace_fh *fh,
+		       const struct trace_fh *fh2, const struct trace_fh *res_fh);
+void nfsio_set_dirents(struct nfsio *nfsio, const struct trace_dirent *dirents, int n);
+void nfsio_set_client(struct nfsio *nfsio, int client, uint64_t now);
+void nfsio_set_completion(struct nfsio *nfsio, nfsio_done_cb done, void *private_data);
+struct epoll_event;
+int nfsio_epoll_update(struct nfsio *nfsio, int epfd);
+int nfsio_epoll_service(struct nfsio *nfsio, struct epoll_event *ev);
 nfsstat3 nfsio_getattr(struct nfsio *nfsio, const char *name, fattr3 *attributes);
 nfsstat3 nfsio_setattr(struct nfsio *nfsio, const char *name, fattr3 *attributes);
 nfsstat3 nfsio_lookup(struct nfsio *nfsio, const char *name, fattr3 *attributes);
@@ -0,0 +1,2169 @@
+/*
+   Mock NFSv3 server to benchmark the replayer against
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE 1
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <popt.h>
+
+#include "trace.h"
+#include "wheel.h"
+
+/*
+ * A server that keeps its files in memory and answers the portmapper,
+ * MOUNT3, NFS3 and NLM4 calls nfs-repl makes, all of them on one TCP
+ * port, so that a replay against it measures the replayer and not a
+ * server or a network.
+ *
+ * Every connection has a thread of its own. Calls are carried out as they
+ * come in, under one lock over the whole namespace, and with --latency
+ * their replies are held back on a timer wheel for the time given for
+ * their op, without holding up the calls behind them.
+ *
+ * Handles carry the file id of their object. File ids are never reused,
+ * so the handle of a removed object is stale. File data is kept in pages
+ * allocated as they are written, holes read back as zeroes. Locks never
+ * block: a LOCK that conflicts with a lock of another owner is denied.
+ */
+
+#define PROG_PMAP  100000
+#define PROG_NFS   100003
+#define PROG_MOUNT 100005
+#define PROG_NLM   100021
+
+#define NFS3_FHSIZE     64
+#define NFS3_MAXNAMLEN  255
+#define NFS3_MAXPATHLEN 1024
+#define NLM_OH_MAX      64
+
+#define MOCK_FH_MAGIC   0x4d4f434b	/* "MOCK" */
+#define MOCK_FH_LEN     12
+#define MOCK_PAGE_BITS  16
+#define MOCK_PAGE       (1 << MOCK_PAGE_BITS)
+#define MOCK_MAX_SIZE   (1ULL << 40)
+#define MOCK_HASH_SIZE  4096
+#define MSG_MAX         (4 * 1024 * 1024)
+
+enum {
+	NFS3_OK             = 0,
+	NFS3ERR_NOENT       = 2,
+	NFS3ERR_EXIST       = 17,
+	NFS3ERR_NOTDIR      = 20,
+	NFS3ERR_ISDIR       = 21,
+	NFS3ERR_INVAL       = 22,
+	NFS3ERR_FBIG        = 27,
+	NFS3ERR_NAMETOOLONG = 63,
+	NFS3ERR_NOTEMPTY    = 66,
+	NFS3ERR_STALE       = 70,
+	NFS3ERR_BADHANDLE   = 10001,
+	NFS3ERR_NOT_SYNC    = 10002,
+	NFS3ERR_NOTSUPP     = 10004,
+	NFS3ERR_TOOSMALL    = 10005,
+};
+
+enum {
+	NF3REG = 1,
+	NF3DIR = 2,
+	NF3LNK = 5,
+};
+
+enum {
+	NLM4_GRANTED  = 0,
+	NLM4_DENIED   = 1,
+	NLM4_STALE_FH = 7,
+};
+
+struct lock {
+	struct lock *next;
+	uint32_t svid;
+	uint32_t oh_len;
+	unsigned char oh[NLM_OH_MAX];
+	uint64_t start, end;		/* end is UINT64_MAX for up to EOF */
+	int exclusive;
+};
+
+struct dentry {
+	struct dentry *hnext;
+	uint64_t dir;
+	uint64_t ino;
+	uint32_t hash;
+	uint32_t slot;			/* in the entries of dir */
+	char name[];
+};
+
+struct inode {
+	uint64_t fileid;
+	int type;
+	uint32_t mode, nlink, uid, gid;
+	uint64_t size;
+	struct timespec atime, mtime, ctime;
+
+	uint64_t parent;		/* of a directory */
+	struct dentry **entries;	/* of a directory, in READDIRPLUS order */
+	uint32_t nentries, entries_size;
+	char *target;			/* of a symlink */
+	unsigned char **pages;		/* of a file */
+	uint64_t npages;
+	unsigned char verf[8];		/* of an exclusive CREATE */
+	struct lock *locks;
+};
+
+static struct {
+	/* the namespace, inodes by file id and names by (directory, name) */
+	pthread_rwlock_t lock;
+	struct inode **inodes;
+	uint64_t ninodes, size;
+	struct dentry **hash;
+	uint32_t hash_size, count;
+	unsigned char verf[8];
+
+	const char *address;
+	int port;
+	uint32_t tmax;
+	int no_data;
+	uint64_t latency[OP_MAX];	/* usec */
+	uint64_t default_latency;
+} mock;
+
+struct xdr {
+	const unsigned char *p;
+	const unsigned char *end;
+	int err;
+};
+
+struct out {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+};
+
+/* attributes of a directory before a call changed it */
+struct wcc {
+	int valid;
+	uint64_t size;
+	struct timespec mtime, ctime;
+};
+
+struct sattr {
+	int set_mode, set_uid, set_gid, set_size;
+	uint32_t mode, uid, gid;
+	uint64_t size;
+	int set_atime, set_mtime;	/* 1 to the server's time, 2 to the one given */
+	struct timespec atime, mtime;
+};
+
+static void *xmalloc(size_t len)
+{
+	void *p = malloc(len);
+
+	if (p == NULL) {
+		fprintf(stderr, "MALLOC failed to allocate %zu bytes\n", len);
+		exit(10);
+	}
+	return p;
+}
+
+static void *xrealloc(void *p, size_t len)
+{
+	p = realloc(p, len);
+	if (p == NULL) {
+		fprintf(stderr, "REALLOC failed to allocate %zu bytes\n", len);
+		exit(10);
+	}
+	return p;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t xdr_u32(struct xdr *x)
+{
+	uint32_t v;
+
+	if (x->err || x->end - x->p < 4) {
+		x->err = 1;
+		return 0;
+	}
+	v = get_be32(x->p);
+	x->p += 4;
+	return v;
+}
+
+static uint64_t xdr_u64(struct xdr *x)
+{
+	uint64_t hi = xdr_u32(x);
+
+	return (hi << 32) | xdr_u32(x);
+}
+
+static const unsigned char *xdr_opaque(struct xdr *x, uint32_t max, uint32_t *len)
+{
+	const unsigned char *p;
+	uint32_t padded;
+
+	*len = xdr_u32(x);
+	padded = (*len + 3) & ~3;
+	if (x->err || *len > max || (uint32_t)(x->end - x->p) < padded) {
+		x->err = 1;
+		*len = 0;
+		return NULL;
+	}
+	p = x->p;
+	x->p += padded;
+	return p;
+}
+
+static const unsigned char *xdr_fixed(struct xdr *x, uint32_t len)
+{
+	const unsigned char *p = x->p;
+
+	if (x->err || (uint32_t)(x->end - x->p) < len) {
+		x->err = 1;
+		return NULL;
+	}
+	x->p += len;
+	return p;
+}
+
+/* a string of up to max bytes into buf, which takes max + 1 */
+static uint32_t xdr_string(struct xdr *x, char *buf, uint32_t max)
+{
+	const unsigned char *p;
+	uint32_t len;
+
+	p = xdr_opaque(x, max, &len);
+	if (p != NULL) {
+		memcpy(buf, p, len);
+	}
+	buf[len] = 0;
+	return len;
+}
+
+static void xdr_time(struct xdr *x, struct timespec *ts)
+{
+	ts->tv_sec  = xdr_u32(x);
+	ts->tv_nsec = xdr_u32(x);
+}
+
+static unsigned char *out_space(struct out *o, size_t len)
+{
+	unsigned char *p;
+
+	if (o->len + len > o->size) {
+		while (o->len + len > o->size) {
+			o->size = o->size ? o->size * 2 : 64 * 1024;
+		}
+		o->data = xrealloc(o->data, o->size);
+	}
+	p = &o->data[o->len];
+	o->len += len;
+	return p;
+}
+
+static void put_u32(struct out *o, uint32_t v)
+{
+	unsigned char *p = out_space(o, 4);
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void put_u64(struct out *o, uint64_t v)
+{
+	put_u32(o, v >> 32);
+	put_u32(o, v);
+}
+
+static void put_bytes(struct out *o, const void *data, uint32_t len)
+{
+	unsigned char *p = out_space(o, (len + 3) & ~3);
+
+	memcpy(p, data, len);
+	memset(p + len, 0, ((len + 3) & ~3) - len);
+}
+
+static void put_opaque(struct out *o, const void *data, uint32_t len)
+{
+	put_u32(o, len);
+	put_bytes(o, data, len);
+}
+
+static void put_string(struct out *o, const char *s)
+{
+	put_opaque(o, s, strlen(s));
+}
+
+static void put_time(struct out *o, const struct timespec *ts)
+{
+	put_u32(o, ts->tv_sec);
+	put_u32(o, ts->tv_nsec);
+}
+
+/*
+ * The namespace. All of it is protected by mock.lock, taken for reading
+ * or writing around each call.
+ */
+static struct inode *inode_get(uint64_t fileid)
+{
+	return fileid < mock.ninodes ? mock.inodes[fileid] : NULL;
+}
+
+static struct inode *inode_new(int type, uint32_t mode)
+{
+	struct inode *ino = xmalloc(sizeof(struct inode));
+
+	memset(ino, 0, sizeof(struct inode));
+	if (mock.ninodes == mock.size) {
+		mock.size  *= 2;
+		mock.inodes = xrealloc(mock.inodes, mock.size * sizeof(struct inode *));
+	}
+	ino->fileid = mock.ninodes++;
+	ino->type   = type;
+	ino->mode   = mode;
+	ino->nlink  = 1;
+	clock_gettime(CLOCK_REALTIME, &ino->ctime);
+	ino->atime  = ino->ctime;
+	ino->mtime  = ino->ctime;
+	mock.inodes[ino->fileid] = ino;
+	return ino;
+}
+
+static void inode_free(struct inode *ino)
+{
+	struct lock *l, *next;
+	uint64_t i;
+
+	for (i = 0; i < ino->npages; i++) {
+		free(ino->pages[i]);
+	}
+	for (l = ino->locks; l != NULL; l = next) {
+		next = l->next;
+		free(l);
+	}
+	free(ino->pages);
+	free(ino->entries);
+	free(ino->target);
+	mock.inodes[ino->fileid] = NULL;
+	free(ino);
+}
+
+static void touch(struct inode *ino, int modified)
+{
+	clock_gettime(CLOCK_REALTIME, &ino->ctime);
+	if (modified) {
+		ino->mtime = ino->ctime;
+	}
+}
+
+static uint32_t name_hash(uint64_t dir, const char *name)
+{
+	uint32_t h = 2166136261U ^ (uint32_t)dir ^ (uint32_t)(dir >> 32);
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+static struct dentry *dir_lookup(struct inode *dir, const char *name)
+{
+	uint32_t hash = name_hash(dir->fileid, name);
+	struct dentry *d;
+
+	for (d = mock.hash[hash & (mock.hash_size - 1)]; d != NULL; d = d->hnext) {
+		if (d->hash == hash && d->dir == dir->fileid && !strcmp(d->name, name)) {
+			return d;
+		}
+	}
+	return NULL;
+}
+
+static void hash_resize(void)
+{
+	struct dentry **old = mock.hash, *d, *next;
+	uint32_t i, old_size = mock.hash_size;
+
+	mock.hash_size = old_size ? old_size * 2 : MOCK_HASH_SIZE;
+	mock.hash = calloc(mock.hash_size, sizeof(struct dentry *));
+	if (mock.hash == NULL) {
+		fprintf(stderr, "CALLOC failed to allocate the namespace\n");
+		exit(10);
+	}
+	for (i = 0; i < old_size; i++) {
+		for (d = old[i]; d != NULL; d = next) {
+			next = d->hnext;
+			d->hnext = mock.hash[d->hash & (mock.hash_size - 1)];
+			mock.hash[d->hash & (mock.hash_size - 1)] = d;
+		}
+	}
+	free(old);
+}
+
+static void dir_add(struct inode *dir, const char *name, struct inode *ino)
+{
+	size_t len = strlen(name);
+	struct dentry *d = xmalloc(sizeof(struct dentry) + len + 1);
+
+	if ((mock.count + 1) * 4 > mock.hash_size * 3) {
+		hash_resize();
+	}
+	memcpy(d->name, name, len + 1);
+	d->dir   = dir->fileid;
+	d->ino   = ino->fileid;
+	d->hash  = name_hash(dir->fileid, name);
+	d->hnext = mock.hash[d->hash & (mock.hash_size - 1)];
+	mock.hash[d->hash & (mock.hash_size - 1)] = d;
+	mock.count++;
+
+	if (dir->nentries == dir->entries_size) {
+		dir->entries_size = dir->entries_size ? dir->entries_size * 2 : 16;
+		dir->entries = xrealloc(dir->entries,
+					dir->entries_size * sizeof(struct dentry *));
+	}
+	d->slot = dir->nentries++;
+	dir->entries[d->slot] = d;
+}
+
+static void dir_remove(struct inode *dir, struct dentry *d)
+{
+	struct dentry **p = &mock.hash[d->hash & (mock.hash_size - 1)];
+
+	while (*p != d) {
+		p = &(*p)->hnext;
+	}
+	*p = d->hnext;
+	mock.count--;
+
+	dir->entries[d->slot] = dir->entries[--dir->nentries];
+	dir->entries[d->slot]->slot = d->slot;
+	free(d);
+}
+
+/* drop name d of ino from dir, and ino with it if that was its last name */
+static void unlink_name(struct inode *dir, struct dentry *d, struct inode *ino)
+{
+	dir_remove(dir, d);
+	if (ino->type == NF3DIR) {
+		dir->nlink--;
+		inode_free(ino);
+		return;
+	}
+	if (--ino->nlink == 0) {
+		inode_free(ino);
+		return;
+	}
+	touch(ino, 0);
+}
+
+static void file_write(struct inode *ino, uint64_t offset, const unsigned char *data,
+		       uint32_t len)
+{
+	uint64_t page, n;
+
+	if (offset + len > ino->size) {
+		ino->size = offset + len;
+	}
+	while (!mock.no_data && len > 0) {
+		page = offset >> MOCK_PAGE_BITS;
+		n = MOCK_PAGE - (offset & (MOCK_PAGE - 1));
+		if (n > len) {
+			n = len;
+		}
+		if (page >= ino->npages) {
+			ino->pages = xrealloc(ino->pages, (page + 1) * sizeof(unsigned char *));
+			memset(&ino->pages[ino->npages], 0,
+			       (page + 1 - ino->npages) * sizeof(unsigned char *));
+			ino->npages = page + 1;
+		}
+		if (ino->pages[page] == NULL) {
+			ino->pages[page] = calloc(1, MOCK_PAGE);
+			if (ino->pages[page] == NULL) {
+				fprintf(stderr, "CALLOC failed to allocate file data\n");
+				exit(10);
+			}
+		}
+		memcpy(&ino->pages[page][offset & (MOCK_PAGE - 1)], data, n);
+		offset += n;
+		data   += n;
+		len    -= n;
+	}
+}
+
+static void file_read(struct inode *ino, uint64_t offset, unsigned char *buf, uint32_t len)
+{
+	uint64_t page, n;
+
+	while (len > 0) {
+		page = offset >> MOCK_PAGE_BITS;
+		n = MOCK_PAGE - (offset & (MOCK_PAGE - 1));
+		if (n > len) {
+			n = len;
+		}
+		if (page < ino->npages && ino->pages[page] != NULL) {
+			memcpy(buf, &ino->pages[page][offset & (MOCK_PAGE - 1)], n);
+		} else {
+			memset(buf, 0, n);
+		}
+		offset += n;
+		buf    += n;
+		len    -= n;
+	}
+}
+
+static void file_truncate(struct inode *ino, uint64_t size)
+{
+	uint64_t keep = (size + MOCK_PAGE - 1) >> MOCK_PAGE_BITS;
+	uint64_t i;
+
+	for (i = keep; i < ino->npages; i++) {
+		free(ino->pages[i]);
+	}
+	if (keep < ino->npages) {
+		ino->npages = keep;
+	}
+	if ((size & (MOCK_PAGE - 1)) && keep > 0 && keep <= ino->npages &&
+	    ino->pages[keep - 1] != NULL) {
+		memset(&ino->pages[keep - 1][size & (MOCK_PAGE - 1)], 0,
+		       MOCK_PAGE - (size & (MOCK_PAGE - 1)));
+	}
+	ino->size = size;
+}
+
+/* the object of a handle, with status NFS3_OK, or NULL */
+static struct inode *xdr_inode(struct xdr *x, int *status)
+{
+	const unsigned char *p;
+	struct inode *ino;
+	uint32_t len;
+	uint64_t fileid;
+
+	p = xdr_opaque(x, 1024, &len);
+	if (p == NULL || len != MOCK_FH_LEN || get_be32(p) != MOCK_FH_MAGIC) {
+		*status = NFS3ERR_BADHANDLE;
+		return NULL;
+	}
+	fileid = ((uint64_t)get_be32(p + 4) << 32) | get_be32(p + 8);
+	ino = inode_get(fileid);
+	*status = ino != NULL ? NFS3_OK : NFS3ERR_STALE;
+	return ino;
+}
+
+/* a directory and a name in it, with status NFS3_OK, or NULL */
+static struct inode *xdr_dirop(struct xdr *x, char *name, int *status)
+{
+	struct inode *dir = xdr_inode(x, status);
+	uint32_t len = xdr_string(x, name, NFS3_MAXPATHLEN);
+
+	if (dir == NULL) {
+		return NULL;
+	}
+	if (dir->type != NF3DIR) {
+		*status = NFS3ERR_NOTDIR;
+	} else if (len > NFS3_MAXNAMLEN) {
+		*status = NFS3ERR_NAMETOOLONG;
+	} else if (len == 0) {
+		*status = NFS3ERR_NOENT;
+	}
+	return dir;
+}
+
+static void xdr_sattr(struct xdr *x, struct sattr *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->set_mode = xdr_u32(x);
+	if (s->set_mode) {
+		s->mode = xdr_u32(x);
+	}
+	s->set_uid = xdr_u32(x);
+	if (s->set_uid) {
+		s->uid = xdr_u32(x);
+	}
+	s->set_gid = xdr_u32(x);
+	if (s->set_gid) {
+		s->gid = xdr_u32(x);
+	}
+	s->set_size = xdr_u32(x);
+	if (s->set_size) {
+		s->size = xdr_u64(x);
+	}
+	s->set_atime = xdr_u32(x);
+	if (s->set_atime == 2) {
+		xdr_time(x, &s->atime);
+	}
+	s->set_mtime = xdr_u32(x);
+	if (s->set_mtime == 2) {
+		xdr_time(x, &s->mtime);
+	}
+}
+
+static int apply_sattr(struct inode *ino, const struct sattr *s)
+{
+	if (s->set_size) {
+		if (ino->type == NF3DIR) {
+			return NFS3ERR_ISDIR;
+		}
+		if (ino->type != NF3REG) {
+			return NFS3ERR_INVAL;
+		}
+		if (s->size > MOCK_MAX_SIZE) {
+			return NFS3ERR_FBIG;
+		}
+	}
+	if (s->set_mode) {
+		ino->mode = s->mode & 07777;
+	}
+	if (s->set_uid) {
+		ino->uid = s->uid;
+	}
+	if (s->set_gid) {
+		ino->gid = s->gid;
+	}
+	touch(ino, 0);
+	if (s->set_size && s->size != ino->size) {
+		file_truncate(ino, s->size);
+		ino->mtime = ino->ctime;
+	}
+	if (s->set_atime) {
+		ino->atime = s->set_atime == 2 ? s->atime : ino->ctime;
+	}
+	if (s->set_mtime) {
+		ino->mtime = s->set_mtime == 2 ? s->mtime : ino->ctime;
+	}
+	return NFS3_OK;
+}
+
+static void put_fattr(struct out *o, const struct inode *ino)
+{
+	uint64_t size = ino->size;
+
+	if (ino->type == NF3DIR) {
+		size = 4096;
+	}
+	put_u32(o, ino->type);
+	put_u32(o, ino->mode);
+	put_u32(o, ino->nlink);
+	put_u32(o, ino->uid);
+	put_u32(o, ino->gid);
+	put_u64(o, size);
+	put_u64(o, (size + 4095) & ~4095ULL);	/* used */
+	put_u32(o, 0);				/* rdev */
+	put_u32(o, 0);
+	put_u64(o, 1);				/* fsid */
+	put_u64(o, ino->fileid);
+	put_time(o, &ino->atime);
+	put_time(o, &ino->mtime);
+	put_time(o, &ino->ctime);
+}
+
+static void put_attr(struct out *o, const struct inode *ino)
+{
+	put_u32(o, ino != NULL);
+	if (ino != NULL) {
+		put_fattr(o, ino);
+	}
+}
+
+static void put_fh(struct out *o, const struct inode *ino)
+{
+	put_u32(o, MOCK_FH_LEN);
+	put_u32(o, MOCK_FH_MAGIC);
+	put_u64(o, ino->fileid);
+}
+
+static void wcc_before(struct wcc *w, const struct inode *ino)
+{
+	w->valid = ino != NULL;
+	if (ino != NULL) {
+		w->size  = ino->type == NF3DIR ? 4096 : ino->size;
+		w->mtime = ino->mtime;
+		w->ctime = ino->ctime;
+	}
+}
+
+static void put_wcc(struct out *o, const struct wcc *w, const struct inode *ino)
+{
+	put_u32(o, w->valid);
+	if (w->valid) {
+		put_u64(o, w->size);
+		put_time(o, &w->mtime);
+		put_time(o, &w->ctime);
+	}
+	put_attr(o, ino);
+}
+
+/*
+ * NFS3 calls. Each decodes its arguments from x and encodes its result
+ * to o, and returns -1 if the arguments could not be decoded.
+ */
+static int rpc_null(struct xdr *x, struct out *o)
+{
+	(void)x;
+	(void)o;
+	return 0;
+}
+
+static int nfs3_getattr(struct xdr *x, struct out *o)
+{
+	struct inode *ino;
+	int status;
+
+	ino = xdr_inode(x, &status);
+	if (x->err) {
+		return -1;
+	}
+	put_u32(o, status);
+	if (status == NFS3_OK) {
+		put_fattr(o, ino);
+	}
+	return 0;
+}
+
+static int nfs3_setattr(struct xdr *x, struct out *o)
+{
+	struct timespec guard;
+	struct inode *ino;
+	struct sattr s;
+	struct wcc w;
+	int status, check;
+
+	ino = xdr_inode(x, &status);
+	xdr_sattr(x, &s);
+	check = xdr_u32(x);
+	if (check) {
+		xdr_time(x, &guard);
+	}
+	if (x->err) {
+		return -1;
+	}
+
+	wcc_before(&w, ino);
+	if (status == NFS3_OK && check &&
+	    (guard.tv_sec != ino->ctime.tv_sec || guard.tv_nsec != ino->ctime.tv_nsec)) {
+		status = NFS3ERR_NOT_SYNC;
+	}
+	if (status == NFS3_OK) {
+		status = apply_sattr(ino, &s);
+	}
+	put_u32(o, status);
+	put_wcc(o, &w, ino);
+	return 0;
+}
+
+static int nfs3_lookup(struct xdr *x, struct out *o)
+{
+	char name[NFS3_MAXPATHLEN + 1];
+	struct inode *dir, *ino = NULL;
+	struct dentry *d;
+	int status;
+
+	dir = xdr_dirop(x, name, &status);
+	if (x->err) {
+		return -1;
+	}
+	if (status == NFS3_OK) {
+		if (!strcmp(name, ".")) {
+			ino = dir;
+		} else if (!strcmp(name, "..")) {
+			ino = inode_get(dir->parent);
+		} else if ((d = dir_lookup(dir, name)) != NULL) {
+			ino = inode_get(d->ino);
+		}
+		if (ino == NULL) {
+			status = NFS3ERR_NOENT;
+		}
+	}
+	put_u32(o, status);
+	if (status == NFS3_OK) {
+		put_fh(o, ino);
+		put_attr(o, ino);
+	}
+	put_attr(o, dir);
+	return 0;
+}
+
+static int nfs3_access(struct xdr *x, struct out *o)
+{
+	struct inode *ino;
+	uint32_t access;
+	int status;
+
+	ino = xdr_inode(x, &status);
+	access = xdr_u32(x);
+	if (x->err) {
+		return -1;
+	}
+	put_u32(o, status);
+	put_attr(o, ino);
+	if (status == NFS3_OK) {
+		/* READ LOOKUP MODIFY EXTEND DELETE, or READ MODIFY EXTEND EXECUTE */
+		put_u32(o, access & (ino->type == NF3DIR ? 0x1f : 0x2d));
+	}
+	return 0;
+}
+
+static int nfs3_readlink(struct xdr *x, struct out *o)
+{
+	struct inode *ino;
+	int status;
+
+	ino = xdr_inode(x, &status);
+	if (x->err) {
+		return -1;
+	}
+	if (status == NFS3_OK && ino->type != NF3LNK) {
+		status = NFS3ERR_INVAL;
+	}
+	put_u32(o, status);
+	put_attr(o, ino);
+	if (status == NFS3_OK) {
+		put_string(o, ino->target);
+	}
+	return 0;
+}
+
+static int nfs3_read(struct xdr *x, struct out *o)
+{
+	struct inode *ino;
+	uint64_t offset;
+	uint32_t count;
+	unsigned char *p;
+	int status;
+
+	ino    = xdr_inode(x, &status);
+	offset = xdr_u64(x);
+	count  = xdr_u32(x);
+	if (x->err) {
+		return -1;
+	}
+	if (status == NFS3_OK && ino->type != NF3REG) {
+		status = ino->type == NF3DIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+	}
+	put_u32(o, status);
+	put_attr(o, ino);
+	if (status != NFS3_OK) {
+		return 0;
+	}
+
+	if (count > mock.tmax) {
+		count = mock.tmax;
+	}
+	if (offset >= ino->size) {
+		count = 0;
+	} else if (count > ino->size - offset) {
+		count = ino->size - offset;
+	}
+	put_u32(o, count);
+	put_u32(o, offset + count >= ino->size);
+	put_u32(o, count);
+	p = out_space(o, (count + 3) & ~3);
+	file_read(ino, offset, p, count);
+	memset(p + count, 0, ((count + 3) & ~3) - count);
+	return 0;
+}
+
+static int nfs3_write(struct xdr *x, struct out *o)
+{
+	const unsigned char *data;
+	struct inode *ino;
+	uint64_t offset;
+	uint32_t count, len;
+	struct wcc w;
+	int status;
+
+	ino    = xdr_inode(x, &status);
+	offset = xdr_u64(x);
+	count  = xdr_u32(x);
+	xdr_u32(x);			/* stable, everything is FILE_SYNC here */
+	data   = xdr_opaque(x, MSG_MAX, &len);
+	if (x->err) {
+		return -1;
+	}
+	if (count > len) {
+		count = len;
+	}
+
+	wcc_before(&w, ino);
+	if (status == NFS3_OK && ino->type != NF3REG) {
+		status = ino->type == NF3DIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+	}
+	if (status == NFS3_OK &&
+	    (offset > MOCK_MAX_SIZE || count > MOCK_MAX_SIZE - offset)) {
+		status = NFS3ERR_FBIG;
+	}
+	if (status == NFS3_OK) {
+		file_write(ino, offset, data, count);
+		touch(ino, 1);
+	}
+	put_u32(o, status);
+	put_wcc(o, &w, ino);
+	if (status == NFS3_OK) {
+		put_u32(o, count);
+		put_u32(o, 2);		/* FILE_SYNC */
+		put_bytes(o, mock.verf, 8);
+	}
+	return 0;
+}
+
+/* the reply of CREATE, MKDIR and SYMLINK */
+static void put_created(struct out *o, int status, const struct inode *ino,
+			const struct wcc *w, const struct inode *dir)
+{
+	put_u32(o, status);
+	if (status == NFS3_OK) {
+		put_u32(o, 1);
+		put_fh(o, ino);
+		put_attr(o, ino);
+	}
+	put_wcc(o, w, dir);
+}
+
+static int nfs3_create(struct xdr *x, struct out *o)
+{
+	char name[NFS3_MAXPATHLEN + 1];
+	const unsigned char *verf = NULL;
+	struct inode *dir, *ino = NULL;
+	struct dentry *d;
+	struct sattr s;
+	struct wcc w;
+	uint32_t how;
+	int status;
+
+	dir = xdr_dirop(x, name, &status);
+	how = xdr_u32(x);
+	memset(&s, 0, sizeof(s));
+	if (how == 2) {
+		verf = xdr_fixed(x, 8);
+	} else {
+		xdr_sattr(x, &s);
+	}
+	if (x->err) {
+		return -1;
+	}
+
+	wcc_before(&w, dir);
+	if (status == NFS3_OK && (d = dir_lookup(dir, name)) != NULL) {
+		ino = inode_get(d->ino);
+		if (how == 1 || ino->type != NF3REG ||
+		    (how == 2 && memcmp(ino->verf, verf, 8) != 0)) {
+			status = NFS3ERR_EXIST;
+		} else if (how == 0) {
+			status = apply_sattr(ino, &s);
+		}
+	} else if (status == NFS3_OK) {
+		ino = inode_new(NF3REG, 0644);
+		if (verf != NULL) {
+			memcpy(ino->verf, verf, 8);
+		}
+		apply_sattr(ino, &s);
+		dir_add(dir, name, ino);
+		touch(dir, 1);
+	}
+	put_created(o, status, ino, &w, dir);
+	return 0;
+}
+
+static int nfs3_mkdir(struct xdr *x, struct out *o)
+{
+	char name[NFS3_MAXPATHLEN + 1];
+	struct inode *dir, *ino = NULL;
+	struct sattr s;
+	struct wcc w;
+	int status;
+
+	dir = xdr_dirop(x, name, &status);
+	xdr_sattr(x, &s);
+	if (x->err) {
+		return -1;
+	}
+
+	wcc_before(&w, dir);
+	if (status == NFS3_OK && dir_lookup(dir, name) != NULL) {
+		status = NFS3ERR_EXIST;
+	}
+	if (status == NFS3_OK) {
+		s.set_size = 0;
+		ino = inode_new(NF3DIR, 0755);
+		ino->nlink  = 2;
+		ino->parent = dir->fileid;
+		apply_sattr(ino, &s);
+		dir_add(dir, name, ino);
+		dir->nlink++;
+		touch(dir, 1);
+	}
+	put_created(o, status, ino, &w, dir);
+	return 0;
+}
+
+static int nfs3_symlink(struct xdr *x, struct out *o)
+{
+	char name[NFS3_MAXPATHLEN + 1], target[NFS3_MAXPATHLEN + 1];
+	struct inode *dir, *ino = NULL;
+	struct sattr s;
+	struct wcc w;
+	int status;
+
+	dir = xdr_dirop(x, name, &status);
+	xdr_sattr(x, &s);
+	xdr_string(x, target, NFS3_MAXPATHLEN);
+	if (x->err) {
+		return -1;
+	}
+
+	wcc_before(&w, dir);
+	if (status == NFS3_OK && dir_lookup(dir, name) != NULL) {
+		status = NFS3ERR_EXIST;
+	}
+	if (status == NFS3_OK) {
+		s.set_size = 0;
+		ino = inode_new(NF3LNK, 0777);
+		ino->target = strdup(target);
+		if (ino->target == NULL) {
+			fprintf(stderr, "STRDUP failed to allocate a symlink\n");
+			exit(10);
+		}
+		ino->size = strlen(target);
+		apply_sattr(ino, &s);
+		dir_add(dir, name, ino);
+		touch(dir, 1);
+	}
+	put_created(o, status, ino, &w, dir);
+	return 0;
+}
+
+static int nfs3_mknod(struct xdr *x, struct out *o)
+{
+	(void)x;
+	put_u32(o, NFS3ERR_NOTSUPP);
+	put_u32(o, 0);			/* dir_wcc */
+	put_u32(o, 0);
+	return 0;
+}
+
+/* REMOVE and RMDIR */
+static int remove_name(struct xdr *x, struct out *o, int rmdir)
+{
+	char name[NFS3_MAXPATHLEN + 1];
+	struct inode *dir, *ino = NULL;
+	struct dentry *d = NULL;
+	struct wcc w;
+	int status;
+
+	dir = xdr_dirop(x, name, &status);
+	if (x->err) {
+		return -1;
+	}
+
+	wcc_before(&w, dir);
+	if (status == NFS3_OK) {
+		d = dir_lookup(dir, name);
+		if (d == NULL) {
+			status = !strcmp(name, ".") || !strcmp(name, "..") ?
+				NFS3ERR_INVAL : NFS3ERR_NOENT;
+		} else {
+			ino = inode_get(d->ino);
+		}
+	}
+	if (status == NFS3_OK) {
+		if (rmdir && ino->type != NF3DIR) {
+			status = NFS3ERR_NOTDIR;
+		} else if (!rmdir && ino->type == NF3DIR) {
+			status = NFS3ERR_ISDIR;
+		} else if (rmdir && ino->nentries > 0) {
+			status = NFS3ERR_NOTEMPTY;
+		}
+	}
+	if (status == NFS3_OK) {
+		unlink_name(dir, d, ino);
+		touch(dir, 1);
+	}
+	put_u32(o, status);
+	put_wcc(o, &w, dir);
+	return 0;
+}
+
+static int nfs3_remove(struct xdr *x, struct out *o)
+{
+	return remove_name(x, o, 0);
+}
+
+static int nfs3_rmdir(struct xdr *x, struct out *o)
+{
+	return remove_name(x, o, 1);
+}
+
+static int nfs3_rename(struct xdr *x, struct out *o)
+{
+	char from_name[NFS3_MAXPATHLEN + 1], to_name[NFS3_MAXPATHLEN + 1];
+	struct inode *from, *to, *ino = NULL, *old = NULL, *p;
+	struct dentry *src = NULL, *dst = NULL;
+	struct wcc from_w, to_w;
+	int status, to_status;
+
+	from = xdr_dirop(x, from_name, &status);
+	to   = xdr_dirop(x, to_name, &to_status);
+	if (x->err) {
+		return -1;
+	}
+	if (status == NFS3_OK) {
+		status = to_status;
+	}
+
+	wcc_before(&from_w, from);
+	wcc_before(&to_w, to);
+	if (status == NFS3_OK) {
+		src = dir_lookup(from, from_name);
+		if (src == NULL) {
+			status = NFS3ERR_NOENT;
+		} else {
+			ino = inode_get(src->ino);
+			dst = dir_lookup(to, to_name);
+		}
+	}
+	if (status == NFS3_OK && dst != NULL) {
+		old = inode_get(dst->ino);
+		if (old == ino) {
+			goto done;
+		}
+		if (ino->type == NF3DIR && old->type != NF3DIR) {
+			status = NFS3ERR_NOTDIR;
+		} else if (ino->type != NF3DIR && old->type == NF3DIR) {
+			status = NFS3ERR_ISDIR;
+		} else if (old->type == NF3DIR && old->nentries > 0) {
+			status = NFS3ERR_NOTEMPTY;
+		}
+	}
+	/* a directory cannot go below itself */
+	for (p = to; status == NFS3_OK && ino->type == NF3DIR; p = inode_get(p->parent)) {
+		if (p == ino) {
+			status = NFS3ERR_INVAL;
+		}
+		if (p->fileid == p->parent) {
+			break;
+		}
+	}
+	if (status == NFS3_OK) {
+		if (dst != NULL) {
+			unlink_name(to, dst, old);
+		}
+		dir_remove(from, src);
+		dir_add(to, to_name, ino);
+		if (ino->type == NF3DIR && from != to) {
+			from->nlink--;
+			to->nlink++;
+			ino->parent = to->fileid;
+		}
+		touch(ino, 0);
+		touch(from, 1);
+		touch(to, 1);
+	}
+
+done:
+	put_u32(o, status);
+	put_wcc(o, &from_w, from);
+	put_wcc(o, &to_w, to);
+	return 0;
+}
+
+static int nfs3_link(struct xdr *x, struct out *o)
+{
+	char name[NFS3_MAXPATHLEN + 1];
+	struct inode *ino, *dir;
+	struct wcc w;
+	int status, dir_status;
+
+	ino = xdr_inode(x, &status);
+	dir = xdr_dirop(x, name, &dir_status);
+	if (x->err) {
+		return -1;
+	}
+	if (status == NFS3_OK) {
+		status = dir_status;
+	}
+
+	wcc_before(&w, dir);
+	if (status == NFS3_OK && ino->type == NF3DIR) {
+		status = NFS3ERR_ISDIR;
+	}
+	if (status == NFS3_OK && dir_lookup(dir, name) != NULL) {
+		status = NFS3ERR_EXIST;
+	}
+	if (status == NFS3_OK) {
+		dir_add(dir, name, ino);
+		ino->nlink++;
+		touch(ino, 0);
+		touch(dir, 1);
+	}
+	put_u32(o, status);
+	put_attr(o, ino);
+	put_wcc(o, &w, dir);
+	return 0;
+}
+
+static int nfs3_readdir(struct xdr *x, struct out *o)
+{
+	(void)x;
+	put_u32(o, NFS3ERR_NOTSUPP);
+	put_u32(o, 0);			/* dir_attributes */
+	return 0;
+}
+
+static int nfs3_readdirplus(struct xdr *x, struct out *o)
+{
+	struct inode *dir, *ino;
+	uint64_t cookie, pos, end;
+	uint32_t dircount, maxcount, used = 0;
+	const char *name;
+	size_t start, reply, mark;
+	int status;
+
+	dir      = xdr_inode(x, &status);
+	cookie   = xdr_u64(x);
+	xdr_fixed(x, 8);		/* cookieverf, cookies stay valid here */
+	dircount = xdr_u32(x);
+	maxcount = xdr_u32(x);
+	if (x->err) {
+		return -1;
+	}
+	if (status == NFS3_OK && dir->type != NF3DIR) {
+		status = NFS3ERR_NOTDIR;
+	}
+	reply = o->len;
+	put_u32(o, status);
+	put_attr(o, dir);
+	if (status != NFS3_OK) {
+		return 0;
+	}
+	put_u64(o, 0);			/* cookieverf */
+
+	/* entry pos has cookie pos + 1: ".", "..", then the entries */
+	start = o->len;
+	end = dir->nentries + 2;
+	for (pos = cookie; pos < end; pos++) {
+		if (pos == 0) {
+			name = ".";
+			ino  = dir;
+		} else if (pos == 1) {
+			name = "..";
+			ino  = inode_get(dir->parent);
+		} else {
+			name = dir->entries[pos - 2]->name;
+			ino  = inode_get(dir->entries[pos - 2]->ino);
+		}
+		used += 8 + 4 + ((strlen(name) + 3) & ~3) + 8;
+
+		mark = o->len;
+		put_u32(o, 1);
+		put_u64(o, ino->fileid);
+		put_string(o, name);
+		put_u64(o, pos + 1);
+		put_attr(o, ino);
+		put_u32(o, 1);
+		put_fh(o, ino);
+		if (used > dircount || o->len - start + 8 > maxcount) {
+			o->len = mark;
+			break;
+		}
+	}
+	if (pos == cookie && pos < end) {
+		o->len = reply;
+		put_u32(o, NFS3ERR_TOOSMALL);
+		put_attr(o, dir);
+		return 0;
+	}
+	put_u32(o, 0);
+	put_u32(o, pos >= end);
+	return 0;
+}
+
+static int nfs3_fsstat(struct xdr *x, struct out *o)
+{
+	struct inode *ino;
+	int status;
+
+	ino = xdr_inode(x, &status);
+	if (x->err) {
+		return -1;
+	}
+	put_u32(o, status);
+	put_attr(o, ino);
+	if (status == NFS3_OK) {
+		put_u64(o, MOCK_MAX_SIZE);		/* tbytes */
+		put_u64(o, MOCK_MAX_SIZE);		/* fbytes */
+		put_u64(o, MOCK_MAX_SIZE);		/* abytes */
+		put_u64(o, 1ULL << 32);			/* tfiles */
+		put_u64(o, (1ULL << 32) - mock.count);	/* ffiles */
+		put_u64(o, (1ULL << 32) - mock.count);	/* afiles */
+		put_u32(o, 0);				/* invarsec */
+	}
+	return 0;
+}
+
+static int nfs3_fsinfo(struct xdr *x, struct out *o)
+{
+	struct inode *ino;
+	int status;
+
+	ino = xdr_inode(x, &status);
+	if (x->err) {
+		return -1;
+	}
+	put_u32(o, status);
+	put_attr(o, ino);
+	if (status == NFS3_OK) {
+		put_u32(o, mock.tmax);		/* rtmax */
+		put_u32(o, mock.tmax);		/* rtpref */
+		put_u32(o, 4096);		/* rtmult */
+		put_u32(o, mock.tmax);		/* wtmax */
+		put_u32(o, mock.tmax);		/* wtpref */
+		put_u32(o, 4096);		/* wtmult */
+		put_u32(o, 65536);		/* dtpref */
+		put_u64(o, MOCK_MAX_SIZE);	/* maxfilesize */
+		put_u32(o, 0);			/* time_delta */
+		put_u32(o, 1);
+		put_u32(o, 0x1b);		/* LINK SYMLINK HOMOGENEOUS CANSETTIME */
+	}
+	return 0;
+}
+
+static int nfs3_pathconf(struct xdr *x, struct out *o)
+{
+	struct inode *ino;
+	int status;
+
+	ino = xdr_inode(x, &status);
+	if (x->err) {
+		return -1;
+	}
+	put_u32(o, status);
+	put_attr(o, ino);
+	if (status == NFS3_OK) {
+		put_u32(o, 32000);		/* linkmax */
+		put_u32(o, NFS3_MAXNAMLEN);	/* name_max */
+		put_u32(o, 1);			/* no_trunc */
+		put_u32(o, 1);			/* chown_restricted */
+		put_u32(o, 0);			/* case_insensitive */
+		put_u32(o, 1);			/* case_preserving */
+	}
+	return 0;
+}
+
+static int nfs3_commit(struct xdr *x, struct out *o)
+{
+	struct inode *ino;
+	struct wcc w;
+	int status;
+
+	ino = xdr_inode(x, &status);
+	xdr_u64(x);			/* offset */
+	xdr_u32(x);			/* count */
+	if (x->err) {
+		return -1;
+	}
+	wcc_before(&w, ino);
+	put_u32(o, status);
+	put_wcc(o, &w, ino);
+	if (status == NFS3_OK) {
+		put_bytes(o, mock.verf, 8);
+	}
+	return 0;
+}
+
+/* MOUNT3 calls, every path mounts the one namespace there is */
+static int mount3_mnt(struct xdr *x, struct out *o)
+{
+	char path[NFS3_MAXPATHLEN + 1];
+
+	xdr_string(x, path, NFS3_MAXPATHLEN);
+	if (x->err) {
+		return -1;
+	}
+	put_u32(o, 0);			/* MNT3_OK */
+	put_fh(o, inode_get(1));
+	put_u32(o, 1);			/* auth_flavors: AUTH_UNIX */
+	put_u32(o, 1);
+	return 0;
+}
+
+static int mount3_dump(struct xdr *x, struct out *o)
+{
+	(void)x;
+	put_u32(o, 0);
+	return 0;
+}
+
+static int mount3_umnt(struct xdr *x, struct out *o)
+{
+	char path[NFS3_MAXPATHLEN + 1];
+
+	(void)o;
+	xdr_string(x, path, NFS3_MAXPATHLEN);
+	return x->err ? -1 : 0;
+}
+
+static int mount3_export(struct xdr *x, struct out *o)
+{
+	(void)x;
+	put_u32(o, 1);
+	put_string(o, "/");
+	put_u32(o, 0);			/* groups */
+	put_u32(o, 0);
+	return 0;
+}
+
+/* the portmapper knows of nothing but what is here */
+static int known_program(uint32_t prog, uint32_t vers)
+{
+	return (prog == PROG_PMAP && vers >= 2 && vers <= 4) ||
+	       (prog == PROG_NFS && vers == 3) ||
+	       (prog == PROG_MOUNT && vers >= 1 && vers <= 3) ||
+	       (prog == PROG_NLM && vers == 4);
+}
+
+static int pmap2_getport(struct xdr *x, struct out *o)
+{
+	uint32_t prog, vers;
+
+	prog = xdr_u32(x);
+	vers = xdr_u32(x);
+	xdr_u32(x);			/* prot */
+	xdr_u32(x);			/* port */
+	if (x->err) {
+		return -1;
+	}
+	put_u32(o, known_program(prog, vers) ? mock.port : 0);
+	return 0;
+}
+
+static int rpcb_getaddr(struct xdr *x, struct out *o)
+{
+	char netid[256], addr[256], owner[256], uaddr[INET_ADDRSTRLEN + 16];
+	uint32_t prog, vers;
+
+	prog = xdr_u32(x);
+	vers = xdr_u32(x);
+	xdr_string(x, netid, 255);
+	xdr_string(x, addr, 255);
+	xdr_string(x, owner, 255);
+	if (x->err) {
+		return -1;
+	}
+	if (!known_program(prog, vers) || strcmp(netid, "tcp") != 0) {
+		put_string(o, "");
+		return 0;
+	}
+	snprintf(uaddr, sizeof(uaddr), "%s.%d.%d", mock.address,
+		 mock.port >> 8, mock.port & 0xff);
+	put_string(o, uaddr);
+	return 0;
+}
+
+/*
+ * NLM4 calls. Owners are told by svid and owner handle, and a lock is
+ * denied rather than blocked on.
+ */
+struct nlm_lock {
+	struct lock lock;
+	struct inode *ino;
+	int status;
+};
+
+static void xdr_nlm_lock(struct xdr *x, struct nlm_lock *l, int exclusive)
+{
+	char caller[NFS3_MAXPATHLEN + 1];
+	const unsigned char *oh;
+	struct xdr fh;
+	uint32_t len;
+	uint64_t offset, count;
+
+	memset(l, 0, sizeof(*l));
+	xdr_string(x, caller, NFS3_MAXPATHLEN);
+	fh.p   = x->p;
+	fh.end = x->end;
+	fh.err = 0;
+	xdr_opaque(x, 1024, &len);
+	l->ino = xdr_inode(&fh, &l->status);
+	oh = xdr_opaque(x, 1024, &len);
+	l->lock.svid = xdr_u32(x);
+	offset = xdr_u64(x);
+	count  = xdr_u64(x);
+	if (x->err) {
+		return;
+	}
+	l->lock.oh_len = len < NLM_OH_MAX ? len : NLM_OH_MAX;
+	memcpy(l->lock.oh, oh, l->lock.oh_len);
+	l->lock.start = offset;
+	l->lock.end   = count == 0 || offset + count < offset ? UINT64_MAX : offset + count;
+	l->lock.exclusive = exclusive;
+	l->status = l->status == NFS3_OK ? NLM4_GRANTED : NLM4_STALE_FH;
+}
+
+static int same_owner(const struct lock *a, const struct lock *b)
+{
+	return a->svid == b->svid && a->oh_len == b->oh_len &&
+	       memcmp(a->oh, b->oh, a->oh_len) == 0;
+}
+
+static struct lock *lock_conflict(const struct inode *ino, const struct lock *l)
+{
+	struct lock *k;
+
+	for (k = ino->locks; k != NULL; k = k->next) {
+		if (k->start < l->end && l->start < k->end &&
+		    (k->exclusive || l->exclusive) && !same_owner(k, l)) {
+			return k;
+		}
+	}
+	return NULL;
+}
+
+/* the owner of l lets go of what it holds in the range of l */
+static void lock_release(struct inode *ino, const struct lock *l)
+{
+	struct lock **p = &ino->locks, *k, *right;
+
+	while ((k = *p) != NULL) {
+		if (!same_owner(k, l) || k->end <= l->start || l->end <= k->start) {
+			p = &k->next;
+			continue;
+		}
+		if (k->start < l->start && k->end > l->end) {
+			right = xmalloc(sizeof(struct lock));
+			*right = *k;
+			right->start = l->end;
+			k->end = l->start;
+			right->next = k->next;
+			k->next = right;
+			return;
+		}
+		if (k->start < l->start) {
+			k->end = l->start;
+		} else if (k->end > l->end) {
+			k->start = l->end;
+		} else {
+			*p = k->next;
+			free(k);
+			continue;
+		}
+		p = &k->next;
+	}
+}
+
+static void put_cookie(struct out *o, const unsigned char *cookie, uint32_t len)
+{
+	put_opaque(o, cookie, len);
+}
+
+static int nlm4_test(struct xdr *x, struct out *o)
+{
+	const unsigned char *cookie;
+	struct nlm_lock l;
+	struct lock *k = NULL;
+	uint32_t len;
+	int exclusive;
+
+	cookie = xdr_opaque(x, 1024, &len);
+	exclusive = xdr_u32(x);
+	xdr_nlm_lock(x, &l, exclusive);
+	if (x->err) {
+		return -1;
+	}
+	if (l.status == NLM4_GRANTED) {
+		k = lock_conflict(l.ino, &l.lock);
+		if (k != NULL) {
+			l.status = NLM4_DENIED;
+		}
+	}
+	put_cookie(o, cookie, len);
+	put_u32(o, l.status);
+	if (k != NULL) {
+		put_u32(o, k->exclusive);
+		put_u32(o, k->svid);
+		put_opaque(o, k->oh, k->oh_len);
+		put_u64(o, k->start);
+		put_u64(o, k->end == UINT64_MAX ? 0 : k->end - k->start);
+	}
+	return 0;
+}
+
+static int nlm4_lock(struct xdr *x, struct out *o)
+{
+	const unsigned char *cookie;
+	struct nlm_lock l;
+	struct lock *k;
+	uint32_t len;
+	int exclusive;
+
+	cookie = xdr_opaque(x, 1024, &len);
+	xdr_u32(x);			/* block */
+	exclusive = xdr_u32(x);
+	xdr_nlm_lock(x, &l, exclusive);
+	xdr_u32(x);			/* reclaim */
+	xdr_u32(x);			/* state */
+	if (x->err) {
+		return -1;
+	}
+	if (l.status == NLM4_GRANTED && lock_conflict(l.ino, &l.lock) != NULL) {
+		l.status = NLM4_DENIED;
+	}
+	if (l.status == NLM4_GRANTED) {
+		k = xmalloc(sizeof(struct lock));
+		*k = l.lock;
+		k->next = l.ino->locks;
+		l.ino->locks = k;
+	}
+	put_cookie(o, cookie, len);
+	put_u32(o, l.status);
+	return 0;
+}
+
+static int nlm4_cancel(struct xdr *x, struct out *o)
+{
+	const unsigned char *cookie;
+	struct nlm_lock l;
+	uint32_t len;
+
+	cookie = xdr_opaque(x, 1024, &len);
+	xdr_u32(x);			/* block */
+	xdr_nlm_lock(x, &l, xdr_u32(x));
+	if (x->err) {
+		return -1;
+	}
+	put_cookie(o, cookie, len);
+	put_u32(o, NLM4_GRANTED);	/* nothing ever waits */
+	return 0;
+}
+
+static int nlm4_unlock(struct xdr *x, struct out *o)
+{
+	const unsigned char *cookie;
+	struct nlm_lock l;
+	uint32_t len;
+
+	cookie = xdr_opaque(x, 1024, &len);
+	xdr_nlm_lock(x, &l, 0);
+	if (x->err) {
+		return -1;
+	}
+	if (l.status == NLM4_GRANTED) {
+		lock_release(l.ino, &l.lock);
+	}
+	put_cookie(o, cookie, len);
+	put_u32(o, l.status);
+	return 0;
+}
+
+/*
+ * The calls of each program version. write is set for calls that change
+ * the namespace, opcode is the op whose --latency the reply waits for.
+ */
+struct proc {
+	int (*fn)(struct xdr *x, struct out *o);
+	int write;
+	int opcode;
+};
+
+static const struct proc pmap2_procs[] = {
+	[0] = { rpc_null,      0, -1 },
+	[3] = { pmap2_getport, 0, -1 },
+};
+
+static const struct proc rpcb_procs[] = {
+	[0] = { rpc_null,     0, -1 },
+	[3] = { rpcb_getaddr, 0, -1 },
+};
+
+static const struct proc mount3_procs[] = {
+	[0] = { rpc_null,      0, -1 },
+	[1] = { mount3_mnt,    0, -1 },
+	[2] = { mount3_dump,   0, -1 },
+	[3] = { mount3_umnt,   0, -1 },
+	[4] = { rpc_null,      0, -1 },
+	[5] = { mount3_export, 0, -1 },
+};
+
+static const struct proc nfs3_procs[] = {
+	[0]  = { rpc_null,         0, -1 },
+	[1]  = { nfs3_getattr,     0, OP_GETATTR3 },
+	[2]  = { nfs3_setattr,     1, OP_SETATTR3 },
+	[3]  = { nfs3_lookup,      0, OP_LOOKUP3 },
+	[4]  = { nfs3_access,      0, OP_ACCESS3 },
+	[5]  = { nfs3_readlink,    0, OP_READLINK3 },
+	[6]  = { nfs3_read,        0, OP_READ3 },
+	[7]  = { nfs3_write,       1, OP_WRITE3 },
+	[8]  = { nfs3_create,      1, OP_CREATE3 },
+	[9]  = { nfs3_mkdir,       1, OP_MKDIR3 },
+	[10] = { nfs3_symlink,     1, OP_SYMLINK3 },
+	[11] = { nfs3_mknod,       0, -1 },
+	[12] = { nfs3_remove,      1, OP_REMOVE3 },
+	[13] = { nfs3_rmdir,       1, OP_RMDIR3 },
+	[14] = { nfs3_rename,      1, OP_RENAME3 },
+	[15] = { nfs3_link,        1, OP_LINK3 },
+	[16] = { nfs3_readdir,     0, -1 },
+	[17] = { nfs3_readdirplus, 0, OP_READDIRPLUS3 },
+	[18] = { nfs3_fsstat,      0, OP_FSSTAT3 },
+	[19] = { nfs3_fsinfo,      0, OP_FSINFO3 },
+	[20] = { nfs3_pathconf,    0, OP_PATHCONF3 },
+	[21] = { nfs3_commit,      0, OP_COMMIT3 },
+};
+
+static const struct proc nlm4_procs[] = {
+	[0] = { rpc_null,    0, -1 },
+	[1] = { nlm4_test,   0, OP_TEST4 },
+	[2] = { nlm4_lock,   1, OP_LOCK4 },
+	[3] = { nlm4_cancel, 1, -1 },
+	[4] = { nlm4_unlock, 1, OP_UNLOCK4 },
+};
+
+#define PROCS(p) (p), sizeof(p) / sizeof((p)[0])
+
+static const struct program {
+	uint32_t prog, vers;
+	const struct proc *procs;
+	uint32_t nprocs;
+	int delayed;			/* by --latency */
+} programs[] = {
+	{ PROG_PMAP,  2, PROCS(pmap2_procs),  0 },
+	{ PROG_PMAP,  3, PROCS(rpcb_procs),   0 },
+	{ PROG_PMAP,  4, PROCS(rpcb_procs),   0 },
+	{ PROG_MOUNT, 1, PROCS(mount3_procs), 0 },
+	{ PROG_MOUNT, 3, PROCS(mount3_procs), 0 },
+	{ PROG_NFS,   3, PROCS(nfs3_procs),   1 },
+	{ PROG_NLM,   4, PROCS(nlm4_procs),   1 },
+};
+
+#define NPROGRAMS (sizeof(programs) / sizeof(programs[0]))
+
+/* a reply held back until its time */
+struct reply {
+	struct wheel_timer timer;
+	size_t len;
+	unsigned char data[];
+};
+
+struct conn {
+	int fd;
+	uint64_t start;
+	struct wheel wheel;
+	unsigned char *in;
+	size_t in_len, in_size;
+	struct out msg;			/* a call sent in several fragments */
+	struct out out;
+};
+
+static uint64_t clock_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* carry out the call in msg and queue its reply on c */
+static void rpc_call(struct conn *c, const unsigned char *msg, size_t len)
+{
+	struct xdr x = { msg, msg + len, 0 };
+	const struct program *prog = NULL;
+	const struct proc *proc = NULL;
+	uint32_t xid, rpcvers, p, vers, n, auth_len, low = UINT32_MAX, high = 0;
+	size_t start = c->out.len, stat;
+	struct reply *r;
+	uint64_t latency = 0;
+	unsigned i;
+
+	xid = xdr_u32(&x);
+	if (xdr_u32(&x) != 0) {		/* not a CALL */
+		return;
+	}
+	rpcvers = xdr_u32(&x);
+	p       = xdr_u32(&x);
+	vers    = xdr_u32(&x);
+	n       = xdr_u32(&x);
+	xdr_u32(&x);			/* cred */
+	xdr_opaque(&x, 400, &auth_len);
+	xdr_u32(&x);			/* verf */
+	xdr_opaque(&x, 400, &auth_len);
+	if (x.err) {
+		return;
+	}
+
+	put_u32(&c->out, 0);		/* record mark */
+	put_u32(&c->out, xid);
+	put_u32(&c->out, 1);		/* REPLY */
+	if (rpcvers != 2) {
+		put_u32(&c->out, 1);	/* MSG_DENIED */
+		put_u32(&c->out, 0);	/* RPC_MISMATCH */
+		put_u32(&c->out, 2);
+		put_u32(&c->out, 2);
+		goto reply;
+	}
+	put_u32(&c->out, 0);		/* MSG_ACCEPTED */
+	put_u32(&c->out, 0);		/* verf AUTH_NULL */
+	put_u32(&c->out, 0);
+	stat = c->out.len;
+
+	for (i = 0; i < NPROGRAMS; i++) {
+		if (programs[i].prog != p) {
+			continue;
+		}
+		if (programs[i].vers < low) {
+			low = programs[i].vers;
+		}
+		if (programs[i].vers > high) {
+			high = programs[i].vers;
+		}
+		if (programs[i].vers == vers) {
+			prog = &programs[i];
+		}
+	}
+	if (prog != NULL && n < prog->nprocs && prog->procs[n].fn != NULL) {
+		proc = &prog->procs[n];
+	}
+	if (prog == NULL && high == 0) {
+		put_u32(&c->out, 1);	/* PROG_UNAVAIL */
+	} else if (prog == NULL) {
+		put_u32(&c->out, 2);	/* PROG_MISMATCH */
+		put_u32(&c->out, low);
+		put_u32(&c->out, high);
+	} else if (proc == NULL) {
+		put_u32(&c->out, 3);	/* PROC_UNAVAIL */
+	} else {
+		put_u32(&c->out, 0);	/* SUCCESS */
+		if (proc->write) {
+			pthread_rwlock_wrlock(&mock.lock);
+		} else {
+			pthread_rwlock_rdlock(&mock.lock);
+		}
+		if (proc->fn(&x, &c->out) != 0) {
+			c->out.len = stat;
+			put_u32(&c->out, 4);	/* GARBAGE_ARGS */
+		}
+		pthread_rwlock_unlock(&mock.lock);
+		if (prog->delayed) {
+			latency = proc->opcode >= 0 ? mock.latency[proc->opcode] :
+				mock.default_latency;
+		}
+	}
+
+reply:
+	len = c->out.len - start - 4;
+	c->out.data[start]     = 0x80 | (len >> 24);
+	c->out.data[start + 1] = len >> 16;
+	c->out.data[start + 2] = len >> 8;
+	c->out.data[start + 3] = len;
+	if (latency == 0) {
+		return;
+	}
+
+	r = xmalloc(sizeof(struct reply) + len + 4);
+	r->len = len + 4;
+	memcpy(r->data, &c->out.data[start], r->len);
+	c->out.len = start;
+	r->timer.due = clock_usec() - c->start + latency;
+	wheel_add(&c->wheel, &r->timer);
+}
+
+/* carry out the calls that have come in whole */
+static int conn_input(struct conn *c)
+{
+	size_t pos = 0;
+	uint32_t mark, flen;
+
+	while (c->in_len - pos >= 4) {
+		mark = get_be32(&c->in[pos]);
+		flen = mark & 0x7fffffff;
+		if (flen > MSG_MAX || c->msg.len + flen > MSG_MAX) {
+			fprintf(stderr, "RPC record of %u bytes is too large\n", flen);
+			return -1;
+		}
+		if (c->in_len - pos - 4 < flen) {
+			if (flen + 4 > c->in_size) {
+				c->in_size = flen + 4;
+				c->in = xrealloc(c->in, c->in_size);
+			}
+			break;
+		}
+		if ((mark & 0x80000000) && c->msg.len == 0) {
+			rpc_call(c, &c->in[pos + 4], flen);
+		} else {
+			memcpy(out_space(&c->msg, flen), &c->in[pos + 4], flen);
+			if (mark & 0x80000000) {
+				rpc_call(c, c->msg.data, c->msg.len);
+				c->msg.len = 0;
+			}
+		}
+		pos += 4 + flen;
+	}
+	memmove(c->in, &c->in[pos], c->in_len - pos);
+	c->in_len -= pos;
+	return 0;
+}
+
+static int conn_flush(struct conn *c)
+{
+	struct wheel_timer *t;
+	struct reply *r;
+	size_t done = 0;
+	ssize_t n;
+
+	wheel_advance(&c->wheel, clock_usec() - c->start);
+	while ((t = wheel_expire(&c->wheel)) != NULL) {
+		r = (struct reply *)((char *)t - offsetof(struct reply, timer));
+		memcpy(out_space(&c->out, r->len), r->data, r->len);
+		free(r);
+	}
+	while (done < c->out.len) {
+		n = write(c->fd, &c->out.data[done], c->out.len - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		done += n;
+	}
+	c->out.len = 0;
+	return 0;
+}
+
+static void *conn_main(void *private_data)
+{
+	struct conn *c = private_data;
+	struct wheel_timer *t;
+	struct pollfd pfd;
+	struct timespec ts;
+	uint64_t next, now;
+	ssize_t n;
+
+	pfd.fd     = c->fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		next = wheel_next(&c->wheel);
+		if (next != UINT64_MAX) {
+			now  = clock_usec() - c->start;
+			next = next > now ? next - now : 0;
+			ts.tv_sec  = next / 1000000;
+			ts.tv_nsec = (next % 1000000) * 1000;
+		}
+		if (ppoll(&pfd, 1, next != UINT64_MAX ? &ts : NULL, NULL) < 0 &&
+		    errno != EINTR) {
+			break;
+		}
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (c->in_len == c->in_size) {
+				c->in_size *= 2;
+				c->in = xrealloc(c->in, c->in_size);
+			}
+			n = read(c->fd, &c->in[c->in_len], c->in_size - c->in_len);
+			if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+				break;
+			}
+			if (n > 0) {
+				c->in_len += n;
+				if (conn_input(c) != 0) {
+					break;
+				}
+			}
+		}
+		if (conn_flush(c) != 0) {
+			break;
+		}
+	}
+
+	close(c->fd);
+	wheel_advance(&c->wheel, UINT64_MAX - 1);
+	while ((t = wheel_expire(&c->wheel)) != NULL) {
+		free((char *)t - offsetof(struct reply, timer));
+	}
+	free(c->in);
+	free(c->msg.data);
+	free(c->out.data);
+	free(c);
+	return NULL;
+}
+
+/* "100,READ3=500,WRITE3=800": usec for every op, then for some */
+static int parse_latency(const char *spec)
+{
+	char *tmp, *tok, *eq, *end, *save;
+	long long usec;
+	int opcode, i, ret = 0;
+
+	tmp = strdup(spec);
+	if (tmp == NULL) {
+		exit(10);
+	}
+	for (tok = strtok_r(tmp, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		eq = strchr(tok, '=');
+		usec = strtoll(eq != NULL ? eq + 1 : tok, &end, 10);
+		if (*end != 0 || usec < 0) {
+			fprintf(stderr, "Invalid latency %s\n", tok);
+			ret = -1;
+			break;
+		}
+		if (eq == NULL) {
+			mock.default_latency = usec;
+			for (i = 0; i < OP_MAX; i++) {
+				mock.latency[i] = usec;
+			}
+			continue;
+		}
+		opcode = trace_op_lookup(tok, eq - tok);
+		if (opcode < 0 || opcode == OP_DELTREE) {
+			fprintf(stderr, "Unknown operation %.*s\n", (int)(eq - tok), tok);
+			ret = -1;
+			break;
+		}
+		mock.latency[opcode] = usec;
+	}
+	free(tmp);
+	return ret;
+}
+
+static void show_usage(void)
+{
+	printf("usage: nfs-mock-server [OPTIONS]\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	int opt, fd, one = 1;
+	const char *latency = NULL;
+	struct sockaddr_in sin;
+	struct conn *c;
+	struct inode *root;
+	pthread_t thread;
+	pthread_attr_t attr;
+	uint64_t boot;
+	poptContext pc;
+	struct poptOption popt_options[] = {
+		POPT_AUTOHELP
+		{ "address", 'a', POPT_ARG_STRING, &mock.address, 0,
+		  "address to listen on", "ipv4" },
+		{ "port", 'p', POPT_ARG_INT, &mock.port, 0,
+		  "port to listen on, the one the portmapper has", "port" },
+		{ "latency", 'l', POPT_ARG_STRING, &latency, 0,
+		  "hold back replies for usec, and ops given by name for their own usec",
+		  "usec[,OP=usec...]" },
+		{ "tmax", 0, POPT_ARG_INT, &mock.tmax, 0,
+		  "largest READ and WRITE, as FSINFO tells", "bytes" },
+		{ "no-data", 0, POPT_ARG_NONE, &mock.no_data, 0,
+		  "do not keep what is written, READs return zeroes", NULL },
+		POPT_TABLEEND
+	};
+
+	mock.address = "127.0.0.1";
+	mock.port    = 111;
+	mock.tmax    = 1024 * 1024;
+
+	pc = poptGetContext(argv[0], argc, argv, popt_options, 0);
+	while ((opt = poptGetNextOpt(pc)) != -1) {
+		fprintf(stderr, "Invalid option %s: %s\n",
+			poptBadOption(pc, 0), poptStrerror(opt));
+		show_usage();
+		exit(1);
+	}
+	poptFreeContext(pc);
+	if (latency != NULL && parse_latency(latency) != 0) {
+		exit(1);
+	}
+	if (mock.tmax < 4096 || mock.tmax > MSG_MAX / 2) {
+		fprintf(stderr, "--tmax must be between 4096 and %d\n", MSG_MAX / 2);
+		exit(1);
+	}
+
+	pthread_rwlock_init(&mock.lock, NULL);
+	mock.size   = 1024;
+	mock.inodes = calloc(mock.size, sizeof(struct inode *));
+	if (mock.inodes == NULL) {
+		fprintf(stderr, "CALLOC failed to allocate the namespace\n");
+		exit(10);
+	}
+	mock.ninodes = 1;		/* file id 0 is no file */
+	hash_resize();
+	root = inode_new(NF3DIR, 0777);
+	root->nlink  = 2;
+	root->parent = root->fileid;
+	boot = clock_usec();
+	memcpy(mock.verf, &boot, sizeof(mock.verf));
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port   = htons(mock.port);
+	if (inet_pton(AF_INET, mock.address, &sin.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address %s\n", mock.address);
+		exit(1);
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to create a socket. %s\n", strerror(errno));
+		exit(1);
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(fd, 128) != 0) {
+		fprintf(stderr, "Failed to listen on %s:%d. %s\n",
+			mock.address, mock.port, strerror(errno));
+		exit(1);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	printf("Serving on %s:%d\n", mock.address, mock.port);
+	fflush(stdout);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (;;) {
+		int cfd = accept(fd, NULL, NULL);
+
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "Failed to accept a connection. %s\n", strerror(errno));
+			exit(1);
+		}
+		setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		c = xmalloc(sizeof(struct conn));
+		memset(c, 0, sizeof(struct conn));
+		c->fd      = cfd;
+		c->start   = clock_usec();
+		c->in_size = 256 * 1024;
+		c->in      = xmalloc(c->in_size);
+		wheel_init(&c->wheel, 0);
+		if (pthread_create(&thread, &attr, conn_main, c) != 0) {
+			fprintf(stderr, "Failed to start a connection thread\n");
+			exit(10);
+		}
+	}
+
+	return 0;
+}
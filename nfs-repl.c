@@ -1,10 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <time.h>
 #include <inttypes.h>
+#include <popt.h>
 
 #include <nfsc/libnfs.h>
 #include <nfsc/libnfs-raw.h>
@@ -14,133 +16,97 @@
 #include "libnfs-glue.h"
 #include "nfsio.h"
 
-int print_list (struct nfs_context *nfs) {
+#define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 
-    int ret;
-    struct stat st;
-    struct nfsdirent *nfsdirent;
-    struct nfsdir *nfsdir;
+static void show_usage(void)
+{
+    printf ("usage: nfs-repl [OPTIONS] --nfs=nfs://server/export trace\n");
+}
 
-    ret = nfs_opendir (nfs, "/", &nfsdir);
-    if (ret != 0) {
-        printf ("opendir has failed. Error:%s\n", nfs_get_error (nfs));
-	return ret;
+int main (int argc, const char *argv[]) {
+
+    int opt;
+    poptContext pc;
+    struct poptOption popt_options[] = {
+        POPT_AUTOHELP
+        { "nfs", 0, POPT_ARG_STRING, &options.nfs, 0,
+          "nfs url to replay against", "nfs://server/export" },
+        { "nlm", 0, POPT_ARG_NONE, &options.nlm, 0,
+          "connect to NLM, needed for LOCK4/UNLOCK4/TEST4", NULL },
+        { "handles", 0, POPT_ARG_NONE, &options.handles, 0,
+          "map traced file handles to live ones instead of resolving paths", NULL },
+        { "handle-cache", 0, POPT_ARG_STRING, &options.handle_cache, 0,
+          "start with the handles saved in this file, and save them there at exit", "file" },
+        { "handle-cache-mem", 0, POPT_ARG_INT, &options.handle_cache_mem, 0,
+          "evict handles to keep the handle cache within this size (default: unlimited)", "MB" },
+        { "negative-cache", 0, POPT_ARG_NONE, &options.negative_cache, 0,
+          "remember the names LOOKUP did not find, as a client would, instead of asking again", NULL },
+        { "attr-cache", 0, POPT_ARG_NONE, &options.attr_cache, 0,
+          "answer GETATTR, ACCESS and LOOKUP from the attributes a client would have cached", NULL },
+        { "acregmin", 0, POPT_ARG_INT, &options.acregmin, 0,
+          "with --attr-cache, least time file attributes are cached (default: 3)", "seconds" },
+        { "acregmax", 0, POPT_ARG_INT, &options.acregmax, 0,
+          "with --attr-cache, most time file attributes are cached (default: 60)", "seconds" },
+        { "acdirmin", 0, POPT_ARG_INT, &options.acdirmin, 0,
+          "with --attr-cache, least time directory attributes are cached (default: 30)", "seconds" },
+        { "acdirmax", 0, POPT_ARG_INT, &options.acdirmax, 0,
+          "with --attr-cache, most time directory attributes are cached (default: 60)", "seconds" },
+        { "verify", 0, POPT_ARG_NONE, &options.verify, 0,
+          "check the data READs return against what the replay wrote", NULL },
+        { "payload-seed", 0, POPT_ARG_INT, &options.payload_seed, 0,
+          "seed of the data WRITEs send", "integer" },
+        { "compress-ratio", 0, POPT_ARG_DOUBLE, &options.compress_ratio, 0,
+          "make the data WRITEs send compress this much (default: 1, incompressible)", "ratio" },
+        { "dedupe-ratio", 0, POPT_ARG_DOUBLE, &options.dedupe_ratio, 0,
+          "make the data WRITEs send dedupe this much (default: 1, all unique)", "ratio" },
+        { "machine-readable", 0, POPT_ARG_NONE, &options.machine_readable, 0,
+          "report the results in lines for scripts to parse", NULL },
+        { "live", 0, POPT_ARG_NONE, &options.live, 0,
+          "print the throughput and latencies of every second of the replay", NULL },
+        { "timeline", 0, POPT_ARG_STRING, &options.timeline, 0,
+          "write the throughput and latencies of every second to this file, CSV or JSON if it ends in .json", "file" },
+        { "fidelity", 0, POPT_ARG_NONE, &options.fidelity, 0,
+          "compare the pace, latencies and concurrency of the replay with those of the trace", NULL },
+        { "oplog", 0, POPT_ARG_STRING, &options.oplog, 0,
+          "log every completed op to this file, read it with nfs-oplog-dump", "file" },
+        { "nprocs", 'n', POPT_ARG_INT, &options.nprocs, 0,
+          "number of worker threads, each with its own connection", "integer" },
+        { "queue-depth", 'q', POPT_ARG_INT, &options.queue_depth, 0,
+          "number of calls to keep in flight per connection", "integer" },
+        { "spread-files", 0, POPT_ARG_NONE, &options.spread_files, 0,
+          "spread the ops across the workers by file instead of by traced client", NULL },
+        { "speed", 's', POPT_ARG_DOUBLE, &options.speed, 0,
+          "replay at the traced times, sped up by this factor (default: as fast as possible)", "factor" },
+        { "target-rate", 'R', POPT_ARG_DOUBLE, &options.targetrate, 0,
+          "replay at this many ops per second, ignoring the traced times", "ops/sec" },
+        { "timelimit", 't', POPT_ARG_INT, &options.timelimit, 0,
+          "stop the replay after this many seconds", "seconds" },
+        { "warmup", 0, POPT_ARG_INT, &options.warmup, 0,
+          "leave the first seconds of the replay out of the results", "seconds" },
+        { "trunc-io", 0, POPT_ARG_INT, &options.trunc_io, 0,
+          "truncate all reads and writes to this size", "bytes" },
+        POPT_TABLEEND
+    };
+
+    /* the defaults of the Linux client */
+    options.acregmin = 3;
+    options.acregmax = 60;
+    options.acdirmin = 30;
+    options.acdirmax = 60;
+
+    pc = poptGetContext (argv[0], argc, argv, popt_options, 0);
+    while ((opt = poptGetNextOpt (pc)) != -1) {
+        fprintf (stderr, "Invalid option %s: %s\n",
+                 poptBadOption (pc, 0), poptStrerror (opt));
+        show_usage ();
+        exit (1);
     }
 
-    while ((nfsdirent = nfs_readdir (nfs, nfsdir)) != NULL) {
-
-        char path[1024];
-        if (!strcmp (nfsdirent->name, ".") || !strcmp (nfsdirent->name, "..")) {
-   	    continue;
-	}
-
-	sprintf (path, "%s/%s", "/", nfsdirent->name);
-	ret = nfs_stat (nfs, path, &st);
-	if (ret != 0) {
-    	    fprintf (stderr, "Failed to stat(%s) %s\n",
-			path, nfs_get_error (nfs));
-	    continue;
-	}
-
-	switch (st.st_mode & S_IFMT) {
-#ifndef WIN32
-	case S_IFLNK:
-#endif
-	case S_IFREG:
-  	    printf ("-");
-	    break;
-	case S_IFDIR:
-    	    printf ("d");
- 	    break;
-	case S_IFCHR:
- 	    printf ("c");
-	    break;
-	case S_IFBLK:
-   	    printf ("b");
-  	    break;
-	}
-	printf ("%c%c%c",
-		"-r"[!!(st.st_mode & S_IRUSR)],
-		"-w"[!!(st.st_mode & S_IWUSR)],
-		"-x"[!!(st.st_mode & S_IXUSR)]
-		);
-	printf ("%c%c%c",
-		"-r"[!!(st.st_mode & S_IRGRP)],
-		"-w"[!!(st.st_mode & S_IWGRP)],
-		"-x"[!!(st.st_mode & S_IXGRP)]
-		);
-	printf ("%c%c%c",
-		"-r"[!!(st.st_mode & S_IROTH)],
-		"-w"[!!(st.st_mode & S_IWOTH)],
-		"-x"[!!(st.st_mode & S_IXOTH)]
-		);
-	printf (" %5d", st.st_uid);
-	printf (" %5d", st.st_gid);
-	printf (" %12" PRId64, st.st_size);
-
-	printf (" %s\n", nfsdirent->name);
+    options.loadfile = discard_const (poptGetArg (pc));
+    if (options.loadfile == NULL || options.nfs == NULL) {
+        show_usage ();
+        exit (1);
     }
-    nfs_closedir (nfs, nfsdir);
-    return 0;
-}
-
-int main(int argc, char *argv[]) {
-
-    int ret;
-    uint64_t count, offset;
-    struct nfs_context *nfs = NULL;
-    struct nfsfh* creat_fh = NULL;
-    struct nfsfh* open_fh = NULL;
-
-    char * buf = (char*) malloc (sizeof (char) * 4096);
-    char *server = argv[1];
-    char *export = "/local/nfs_server";
-    nfsio * io = do_nfsio_connect (server, export);
-
-    //list root
-    print_list (io->nfs);
-
-    printf ("mkdir\n");
-    nfs_mkdir (io->nfs, "/new_dir0");
-    nfs_mkdir (io->nfs, "/new_dir1");
-    print_list (io->nfs);
 
-    printf ("rename dir\n");
-    nfs_rename (io->nfs, "/new_dir0", "/new_dir0_renamed");
-    print_list (io->nfs);
-
-    printf ("rmdir\n");
-    nfs_rmdir (io->nfs, "/new_dir1");
-    print_list (io->nfs);
-
-    printf ("creat\n");
-    struct nfsfh* fh = NULL;
-    nfs_creat (io->nfs, "/newfile", 0660, &creat_fh);
-    print_list (io->nfs);
-
-    printf ("open\n");
-    ret = nfs_open (io->nfs, "/newfile", O_RDONLY, &open_fh);
-    printf ("open ret=%d\n", ret);
-
-    offset = 0;
-    count = 4096;
-
-    printf ("pwrite\n");
-    ret = nfs_pwrite (io->nfs, open_fh, offset, count, buf);
-    printf ("pwrite ret=%d\n", ret);
-
-    printf ("pread\n");
-    ret = nfs_pread (io->nfs, open_fh, offset, count, buf);
-    printf ("pread ret=%d\n", ret);
-
-    printf ("close\n");
-    ret = nfs_close (io->nfs, open_fh);
-    printf ("close ret=%d\n", ret);
-
-    printf ("unlink\n");
-    nfs_unlink (io->nfs, "/newfile");
-    print_list (io->nfs);
-
-    return ret;
+    return nfs3_replay (options.loadfile);
 }
-
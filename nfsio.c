@@ -16,9 +16,20 @@
 */
 
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE 1
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -28,60 +39,34 @@
 #include <nfsc/libnfs-raw-nlm.h>
 #include <nfsc/libnfs-raw-nfs.h>
 
+#include "attrcache.h"
+#include "fhcache.h"
+#include "fidelity.h"
+#include "hist.h"
 #include "libnfs-glue.h"
 #include "nfsio.h"
+#include "oplog.h"
+#include "payload.h"
+#include "wheel.h"
 
 #define discard_const(ptr) ((void *)((intptr_t)(ptr)))
 #define ZERO_STRUCT(x) memset(&(x), 0, sizeof(x))
 
 #define MAX_FILES 200
-#define MAX_OPS 100
 
 const int global_random;
-char rw_buf[];
-
-struct options {
-	const char *backend;
-	int nprocs;
-	int sync_open;
-	int sync_dirs;
-	int do_fsync;
-	int no_resolve;
-	int fsync_frequency;
-	char *tcp_options;
-	int timelimit;
-	int warmup;
-	const char *directory;
-	char *loadfile;
-	double targetrate;
-	int ea_enable;
-	int clients_per_process;
-	int one_byte_write_fix;
-	int stat_check;
-	int fake_io;
-	int skip_cleanup;
-	int per_client_results;
-	const char *nfs;
-	int nlm;
-	const char *server;
-	int run_once;
-	int allow_scsi_writes;
-	int trunc_io;
-	const char *scsi_dev;
-	const char *iscsi_device;
-	const char *iscsi_initiatorname;
-	int machine_readable;
-	const char *smb_share;
-	const char *smb_user;
-};
 
-static struct options options;
+struct options options;
 
-struct op {
-    unsigned count;
-    double total_time;
-    double max_latency;
-};
+/*
+ * What a worker has done since the replay started, which the reporter
+ * thread samples every second while the worker goes on. Only the worker
+ * writes it, and on a cache line of its own.
+ */
+struct live {
+	uint64_t bytes;
+	struct hist lat;
+} __attribute__((aligned(64)));
 
 struct child_struct {
 	int id;
@@ -96,6 +81,8 @@ struct child_struct {
 	double bytes_done_warmup;
 	double max_latency;
 	double worst_latency;
+	double lag_total;
+	double lag_max;
 	struct timeval starttime;
 	struct timeval lasttime;
 	off_t bytes_since_fsync;
@@ -104,7 +91,8 @@ struct child_struct {
 		double last_bytes;
 		struct timeval last_time;
 	} rate;
-	struct op ops[MAX_OPS];
+	struct hist ops[OP_MAX];	/* latencies per op type, in ns */
+	struct live live;
 	void *private;
 
 	int sequence_point;
@@ -114,15 +102,6 @@ struct child_struct {
 	struct child_struct *all_children;
 };
 
-struct dbench_op {
-	struct child_struct *child;
-	const char *op;
-	const char *fname;
-	const char *fname2;
-	const char *status;
-	int64_t params[10];
-};
-
 struct backend_op {
     const char *name;
     void (*fn)(struct dbench_op *);
@@ -153,16 +132,43 @@ char *get_next_arg(const char *args, int id) {
 }
 
 /*
- * return a timeval for the current time
+ * return a timeval for the current time, on the monotonic clock so that
+ * intervals are not thrown off when the system time is set
  */
 struct timeval timeval_current (void) {
+    struct timespec ts;
     struct timeval tv;
-    gettimeofday (&tv, NULL);
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    tv.tv_sec = ts.tv_sec;
+    tv.tv_usec = ts.tv_nsec / 1000;
     return tv;
 }
 
+/*
+ * return the number of seconds since a timeval
+ */
+static double timeval_elapsed(struct timeval *tv)
+{
+	struct timeval tv2 = timeval_current();
+	return (tv2.tv_sec - tv->tv_sec) +
+	       (tv2.tv_usec - tv->tv_usec)*1.0e-6;
+}
+
 static void nfs3_deltree(struct dbench_op *op);
 
+/*
+ * the connection to replay op on, primed with the traced handles of op
+ */
+static struct nfsio *op_nfsio(struct dbench_op *op)
+{
+	struct nfsio *nfsio = op->child->private;
+
+	nfsio_set_handles(nfsio, op->fh, op->fh2, op->res_fh);
+	nfsio_set_dirents(nfsio, op->dirents, op->ndirents);
+	nfsio_set_client(nfsio, op->client, op->timestamp);
+	return nfsio;
+}
+
 static void nfs3_cleanup(struct child_struct *child)
 {
 	char *dname;
@@ -178,10 +184,8 @@ static void nfs3_cleanup(struct child_struct *child)
 	free(dname);
 }
 
-static void nfs3_setup(struct child_struct *child)
+static void nfs3_connect(struct child_struct *child)
 {
-	const char *status = "0x00000000";
-	nfsstat3 res;
 	char *url;
 
 	child->rate.last_time = timeval_current();
@@ -196,6 +200,16 @@ static void nfs3_setup(struct child_struct *child)
 		printf("nfsio_connect() failed\n");
 		exit(10);
 	}
+	((struct nfsio *)child->private)->handle_mode = options.handles;
+	((struct nfsio *)child->private)->negative_cache = options.negative_cache;
+	((struct nfsio *)child->private)->verify = options.verify;
+}
+
+static void nfs3_setup(struct child_struct *child)
+{
+	nfsstat3 res;
+
+	nfs3_connect(child);
 
 	/* create '/clients' */
 	res = nfsio_lookup(child->private, "/clients", NULL);
@@ -272,7 +286,7 @@ static void nfs3_deltree(struct dbench_op *op)
 
 	cbd = malloc(sizeof(struct cb_data));
 
-	cbd->nfsio = op->child->private;
+	cbd->nfsio = op_nfsio(op);
 	cbd->dirname = discard_const(op->fname);
 
 	res = nfsio_lookup(cbd->nfsio, cbd->dirname, NULL);
@@ -290,17 +304,6 @@ static void nfs3_deltree(struct dbench_op *op)
 	free(cbd);
 }
 
-static int check_status(int status, const char *expected)
-{
-	if (strcmp(expected, "*") == 0){
-		return 1;
-	}
-	if (strncmp(expected, "0x", 2) == 0) {
-		return status == strtol(expected, NULL, 16);
-	}
-	return 0;
-}
-
 static void failed(struct child_struct *child)
 {
 	child->failed = 1;
@@ -308,64 +311,33 @@ static void failed(struct child_struct *child)
 	exit(1);
 }
 
+/*
+ * The handlers below only issue their call, the outcome is checked by
+ * the completion set by the replay loop, see op_done().
+ */
 static void nfs3_getattr(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_getattr(op->child->private, op->fname, NULL);
-	if (!check_status(res, op->status)) {
-		printf("[%d] GETATTR \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_getattr(op_nfsio(op), op->fname, NULL);
 }
 
 static void nfs3_setattr(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_setattr(op->child->private, op->fname, NULL);
-	if (!check_status(res, op->status)) {
-		printf("[%d] SETATTR \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_setattr(op_nfsio(op), op->fname, NULL);
 }
 
 static void nfs3_pathconf(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_pathconf(op->child->private, discard_const(op->fname));
-	if (!check_status(res, op->status)) {
-		printf("[%d] PATHCONF \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_pathconf(op_nfsio(op), discard_const(op->fname));
 }
 
 static void nfs3_readlink(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_readlink(op->child->private, discard_const(op->fname));
-	if (!check_status(res, op->status)) {
-		printf("[%d] READLINK \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_readlink(op_nfsio(op), discard_const(op->fname));
 }
 
 static void nfs3_lookup(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_lookup(op->child->private, op->fname, NULL);
-	if (!check_status(res, op->status)) {
-		printf("[%d] LOOKUP \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_lookup(op_nfsio(op), op->fname, NULL);
 }
 
 void do_nfs3_create (nfsio * nio, const char *name) {
@@ -377,80 +349,54 @@ void do_nfs3_create (nfsio * nio, const char *name) {
 
 static void nfs3_create(struct dbench_op *op)
 {
-	nfsstat3 res;
+	nfsio_create(op_nfsio(op), op->fname);
+}
 
-	res = nfsio_create(op->child->private, op->fname);
-	if (!check_status(res, op->status)) {
-		printf("[%d] CREATE \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+static void account_bytes(struct child_struct *child, int len)
+{
+	child->bytes += len;
+	__atomic_store_n(&child->live.bytes, child->live.bytes + len, __ATOMIC_RELAXED);
 }
 
-static void nfs3_write(struct dbench_op *op)
+/* the data a READ3 or WRITE3 moves, after --trunc-io */
+static int op_len(const struct dbench_op *op)
 {
-	off_t offset = op->params[0];
 	int len = op->params[1];
-	int stable = op->params[2];
-	nfsstat3 res;
 
 	if ((options.trunc_io > 0) && (len > options.trunc_io)) {
 		len = options.trunc_io;
 	}
+	return len;
+}
 
-	res = nfsio_write(op->child->private, op->fname, rw_buf, offset, len, stable);
-	if (!check_status(res, op->status)) {
-		printf("[%d] WRITE \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname,
-		       res, op->status);
-		failed(op->child);
-	}
-	op->child->bytes += len;
+static void nfs3_write(struct dbench_op *op)
+{
+	off_t offset = op->params[0];
+	int len = op_len(op);
+	int stable = op->params[2];
+
+	nfsio_write(op_nfsio(op), op->fname, NULL, offset, len, stable);
+	account_bytes(op->child, len);
 }
 
 static void nfs3_commit(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_commit(op->child->private, op->fname);
-	if (!check_status(res, op->status)) {
-		printf("[%d] COMMIT \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_commit(op_nfsio(op), op->fname);
 }
 
 
 static void nfs3_read(struct dbench_op *op)
 {
 	off_t offset = op->params[0];
-	int len = op->params[1];
-	nfsstat3 res = 0;
+	int len = op_len(op);
 
-	if ((options.trunc_io > 0) && (len > options.trunc_io)) {
-		len = options.trunc_io;
-	}
-
-	res = nfsio_read(op->child->private, op->fname, NULL, offset, len);
-	if (!check_status(res, op->status)) {
-		printf("[%d] READ \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname,
-		       res, op->status);
-		failed(op->child);
-	}
-	op->child->bytes += len;
+	nfsio_read(op_nfsio(op), op->fname, NULL, offset, len);
+	account_bytes(op->child, len);
 }
 
 static void nfs3_access(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_access(op->child->private, op->fname, 0, NULL);
-	if (!check_status(res, op->status)) {
-		printf("[%d] ACCESS \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_access(op_nfsio(op), op->fname, 0, NULL);
 }
 
 void do_nfs3_mkdir (nfsio *nio, const char *name) {
@@ -463,148 +409,66 @@ void do_nfs3_mkdir (nfsio *nio, const char *name) {
 
 static void nfs3_mkdir(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_mkdir(op->child->private, op->fname);
-	if (!check_status(res, op->status)) {
-		printf("[%d] MKDIR \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_mkdir(op_nfsio(op), op->fname);
 }
 
 static void nfs3_rmdir(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_rmdir(op->child->private, op->fname);
-	if (!check_status(res, op->status)) {
-		printf("[%d] RMDIR \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_rmdir(op_nfsio(op), op->fname);
 }
 
 static void nfs3_fsstat(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_fsstat(op->child->private);
-	if (!check_status(res, op->status)) {
-		printf("[%d] FSSTAT failed (%x) - expected %s\n",
-		       op->child->line, res, op->status);
-		failed(op->child);
-	}
+	nfsio_fsstat(op_nfsio(op));
 }
 
 static void nfs3_fsinfo(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_fsinfo(op->child->private);
-	if (!check_status(res, op->status)) {
-		printf("[%d] FSINFO failed (%x) - expected %s\n",
-		       op->child->line, res, op->status);
-		failed(op->child);
-	}
+	nfsio_fsinfo(op_nfsio(op));
 }
 
 static void nfs3_symlink(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_symlink(op->child->private, op->fname, op->fname2);
-	if (!check_status(res, op->status)) {
-		printf("[%d] SYMLINK \"%s\"->\"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, op->fname2,
-		       res, op->status);
-		failed(op->child);
-	}
+	nfsio_symlink(op_nfsio(op), op->fname, op->fname2);
 }
 
 static void nfs3_remove(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_remove(op->child->private, op->fname);
-	if (!check_status(res, op->status)) {
-		printf("[%d] REMOVE \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_remove(op_nfsio(op), op->fname);
 }
 
 static void nfs3_readdirplus(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_readdirplus(op->child->private, op->fname, NULL, NULL);
-	if (!check_status(res, op->status)) {
-		printf("[%d] READDIRPLUS \"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, res, op->status);
-		failed(op->child);
-	}
+	nfsio_readdirplus(op_nfsio(op), op->fname, NULL, NULL);
 }
 
 static void nfs3_link(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_link(op->child->private, op->fname, op->fname2);
-	if (!check_status(res, op->status)) {
-		printf("[%d] LINK \"%s\"->\"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, op->fname2,
-		       res, op->status);
-		failed(op->child);
-	}
+	nfsio_link(op_nfsio(op), op->fname, op->fname2);
 }
 
 static void nfs3_lock(struct dbench_op *op)
 {
 	off_t offset = op->params[0];
 	int len = op->params[1];
-	nlmstat4 res;
 
-	res = nfsio_lock(op->child->private, op->fname, offset, len);
-	if (!check_status(res, op->status)) {
-		printf("[%d] LOCK \"%s\" %u-%u failed (%x) - expected %s\n",
-		       op->child->line, op->fname, (unsigned)offset,
-		       (unsigned)offset + len,
-		       res, op->status);
-		failed(op->child);
-	}
+	nfsio_lock(op_nfsio(op), op->fname, offset, len);
 }
 
 static void nfs3_unlock(struct dbench_op *op)
 {
 	off_t offset = op->params[0];
 	int len = op->params[1];
-	nlmstat4 res;
 
-	res = nfsio_unlock(op->child->private, op->fname, offset, len);
-	if (!check_status(res, op->status)) {
-		printf("[%d] UNLOCK \"%s\" %u-%u failed (%x) - expected %s\n",
-		       op->child->line, op->fname, (unsigned)offset,
-		       (unsigned)offset + len,
-		       res, op->status);
-		failed(op->child);
-	}
+	nfsio_unlock(op_nfsio(op), op->fname, offset, len);
 }
 
 static void nfs3_test(struct dbench_op *op)
 {
 	off_t offset = op->params[0];
 	int len = op->params[1];
-	nlmstat4 res;
 
-	res = nfsio_test(op->child->private, op->fname, offset, len);
-	if (!check_status(res, op->status)) {
-		printf("[%d] TEST \"%s\" %u-%u failed (%x) - expected %s\n",
-		       op->child->line, op->fname, (unsigned)offset,
-		       (unsigned)offset + len,
-		       res, op->status);
-		failed(op->child);
-	}
+	nfsio_test(op_nfsio(op), op->fname, offset, len);
 }
 
 void do_nfs3_rename(nfsio * nio, const char * oldname, const char *newname) {
@@ -616,15 +480,7 @@ void do_nfs3_rename(nfsio * nio, const char * oldname, const char *newname) {
 
 static void nfs3_rename(struct dbench_op *op)
 {
-	nfsstat3 res;
-
-	res = nfsio_rename(op->child->private, op->fname, op->fname2);
-	if (!check_status(res, op->status)) {
-		printf("[%d] RENAME \"%s\"->\"%s\" failed (%x) - expected %s\n",
-		       op->child->line, op->fname, op->fname2,
-		       res, op->status);
-		failed(op->child);
-	}
+	nfsio_rename(op_nfsio(op), op->fname, op->fname2);
 }
 
 static int nfs3_init(void)
@@ -648,3 +504,1323 @@ static int nfs3_init(void)
 	return 0;
 }
 
+
+static struct backend_op nfs3_ops[OP_MAX] = {
+	[OP_DELTREE]      = { "Deltree",      nfs3_deltree },
+	[OP_GETATTR3]     = { "GETATTR3",     nfs3_getattr },
+	[OP_LOOKUP3]      = { "LOOKUP3",      nfs3_lookup },
+	[OP_CREATE3]      = { "CREATE3",      nfs3_create },
+	[OP_WRITE3]       = { "WRITE3",       nfs3_write },
+	[OP_COMMIT3]      = { "COMMIT3",      nfs3_commit },
+	[OP_READ3]        = { "READ3",        nfs3_read },
+	[OP_ACCESS3]      = { "ACCESS3",      nfs3_access },
+	[OP_MKDIR3]       = { "MKDIR3",       nfs3_mkdir },
+	[OP_RMDIR3]       = { "RMDIR3",       nfs3_rmdir },
+	[OP_FSSTAT3]      = { "FSSTAT3",      nfs3_fsstat },
+	[OP_FSINFO3]      = { "FSINFO3",      nfs3_fsinfo },
+	[OP_SYMLINK3]     = { "SYMLINK3",     nfs3_symlink },
+	[OP_REMOVE3]      = { "REMOVE3",      nfs3_remove },
+	[OP_READDIRPLUS3] = { "READDIRPLUS3", nfs3_readdirplus },
+	[OP_RENAME3]      = { "RENAME3",      nfs3_rename },
+	[OP_LINK3]        = { "LINK3",        nfs3_link },
+	[OP_PATHCONF3]    = { "PATHCONF3",    nfs3_pathconf },
+	[OP_READLINK3]    = { "READLINK3",    nfs3_readlink },
+	[OP_SETATTR3]     = { "SETATTR3",     nfs3_setattr },
+	[OP_LOCK4]        = { "LOCK4",        nfs3_lock },
+	[OP_UNLOCK4]      = { "UNLOCK4",      nfs3_unlock },
+	[OP_TEST4]        = { "TEST4",        nfs3_test },
+};
+
+static void check_op(struct dbench_op *op, int res)
+{
+	if (trace_check_status(res, op->status)) {
+		return;
+	}
+
+	printf("[%lu] %s", op->line, nfs3_ops[op->opcode].name);
+	if (op->fname != NULL) {
+		printf(" \"%s\"", op->fname);
+	}
+	if (op->fname2 != NULL) {
+		printf("->\"%s\"", op->fname2);
+	}
+	if (op->opcode >= OP_LOCK4) {
+		printf(" %u-%u", (unsigned)op->params[0],
+		       (unsigned)(op->params[0] + op->params[1]));
+	}
+	printf(" failed (%x) - expected %s\n", res, op->status);
+
+	op->child->line = op->line;
+	failed(op->child);
+}
+
+static void account_op(struct child_struct *child, int opcode, double latency)
+{
+	hist_record(&child->ops[opcode], latency * 1.0e9);
+	hist_record_live(&child->live.lat, latency * 1.0e9);
+	if (latency > child->max_latency) {
+		child->max_latency = latency;
+	}
+}
+
+/*
+ * The replay clock, usec on the monotonic clock since the replay started.
+ * Ops are due at their traced time, scaled by --speed, or spaced evenly
+ * at --target-rate; with neither they are due as soon as they are read.
+ */
+static uint64_t replay_start;
+static int replay_timed;
+
+static uint64_t clock_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t replay_clock(void)
+{
+	return clock_usec() - replay_start;
+}
+
+/*
+ * Scheduling. An op locks the objects it works on, by path: the files it
+ * names exclusively and their ancestors shared. The lock queue of each
+ * object is FIFO and an op queues for all its locks at once, in trace
+ * order, so ops on the same object keep their order, ops inside a
+ * directory stay on their side of the ops on the directory itself (its
+ * MKDIR, a RENAME to or from it, a READDIRPLUS of it) and ops on
+ * unrelated files run in parallel. An op is handed to its worker once it
+ * holds all its locks and gives them back when it completes.
+ */
+struct replay_op;
+struct sched_obj;
+
+struct lock_req {
+	struct replay_op *op;
+	struct sched_obj *obj;
+	struct lock_req *prev, *next;
+	int excl;
+	int granted;
+};
+
+struct sched_obj {
+	struct sched_obj *hnext;
+	struct lock_req *first, *last;
+	int nexcl;
+	uint32_t hash;
+	size_t len;
+	char key[];
+};
+
+/*
+ * A replay worker: a thread with its own connection. The ops in its ready
+ * list, protected by lock, go on its timer wheel and are sent once they
+ * are due, as the queue depth allows. tfd wakes it up for the next one.
+ */
+struct worker {
+	struct child_struct child;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct replay_op *ready, *ready_last;
+	struct wheel wheel;
+	int efd, epfd, tfd;
+	uint64_t armed;
+	unsigned depth;
+	int warm;
+	int eof;
+	/* ops this worker retired, on their way to the fidelity report */
+	struct fidelity_op *retired;
+	size_t retired_size;
+};
+
+/*
+ * An op of the trace being replayed. Its strings stay valid until every
+ * op read before it has completed as well.
+ */
+struct replay_op {
+	struct dbench_op op;
+	struct worker *worker;
+	struct replay_op *next;
+	struct wheel_timer timer;
+	struct lock_req *reqs;
+	int nreqs;
+	int pending;
+	int done;
+	uint64_t issued;	/* usec on the replay clock */
+	uint64_t latency;	/* ns */
+};
+
+#define timer_op(t) ((struct replay_op *)((char *)(t) - offsetof(struct replay_op, timer)))
+
+/*
+ * The ops read and not completed yet, from tail to head, and the objects
+ * they lock. All of it is protected by lock.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct replay_op *ops;
+	unsigned long nops, head, tail;
+	struct sched_obj **objs;
+	uint32_t size, count;
+	/* taken before lock is dropped: retired ops reach fidelity in order */
+	pthread_mutex_t fid_lock;
+} sched = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.fid_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint32_t sched_hash(const char *key, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 16777619;
+	}
+	return h;
+}
+
+static void sched_resize(void)
+{
+	struct sched_obj **old = sched.objs;
+	struct sched_obj *obj, *next;
+	uint32_t i, old_size = sched.size;
+
+	sched.size = old_size ? old_size * 2 : 4096;
+	sched.objs = calloc(sched.size, sizeof(struct sched_obj *));
+	if (sched.objs == NULL) {
+		printf("Failed to allocate the scheduler object table\n");
+		exit(10);
+	}
+	for (i = 0; i < old_size; i++) {
+		for (obj = old[i]; obj; obj = next) {
+			next = obj->hnext;
+			obj->hnext = sched.objs[obj->hash & (sched.size - 1)];
+			sched.objs[obj->hash & (sched.size - 1)] = obj;
+		}
+	}
+	free(old);
+}
+
+static struct sched_obj *sched_obj(const char *key, size_t len)
+{
+	uint32_t hash = sched_hash(key, len);
+	struct sched_obj *obj;
+
+	if (sched.count >= sched.size) {
+		sched_resize();
+	}
+	for (obj = sched.objs[hash & (sched.size - 1)]; obj; obj = obj->hnext) {
+		if (obj->hash == hash && obj->len == len &&
+		    memcmp(obj->key, key, len) == 0) {
+			return obj;
+		}
+	}
+
+	obj = malloc(sizeof(struct sched_obj) + len);
+	if (obj == NULL) {
+		printf("Failed to allocate a scheduler object\n");
+		exit(10);
+	}
+	obj->first = obj->last = NULL;
+	obj->nexcl = 0;
+	obj->hash  = hash;
+	obj->len   = len;
+	memcpy(obj->key, key, len);
+	obj->hnext = sched.objs[hash & (sched.size - 1)];
+	sched.objs[hash & (sched.size - 1)] = obj;
+	sched.count++;
+
+	return obj;
+}
+
+static void sched_obj_free(struct sched_obj *obj)
+{
+	struct sched_obj **o;
+
+	for (o = &sched.objs[obj->hash & (sched.size - 1)]; *o != obj; o = &(*o)->hnext)
+		;
+	*o = obj->hnext;
+	sched.count--;
+	free(obj);
+}
+
+static void lock_add(struct replay_op *rop, const char *key, size_t len, int excl)
+{
+	struct sched_obj *obj = sched_obj(key, len);
+	int i;
+
+	for (i = 0; i < rop->nreqs; i++) {
+		if (rop->reqs[i].obj == obj) {
+			rop->reqs[i].excl |= excl;
+			return;
+		}
+	}
+	rop->reqs[rop->nreqs].obj  = obj;
+	rop->reqs[rop->nreqs].op   = rop;
+	rop->reqs[rop->nreqs].excl = excl;
+	rop->nreqs++;
+}
+
+static int path_locks(const char *path)
+{
+	int n = 2;
+
+	for (; *path; path++) {
+		n += *path == '/';
+	}
+	return n;
+}
+
+/* path exclusively, all its ancestors shared */
+static void lock_path(struct replay_op *rop, const char *path)
+{
+	size_t i, len;
+
+	while (path[0] == '.') path++;
+
+	len = strlen(path);
+	if (len == 0) {
+		path = "/";
+		len  = 1;
+	}
+	lock_add(rop, path, len, 1);
+	if (len > 1) {
+		lock_add(rop, "/", 1, 0);
+	}
+	for (i = 1; i < len; i++) {
+		if (path[i] == '/') {
+			lock_add(rop, path, i, 0);
+		}
+	}
+}
+
+/* the locks rop needs, the objects it names are its file names */
+static void sched_locks(struct replay_op *rop)
+{
+	struct dbench_op *op = &rop->op;
+	int objs = op->opcode == OP_RENAME3 || op->opcode == OP_LINK3;
+	int n = 0;
+
+	if (op->fname != NULL) {
+		n += path_locks(op->fname);
+	}
+	if (objs && op->fname2 != NULL) {
+		n += path_locks(op->fname2);
+	}
+
+	rop->nreqs = 0;
+	rop->reqs  = NULL;
+	if (n == 0) {
+		return;
+	}
+	rop->reqs = calloc(n, sizeof(struct lock_req));
+	if (rop->reqs == NULL) {
+		printf("Failed to allocate the locks of line %lu\n", op->line);
+		exit(10);
+	}
+
+	if (op->fname != NULL) {
+		lock_path(rop, op->fname);
+	}
+	if (objs && op->fname2 != NULL) {
+		lock_path(rop, op->fname2);
+	}
+}
+
+static void lock_grant(struct lock_req *r, struct replay_op ***ready)
+{
+	r->granted = 1;
+	if (--r->op->pending == 0) {
+		r->op->next = NULL;
+		**ready = r->op;
+		*ready = &r->op->next;
+	}
+}
+
+static void lock_queue(struct lock_req *r, struct replay_op ***ready)
+{
+	struct sched_obj *obj = r->obj;
+	int grant = r->excl ? obj->first == NULL : obj->nexcl == 0;
+
+	r->next = NULL;
+	r->prev = obj->last;
+	if (obj->last != NULL) {
+		obj->last->next = r;
+	} else {
+		obj->first = r;
+	}
+	obj->last = r;
+	if (r->excl) {
+		obj->nexcl++;
+	}
+	if (grant) {
+		lock_grant(r, ready);
+	}
+}
+
+static void lock_release(struct lock_req *r, struct replay_op ***ready)
+{
+	struct sched_obj *obj = r->obj;
+	struct lock_req *q;
+
+	if (r->prev != NULL) {
+		r->prev->next = r->next;
+	} else {
+		obj->first = r->next;
+	}
+	if (r->next != NULL) {
+		r->next->prev = r->prev;
+	} else {
+		obj->last = r->prev;
+	}
+
+	if (r->excl) {
+		/* r was alone at the head, grant the next writer or readers */
+		obj->nexcl--;
+		for (q = obj->first; q != NULL; q = q->next) {
+			if (q->excl) {
+				if (q == obj->first) {
+					lock_grant(q, ready);
+				}
+				break;
+			}
+			lock_grant(q, ready);
+		}
+	} else if (obj->first != NULL && !obj->first->granted) {
+		/* the last reader ahead of a writer is gone */
+		lock_grant(obj->first, ready);
+	}
+
+	if (obj->first == NULL) {
+		sched_obj_free(obj);
+	}
+}
+
+static void worker_wake(struct worker *w)
+{
+	uint64_t one = 1;
+
+	if (write(w->efd, &one, sizeof(one)) < 0) {
+		printf("Failed to wake child %d. %s\n", w->child.id, strerror(errno));
+		exit(10);
+	}
+}
+
+/* hand the ops that got all their locks to their workers */
+static void sched_dispatch(struct replay_op *ready)
+{
+	struct replay_op *rop, *next;
+	struct worker *w;
+	int wake;
+
+	for (rop = ready; rop; rop = next) {
+		next = rop->next;
+		w = rop->worker;
+
+		pthread_mutex_lock(&w->lock);
+		rop->next = NULL;
+		wake = w->ready == NULL;
+		if (w->ready_last != NULL) {
+			w->ready_last->next = rop;
+		} else {
+			w->ready = rop;
+		}
+		w->ready_last = rop;
+		pthread_mutex_unlock(&w->lock);
+
+		if (wake) {
+			worker_wake(w);
+		}
+	}
+}
+
+/* the CPU time the process had used when the results started */
+static struct rusage warm_rusage;
+static int warm_rusage_taken;
+
+static void take_warm_rusage(void)
+{
+	if (!__atomic_exchange_n(&warm_rusage_taken, 1, __ATOMIC_ACQ_REL)) {
+		getrusage(RUSAGE_SELF, &warm_rusage);
+	}
+}
+
+static double rusage_cpu(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_stime.tv_sec +
+	       1.0e-6 * (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec);
+}
+
+/* the warmup is over, start the stats of w over */
+static void worker_warm(struct worker *w)
+{
+	struct child_struct *child = &w->child;
+
+	take_warm_rusage();
+
+	memset(child->ops, 0, sizeof(child->ops));
+	child->bytes       = 0;
+	child->max_latency = 0;
+	child->lag_total   = 0;
+	child->lag_max     = 0;
+	w->warm = 1;
+}
+
+/* with --oplog, the log every completed op goes to */
+static struct oplog *oplog;
+
+/* with --fidelity, the ops as traced and as replayed, fed in trace order */
+static struct fidelity *fidelity;
+
+/* what fidelity gets of a retired op, 0 for none if it ran in the warmup */
+static int fidelity_op(const struct replay_op *rop, struct fidelity_op *fop)
+{
+	if (rop->issued < options.warmup * 1000000ULL) {
+		return 0;
+	}
+	fop->opcode     = rop->op.opcode;
+	fop->client     = rop->op.client;
+	fop->traced     = rop->op.timestamp;
+	fop->traced_lat = rop->op.latency;
+	fop->due        = rop->timer.due;
+	fop->issued     = rop->issued;
+	fop->latency    = rop->latency;
+	return 1;
+}
+
+static void log_op(struct replay_op *rop, int status, uint32_t bytes)
+{
+	struct dbench_op *op = &rop->op;
+	struct oplog_rec rec;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.line      = op->line;
+	rec.issued    = rop->issued * 1000;
+	rec.completed = ts.tv_sec * 1000000000ULL + ts.tv_nsec - replay_start * 1000;
+	rec.bytes     = bytes;
+	rec.status = status;
+	rec.opcode = op->opcode;
+	rec.worker = rop->worker->child.id;
+	rec.client = op->client;
+	oplog_add(oplog, rec.worker, &rec);
+}
+
+static void op_done(int status, double latency, uint32_t bytes, void *private_data)
+{
+	struct replay_op *rop = private_data;
+	struct replay_op *ready = NULL, **last = &ready;
+	struct worker *w = rop->worker;
+	size_t n = 0, j;
+	int i;
+
+	check_op(&rop->op, status);
+	if (!rop->worker->warm && replay_clock() >= options.warmup * 1000000ULL) {
+		worker_warm(rop->worker);
+	}
+	account_op(&rop->worker->child, rop->op.opcode, latency);
+	rop->latency = latency * 1.0e9;
+	if (oplog != NULL) {
+		log_op(rop, status, bytes);
+	}
+
+	pthread_mutex_lock(&sched.lock);
+	for (i = 0; i < rop->nreqs; i++) {
+		lock_release(&rop->reqs[i], &last);
+	}
+	free(rop->reqs);
+	rop->reqs = NULL;
+	rop->done = 1;
+	while (sched.tail != sched.head && sched.ops[sched.tail % sched.nops].done) {
+		if (fidelity != NULL) {
+			if (n == w->retired_size) {
+				w->retired_size = w->retired_size ? 2 * w->retired_size : 64;
+				w->retired = realloc(w->retired, w->retired_size *
+						     sizeof(struct fidelity_op));
+				if (w->retired == NULL) {
+					fprintf(stderr, "Failed to allocate the retired ops\n");
+					exit(10);
+				}
+			}
+			n += fidelity_op(&sched.ops[sched.tail % sched.nops], &w->retired[n]);
+		}
+		sched.tail++;
+	}
+	/* the slots are free for the reader now, fidelity has copies */
+	if (n > 0) {
+		pthread_mutex_lock(&sched.fid_lock);
+	}
+	pthread_cond_signal(&sched.cond);
+	pthread_mutex_unlock(&sched.lock);
+
+	if (n > 0) {
+		for (j = 0; j < n; j++) {
+			fidelity_add(fidelity, &w->retired[j]);
+		}
+		pthread_mutex_unlock(&sched.fid_lock);
+	}
+
+	sched_dispatch(ready);
+}
+
+/* send the ops that are due, as the queue depth allows */
+static void worker_issue(struct worker *w)
+{
+	struct nfsio *nfsio = w->child.private;
+	struct replay_op *rop, *next;
+	struct wheel_timer *t;
+	struct dbench_op *op;
+	struct timeval start;
+	double lag;
+
+	pthread_mutex_lock(&w->lock);
+	rop = w->ready;
+	w->ready = w->ready_last = NULL;
+	pthread_mutex_unlock(&w->lock);
+	for (; rop; rop = next) {
+		next = rop->next;
+		wheel_add(&w->wheel, &rop->timer);
+	}
+	wheel_advance(&w->wheel, replay_clock());
+
+	while (nfsio->inflight < (int)w->depth &&
+	       (t = wheel_expire(&w->wheel)) != NULL) {
+		rop = timer_op(t);
+		op  = &rop->op;
+		rop->issued = replay_clock();
+
+		if (replay_timed) {
+			lag = (rop->issued - t->due) * 1.0e-6;
+			w->child.lag_total += lag;
+			if (lag > w->child.lag_max) {
+				w->child.lag_max = lag;
+			}
+		}
+
+		w->child.line = op->line;
+		if (op->opcode == OP_DELTREE) {
+			start = timeval_current();
+			nfs3_deltree(op);
+			op_done(NFS3_OK, timeval_elapsed(&start), 0, rop);
+		} else {
+			nfsio_set_completion(nfsio, op_done, rop);
+			nfs3_ops[op->opcode].fn(op);
+		}
+	}
+}
+
+/* wake w up when its next op is due, due is UINT64_MAX for never */
+static void worker_arm(struct worker *w, uint64_t due)
+{
+	struct itimerspec its;
+	uint64_t t = replay_start + due;
+
+	if (due == w->armed) {
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	if (due != UINT64_MAX) {
+		its.it_value.tv_sec  = t / 1000000;
+		its.it_value.tv_nsec = (t % 1000000) * 1000;
+	}
+	if (timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		printf("Failed to set the timer of child %d. %s\n",
+		       w->child.id, strerror(errno));
+		failed(&w->child);
+	}
+	w->armed = due;
+}
+
+static void *worker_main(void *private_data)
+{
+	struct worker *w = private_data;
+	struct nfsio *nfsio = w->child.private;
+	struct epoll_event ev[16];
+	uint64_t count;
+	int i, n, eof;
+
+	/* the default 50us of slack would be most of the issue skew */
+	prctl(PR_SET_TIMERSLACK, 1UL);
+
+	for (;;) {
+		worker_issue(w);
+
+		pthread_mutex_lock(&w->lock);
+		eof = w->eof;
+		pthread_mutex_unlock(&w->lock);
+		if (eof) {
+			break;
+		}
+
+		/* with the queue full, the next op waits for a reply anyway */
+		if (w->wheel.expired.first == NULL) {
+			worker_arm(w, wheel_next(&w->wheel));
+		}
+		if (nfsio_epoll_update(nfsio, w->epfd) < 0) {
+			failed(&w->child);
+		}
+		n = epoll_wait(w->epfd, ev, 16, -1);
+		if (n < 0 && errno != EINTR) {
+			printf("epoll_wait failed in child %d. %s\n",
+			       w->child.id, strerror(errno));
+			failed(&w->child);
+		}
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.ptr == NULL || ev[i].data.ptr == w) {
+				int fd = ev[i].data.ptr == NULL ? w->efd : w->tfd;
+
+				if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+					failed(&w->child);
+				}
+				continue;
+			}
+			if (nfsio_epoll_service(nfsio, &ev[i]) < 0) {
+				failed(&w->child);
+			}
+		}
+	}
+	w->child.done = 1;
+
+	return NULL;
+}
+
+static int worker_start(struct worker *w, int id, int nprocs, unsigned depth)
+{
+	struct epoll_event ev;
+
+	w->child.id          = id;
+	w->child.num_clients = nprocs;
+	nfs3_connect(&w->child);
+	w->depth = depth;
+	w->warm  = options.warmup <= 0;
+	w->armed = UINT64_MAX;
+	wheel_init(&w->wheel, 0);
+
+	w->efd  = eventfd(0, EFD_NONBLOCK);
+	w->tfd  = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	w->epfd = epoll_create1(0);
+	if (w->efd < 0 || w->tfd < 0 || w->epfd < 0) {
+		printf("Failed to set up the event loop of child %d. %s\n",
+		       id, strerror(errno));
+		return -1;
+	}
+	ev.events   = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->efd, &ev) < 0) {
+		printf("Failed to watch the queue of child %d. %s\n",
+		       id, strerror(errno));
+		return -1;
+	}
+	ev.data.ptr = w;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->tfd, &ev) < 0) {
+		printf("Failed to watch the timer of child %d. %s\n",
+		       id, strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_init(&w->lock, NULL);
+	return 0;
+}
+
+static void worker_stop(struct worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->eof = 1;
+	pthread_mutex_unlock(&w->lock);
+	worker_wake(w);
+
+	pthread_join(w->thread, NULL);
+	nfsio_disconnect(w->child.private);
+	close(w->epfd);
+	close(w->tfd);
+	close(w->efd);
+	pthread_mutex_destroy(&w->lock);
+	free(w->retired);
+	w->retired = NULL;
+}
+
+/*
+ * Worker an op goes to: the one of its traced client, or with
+ * --spread-files the one of the file it works on.
+ */
+static unsigned op_worker(const struct dbench_op *op, unsigned nprocs)
+{
+	const unsigned char *p;
+	uint32_t h;
+
+	if (!options.spread_files || op->fname == NULL) {
+		return op->client % nprocs;
+	}
+	for (h = 5381, p = (const unsigned char *)op->fname; *p; p++) {
+		h = h * 33 + *p;
+	}
+	return h % nprocs;
+}
+
+static const double report_pct[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+static const char *report_pct_name[] = { "p50", "p90", "p99", "p99.9", "p99.99" };
+#define REPORT_PCTS (sizeof(report_pct) / sizeof(report_pct[0]))
+
+/*
+ * The latencies of each op type in ms, one line each starting with @O,
+ * then @T with the totals, for scripts to pick out of the report.
+ */
+static void nfs3_report_machine(struct child_struct *child, double elapsed)
+{
+	unsigned long count = 0;
+	unsigned j;
+	int i;
+
+	printf("@O op count avg");
+	for (j = 0; j < REPORT_PCTS; j++) {
+		printf(" %s", report_pct_name[j]);
+	}
+	printf(" max\n");
+	for (i = 0; i < OP_MAX; i++) {
+		const struct hist *h = &child->ops[i];
+
+		if (h->count == 0) {
+			continue;
+		}
+		printf("@O %s %lu %.6f", nfs3_ops[i].name, (unsigned long)h->count,
+		       1.0e-6 * h->sum / h->count);
+		for (j = 0; j < REPORT_PCTS; j++) {
+			printf(" %.6f", 1.0e-6 * hist_percentile(h, report_pct[j]));
+		}
+		printf(" %.6f\n", 1.0e-6 * h->max);
+		count += h->count;
+	}
+	printf("@T ops secs ops/sec MB/sec max\n");
+	printf("@T %lu %.6f %.3f %.6f %.6f\n", count, elapsed, count / elapsed,
+	       child->bytes / (1.0e6 * elapsed), 1000 * child->max_latency);
+}
+
+static void nfs3_report(struct child_struct *child)
+{
+	double elapsed = timeval_elapsed(&child->starttime);
+	unsigned long count = 0;
+	unsigned j;
+	int i;
+
+	if (options.machine_readable) {
+		nfs3_report_machine(child, elapsed);
+		return;
+	}
+
+	printf("\n Operation                Count    AvgLat       p50       p90"
+	       "       p99     p99.9    p99.99    MaxLat\n");
+	printf(" ------------------------------------------------------------"
+	       "----------------------------------------\n");
+	for (i = 0; i < OP_MAX; i++) {
+		const struct hist *h = &child->ops[i];
+
+		if (h->count == 0) {
+			continue;
+		}
+		printf(" %-22s %7lu %9.03f", nfs3_ops[i].name,
+		       (unsigned long)h->count, 1.0e-6 * h->sum / h->count);
+		for (j = 0; j < REPORT_PCTS; j++) {
+			printf(" %9.03f", 1.0e-6 * hist_percentile(h, report_pct[j]));
+		}
+		printf(" %9.03f\n", 1.0e-6 * h->max);
+		count += h->count;
+	}
+
+	printf("\n%lu ops in %.3f secs: %.1f ops/sec, %.3f MB/sec, max latency %.03f ms\n",
+	       count, elapsed, count / elapsed,
+	       child->bytes / (1.0e6 * elapsed), 1000 * child->max_latency);
+	if (replay_timed && count > 0) {
+		printf("Issue lag: avg %.03f ms, max %.03f ms\n",
+		       1000 * child->lag_total / count, 1000 * child->lag_max);
+	}
+	if (count > 0) {
+		struct rusage ru;
+		double cpu;
+
+		getrusage(RUSAGE_SELF, &ru);
+		cpu = rusage_cpu(&ru) - rusage_cpu(&warm_rusage);
+		printf("CPU: %.1f usec per op, %.1f%% of a core\n",
+		       1.0e6 * cpu / count, 100 * cpu / elapsed);
+	}
+}
+
+/*
+ * The reporter thread: every second it samples what the workers have
+ * done, and prints the throughput and latencies of that second with
+ * --live and writes them to the --timeline file.
+ */
+struct reporter {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+
+	struct worker *workers;
+	unsigned nprocs;
+	FILE *timeline;
+	int json;
+
+	/* what each worker had done at the last sample */
+	struct hist *last;
+	uint64_t *last_bytes;
+	struct hist now, delta, window;
+};
+
+static void reporter_sample(struct reporter *r, unsigned long second, double interval)
+{
+	struct hist *win = &r->window;
+	uint64_t bytes = 0, b;
+	double pct[REPORT_PCTS];
+	unsigned i, j;
+
+	memset(win, 0, sizeof(*win));
+	for (i = 0; i < r->nprocs; i++) {
+		struct live *live = &r->workers[i].child.live;
+
+		hist_snapshot(&r->now, &live->lat);
+		hist_diff(&r->delta, &r->now, &r->last[i]);
+		hist_merge(win, &r->delta);
+		r->last[i] = r->now;
+
+		b = __atomic_load_n(&live->bytes, __ATOMIC_RELAXED);
+		bytes += b - r->last_bytes[i];
+		r->last_bytes[i] = b;
+	}
+	for (j = 0; j < REPORT_PCTS; j++) {
+		pct[j] = 1.0e-6 * hist_percentile(win, report_pct[j]);
+	}
+
+	if (options.live) {
+		printf("%6lus %10.1f ops/sec %9.3f MB/sec", second,
+		       win->count / interval, bytes / (1.0e6 * interval));
+		for (j = 0; j < REPORT_PCTS; j++) {
+			printf(" %s %.3f", report_pct_name[j], pct[j]);
+		}
+		printf(" max %.3f ms\n", 1.0e-6 * win->max);
+		fflush(stdout);
+	}
+
+	if (r->timeline == NULL) {
+		return;
+	}
+	if (r->json) {
+		fprintf(r->timeline, "%s{\"time\": %lu, \"ops\": %llu, \"ops_per_sec\": %.1f, "
+			"\"mb_per_sec\": %.3f", second > 1 ? ",\n" : "", second,
+			(unsigned long long)win->count, win->count / interval,
+			bytes / (1.0e6 * interval));
+		for (j = 0; j < REPORT_PCTS; j++) {
+			fprintf(r->timeline, ", \"%s_ms\": %.6f", report_pct_name[j], pct[j]);
+		}
+		fprintf(r->timeline, ", \"max_ms\": %.6f}", 1.0e-6 * win->max);
+	} else {
+		fprintf(r->timeline, "%lu,%llu,%.1f,%.3f", second,
+			(unsigned long long)win->count, win->count / interval,
+			bytes / (1.0e6 * interval));
+		for (j = 0; j < REPORT_PCTS; j++) {
+			fprintf(r->timeline, ",%.6f", pct[j]);
+		}
+		fprintf(r->timeline, ",%.6f\n", 1.0e-6 * win->max);
+	}
+	fflush(r->timeline);
+}
+
+static void *reporter_main(void *private_data)
+{
+	struct reporter *r = private_data;
+	struct timespec due, now, last;
+	unsigned long second = 0;
+	int stop;
+
+	prctl(PR_SET_NAME, "nfs-repl report");
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	last = due;
+
+	for (;;) {
+		due.tv_sec++;
+		pthread_mutex_lock(&r->lock);
+		while (!r->stop && pthread_cond_timedwait(&r->cond, &r->lock, &due) != ETIMEDOUT) {
+		}
+		stop = r->stop;
+		pthread_mutex_unlock(&r->lock);
+		if (stop) {
+			break;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		reporter_sample(r, ++second, (now.tv_sec - last.tv_sec) +
+				(now.tv_nsec - last.tv_nsec) * 1.0e-9);
+		last = now;
+	}
+	return NULL;
+}
+
+static int reporter_start(struct reporter *r, struct worker *workers, unsigned nprocs)
+{
+	pthread_condattr_t attr;
+	const char *ext;
+	unsigned j;
+
+	memset(r, 0, sizeof(*r));
+	r->workers    = workers;
+	r->nprocs     = nprocs;
+	r->last       = calloc(nprocs, sizeof(struct hist));
+	r->last_bytes = calloc(nprocs, sizeof(uint64_t));
+	if (r->last == NULL || r->last_bytes == NULL) {
+		printf("Failed to allocate the reporter\n");
+		return -1;
+	}
+
+	if (options.timeline != NULL) {
+		r->timeline = fopen(options.timeline, "w");
+		if (r->timeline == NULL) {
+			printf("Failed to open %s. %s\n", options.timeline, strerror(errno));
+			return -1;
+		}
+		ext = strrchr(options.timeline, '.');
+		r->json = ext != NULL && strcmp(ext, ".json") == 0;
+		if (r->json) {
+			fprintf(r->timeline, "[\n");
+		} else {
+			fprintf(r->timeline, "time,ops,ops_per_sec,mb_per_sec");
+			for (j = 0; j < REPORT_PCTS; j++) {
+				fprintf(r->timeline, ",%s_ms", report_pct_name[j]);
+			}
+			fprintf(r->timeline, ",max_ms\n");
+		}
+	}
+
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&r->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&r->thread, NULL, reporter_main, r) != 0) {
+		printf("Failed to start the reporter\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void reporter_stop(struct reporter *r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_signal(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+	pthread_join(r->thread, NULL);
+
+	if (r->timeline != NULL) {
+		if (r->json) {
+			fprintf(r->timeline, "\n]\n");
+		}
+		fclose(r->timeline);
+	}
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->cond);
+	free(r->last);
+	free(r->last_bytes);
+}
+
+/*
+ * Replay a trace from start to end over --nprocs connections, each driven
+ * by its own worker thread with up to --queue-depth calls in flight. This
+ * thread reads the trace and queues the ops for their locks, the workers
+ * send them once they have them.
+ */
+int nfs3_replay(const char *loadfile)
+{
+	struct worker *workers;
+	static struct child_struct total;	/* too large for the stack */
+	static struct reporter reporter;
+	int reporting = options.live || options.timeline != NULL;
+	struct fhcache_stats cache;
+	unsigned long cache_hits = 0, cache_misses = 0, lookups_saved = 0;
+	unsigned long resolve_lookups = 0;
+	double resolve_time = 0;
+	unsigned long getattrs_saved = 0, accesses_saved = 0, attr_lookups_saved = 0;
+	unsigned long reads_verified = 0, verify_errors = 0;
+	struct attrcache *attrs = NULL;
+	struct replay_op *rop, *ready, **last;
+	struct trace *trace;
+	unsigned long count = 0;
+	uint64_t first = 0, limit = UINT64_MAX;
+	unsigned nprocs, depth, i, j;
+	int ret;
+
+	if (options.nfs == NULL) {
+		printf("--nfs target was not specified\n");
+		return 1;
+	}
+	nprocs = options.nprocs > 0 ? options.nprocs : 1;
+	depth  = options.queue_depth > 0 ? options.queue_depth : 1;
+	if (options.timelimit > 0) {
+		limit = (options.warmup + options.timelimit) * 1000000ULL;
+	}
+	replay_timed = options.speed > 0 || options.targetrate > 0;
+	if (payload_init(options.payload_seed, options.compress_ratio,
+			 options.dedupe_ratio) != 0) {
+		return 1;
+	}
+
+	trace = trace_open(loadfile);
+	if (trace == NULL) {
+		return 1;
+	}
+
+	/*
+	 * Read well ahead of what is in flight, an op waiting for its locks
+	 * should not keep the unrelated ones behind it from being sent.
+	 */
+	sched.nops = 16 * nprocs * depth;
+	sched.ops  = calloc(sched.nops, sizeof(struct replay_op));
+	if (posix_memalign((void **)&workers, 64, nprocs * sizeof(struct worker)) != 0) {
+		workers = NULL;
+	} else {
+		memset(workers, 0, nprocs * sizeof(struct worker));
+	}
+	if (sched.ops == NULL || workers == NULL) {
+		printf("Failed to allocate %u workers\n", nprocs);
+		trace_close(trace);
+		return 1;
+	}
+	sched_resize();
+
+	for (i = 0; i < nprocs; i++) {
+		workers[i].child.all_children = &workers[0].child;
+		if (worker_start(&workers[i], i, nprocs, depth) != 0) {
+			exit(10);
+		}
+	}
+
+	for (i = 0; i < nprocs && options.handle_cache_mem > 0; i++) {
+		fhcache_set_budget(((struct nfsio *)workers[i].child.private)->cache,
+				   (size_t)options.handle_cache_mem << 20);
+	}
+
+	if (options.attr_cache) {
+		struct attrcache_timeo timeo = {
+			options.acregmin, options.acregmax,
+			options.acdirmin, options.acdirmax
+		};
+
+		attrs = attrcache_new(&timeo);
+		for (i = 0; i < nprocs; i++) {
+			((struct nfsio *)workers[i].child.private)->attrs = attrs;
+		}
+	}
+
+	if (options.handle_cache != NULL) {
+		int loaded = fhcache_load(((struct nfsio *)workers[0].child.private)->cache,
+					  options.handle_cache);
+
+		if (loaded > 0) {
+			printf("Loaded %d handles from %s\n", loaded, options.handle_cache);
+		}
+	}
+
+	/* the clock starts once everybody is connected */
+	memset(&total, 0, sizeof(total));
+	total.starttime = timeval_current();
+	total.starttime.tv_sec += options.warmup;
+	replay_start = clock_usec();
+	if (options.warmup <= 0) {
+		take_warm_rusage();
+	}
+	if (options.fidelity) {
+		fidelity = fidelity_new(replay_timed);
+	}
+	if (options.oplog != NULL) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		oplog = oplog_open(options.oplog, nprocs,
+				   ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+		if (oplog == NULL) {
+			exit(10);
+		}
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		workers[i].child.starttime = total.starttime;
+		if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+			printf("Failed to start child %u\n", i);
+			exit(10);
+		}
+	}
+	if (reporting && reporter_start(&reporter, workers, nprocs) != 0) {
+		exit(10);
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&sched.lock);
+		while (sched.head - sched.tail == sched.nops) {
+			pthread_cond_wait(&sched.cond, &sched.lock);
+		}
+		rop = &sched.ops[sched.head % sched.nops];
+		pthread_mutex_unlock(&sched.lock);
+
+		ret = trace_next(trace, &rop->op);
+		if (ret <= 0) {
+			break;
+		}
+		if (rop->op.opcode >= OP_LOCK4 && !options.nlm) {
+			printf("[%lu] %s needs NLM, run with --nlm\n",
+			       rop->op.line, rop->op.op);
+			ret = -1;
+			break;
+		}
+		rop->worker   = &workers[op_worker(&rop->op, nprocs)];
+		rop->op.child = &rop->worker->child;
+		rop->done     = 0;
+
+		if (options.targetrate > 0) {
+			rop->timer.due = count * 1.0e6 / options.targetrate;
+		} else if (options.speed > 0) {
+			if (count == 0) {
+				first = rop->op.timestamp;
+			}
+			rop->timer.due = rop->op.timestamp > first ?
+				(rop->op.timestamp - first) / options.speed : 0;
+		} else {
+			rop->timer.due = 0;
+		}
+		if (rop->timer.due >= limit || replay_clock() >= limit) {
+			break;
+		}
+
+		ready = NULL;
+		last  = &ready;
+		pthread_mutex_lock(&sched.lock);
+		sched_locks(rop);
+		rop->pending = rop->nreqs + 1;
+		for (j = 0; j < (unsigned)rop->nreqs; j++) {
+			lock_queue(&rop->reqs[j], &last);
+		}
+		if (--rop->pending == 0) {
+			rop->next = NULL;
+			*last = rop;
+		}
+		sched.head++;
+
+		/* hand back the strings of the ops all workers are done with */
+		if (++count % 64 == 0) {
+			trace_release(trace, sched.ops[sched.tail % sched.nops].op.line);
+		}
+		pthread_mutex_unlock(&sched.lock);
+
+		sched_dispatch(ready);
+	}
+
+	pthread_mutex_lock(&sched.lock);
+	while (sched.tail != sched.head) {
+		pthread_cond_wait(&sched.cond, &sched.lock);
+	}
+	pthread_mutex_unlock(&sched.lock);
+	if (reporting) {
+		reporter_stop(&reporter);
+	}
+
+	if (options.handle_cache != NULL) {
+		fhcache_save(((struct nfsio *)workers[0].child.private)->cache,
+			     options.handle_cache);
+	}
+
+	/* workers on the same export share a cache, count it once */
+	memset(&cache, 0, sizeof(cache));
+	for (i = 0; i < nprocs; i++) {
+		struct nfsio *nfsio = workers[i].child.private;
+		struct fhcache_stats st;
+
+		cache_hits    += nfsio->cache_hits;
+		cache_misses  += nfsio->cache_misses;
+		resolve_lookups += nfsio->resolve_lookups;
+		resolve_time    += nfsio->resolve_time;
+		lookups_saved += nfsio->lookups_saved;
+		getattrs_saved     += nfsio->getattrs_saved;
+		accesses_saved     += nfsio->accesses_saved;
+		attr_lookups_saved += nfsio->attr_lookups_saved;
+		reads_verified     += nfsio->reads_verified;
+		verify_errors      += nfsio->verify_errors;
+		for (j = 0; j < i; j++) {
+			if (((struct nfsio *)workers[j].child.private)->cache == nfsio->cache) {
+				break;
+			}
+		}
+		if (j == i) {
+			fhcache_stats(nfsio->cache, &st);
+			cache.entries   += st.entries;
+			cache.bytes     += st.bytes;
+			cache.evictions += st.evictions;
+		}
+	}
+
+	for (i = 0; i < nprocs; i++) {
+		struct child_struct *child = &workers[i].child;
+
+		worker_stop(&workers[i]);
+
+		total.bytes     += child->bytes;
+		total.lag_total += child->lag_total;
+		if (child->max_latency > total.max_latency) {
+			total.max_latency = child->max_latency;
+		}
+		if (child->lag_max > total.lag_max) {
+			total.lag_max = child->lag_max;
+		}
+		for (j = 0; j < OP_MAX; j++) {
+			hist_merge(&total.ops[j], &child->ops[j]);
+		}
+	}
+	total.done = 1;
+	if (oplog != NULL) {
+		if (oplog_close(oplog) != 0) {
+			ret = -1;
+		}
+		oplog = NULL;
+	}
+
+	if (replay_clock() < options.warmup * 1000000ULL) {
+		printf("The replay ended within the %d second warmup\n", options.warmup);
+	} else {
+		nfs3_report(&total);
+	}
+	printf("Handle cache: %lu hits, %lu misses, %llu evictions, %llu entries in %.1f MB\n",
+	       cache_hits, cache_misses, (unsigned long long)cache.evictions,
+	       (unsigned long long)cache.entries, cache.bytes / 1048576.0);
+	if (resolve_lookups > 0) {
+		printf("Path resolution: %lu LOOKUPs, %.3f secs waited for, not in op latencies\n",
+		       resolve_lookups, resolve_time);
+	}
+	if (options.negative_cache) {
+		printf("Negative cache: %lu LOOKUPs not sent\n", lookups_saved);
+	}
+	if (attrs != NULL) {
+		printf("Attribute cache: %lu GETATTRs, %lu ACCESSes, %lu LOOKUPs not sent\n",
+		       getattrs_saved, accesses_saved, attr_lookups_saved);
+		attrcache_free(attrs);
+	}
+	if (options.verify) {
+		printf("Verify: %lu READ replies checked, %lu with other data than was written\n",
+		       reads_verified, verify_errors);
+	}
+	if (fidelity != NULL) {
+		fidelity_report(fidelity);
+		fidelity_free(fidelity);
+		fidelity = NULL;
+	}
+
+	free(workers);
+	free(sched.ops);
+	free(sched.objs);
+	trace_close(trace);
+
+	return ret < 0 ? 1 : 0;
+}
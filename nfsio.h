@@ -1,3 +1,69 @@
+#ifndef _NFSIO_H_
+#define _NFSIO_H_
+
+#include "trace.h"
+
+struct options {
+	const char *backend;
+	int nprocs;
+	int sync_open;
+	int sync_dirs;
+	int do_fsync;
+	int no_resolve;
+	int fsync_frequency;
+	char *tcp_options;
+	int timelimit;
+	int warmup;
+	const char *directory;
+	char *loadfile;
+	double targetrate;
+	int ea_enable;
+	int clients_per_process;
+	int one_byte_write_fix;
+	int stat_check;
+	int fake_io;
+	int skip_cleanup;
+	int per_client_results;
+	const char *nfs;
+	int nlm;
+	int handles;
+	int queue_depth;
+	int spread_files;
+	double speed;
+	const char *handle_cache;
+	int handle_cache_mem;
+	int negative_cache;
+	int attr_cache;
+	int acregmin;
+	int acregmax;
+	int acdirmin;
+	int acdirmax;
+	int verify;
+	int payload_seed;
+	double compress_ratio;
+	double dedupe_ratio;
+	int live;
+	const char *timeline;
+	const char *oplog;
+	int fidelity;
+	const char *server;
+	int run_once;
+	int allow_scsi_writes;
+	int trunc_io;
+	const char *scsi_dev;
+	const char *iscsi_device;
+	const char *iscsi_initiatorname;
+	int machine_readable;
+	const char *smb_share;
+	const char *smb_user;
+};
+
+extern struct options options;
+
+int nfs3_replay(const char *loadfile);
+
 void do_nfs3_mkdir (nfsio *nio, const char *name);
 void do_nfs3_create (nfsio *nio, const char *name);
 void do_nfs3_rename(nfsio * nio, const char * oldname, const char *newname);
+
+#endif /* _NFSIO_H_ */
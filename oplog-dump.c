@@ -0,0 +1,107 @@
+/*
+   Print a log of the ops a replay completed
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <popt.h>
+
+#include "oplog.h"
+#include "trace.h"
+
+static void print_time(uint64_t ns, uint64_t start, int wall)
+{
+	if (wall) {
+		ns += start;
+	}
+	printf("%" PRIu64 ".%09" PRIu64, ns / 1000000000, ns % 1000000000);
+}
+
+static void show_usage(void)
+{
+	printf("usage: nfs-oplog-dump [OPTIONS] oplog\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	int opt;
+	int wall = 0;
+	const char *input;
+	unsigned long count = 0;
+	struct oplog_header hdr;
+	struct oplog_rec rec;
+	FILE *f;
+	poptContext pc;
+	struct poptOption popt_options[] = {
+		POPT_AUTOHELP
+		{ "wall", 'w', POPT_ARG_NONE, &wall, 0,
+		  "print wall clock times instead of times since the start of the replay", NULL },
+		POPT_TABLEEND
+	};
+
+	pc = poptGetContext(argv[0], argc, argv, popt_options, 0);
+	while ((opt = poptGetNextOpt(pc)) != -1) {
+		fprintf(stderr, "Invalid option %s: %s\n",
+			poptBadOption(pc, 0), poptStrerror(opt));
+		show_usage();
+		exit(1);
+	}
+
+	input = poptGetArg(pc);
+	if (input == NULL) {
+		show_usage();
+		exit(1);
+	}
+
+	f = strcmp(input, "-") ? fopen(input, "r") : stdin;
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s. %s\n", input, strerror(errno));
+		exit(1);
+	}
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, OPLOG_MAGIC, sizeof(hdr.magic)) != 0) {
+		fprintf(stderr, "%s is not an op log\n", input);
+		exit(1);
+	}
+	if (hdr.record_size != sizeof(rec)) {
+		fprintf(stderr, "%s has records of %u bytes, expected %zu\n",
+			input, hdr.record_size, sizeof(rec));
+		exit(1);
+	}
+
+	printf("# issued completed latency(us) worker client line op bytes status\n");
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		print_time(rec.issued, hdr.start, wall);
+		putchar(' ');
+		print_time(rec.completed, hdr.start, wall);
+		printf(" %.3f %u %u %" PRIu64 " %s %u 0x%08x\n",
+		       (rec.completed - rec.issued) / 1000.0, rec.worker, rec.client,
+		       rec.line, trace_op_name(rec.opcode), rec.bytes, rec.status);
+		count++;
+	}
+	if (ferror(f)) {
+		fprintf(stderr, "Failed to read %s. %s\n", input, strerror(errno));
+		exit(1);
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
+	poptFreeContext(pc);
+
+	fprintf(stderr, "%lu ops\n", count);
+	return 0;
+}
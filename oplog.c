@@ -0,0 +1,234 @@
+/*
+   Log of the ops a replay completed
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "oplog.h"
+
+#define OPLOG_CHUNK	1024
+
+struct oplog_chunk {
+	struct oplog_chunk *next;
+	unsigned count;
+	struct oplog_rec rec[OPLOG_CHUNK];
+};
+
+struct oplog {
+	int fd;
+	const char *path;
+	pthread_t thread;
+
+	/* full chunks waiting for the writer, and empty ones it gave back */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct oplog_chunk *full, **full_last;
+	struct oplog_chunk *empty;
+	int stop;
+	int error;
+
+	/* the chunk each worker is filling */
+	unsigned workers;
+	struct oplog_chunk **cur;
+};
+
+static struct oplog_chunk *chunk_new(void)
+{
+	struct oplog_chunk *c = malloc(sizeof(struct oplog_chunk));
+
+	if (c == NULL) {
+		fprintf(stderr, "MALLOC failed to allocate the op log\n");
+		exit(10);
+	}
+	c->count = 0;
+	return c;
+}
+
+static int write_all(struct oplog *log, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(log->fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Failed to write %s. %s\n", log->path, strerror(errno));
+			return -1;
+		}
+		buf  = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void *oplog_main(void *private_data)
+{
+	struct oplog *log = private_data;
+	struct oplog_chunk *c, *next;
+	int error = 0;
+
+	pthread_mutex_lock(&log->lock);
+	for (;;) {
+		while (log->full == NULL && !log->stop) {
+			pthread_cond_wait(&log->cond, &log->lock);
+		}
+		c = log->full;
+		if (c == NULL) {
+			break;
+		}
+		log->full      = NULL;
+		log->full_last = &log->full;
+		pthread_mutex_unlock(&log->lock);
+
+		for (next = c; next != NULL; next = next->next) {
+			if (!error) {
+				error = write_all(log, next->rec,
+						  next->count * sizeof(struct oplog_rec));
+			}
+		}
+
+		pthread_mutex_lock(&log->lock);
+		for (; c != NULL; c = next) {
+			next = c->next;
+			c->count = 0;
+			c->next  = log->empty;
+			log->empty = c;
+		}
+	}
+	log->error = error;
+	pthread_mutex_unlock(&log->lock);
+
+	return NULL;
+}
+
+/* hand c to the writer, and get an empty chunk for what comes next */
+static struct oplog_chunk *oplog_submit(struct oplog *log, struct oplog_chunk *c)
+{
+	struct oplog_chunk *e;
+
+	pthread_mutex_lock(&log->lock);
+	c->next = NULL;
+	*log->full_last = c;
+	log->full_last  = &c->next;
+	pthread_cond_signal(&log->cond);
+	e = log->empty;
+	if (e != NULL) {
+		log->empty = e->next;
+	}
+	pthread_mutex_unlock(&log->lock);
+
+	return e != NULL ? e : chunk_new();
+}
+
+void oplog_add(struct oplog *log, unsigned worker, const struct oplog_rec *rec)
+{
+	struct oplog_chunk *c = log->cur[worker];
+
+	c->rec[c->count++] = *rec;
+	if (c->count == OPLOG_CHUNK) {
+		log->cur[worker] = oplog_submit(log, c);
+	}
+}
+
+struct oplog *oplog_open(const char *path, unsigned workers, uint64_t start)
+{
+	struct oplog_header hdr;
+	struct oplog *log;
+	unsigned i;
+
+	log = calloc(1, sizeof(struct oplog));
+	if (log == NULL) {
+		fprintf(stderr, "Failed to allocate the op log\n");
+		return NULL;
+	}
+	log->path = path;
+	log->fd   = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (log->fd < 0) {
+		fprintf(stderr, "Failed to open %s. %s\n", path, strerror(errno));
+		free(log);
+		return NULL;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OPLOG_MAGIC, sizeof(hdr.magic));
+	hdr.record_size = sizeof(struct oplog_rec);
+	hdr.workers     = workers;
+	hdr.start       = start;
+	if (write_all(log, &hdr, sizeof(hdr)) != 0) {
+		close(log->fd);
+		free(log);
+		return NULL;
+	}
+
+	log->workers = workers;
+	log->cur     = calloc(workers, sizeof(struct oplog_chunk *));
+	if (log->cur == NULL) {
+		fprintf(stderr, "Failed to allocate the op log\n");
+		exit(10);
+	}
+	for (i = 0; i < workers; i++) {
+		log->cur[i] = chunk_new();
+	}
+	log->full_last = &log->full;
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->cond, NULL);
+	if (pthread_create(&log->thread, NULL, oplog_main, log) != 0) {
+		fprintf(stderr, "Failed to start the op log writer\n");
+		exit(10);
+	}
+	return log;
+}
+
+int oplog_close(struct oplog *log)
+{
+	struct oplog_chunk *c;
+	unsigned i;
+	int ret;
+
+	pthread_mutex_lock(&log->lock);
+	for (i = 0; i < log->workers; i++) {
+		c = log->cur[i];
+		c->next = NULL;
+		*log->full_last = c;
+		log->full_last  = &c->next;
+	}
+	log->stop = 1;
+	pthread_cond_signal(&log->cond);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->thread, NULL);
+
+	while ((c = log->empty) != NULL) {
+		log->empty = c->next;
+		free(c);
+	}
+	ret = log->error;
+	if (close(log->fd) != 0) {
+		fprintf(stderr, "Failed to close %s. %s\n", log->path, strerror(errno));
+		ret = -1;
+	}
+	pthread_mutex_destroy(&log->lock);
+	pthread_cond_destroy(&log->cond);
+	free(log->cur);
+	free(log);
+
+	return ret;
+}
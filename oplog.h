@@ -0,0 +1,54 @@
+/*
+   Log of the ops a replay completed
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#ifndef _OPLOG_H_
+#define _OPLOG_H_
+
+#include <stdint.h>
+
+/*
+ * The file is a header followed by one record per op, in the byte order
+ * of the machine that wrote it, in the order the ops completed on each
+ * worker.
+ */
+#define OPLOG_MAGIC	"NFSOPLG1"
+
+struct oplog_header {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t workers;
+	uint64_t start;		/* wall clock at the start of the replay, ns since the epoch */
+};
+
+struct oplog_rec {
+	uint64_t line;		/* line (or record) number in the trace */
+	uint64_t issued;	/* ns since the start of the replay */
+	uint64_t completed;
+	uint32_t bytes;		/* data READ3 or WRITE3 moved */
+	uint32_t status;	/* nfsstat3 or nlmstat4 */
+	uint16_t opcode;
+	uint16_t worker;
+	uint32_t client;	/* traced client */
+};
+
+struct oplog;
+
+/*
+ * Each worker adds its records to buffers of its own, which a thread of
+ * the log writes out as they fill up. Close once the workers are done.
+ */
+struct oplog *oplog_open(const char *path, unsigned workers, uint64_t start);
+void oplog_add(struct oplog *log, unsigned worker, const struct oplog_rec *rec);
+int oplog_close(struct oplog *log);
+
+#endif /* _OPLOG_H_ */
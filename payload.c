@@ -0,0 +1,171 @@
+/*
+   Data written and read back by the replay
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+/*
+ * Files are written in blocks of PAYLOAD_BLOCK bytes, each a function of
+ * the file, its place in the file and the seed, so that any range read
+ * back can be checked without remembering what was written where.
+ *
+ * A block starts with random bytes from a xorshift128+ generator run on
+ * four lanes at once, with GCC vector extensions that become SSE or AVX
+ * code as the target allows, and ends with a byte repeated, as much of it
+ * as it takes for the block to compress as asked. Some blocks, picked by
+ * a hash of where they are, are one of PAYLOAD_SHARED blocks every file
+ * has, which is what a deduplicating server finds twice.
+ *
+ * No word is zero, a zeroed word is a hole or a range never written.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "payload.h"
+
+#define PAYLOAD_BLOCK	4096
+#define PAYLOAD_SHARED	64
+
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+
+static struct {
+	uint64_t seed;
+	uint32_t random_bytes;	/* per block, a multiple of sizeof(v4u64) */
+	uint32_t shared;	/* blocks out of 2^32 that are shared ones */
+} payload = { 0, PAYLOAD_BLOCK, 0 };
+
+int payload_init(uint64_t seed, double compress_ratio, double dedupe_ratio)
+{
+	uint32_t random_bytes = PAYLOAD_BLOCK;
+
+	if (compress_ratio > 1) {
+		random_bytes = PAYLOAD_BLOCK / compress_ratio;
+		random_bytes -= random_bytes % sizeof(v4u64);
+		if (random_bytes == 0) {
+			fprintf(stderr, "Compression ratio %g is too high, at most %zu\n",
+				compress_ratio, PAYLOAD_BLOCK / sizeof(v4u64));
+			return -1;
+		}
+	}
+	payload.seed         = seed;
+	payload.random_bytes = random_bytes;
+	payload.shared       = dedupe_ratio > 1 ? (1 - 1 / dedupe_ratio) * 4294967295.0 : 0;
+	return 0;
+}
+
+static inline uint64_t mix64(uint64_t z)
+{
+	z += 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t block_key(uint64_t file, uint64_t block)
+{
+	uint64_t h = mix64(mix64(file ^ payload.seed) + block);
+
+	if ((uint32_t)h < payload.shared) {
+		return mix64(payload.seed + (h >> 32) % PAYLOAD_SHARED);
+	}
+	return h;
+}
+
+static void block_fill(char *buf, uint64_t key)
+{
+	v4u64 s0 = { mix64(key), mix64(key + 1), mix64(key + 2), mix64(key + 3) };
+	v4u64 s1 = { mix64(key + 4), mix64(key + 5), mix64(key + 6), mix64(key + 7) };
+	v4u64 x, y, r;
+	uint32_t i;
+
+	for (i = 0; i < payload.random_bytes; i += sizeof(v4u64)) {
+		x  = s0;
+		y  = s1;
+		s0 = y;
+		x ^= x << 23;
+		s1 = x ^ y ^ (x >> 17) ^ (y >> 26);
+		r  = (s1 + y) | 1;
+		memcpy(buf + i, &r, sizeof(r));
+	}
+	memset(buf + i, (int)(key >> 56) | 1, PAYLOAD_BLOCK - i);
+}
+
+void payload_fill(char *buf, uint64_t file, uint64_t offset, size_t len)
+{
+	char tmp[PAYLOAD_BLOCK] __attribute__((aligned(32)));
+	uint64_t block = offset / PAYLOAD_BLOCK;
+	size_t skip = offset % PAYLOAD_BLOCK, n;
+
+	while (len > 0) {
+		n = PAYLOAD_BLOCK - skip < len ? PAYLOAD_BLOCK - skip : len;
+		if (n == PAYLOAD_BLOCK) {
+			block_fill(buf, block_key(file, block));
+		} else {
+			block_fill(tmp, block_key(file, block));
+			memcpy(buf, tmp + skip, n);
+		}
+		buf  += n;
+		len  -= n;
+		skip  = 0;
+		block++;
+	}
+}
+
+/* the first byte of buf that is neither as expected nor in a zeroed word */
+static size_t first_bad(const char *buf, const char *expected, uint64_t offset, size_t len)
+{
+	size_t i = 0, end, j;
+
+	while (i < len) {
+		end = i + 8 - (offset + i) % 8;
+		if (end > len) {
+			end = len;
+		}
+		for (j = i; j < end && buf[j] == 0; j++) {
+		}
+		if (j < end) {
+			for (j = i; j < end; j++) {
+				if (buf[j] != expected[j]) {
+					return j;
+				}
+			}
+		}
+		i = end;
+	}
+	return len;
+}
+
+int payload_check(const char *buf, uint64_t file, uint64_t offset, size_t len,
+		  uint64_t *bad)
+{
+	char tmp[PAYLOAD_BLOCK] __attribute__((aligned(32)));
+	uint64_t block = offset / PAYLOAD_BLOCK;
+	size_t skip = offset % PAYLOAD_BLOCK, n, i;
+
+	while (len > 0) {
+		n = PAYLOAD_BLOCK - skip < len ? PAYLOAD_BLOCK - skip : len;
+		block_fill(tmp, block_key(file, block));
+		if (memcmp(buf, tmp + skip, n) != 0) {
+			i = first_bad(buf, tmp + skip, offset, n);
+			if (i < n) {
+				*bad = offset + i;
+				return -1;
+			}
+		}
+		buf    += n;
+		offset += n;
+		len    -= n;
+		skip    = 0;
+		block++;
+	}
+	return 0;
+}
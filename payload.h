@@ -0,0 +1,41 @@
+/*
+   Data written and read back by the replay
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#ifndef _PAYLOAD_H_
+#define _PAYLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * How the data looks to the server: seed changes all of it, and the data
+ * compresses about compress_ratio:1 and dedupes about dedupe_ratio:1.
+ * Ratios of 1 or less give data that does neither. Call before any I/O.
+ */
+int payload_init(uint64_t seed, double compress_ratio, double dedupe_ratio);
+
+/*
+ * The bytes at offset..offset+len of the file with key file, as the
+ * replay writes them, the same whichever write they come from.
+ */
+void payload_fill(char *buf, uint64_t file, uint64_t offset, size_t len);
+
+/*
+ * Check what a READ at offset returned against what was written: 0 if it
+ * matches, -1 with the file offset of the first bad byte in *bad if not.
+ * Zeroed words are taken as never written.
+ */
+int payload_check(const char *buf, uint64_t file, uint64_t offset, size_t len,
+		  uint64_t *bad);
+
+#endif /* _PAYLOAD_H_ */
@@ -0,0 +1,960 @@
+/*
+   Binary NFS traces
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "trace.h"
+
+/*
+ * A binary trace is a file header followed by blocks of up to
+ * TRACE_BIN_BLOCK_OPS ops. Each block is stored column by column, every
+ * column a run of LEB128 varints, and the whole block is deflated:
+ *
+ *   file header:  "NFSTRACE" version:u32 block_ops:u32
+ *   block header: nops:u32 ndict:u32 raw_len:u32 comp_len:u32 col_len:u32[COL_MAX]
+ *   block data:   zlib(dict | opcode | line | time | client | fname | fname2 |
+ *                      status | nparams | params | fhdict | fh | fh2 | res_fh |
+ *                      latency | dirents)
+ *
+ * Paths and status strings live in a dictionary that grows as the trace is
+ * written; a block carries the entries first referenced in it, so blocks
+ * must be read in order. Timestamps and line numbers are delta encoded
+ * from the previous op in the same block, params are zigzag encoded and
+ * only the params up to the last non-zero one are stored. String columns
+ * hold dictionary index + 1, 0 meaning no string. File handles have a
+ * dictionary of their own that works the same way. The dirents column
+ * holds, for each op, the number of READDIRPLUS3 entries it carries and
+ * then a (name, handle) pair of indexes per entry. All header fields are
+ * little endian.
+ *
+ * Version 1 traces have no handle columns, version 2 ones no latency
+ * column and version 3 ones no dirents column.
+ */
+
+#define TRACE_BIN_MAGIC "NFSTRACE"
+#define TRACE_BIN_VERSION 4
+#define TRACE_BIN_BLOCK_OPS 65536
+/* the most ops a block of a trace being read may have */
+#define TRACE_BIN_MAX_BLOCK_OPS (1 << 20)
+
+enum {
+	COL_DICT = 0,
+	COL_OPCODE,
+	COL_LINE,
+	COL_TIME,
+	COL_CLIENT,
+	COL_FNAME,
+	COL_FNAME2,
+	COL_STATUS,
+	COL_NPARAMS,
+	COL_PARAMS,
+	COL_FHDICT,
+	COL_FH,
+	COL_FH2,
+	COL_RES_FH,
+	COL_LATENCY,
+	COL_DIRENTS,
+	COL_MAX
+};
+
+#define BLOCK_HEADER_LEN(ncols) (4 * (4 + (ncols)))
+
+struct buf {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+};
+
+static void buf_reserve(struct buf *b, size_t len)
+{
+	if (b->len + len <= b->size) {
+		return;
+	}
+	while (b->len + len > b->size) {
+		b->size = b->size ? b->size * 2 : 4096;
+	}
+	b->data = realloc(b->data, b->size);
+	if (b->data == NULL) {
+		fprintf(stderr, "Failed to realloc trace buffer\n");
+		exit(10);
+	}
+}
+
+static inline void put_varint(struct buf *b, uint64_t v)
+{
+	buf_reserve(b, 10);
+	while (v >= 0x80) {
+		b->data[b->len++] = v | 0x80;
+		v >>= 7;
+	}
+	b->data[b->len++] = v;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t hash_string(const char *s)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (*s) {
+		h ^= (unsigned char)*s++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t hash_fh(const struct trace_fh *fh)
+{
+	uint64_t h = 14695981039346656037ULL;
+	uint32_t i;
+
+	for (i = 0; i < fh->len; i++) {
+		h ^= fh->data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * Strings are copied into large chunks that are never moved or freed
+ * before the trace is closed, so ops can keep pointing at them.
+ */
+#define STRING_CHUNK (1024 * 1024)
+
+struct string_chunk {
+	struct string_chunk *next;
+	size_t used;
+	char data[STRING_CHUNK];
+};
+
+struct dict {
+	struct string_chunk *chunks;
+	char **strings;
+	uint32_t count;
+	uint32_t size;
+
+	/* writer only: string -> index + 1 */
+	uint32_t *hash;
+	uint32_t hash_size;
+};
+
+static char *dict_copy(struct dict *dict, const char *s, size_t len)
+{
+	struct string_chunk *c = dict->chunks;
+	char *p;
+
+	if (c == NULL || c->used + len + 1 > STRING_CHUNK) {
+		c = malloc(sizeof(struct string_chunk));
+		if (c == NULL) {
+			fprintf(stderr, "Failed to malloc trace string chunk\n");
+			exit(10);
+		}
+		c->next = dict->chunks;
+		c->used = 0;
+		dict->chunks = c;
+	}
+	p = &c->data[c->used];
+	memcpy(p, s, len);
+	p[len] = 0;
+	c->used += len + 1;
+	return p;
+}
+
+static uint32_t dict_append(struct dict *dict, const char *s, size_t len)
+{
+	if (dict->count == dict->size) {
+		dict->size = dict->size ? dict->size * 2 : 1024;
+		dict->strings = realloc(dict->strings, dict->size * sizeof(char *));
+		if (dict->strings == NULL) {
+			fprintf(stderr, "Failed to realloc trace dictionary\n");
+			exit(10);
+		}
+	}
+	dict->strings[dict->count] = dict_copy(dict, s, len);
+	return dict->count++;
+}
+
+static void dict_rehash(struct dict *dict)
+{
+	uint32_t i, j, mask;
+
+	free(dict->hash);
+	dict->hash_size = dict->hash_size ? dict->hash_size * 2 : 4096;
+	dict->hash = calloc(dict->hash_size, sizeof(uint32_t));
+	if (dict->hash == NULL) {
+		fprintf(stderr, "Failed to calloc trace dictionary hash\n");
+		exit(10);
+	}
+
+	mask = dict->hash_size - 1;
+	for (i = 0; i < dict->count; i++) {
+		j = hash_string(dict->strings[i]) & mask;
+		while (dict->hash[j] != 0) {
+			j = (j + 1) & mask;
+		}
+		dict->hash[j] = i + 1;
+	}
+}
+
+/* Returns the index of s, adding it to both dict and out if it is new. */
+static uint32_t dict_intern(struct dict *dict, const char *s, struct buf *out)
+{
+	uint32_t j, mask;
+	size_t len;
+
+	if (dict->count * 2 >= dict->hash_size) {
+		dict_rehash(dict);
+	}
+
+	mask = dict->hash_size - 1;
+	for (j = hash_string(s) & mask; dict->hash[j] != 0; j = (j + 1) & mask) {
+		if (strcmp(dict->strings[dict->hash[j] - 1], s) == 0) {
+			return dict->hash[j] - 1;
+		}
+	}
+
+	len = strlen(s);
+	if (len >= STRING_CHUNK) {
+		fprintf(stderr, "Trace string too long: %zu bytes\n", len);
+		exit(10);
+	}
+	put_varint(out, len);
+	buf_reserve(out, len);
+	memcpy(&out->data[out->len], s, len);
+	out->len += len;
+
+	dict->hash[j] = dict_append(dict, s, len) + 1;
+	return dict->hash[j] - 1;
+}
+
+static void dict_free(struct dict *dict)
+{
+	struct string_chunk *c;
+
+	while ((c = dict->chunks) != NULL) {
+		dict->chunks = c->next;
+		free(c);
+	}
+	free(dict->strings);
+	free(dict->hash);
+}
+
+/*
+ * The handle dictionary keeps whole struct trace_fh in chunks that are not
+ * moved or freed before the trace is closed either.
+ */
+#define FH_CHUNK 4096
+
+struct fh_chunk {
+	struct fh_chunk *next;
+	uint32_t used;
+	struct trace_fh fhs[FH_CHUNK];
+};
+
+struct fh_dict {
+	struct fh_chunk *chunks;
+	struct trace_fh **fhs;
+	uint32_t count;
+	uint32_t size;
+
+	/* writer only: handle -> index + 1 */
+	uint32_t *hash;
+	uint32_t hash_size;
+};
+
+static uint32_t fh_dict_append(struct fh_dict *dict, const unsigned char *data, uint32_t len)
+{
+	struct fh_chunk *c = dict->chunks;
+	struct trace_fh *fh;
+
+	if (c == NULL || c->used == FH_CHUNK) {
+		c = malloc(sizeof(struct fh_chunk));
+		if (c == NULL) {
+			fprintf(stderr, "Failed to malloc trace handle chunk\n");
+			exit(10);
+		}
+		c->next = dict->chunks;
+		c->used = 0;
+		dict->chunks = c;
+	}
+	if (dict->count == dict->size) {
+		dict->size = dict->size ? dict->size * 2 : 1024;
+		dict->fhs = realloc(dict->fhs, dict->size * sizeof(struct trace_fh *));
+		if (dict->fhs == NULL) {
+			fprintf(stderr, "Failed to realloc trace handle dictionary\n");
+			exit(10);
+		}
+	}
+
+	fh = &c->fhs[c->used++];
+	fh->len = len;
+	memcpy(fh->data, data, len);
+	dict->fhs[dict->count] = fh;
+	return dict->count++;
+}
+
+static void fh_dict_rehash(struct fh_dict *dict)
+{
+	uint32_t i, j, mask;
+
+	free(dict->hash);
+	dict->hash_size = dict->hash_size ? dict->hash_size * 2 : 4096;
+	dict->hash = calloc(dict->hash_size, sizeof(uint32_t));
+	if (dict->hash == NULL) {
+		fprintf(stderr, "Failed to calloc trace handle hash\n");
+		exit(10);
+	}
+
+	mask = dict->hash_size - 1;
+	for (i = 0; i < dict->count; i++) {
+		j = hash_fh(dict->fhs[i]) & mask;
+		while (dict->hash[j] != 0) {
+			j = (j + 1) & mask;
+		}
+		dict->hash[j] = i + 1;
+	}
+}
+
+/* Returns the index of fh, adding it to both dict and out if it is new. */
+static uint32_t fh_dict_intern(struct fh_dict *dict, const struct trace_fh *fh,
+			       struct buf *out)
+{
+	const struct trace_fh *e;
+	uint32_t j, mask;
+
+	if (dict->count * 2 >= dict->hash_size) {
+		fh_dict_rehash(dict);
+	}
+
+	mask = dict->hash_size - 1;
+	for (j = hash_fh(fh) & mask; dict->hash[j] != 0; j = (j + 1) & mask) {
+		e = dict->fhs[dict->hash[j] - 1];
+		if (e->len == fh->len && memcmp(e->data, fh->data, fh->len) == 0) {
+			return dict->hash[j] - 1;
+		}
+	}
+
+	put_varint(out, fh->len);
+	buf_reserve(out, fh->len);
+	memcpy(&out->data[out->len], fh->data, fh->len);
+	out->len += fh->len;
+
+	dict->hash[j] = fh_dict_append(dict, fh->data, fh->len) + 1;
+	return dict->hash[j] - 1;
+}
+
+static void fh_dict_free(struct fh_dict *dict)
+{
+	struct fh_chunk *c;
+
+	while ((c = dict->chunks) != NULL) {
+		dict->chunks = c->next;
+		free(c);
+	}
+	free(dict->fhs);
+	free(dict->hash);
+}
+
+
+struct trace_writer {
+	FILE *f;
+	const char *path;
+	int level;
+	struct dict dict;
+	struct fh_dict fh_dict;
+	struct buf cols[COL_MAX];
+	struct buf raw;
+	struct buf comp;
+	uint32_t nops;
+	uint32_t ndict;
+	unsigned long last_line;
+	uint64_t last_time;
+};
+
+struct trace_writer *trace_writer_open(const char *path, int level)
+{
+	struct trace_writer *w;
+	unsigned char hdr[16];
+
+	w = malloc(sizeof(struct trace_writer));
+	if (w == NULL) {
+		fprintf(stderr, "Failed to malloc trace writer\n");
+		return NULL;
+	}
+	memset(w, 0, sizeof(struct trace_writer));
+	w->path  = path;
+	w->level = level;
+
+	w->f = fopen(path, "w");
+	if (w->f == NULL) {
+		fprintf(stderr, "Failed to open %s. %s\n", path, strerror(errno));
+		free(w);
+		return NULL;
+	}
+
+	memcpy(hdr, TRACE_BIN_MAGIC, 8);
+	put_u32(&hdr[8], TRACE_BIN_VERSION);
+	put_u32(&hdr[12], TRACE_BIN_BLOCK_OPS);
+	if (fwrite(hdr, sizeof(hdr), 1, w->f) != 1) {
+		fprintf(stderr, "Failed to write %s. %s\n", path, strerror(errno));
+		fclose(w->f);
+		free(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+static int trace_writer_flush(struct trace_writer *w)
+{
+	unsigned char hdr[BLOCK_HEADER_LEN(COL_MAX)];
+	uLongf comp_len;
+	int i;
+
+	if (w->nops == 0) {
+		return 0;
+	}
+
+	w->raw.len = 0;
+	for (i = 0; i < COL_MAX; i++) {
+		if (w->cols[i].len == 0) {
+			continue;
+		}
+		buf_reserve(&w->raw, w->cols[i].len);
+		memcpy(&w->raw.data[w->raw.len], w->cols[i].data, w->cols[i].len);
+		w->raw.len += w->cols[i].len;
+	}
+
+	comp_len = compressBound(w->raw.len);
+	w->comp.len = 0;
+	buf_reserve(&w->comp, comp_len);
+	if (compress2(w->comp.data, &comp_len, w->raw.data, w->raw.len,
+		      w->level) != Z_OK) {
+		fprintf(stderr, "Failed to compress trace block\n");
+		return -1;
+	}
+
+	put_u32(&hdr[0], w->nops);
+	put_u32(&hdr[4], w->ndict);
+	put_u32(&hdr[8], w->raw.len);
+	put_u32(&hdr[12], comp_len);
+	for (i = 0; i < COL_MAX; i++) {
+		put_u32(&hdr[16 + 4 * i], w->cols[i].len);
+		w->cols[i].len = 0;
+	}
+
+	if (fwrite(hdr, sizeof(hdr), 1, w->f) != 1 ||
+	    fwrite(w->comp.data, comp_len, 1, w->f) != 1) {
+		fprintf(stderr, "Failed to write %s. %s\n", w->path, strerror(errno));
+		return -1;
+	}
+
+	w->nops  = 0;
+	w->ndict = 0;
+	return 0;
+}
+
+static uint64_t trace_writer_string(struct trace_writer *w, const char *s)
+{
+	uint32_t count = w->dict.count;
+	uint32_t idx;
+
+	if (s == NULL) {
+		return 0;
+	}
+	idx = dict_intern(&w->dict, s, &w->cols[COL_DICT]);
+	if (w->dict.count != count) {
+		w->ndict++;
+	}
+	return idx + 1;
+}
+
+static uint64_t trace_writer_fh(struct trace_writer *w, const struct trace_fh *fh)
+{
+	if (fh == NULL || fh->len == 0 || fh->len > sizeof(fh->data)) {
+		return 0;
+	}
+	return fh_dict_intern(&w->fh_dict, fh, &w->cols[COL_FHDICT]) + 1;
+}
+
+int trace_writer_add(struct trace_writer *w, const struct dbench_op *op)
+{
+	int i, nparams;
+
+	if (w->nops == 0) {
+		w->last_line = 0;
+		w->last_time = 0;
+	}
+
+	put_varint(&w->cols[COL_OPCODE], op->opcode);
+	put_varint(&w->cols[COL_LINE], zigzag(op->line - w->last_line));
+	put_varint(&w->cols[COL_TIME], zigzag(op->timestamp - w->last_time));
+	put_varint(&w->cols[COL_CLIENT], op->client);
+	put_varint(&w->cols[COL_FNAME], trace_writer_string(w, op->fname));
+	put_varint(&w->cols[COL_FNAME2], trace_writer_string(w, op->fname2));
+	put_varint(&w->cols[COL_STATUS], trace_writer_string(w, op->status));
+
+	for (nparams = 10; nparams > 0 && op->params[nparams - 1] == 0; nparams--)
+		;
+	put_varint(&w->cols[COL_NPARAMS], nparams);
+	for (i = 0; i < nparams; i++) {
+		put_varint(&w->cols[COL_PARAMS], zigzag(op->params[i]));
+	}
+
+	put_varint(&w->cols[COL_FH], trace_writer_fh(w, op->fh));
+	put_varint(&w->cols[COL_FH2], trace_writer_fh(w, op->fh2));
+	put_varint(&w->cols[COL_RES_FH], trace_writer_fh(w, op->res_fh));
+	put_varint(&w->cols[COL_LATENCY], op->latency);
+	put_varint(&w->cols[COL_DIRENTS], op->ndirents);
+	for (i = 0; i < op->ndirents; i++) {
+		put_varint(&w->cols[COL_DIRENTS], trace_writer_string(w, op->dirents[i].name));
+		put_varint(&w->cols[COL_DIRENTS], trace_writer_fh(w, op->dirents[i].fh));
+	}
+
+	w->last_line = op->line;
+	w->last_time = op->timestamp;
+
+	if (++w->nops == TRACE_BIN_BLOCK_OPS) {
+		return trace_writer_flush(w);
+	}
+	return 0;
+}
+
+int trace_writer_close(struct trace_writer *w)
+{
+	int ret, i;
+
+	ret = trace_writer_flush(w);
+	if (fclose(w->f) != 0) {
+		fprintf(stderr, "Failed to close %s. %s\n", w->path, strerror(errno));
+		ret = -1;
+	}
+
+	dict_free(&w->dict);
+	fh_dict_free(&w->fh_dict);
+	for (i = 0; i < COL_MAX; i++) {
+		free(w->cols[i].data);
+	}
+	free(w->raw.data);
+	free(w->comp.data);
+	free(w);
+
+	return ret;
+}
+
+
+/*
+ * The entries of the READDIRPLUS3 ops read. Their names and handles are in
+ * the dictionaries, only the arrays are handed out from these chunks.
+ */
+#define DIRENT_CHUNK (64 * 1024)
+
+struct dirent_chunk {
+	struct dirent_chunk *next;
+	unsigned long max_line;
+	size_t used;
+	struct trace_dirent dirents[DIRENT_CHUNK / sizeof(struct trace_dirent)];
+};
+
+struct trace_bin {
+	FILE *f;
+	const char *path;
+	struct dict dict;
+	struct fh_dict fh_dict;
+	struct buf raw;
+	struct buf comp;
+	struct dbench_op *ops;
+	int ncols;
+	uint32_t nops;
+	uint32_t next;
+	uint32_t block_ops;
+	int corrupt;		/* a varint of the block ran on too long */
+	struct dirent_chunk *dirent_head, *dirent_tail, *dirent_spare;
+};
+
+int trace_bin_probe(const char *magic, int len)
+{
+	return len >= 8 && memcmp(magic, TRACE_BIN_MAGIC, 8) == 0;
+}
+
+struct trace_bin *trace_bin_open(const char *path)
+{
+	struct trace_bin *bin;
+	unsigned char hdr[16];
+
+	bin = malloc(sizeof(struct trace_bin));
+	if (bin == NULL) {
+		fprintf(stderr, "Failed to malloc binary trace\n");
+		return NULL;
+	}
+	memset(bin, 0, sizeof(struct trace_bin));
+	bin->path = path;
+
+	bin->f = fopen(path, "r");
+	if (bin->f == NULL) {
+		fprintf(stderr, "Failed to open trace %s. %s\n", path, strerror(errno));
+		free(bin);
+		return NULL;
+	}
+	if (fread(hdr, sizeof(hdr), 1, bin->f) != 1 ||
+	    memcmp(hdr, TRACE_BIN_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s is not a binary trace\n", path);
+		goto failed;
+	}
+	switch (get_u32(&hdr[8])) {
+	case 1:
+		bin->ncols = COL_FHDICT;
+		break;
+	case 2:
+		bin->ncols = COL_LATENCY;
+		break;
+	case 3:
+		bin->ncols = COL_DIRENTS;
+		break;
+	case TRACE_BIN_VERSION:
+		bin->ncols = COL_MAX;
+		break;
+	default:
+		fprintf(stderr, "Unsupported binary trace version %u in %s\n",
+			get_u32(&hdr[8]), path);
+		goto failed;
+	}
+
+	bin->block_ops = get_u32(&hdr[12]);
+	if (bin->block_ops == 0 || bin->block_ops > TRACE_BIN_MAX_BLOCK_OPS) {
+		fprintf(stderr, "Bad block size of %u ops in %s\n", bin->block_ops, path);
+		goto failed;
+	}
+	bin->ops = malloc(bin->block_ops * sizeof(struct dbench_op));
+	if (bin->ops == NULL) {
+		fprintf(stderr, "Failed to malloc binary trace ops\n");
+		goto failed;
+	}
+
+	return bin;
+
+failed:
+	fclose(bin->f);
+	free(bin);
+	return NULL;
+}
+
+/* a varint takes 10 bytes at most, a longer one makes the block corrupt */
+static inline uint64_t get_varint(struct trace_bin *bin, const unsigned char **p,
+				  const unsigned char *end)
+{
+	uint64_t v = 0;
+	int shift = 0;
+
+	while (*p < end) {
+		unsigned char c = *(*p)++;
+
+		v |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			break;
+		}
+		shift += 7;
+		if (shift >= 70) {
+			bin->corrupt = 1;
+			return 0;
+		}
+	}
+	return v;
+}
+
+static const char *trace_bin_string(struct trace_bin *bin, uint64_t idx)
+{
+	if (idx == 0 || idx > bin->dict.count) {
+		return NULL;
+	}
+	return bin->dict.strings[idx - 1];
+}
+
+static const struct trace_fh *trace_bin_fh(struct trace_bin *bin, uint64_t idx)
+{
+	if (idx == 0 || idx > bin->fh_dict.count) {
+		return NULL;
+	}
+	return bin->fh_dict.fhs[idx - 1];
+}
+
+static struct trace_dirent *dirent_alloc(struct trace_bin *bin, uint32_t n,
+					 unsigned long line)
+{
+	struct dirent_chunk *c = bin->dirent_tail;
+	struct trace_dirent *d;
+
+	if (c == NULL || c->used + n > sizeof(c->dirents) / sizeof(c->dirents[0])) {
+		if (bin->dirent_spare != NULL) {
+			c = bin->dirent_spare;
+			bin->dirent_spare = NULL;
+		} else {
+			c = malloc(sizeof(struct dirent_chunk));
+			if (c == NULL) {
+				fprintf(stderr, "Failed to malloc directory entries\n");
+				exit(10);
+			}
+		}
+		c->next = NULL;
+		c->used = 0;
+		if (bin->dirent_tail != NULL) {
+			bin->dirent_tail->next = c;
+		} else {
+			bin->dirent_head = c;
+		}
+		bin->dirent_tail = c;
+	}
+
+	d = &c->dirents[c->used];
+	c->used += n;
+	c->max_line = line;
+	return d;
+}
+
+/* the READDIRPLUS3 entries of op, from the dirents column */
+static int trace_bin_dirents(struct trace_bin *bin, struct dbench_op *op,
+			     const unsigned char **p, const unsigned char *end)
+{
+	struct trace_dirent *d;
+	uint64_t n = get_varint(bin, p, end);
+	uint32_t i;
+
+	op->dirents  = NULL;
+	op->ndirents = 0;
+	if (n == 0) {
+		return 0;
+	}
+	if (n > TRACE_MAX_DIRENTS) {
+		return -1;
+	}
+	d = dirent_alloc(bin, n, op->line);
+	for (i = 0; i < n; i++) {
+		d[i].name = trace_bin_string(bin, get_varint(bin, p, end));
+		d[i].fh   = trace_bin_fh(bin, get_varint(bin, p, end));
+	}
+	op->dirents  = d;
+	op->ndirents = n;
+	return 0;
+}
+
+static int trace_bin_read_block(struct trace_bin *bin)
+{
+	unsigned char hdr[BLOCK_HEADER_LEN(COL_MAX)];
+	const unsigned char *col[COL_MAX], *end[COL_MAX];
+	uint32_t ndict, raw_len, comp_len, i;
+	uLongf len;
+	unsigned long line = 0;
+	uint64_t timestamp = 0;
+	size_t off;
+	int j, np;
+
+	if (fread(hdr, BLOCK_HEADER_LEN(bin->ncols), 1, bin->f) != 1) {
+		if (ferror(bin->f)) {
+			fprintf(stderr, "Failed to read %s. %s\n", bin->path, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	bin->nops = get_u32(&hdr[0]);
+	ndict     = get_u32(&hdr[4]);
+	raw_len   = get_u32(&hdr[8]);
+	comp_len  = get_u32(&hdr[12]);
+	if (bin->nops > bin->block_ops) {
+		fprintf(stderr, "Corrupt block in %s\n", bin->path);
+		return -1;
+	}
+	bin->corrupt = 0;
+
+	bin->comp.len = 0;
+	buf_reserve(&bin->comp, comp_len);
+	bin->raw.len = 0;
+	buf_reserve(&bin->raw, raw_len);
+	if (fread(bin->comp.data, comp_len, 1, bin->f) != 1) {
+		fprintf(stderr, "Truncated block in %s\n", bin->path);
+		return -1;
+	}
+	len = raw_len;
+	if (uncompress(bin->raw.data, &len, bin->comp.data, comp_len) != Z_OK ||
+	    len != raw_len) {
+		fprintf(stderr, "Failed to uncompress block in %s\n", bin->path);
+		return -1;
+	}
+
+	for (j = 0, off = 0; j < COL_MAX; j++) {
+		uint32_t col_len = j < bin->ncols ? get_u32(&hdr[16 + 4 * j]) : 0;
+
+		if (off + col_len > raw_len) {
+			fprintf(stderr, "Corrupt block in %s\n", bin->path);
+			return -1;
+		}
+		col[j] = &bin->raw.data[off];
+		end[j] = col[j] + col_len;
+		off += col_len;
+	}
+
+	for (i = 0; i < ndict; i++) {
+		uint64_t slen = get_varint(bin, &col[COL_DICT], end[COL_DICT]);
+
+		if (slen >= STRING_CHUNK || col[COL_DICT] + slen > end[COL_DICT]) {
+			fprintf(stderr, "Corrupt dictionary in %s\n", bin->path);
+			return -1;
+		}
+		dict_append(&bin->dict, (const char *)col[COL_DICT], slen);
+		col[COL_DICT] += slen;
+	}
+
+	while (col[COL_FHDICT] < end[COL_FHDICT]) {
+		uint64_t fhlen = get_varint(bin, &col[COL_FHDICT], end[COL_FHDICT]);
+
+		if (fhlen > sizeof(((struct trace_fh *)0)->data) ||
+		    col[COL_FHDICT] + fhlen > end[COL_FHDICT]) {
+			fprintf(stderr, "Corrupt handle dictionary in %s\n", bin->path);
+			return -1;
+		}
+		fh_dict_append(&bin->fh_dict, col[COL_FHDICT], fhlen);
+		col[COL_FHDICT] += fhlen;
+	}
+
+/* the next value of column c */
+#define COL_VARINT(c) get_varint(bin, &col[c], end[c])
+	for (i = 0; i < bin->nops; i++) {
+		struct dbench_op *op = &bin->ops[i];
+		uint64_t opcode;
+
+		op->child = NULL;
+		opcode = COL_VARINT(COL_OPCODE);
+		if (opcode >= OP_MAX) {
+			fprintf(stderr, "Unknown opcode %" PRIu64 " in %s\n", opcode, bin->path);
+			return -1;
+		}
+		op->opcode = opcode;
+		op->op = trace_op_name(op->opcode);
+
+		line += unzigzag(COL_VARINT(COL_LINE));
+		op->line = line;
+		timestamp += unzigzag(COL_VARINT(COL_TIME));
+		op->timestamp = timestamp;
+		op->client = COL_VARINT(COL_CLIENT);
+
+		op->fname  = trace_bin_string(bin, COL_VARINT(COL_FNAME));
+		op->fname2 = trace_bin_string(bin, COL_VARINT(COL_FNAME2));
+		op->status = trace_bin_string(bin, COL_VARINT(COL_STATUS));
+		if (op->status == NULL) {
+			op->status = "*";
+		}
+
+		np = COL_VARINT(COL_NPARAMS);
+		for (j = 0; j < 10; j++) {
+			op->params[j] = j < np ? unzigzag(COL_VARINT(COL_PARAMS)) : 0;
+		}
+
+		op->fh     = trace_bin_fh(bin, COL_VARINT(COL_FH));
+		op->fh2    = trace_bin_fh(bin, COL_VARINT(COL_FH2));
+		op->res_fh = trace_bin_fh(bin, COL_VARINT(COL_RES_FH));
+		op->latency = COL_VARINT(COL_LATENCY);
+		if (trace_bin_dirents(bin, op, &col[COL_DIRENTS], end[COL_DIRENTS]) != 0) {
+			bin->corrupt = 1;
+		}
+	}
+#undef COL_VARINT
+	if (bin->corrupt) {
+		fprintf(stderr, "Corrupt block in %s\n", bin->path);
+		return -1;
+	}
+
+	bin->next = 0;
+	return 1;
+}
+
+int trace_bin_next(struct trace_bin *bin, struct dbench_op *op)
+{
+	int ret;
+
+	while (bin->next == bin->nops) {
+		ret = trace_bin_read_block(bin);
+		if (ret <= 0) {
+			return ret;
+		}
+	}
+
+	*op = bin->ops[bin->next++];
+	return 1;
+}
+
+/*
+ * Strings and handles live in the dictionaries until the trace is closed,
+ * only the directory entries of released ops are given back.
+ */
+void trace_bin_release(struct trace_bin *bin, unsigned long line)
+{
+	struct dirent_chunk *c;
+
+	while ((c = bin->dirent_head) != NULL && c != bin->dirent_tail &&
+	       c->max_line < line) {
+		bin->dirent_head = c->next;
+		if (bin->dirent_spare == NULL) {
+			bin->dirent_spare = c;
+		} else {
+			free(c);
+		}
+	}
+}
+
+void trace_bin_close(struct trace_bin *bin)
+{
+	struct dirent_chunk *c;
+
+	while ((c = bin->dirent_head) != NULL) {
+		bin->dirent_head = c->next;
+		free(c);
+	}
+	free(bin->dirent_spare);
+	fclose(bin->f);
+	dict_free(&bin->dict);
+	fh_dict_free(&bin->fh_dict);
+	free(bin->raw.data);
+	free(bin->comp.data);
+	free(bin->ops);
+	free(bin);
+}
@@ -0,0 +1,137 @@
+/*
+   Convert NFS traces between the text and binary formats
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <popt.h>
+#include <zlib.h>
+
+#include "trace.h"
+
+static void write_text_op(FILE *f, const struct dbench_op *op)
+{
+	int i, nparams;
+
+	fprintf(f, "%" PRIu64 ".%06" PRIu64,
+		op->timestamp / 1000000, op->timestamp % 1000000);
+	if (op->client != 0) {
+		fprintf(f, " %d", op->client);
+	}
+	fprintf(f, " %s", op->op);
+	if (op->fname != NULL) {
+		fprintf(f, " \"%s\"", op->fname);
+	}
+	if (op->fname2 != NULL) {
+		fprintf(f, " \"%s\"", op->fname2);
+	}
+	for (nparams = 10; nparams > 0 && op->params[nparams - 1] == 0; nparams--)
+		;
+	for (i = 0; i < nparams; i++) {
+		fprintf(f, " %" PRId64, op->params[i]);
+	}
+	fprintf(f, " %s\n", op->status);
+}
+
+static void show_usage(void)
+{
+	printf("usage: nfs-trace-conv [OPTIONS] input output\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	int opt, ret;
+	int text = 0;
+	int level = Z_DEFAULT_COMPRESSION;
+	const char *input, *output;
+	unsigned long count = 0;
+	struct trace *trace;
+	struct trace_writer *w = NULL;
+	struct dbench_op op;
+	FILE *f = NULL;
+	poptContext pc;
+	struct poptOption popt_options[] = {
+		POPT_AUTOHELP
+		{ "text", 't', POPT_ARG_NONE, &text, 0,
+		  "write a text trace instead of a binary one", NULL },
+		{ "level", 'l', POPT_ARG_INT, &level, 0,
+		  "zlib compression level for binary traces", "0-9" },
+		POPT_TABLEEND
+	};
+
+	pc = poptGetContext(argv[0], argc, argv, popt_options, 0);
+	while ((opt = poptGetNextOpt(pc)) != -1) {
+		fprintf(stderr, "Invalid option %s: %s\n",
+			poptBadOption(pc, 0), poptStrerror(opt));
+		show_usage();
+		exit(1);
+	}
+
+	input  = poptGetArg(pc);
+	output = poptGetArg(pc);
+	if (input == NULL || output == NULL) {
+		show_usage();
+		exit(1);
+	}
+
+	trace = trace_open(input);
+	if (trace == NULL) {
+		exit(1);
+	}
+
+	if (text) {
+		f = strcmp(output, "-") ? fopen(output, "w") : stdout;
+		if (f == NULL) {
+			fprintf(stderr, "Failed to open %s. %s\n", output, strerror(errno));
+			exit(1);
+		}
+	} else {
+		w = trace_writer_open(output, level);
+		if (w == NULL) {
+			exit(1);
+		}
+	}
+
+	while ((ret = trace_next(trace, &op)) > 0) {
+		if (text) {
+			write_text_op(f, &op);
+		} else if (trace_writer_add(w, &op) != 0) {
+			ret = -1;
+			break;
+		}
+		trace_release(trace, op.line);
+		count++;
+	}
+
+	if (text) {
+		if (fclose(f) != 0) {
+			fprintf(stderr, "Failed to close %s. %s\n", output, strerror(errno));
+			ret = -1;
+		}
+	} else if (trace_writer_close(w) != 0) {
+		ret = -1;
+	}
+	trace_close(trace);
+	poptFreeContext(pc);
+
+	if (ret < 0) {
+		fprintf(stderr, "Conversion of %s failed after %lu ops\n", input, count);
+		return 1;
+	}
+	fprintf(stderr, "Converted %lu ops\n", count);
+	return 0;
+}
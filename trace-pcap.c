@@ -0,0 +1,1863 @@
+/*
+   NFSv3/NLM4 traces from pcap captures
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/*
+ * Reads a classic libpcap capture (as written by tcpdump -w) in a single
+ * pass and turns the NFSv3, NLM4 and MOUNT traffic in it into ops.
+ *
+ * TCP streams are reassembled per direction and split into RPC records;
+ * nothing but the first MSG_MAX bytes of a record is kept, so WRITE
+ * payloads and large READ replies are skipped rather than buffered, and
+ * truncated captures (-s) work as long as the RPC headers were captured.
+ * Calls are kept until the reply with the same xid comes back from the
+ * server, and an op is emitted at that point with the reply status as its
+ * expected status. Calls that never see a reply are emitted with status
+ * "*" once they are too old or at the end of the capture.
+ *
+ * Captured requests carry file handles, not paths. Paths are rebuilt
+ * from the (parent handle, name) pairs that LOOKUP, CREATE, MKDIR,
+ * SYMLINK and READDIRPLUS replies reveal, kept up to date across RENAME
+ * and REMOVE. The root is the handle returned by MNT or, if the mount is
+ * not in the capture, the handle of the first FSINFO call. Handles that
+ * cannot be placed show up as "/.fh-<hex>".
+ */
+
+#define PCAP_MAGIC_USEC    0xa1b2c3d4
+#define PCAP_MAGIC_NSEC    0xa1b23c4d
+
+#define LINKTYPE_ETHERNET  1
+#define LINKTYPE_RAW       101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4      228
+#define LINKTYPE_IPV6      229
+
+#define MAX_PACKET     (256 * 1024)
+#define MSG_MAX        (256 * 1024)
+#define MAX_FLOWS      4096
+#define MAX_OOO        64
+#define MAX_PENDING    65536
+#define PENDING_USEC   (60 * 1000000ULL)
+#define MAX_DEPTH      128
+#define STR_CHUNK      (64 * 1024)
+
+#define PROG_NFS   100003
+#define PROG_MOUNT 100005
+#define PROG_NLM   100021
+
+#define NFS3_MAXPATHLEN 1024
+
+struct endpoint {
+	unsigned char addr[16];
+	uint16_t port;
+};
+
+struct segment {
+	struct segment *next;
+	uint32_t seq;
+	uint32_t len;
+	unsigned char data[];
+};
+
+struct flow {
+	struct flow *next;
+	struct flow *lru_prev, *lru_next;
+	struct endpoint src, dst;
+
+	int seq_known;
+	int synced;
+	uint32_t next_seq;
+	struct segment *ooo;
+	int ooo_count;
+
+	/* RPC record marking */
+	unsigned char mark[4];
+	int mark_have;
+	uint32_t frag_left;
+	int last_frag;
+
+	unsigned char *msg;
+	size_t msg_len;		/* bytes kept in msg */
+	size_t msg_total;	/* bytes the message really has */
+};
+
+struct pcall {
+	struct pcall *next;
+	struct pcall *age_prev, *age_next;
+	uint32_t xid;
+	struct endpoint client;
+	int client_id;
+	uint32_t prog;
+	uint32_t proc;
+	int opcode;
+	uint64_t time;
+	struct trace_fh fh, fh2;
+	struct trace_fh res_fh;
+	char *name, *name2;
+	int64_t params[3];
+};
+
+struct pentry {
+	struct pentry *next_fh;
+	struct pentry *next_name;
+	struct trace_fh fh;
+	struct trace_fh parent;
+	int is_root;
+	char *name;
+};
+
+struct str_chunk {
+	struct str_chunk *next;
+	unsigned long max_line;
+	size_t used;
+	char data[STR_CHUNK] __attribute__((aligned(8)));
+};
+
+struct trace_pcap {
+	FILE *f;
+	const char *path;
+	int swapped;
+	int nsec;
+	uint32_t linktype;
+	unsigned char *packet;
+	uint64_t first_time;
+	int have_time;
+	uint64_t now;
+
+	struct flow *flows[MAX_FLOWS];
+	struct flow *lru_head, *lru_tail;
+	int nflows;
+
+	struct pcall **pending;
+	uint32_t pending_size;
+	uint32_t npending;
+	struct pcall *age_head, *age_tail;
+
+	struct pentry **by_fh;
+	struct pentry **by_name;
+	uint32_t ns_size;
+	uint32_t nentries;
+	int have_root;
+
+	struct endpoint *clients;
+	int nclients;
+
+	struct dbench_op *queue;
+	uint32_t q_head, q_count, q_size;
+	unsigned long line;
+
+	struct str_chunk *str_head, *str_tail, *str_spare;
+
+	int eof;
+
+	/* statistics printed when the trace is closed */
+	unsigned long packets, calls, replies, unmatched, skipped, timeouts;
+	unsigned long resyncs;
+};
+
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline uint16_t get_be16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static uint32_t swap32(uint32_t v)
+{
+	return ((v & 0xff) << 24) | ((v & 0xff00) << 8) |
+	       ((v >> 8) & 0xff00) | (v >> 24);
+}
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+#define HASH_INIT 14695981039346656037ULL
+
+static void *xmalloc(size_t size)
+{
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		fprintf(stderr, "Failed to malloc %zu bytes in pcap reader\n", size);
+		exit(10);
+	}
+	return p;
+}
+
+static void *xcalloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+
+	if (p == NULL) {
+		fprintf(stderr, "Failed to calloc %zu bytes in pcap reader\n", n * size);
+		exit(10);
+	}
+	return p;
+}
+
+
+/*
+ * XDR decoding. Every getter checks the bounds and latches an error, so
+ * parsers can decode a whole structure and check xdr->err once.
+ */
+struct xdr {
+	const unsigned char *p;
+	const unsigned char *end;
+	int err;
+};
+
+static uint32_t xdr_u32(struct xdr *x)
+{
+	uint32_t v;
+
+	if (x->err || x->end - x->p < 4) {
+		x->err = 1;
+		return 0;
+	}
+	v = get_be32(x->p);
+	x->p += 4;
+	return v;
+}
+
+static uint64_t xdr_u64(struct xdr *x)
+{
+	uint64_t hi = xdr_u32(x);
+
+	return (hi << 32) | xdr_u32(x);
+}
+
+static const unsigned char *xdr_opaque(struct xdr *x, uint32_t max, uint32_t *len)
+{
+	const unsigned char *p;
+	uint32_t padded;
+
+	*len = xdr_u32(x);
+	padded = (*len + 3) & ~3;
+	if (x->err || *len > max || (uint32_t)(x->end - x->p) < padded) {
+		x->err = 1;
+		*len = 0;
+		return NULL;
+	}
+	p = x->p;
+	x->p += padded;
+	return p;
+}
+
+static void xdr_skip(struct xdr *x, uint32_t len)
+{
+	if (x->err || (uint32_t)(x->end - x->p) < len) {
+		x->err = 1;
+		return;
+	}
+	x->p += len;
+}
+
+static void xdr_fh(struct xdr *x, struct trace_fh *fh)
+{
+	const unsigned char *p = xdr_opaque(x, sizeof(fh->data), &fh->len);
+
+	if (p != NULL) {
+		memcpy(fh->data, p, fh->len);
+	}
+}
+
+static char *xdr_strdup(struct xdr *x, uint32_t max)
+{
+	const unsigned char *p;
+	uint32_t len;
+	char *s;
+
+	p = xdr_opaque(x, max, &len);
+	if (p == NULL) {
+		return NULL;
+	}
+	s = xmalloc(len + 1);
+	memcpy(s, p, len);
+	s[len] = 0;
+	return s;
+}
+
+/* fattr3 is fixed size on the wire */
+#define FATTR3_LEN 84
+
+static void xdr_skip_post_op_attr(struct xdr *x)
+{
+	if (xdr_u32(x)) {
+		xdr_skip(x, FATTR3_LEN);
+	}
+}
+
+static void xdr_skip_sattr3(struct xdr *x)
+{
+	if (xdr_u32(x)) {		/* mode */
+		xdr_skip(x, 4);
+	}
+	if (xdr_u32(x)) {		/* uid */
+		xdr_skip(x, 4);
+	}
+	if (xdr_u32(x)) {		/* gid */
+		xdr_skip(x, 4);
+	}
+	if (xdr_u32(x)) {		/* size */
+		xdr_skip(x, 8);
+	}
+	if (xdr_u32(x) == 2) {		/* atime, SET_TO_CLIENT_TIME */
+		xdr_skip(x, 8);
+	}
+	if (xdr_u32(x) == 2) {		/* mtime */
+		xdr_skip(x, 8);
+	}
+}
+
+
+/*
+ * Strings and handles handed out with ops. They are carved out of chunks
+ * that are freed once every op that points into them has been released.
+ */
+static void *pcap_alloc(struct trace_pcap *pcap, size_t len, unsigned long line)
+{
+	struct str_chunk *c = pcap->str_tail;
+	void *p;
+
+	len = (len + 7) & ~7;
+	if (c == NULL || c->used + len > STR_CHUNK) {
+		if (pcap->str_spare != NULL) {
+			c = pcap->str_spare;
+			pcap->str_spare = NULL;
+		} else {
+			c = xmalloc(sizeof(struct str_chunk));
+		}
+		c->next = NULL;
+		c->used = 0;
+		if (pcap->str_tail != NULL) {
+			pcap->str_tail->next = c;
+		} else {
+			pcap->str_head = c;
+		}
+		pcap->str_tail = c;
+	}
+
+	p = &c->data[c->used];
+	c->used += len;
+	c->max_line = line;
+	return p;
+}
+
+static const char *pcap_string(struct trace_pcap *pcap, const char *s, unsigned long line)
+{
+	size_t len = strlen(s) + 1;
+
+	return memcpy(pcap_alloc(pcap, len, line), s, len);
+}
+
+static const struct trace_fh *pcap_fh(struct trace_pcap *pcap, const struct trace_fh *fh,
+				      unsigned long line)
+{
+	if (fh->len == 0) {
+		return NULL;
+	}
+	return memcpy(pcap_alloc(pcap, sizeof(*fh), line), fh, sizeof(*fh));
+}
+
+void trace_pcap_release(struct trace_pcap *pcap, unsigned long line)
+{
+	struct str_chunk *c;
+
+	while ((c = pcap->str_head) != NULL && c != pcap->str_tail &&
+	       c->max_line < line) {
+		pcap->str_head = c->next;
+		if (pcap->str_spare == NULL) {
+			pcap->str_spare = c;
+		} else {
+			free(c);
+		}
+	}
+}
+
+
+/*
+ * The namespace: what we know about where each handle lives. Entries are
+ * indexed both by handle and by (parent handle, name).
+ */
+static uint32_t fh_hash(const struct trace_fh *fh)
+{
+	return hash_bytes(HASH_INIT, fh->data, fh->len);
+}
+
+static uint32_t name_hash(const struct trace_fh *parent, const char *name)
+{
+	return hash_bytes(hash_bytes(HASH_INIT, parent->data, parent->len),
+			  name, strlen(name));
+}
+
+static int fh_equal(const struct trace_fh *a, const struct trace_fh *b)
+{
+	return a->len == b->len && memcmp(a->data, b->data, a->len) == 0;
+}
+
+static struct pentry *ns_find_fh(struct trace_pcap *pcap, const struct trace_fh *fh)
+{
+	struct pentry *e;
+
+	for (e = pcap->by_fh[fh_hash(fh) & (pcap->ns_size - 1)]; e; e = e->next_fh) {
+		if (fh_equal(&e->fh, fh)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static struct pentry *ns_find_name(struct trace_pcap *pcap, const struct trace_fh *parent,
+				   const char *name)
+{
+	struct pentry *e;
+
+	for (e = pcap->by_name[name_hash(parent, name) & (pcap->ns_size - 1)];
+	     e; e = e->next_name) {
+		if (!e->is_root && fh_equal(&e->parent, parent) &&
+		    strcmp(e->name, name) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void ns_link_name(struct trace_pcap *pcap, struct pentry *e)
+{
+	uint32_t h = name_hash(&e->parent, e->name) & (pcap->ns_size - 1);
+
+	e->next_name = pcap->by_name[h];
+	pcap->by_name[h] = e;
+}
+
+static void ns_unlink_name(struct trace_pcap *pcap, struct pentry *e)
+{
+	struct pentry **pp;
+
+	pp = &pcap->by_name[name_hash(&e->parent, e->name) & (pcap->ns_size - 1)];
+	for (; *pp; pp = &(*pp)->next_name) {
+		if (*pp == e) {
+			*pp = e->next_name;
+			return;
+		}
+	}
+}
+
+static void ns_resize(struct trace_pcap *pcap)
+{
+	struct pentry **old_fh = pcap->by_fh;
+	uint32_t old_size = pcap->ns_size;
+	struct pentry *e, *next;
+	uint32_t i, h;
+
+	pcap->ns_size   = old_size ? old_size * 2 : 4096;
+	pcap->by_fh     = xcalloc(pcap->ns_size, sizeof(struct pentry *));
+	free(pcap->by_name);
+	pcap->by_name   = xcalloc(pcap->ns_size, sizeof(struct pentry *));
+
+	for (i = 0; i < old_size; i++) {
+		for (e = old_fh[i]; e; e = next) {
+			next = e->next_fh;
+			h = fh_hash(&e->fh) & (pcap->ns_size - 1);
+			e->next_fh = pcap->by_fh[h];
+			pcap->by_fh[h] = e;
+			ns_link_name(pcap, e);
+		}
+	}
+	free(old_fh);
+}
+
+static void ns_remove(struct trace_pcap *pcap, struct pentry *e)
+{
+	struct pentry **pp;
+
+	pp = &pcap->by_fh[fh_hash(&e->fh) & (pcap->ns_size - 1)];
+	for (; *pp; pp = &(*pp)->next_fh) {
+		if (*pp == e) {
+			*pp = e->next_fh;
+			break;
+		}
+	}
+	ns_unlink_name(pcap, e);
+	free(e->name);
+	free(e);
+	pcap->nentries--;
+}
+
+static void ns_set(struct trace_pcap *pcap, const struct trace_fh *fh,
+		   const struct trace_fh *parent, const char *name)
+{
+	struct pentry *e;
+	uint32_t h;
+
+	if (fh->len == 0 || (name != NULL &&
+	    (!strcmp(name, ".") || !strcmp(name, "..")))) {
+		return;
+	}
+
+	e = ns_find_fh(pcap, fh);
+	if (e != NULL) {
+		if (parent == NULL) {
+			if (e->is_root) {
+				return;
+			}
+		} else if (!e->is_root && fh_equal(&e->parent, parent) &&
+			   strcmp(e->name, name) == 0) {
+			return;
+		}
+		ns_remove(pcap, e);
+	}
+
+	/* whatever was known under this name before is gone */
+	if (parent != NULL && (e = ns_find_name(pcap, parent, name)) != NULL) {
+		ns_remove(pcap, e);
+	}
+
+	if (pcap->nentries >= pcap->ns_size) {
+		ns_resize(pcap);
+	}
+
+	e = xmalloc(sizeof(struct pentry));
+	e->fh = *fh;
+	if (parent != NULL) {
+		e->parent  = *parent;
+		e->is_root = 0;
+		e->name    = strdup(name);
+	} else {
+		e->parent.len = 0;
+		e->is_root = 1;
+		e->name    = strdup("");
+	}
+	if (e->name == NULL) {
+		fprintf(stderr, "Failed to strdup name in pcap reader\n");
+		exit(10);
+	}
+
+	h = fh_hash(fh) & (pcap->ns_size - 1);
+	e->next_fh = pcap->by_fh[h];
+	pcap->by_fh[h] = e;
+	ns_link_name(pcap, e);
+	pcap->nentries++;
+
+	if (parent == NULL) {
+		pcap->have_root = 1;
+	}
+}
+
+static void ns_rename(struct trace_pcap *pcap, const struct trace_fh *from_dir,
+		      const char *from, const struct trace_fh *to_dir, const char *to)
+{
+	struct pentry *e, *old;
+
+	e = ns_find_name(pcap, from_dir, from);
+	old = ns_find_name(pcap, to_dir, to);
+	if (old != NULL && old != e) {
+		ns_remove(pcap, old);
+	}
+	if (e == NULL) {
+		return;
+	}
+
+	ns_unlink_name(pcap, e);
+	free(e->name);
+	e->parent = *to_dir;
+	e->name = strdup(to);
+	if (e->name == NULL) {
+		fprintf(stderr, "Failed to strdup name in pcap reader\n");
+		exit(10);
+	}
+	ns_link_name(pcap, e);
+}
+
+static void ns_unlink(struct trace_pcap *pcap, const struct trace_fh *dir, const char *name)
+{
+	struct pentry *e = ns_find_name(pcap, dir, name);
+
+	if (e != NULL) {
+		ns_remove(pcap, e);
+	}
+}
+
+/* Build the path of fh, or of name inside fh if name is not NULL. */
+static void ns_path(struct trace_pcap *pcap, const struct trace_fh *fh, const char *name,
+		    char *out, size_t size)
+{
+	const char *comps[MAX_DEPTH];
+	const struct trace_fh *cur = fh;
+	struct pentry *e;
+	size_t len = 0;
+	int n = 0;
+	uint32_t i;
+
+	out[0] = 0;
+	while (n < MAX_DEPTH) {
+		e = ns_find_fh(pcap, cur);
+		if (e == NULL) {
+			len = snprintf(out, size, "/.fh-");
+			for (i = 0; i < cur->len && len + 3 < size; i++) {
+				len += snprintf(&out[len], size - len, "%02x", cur->data[i]);
+			}
+			break;
+		}
+		if (e->is_root) {
+			break;
+		}
+		comps[n++] = e->name;
+		cur = &e->parent;
+	}
+
+	while (n-- > 0 && len < size) {
+		len += snprintf(&out[len], size - len, "/%s", comps[n]);
+	}
+	if (name != NULL && len < size) {
+		len += snprintf(&out[len], size - len, "/%s", name);
+	}
+	if (len == 0) {
+		snprintf(out, size, "/");
+	}
+}
+
+
+/*
+ * Completed ops wait in a queue until trace_pcap_next() hands them out.
+ */
+static struct dbench_op *queue_push(struct trace_pcap *pcap)
+{
+	struct dbench_op *q;
+	uint32_t i;
+
+	if (pcap->q_count == pcap->q_size) {
+		q = xmalloc((pcap->q_size ? pcap->q_size * 2 : 256) * sizeof(*q));
+		for (i = 0; i < pcap->q_count; i++) {
+			q[i] = pcap->queue[(pcap->q_head + i) % pcap->q_size];
+		}
+		free(pcap->queue);
+		pcap->queue  = q;
+		pcap->q_head = 0;
+		pcap->q_size = pcap->q_size ? pcap->q_size * 2 : 256;
+	}
+
+	q = &pcap->queue[(pcap->q_head + pcap->q_count++) % pcap->q_size];
+	memset(q, 0, sizeof(*q));
+	q->line = ++pcap->line;
+	return q;
+}
+
+static struct dbench_op *emit_op(struct trace_pcap *pcap, struct pcall *c,
+				 const char *status, uint64_t latency)
+{
+	char path[NFS3_MAXPATHLEN + 256];
+	struct dbench_op *op;
+	int i;
+
+	op = queue_push(pcap);
+	op->opcode    = c->opcode;
+	op->op        = trace_op_name(c->opcode);
+	op->client    = c->client_id;
+	op->timestamp = c->time;
+	op->latency   = latency;
+	op->status    = pcap_string(pcap, status, op->line);
+	for (i = 0; i < 3; i++) {
+		op->params[i] = c->params[i];
+	}
+	op->fh     = pcap_fh(pcap, &c->fh, op->line);
+	op->fh2    = pcap_fh(pcap, &c->fh2, op->line);
+	op->res_fh = pcap_fh(pcap, &c->res_fh, op->line);
+
+	switch (c->opcode) {
+	case OP_FSSTAT3:
+	case OP_FSINFO3:
+		break;
+	case OP_LOOKUP3:
+	case OP_CREATE3:
+	case OP_MKDIR3:
+	case OP_REMOVE3:
+	case OP_RMDIR3:
+		ns_path(pcap, &c->fh, c->name, path, sizeof(path));
+		op->fname = pcap_string(pcap, path, op->line);
+		break;
+	case OP_SYMLINK3:
+		ns_path(pcap, &c->fh, c->name, path, sizeof(path));
+		op->fname  = pcap_string(pcap, path, op->line);
+		op->fname2 = pcap_string(pcap, c->name2, op->line);
+		break;
+	case OP_RENAME3:
+		ns_path(pcap, &c->fh, c->name, path, sizeof(path));
+		op->fname = pcap_string(pcap, path, op->line);
+		ns_path(pcap, &c->fh2, c->name2, path, sizeof(path));
+		op->fname2 = pcap_string(pcap, path, op->line);
+		break;
+	case OP_LINK3:
+		/* nfsio_link() takes the new name first */
+		ns_path(pcap, &c->fh2, c->name, path, sizeof(path));
+		op->fname = pcap_string(pcap, path, op->line);
+		ns_path(pcap, &c->fh, NULL, path, sizeof(path));
+		op->fname2 = pcap_string(pcap, path, op->line);
+		break;
+	default:
+		ns_path(pcap, &c->fh, NULL, path, sizeof(path));
+		op->fname = pcap_string(pcap, path, op->line);
+		break;
+	}
+	return op;
+}
+
+
+/*
+ * Calls waiting for their reply, hashed by (xid, client) and kept on an
+ * age list so stale ones can be expired.
+ */
+static uint32_t pcall_hash(uint32_t xid, const struct endpoint *client)
+{
+	return hash_bytes(hash_bytes(HASH_INIT, &xid, sizeof(xid)),
+			  client, sizeof(*client));
+}
+
+static void pcall_free(struct pcall *c)
+{
+	free(c->name);
+	free(c->name2);
+	free(c);
+}
+
+static void pcall_unlink(struct trace_pcap *pcap, struct pcall *c)
+{
+	struct pcall **pp;
+
+	pp = &pcap->pending[pcall_hash(c->xid, &c->client) & (pcap->pending_size - 1)];
+	for (; *pp; pp = &(*pp)->next) {
+		if (*pp == c) {
+			*pp = c->next;
+			break;
+		}
+	}
+
+	if (c->age_prev) {
+		c->age_prev->age_next = c->age_next;
+	} else {
+		pcap->age_head = c->age_next;
+	}
+	if (c->age_next) {
+		c->age_next->age_prev = c->age_prev;
+	} else {
+		pcap->age_tail = c->age_prev;
+	}
+	pcap->npending--;
+}
+
+static void pcall_expire(struct trace_pcap *pcap, struct pcall *c)
+{
+	pcall_unlink(pcap, c);
+	if (c->opcode >= 0) {
+		emit_op(pcap, c, "*", 0);
+		pcap->timeouts++;
+	}
+	pcall_free(c);
+}
+
+static void pcall_add(struct trace_pcap *pcap, struct pcall *c)
+{
+	struct pcall **pp;
+
+	while (pcap->age_head != NULL &&
+	       (pcap->npending >= MAX_PENDING ||
+		pcap->age_head->time + PENDING_USEC < pcap->now)) {
+		pcall_expire(pcap, pcap->age_head);
+	}
+
+	/* a retransmission replaces the original call */
+	pp = &pcap->pending[pcall_hash(c->xid, &c->client) & (pcap->pending_size - 1)];
+	for (; *pp; pp = &(*pp)->next) {
+		if ((*pp)->xid == c->xid &&
+		    memcmp(&(*pp)->client, &c->client, sizeof(c->client)) == 0) {
+			struct pcall *old = *pp;
+
+			pcall_unlink(pcap, old);
+			pcall_free(old);
+			break;
+		}
+	}
+
+	pp = &pcap->pending[pcall_hash(c->xid, &c->client) & (pcap->pending_size - 1)];
+	c->next = *pp;
+	*pp = c;
+
+	c->age_next = NULL;
+	c->age_prev = pcap->age_tail;
+	if (pcap->age_tail) {
+		pcap->age_tail->age_next = c;
+	} else {
+		pcap->age_head = c;
+	}
+	pcap->age_tail = c;
+	pcap->npending++;
+}
+
+static struct pcall *pcall_find(struct trace_pcap *pcap, uint32_t xid,
+				const struct endpoint *client)
+{
+	struct pcall *c;
+
+	c = pcap->pending[pcall_hash(xid, client) & (pcap->pending_size - 1)];
+	for (; c; c = c->next) {
+		if (c->xid == xid &&
+		    memcmp(&c->client, client, sizeof(*client)) == 0) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+static int client_id(struct trace_pcap *pcap, const unsigned char *addr)
+{
+	int i;
+
+	for (i = 0; i < pcap->nclients; i++) {
+		if (memcmp(pcap->clients[i].addr, addr, 16) == 0) {
+			return i + 1;
+		}
+	}
+	if ((pcap->nclients & (pcap->nclients - 1)) == 0) {
+		pcap->clients = realloc(pcap->clients, (pcap->nclients ? pcap->nclients * 2 : 1)
+					* sizeof(struct endpoint));
+		if (pcap->clients == NULL) {
+			fprintf(stderr, "Failed to realloc pcap clients\n");
+			exit(10);
+		}
+	}
+	memcpy(pcap->clients[pcap->nclients].addr, addr, 16);
+	return ++pcap->nclients;
+}
+
+
+static const int nfs3_opcodes[] = {
+	[1]  = OP_GETATTR3,
+	[2]  = OP_SETATTR3,
+	[3]  = OP_LOOKUP3,
+	[4]  = OP_ACCESS3,
+	[5]  = OP_READLINK3,
+	[6]  = OP_READ3,
+	[7]  = OP_WRITE3,
+	[8]  = OP_CREATE3,
+	[9]  = OP_MKDIR3,
+	[10] = OP_SYMLINK3,
+	[12] = OP_REMOVE3,
+	[13] = OP_RMDIR3,
+	[14] = OP_RENAME3,
+	[15] = OP_LINK3,
+	[17] = OP_READDIRPLUS3,
+	[18] = OP_FSSTAT3,
+	[19] = OP_FSINFO3,
+	[20] = OP_PATHCONF3,
+	[21] = OP_COMMIT3,
+};
+
+/* decode the arguments we need to replay the call */
+static int decode_nfs3_call(struct pcall *c, struct xdr *x)
+{
+	if (c->proc >= sizeof(nfs3_opcodes) / sizeof(nfs3_opcodes[0]) ||
+	    nfs3_opcodes[c->proc] == 0) {
+		return -1;
+	}
+	c->opcode = nfs3_opcodes[c->proc];
+
+	xdr_fh(x, &c->fh);
+
+	switch (c->opcode) {
+	case OP_LOOKUP3:
+	case OP_CREATE3:
+	case OP_MKDIR3:
+	case OP_REMOVE3:
+	case OP_RMDIR3:
+		c->name = xdr_strdup(x, 255);
+		break;
+	case OP_SYMLINK3:
+		c->name = xdr_strdup(x, 255);
+		xdr_skip_sattr3(x);
+		c->name2 = xdr_strdup(x, NFS3_MAXPATHLEN);
+		break;
+	case OP_RENAME3:
+		c->name = xdr_strdup(x, 255);
+		xdr_fh(x, &c->fh2);
+		c->name2 = xdr_strdup(x, 255);
+		break;
+	case OP_LINK3:
+		xdr_fh(x, &c->fh2);
+		c->name = xdr_strdup(x, 255);
+		break;
+	case OP_READ3:
+		c->params[0] = xdr_u64(x);
+		c->params[1] = xdr_u32(x);
+		break;
+	case OP_WRITE3:
+		c->params[0] = xdr_u64(x);
+		c->params[1] = xdr_u32(x);
+		c->params[2] = xdr_u32(x);
+		break;
+	}
+	return x->err ? -1 : 0;
+}
+
+static int decode_nlm4_call(struct pcall *c, struct xdr *x)
+{
+	uint32_t len;
+
+	switch (c->proc) {
+	case 1:
+		c->opcode = OP_TEST4;
+		break;
+	case 2:
+		c->opcode = OP_LOCK4;
+		break;
+	case 4:
+		c->opcode = OP_UNLOCK4;
+		break;
+	default:
+		return -1;
+	}
+
+	xdr_opaque(x, 1024, &len);		/* cookie */
+	if (c->opcode == OP_LOCK4) {
+		xdr_u32(x);			/* block */
+	}
+	if (c->opcode != OP_UNLOCK4) {
+		xdr_u32(x);			/* exclusive */
+	}
+	xdr_opaque(x, 1024, &len);		/* caller_name */
+	xdr_fh(x, &c->fh);
+	xdr_opaque(x, 1024, &len);		/* oh */
+	xdr_u32(x);				/* svid */
+	c->params[0] = xdr_u64(x);
+	c->params[1] = xdr_u64(x);
+
+	return x->err ? -1 : 0;
+}
+
+static void process_call(struct trace_pcap *pcap, uint32_t xid, struct xdr *x,
+			 const struct endpoint *client)
+{
+	struct pcall *c;
+	uint32_t prog, vers, proc, len;
+	int ret = -1;
+
+	if (xdr_u32(x) != 2) {			/* rpcvers */
+		return;
+	}
+	prog = xdr_u32(x);
+	vers = xdr_u32(x);
+	proc = xdr_u32(x);
+	xdr_u32(x);				/* cred */
+	xdr_opaque(x, 400, &len);
+	xdr_u32(x);				/* verf */
+	xdr_opaque(x, 400, &len);
+	if (x->err) {
+		return;
+	}
+
+	c = xcalloc(1, sizeof(struct pcall));
+	c->xid    = xid;
+	c->client = *client;
+	c->prog   = prog;
+	c->proc   = proc;
+	c->opcode = -1;
+	c->time   = pcap->now;
+
+	if (prog == PROG_NFS && vers == 3) {
+		ret = decode_nfs3_call(c, x);
+	} else if (prog == PROG_NLM && vers == 4) {
+		ret = decode_nlm4_call(c, x);
+	} else if (prog == PROG_MOUNT && vers == 3 && proc == 1) {
+		ret = 0;			/* MNT, only the reply matters */
+	}
+	if (ret != 0) {
+		if (prog == PROG_NFS || prog == PROG_NLM) {
+			pcap->skipped++;
+		}
+		pcall_free(c);
+		return;
+	}
+
+	if (c->opcode == OP_FSINFO3 && !pcap->have_root) {
+		ns_set(pcap, &c->fh, NULL, NULL);
+	}
+
+	c->client_id = client_id(pcap, client->addr);
+	pcall_add(pcap, c);
+	pcap->calls++;
+}
+
+/*
+ * The next entry of a READDIRPLUS reply: 1 with its name and handle, 0
+ * if it came without a handle, -1 past the last one.
+ */
+static int readdirplus_entry(struct xdr *x, struct trace_fh *fh, char *name)
+{
+	const unsigned char *p;
+	uint32_t len;
+
+	if (x->err || !xdr_u32(x)) {
+		return -1;
+	}
+	xdr_u64(x);				/* fileid */
+	p = xdr_opaque(x, 255, &len);
+	xdr_u64(x);				/* cookie */
+	xdr_skip_post_op_attr(x);
+	if (!xdr_u32(x)) {			/* handle_follows */
+		return x->err ? -1 : 0;
+	}
+	xdr_fh(x, fh);
+	if (x->err) {
+		return -1;
+	}
+	memcpy(name, p, len);
+	name[len] = 0;
+	return 1;
+}
+
+/*
+ * The entries of a READDIRPLUS reply go in the namespace, and the first
+ * TRACE_MAX_DIRENTS of them with a handle go with op, for the replay to
+ * map their handles.
+ */
+static void process_readdirplus(struct trace_pcap *pcap, struct pcall *c, struct xdr *x,
+				struct dbench_op *op)
+{
+	struct trace_dirent *dirents;
+	struct trace_fh fh;
+	struct xdr first;
+	char name[256];
+	int ret, n = 0;
+
+	xdr_skip_post_op_attr(x);
+	xdr_skip(x, 8);				/* cookieverf */
+
+	first = *x;
+	while ((ret = readdirplus_entry(x, &fh, name)) >= 0) {
+		if (ret == 1) {
+			ns_set(pcap, &fh, &c->fh, name);
+			n += n < TRACE_MAX_DIRENTS;
+		}
+	}
+	if (n == 0) {
+		return;
+	}
+
+	dirents = pcap_alloc(pcap, n * sizeof(struct trace_dirent), op->line);
+	op->dirents  = dirents;
+	op->ndirents = 0;
+	while (op->ndirents < n && (ret = readdirplus_entry(&first, &fh, name)) >= 0) {
+		if (ret == 1) {
+			dirents[op->ndirents].name = pcap_string(pcap, name, op->line);
+			dirents[op->ndirents].fh   = pcap_fh(pcap, &fh, op->line);
+			op->ndirents++;
+		}
+	}
+}
+
+/* find the handle of the object a successful call returned or removed */
+static void nfs3_res_fh(struct trace_pcap *pcap, struct pcall *c, struct xdr *x)
+{
+	struct pentry *e;
+
+	switch (c->opcode) {
+	case OP_LOOKUP3:
+		xdr_fh(x, &c->res_fh);
+		break;
+	case OP_CREATE3:
+	case OP_MKDIR3:
+	case OP_SYMLINK3:
+		if (xdr_u32(x)) {
+			xdr_fh(x, &c->res_fh);
+		}
+		break;
+	case OP_REMOVE3:
+	case OP_RMDIR3:
+		e = ns_find_name(pcap, &c->fh, c->name);
+		if (e != NULL) {
+			c->res_fh = e->fh;
+		}
+		break;
+	}
+	if (x->err) {
+		c->res_fh.len = 0;
+	}
+}
+
+/* update the namespace with what a successful reply tells us */
+static void process_nfs3_reply(struct trace_pcap *pcap, struct pcall *c, struct xdr *x,
+			       struct dbench_op *op)
+{
+	switch (c->opcode) {
+	case OP_LOOKUP3:
+	case OP_CREATE3:
+	case OP_MKDIR3:
+	case OP_SYMLINK3:
+		if (c->res_fh.len != 0) {
+			ns_set(pcap, &c->res_fh, &c->fh, c->name);
+		}
+		break;
+	case OP_READDIRPLUS3:
+		process_readdirplus(pcap, c, x, op);
+		break;
+	case OP_REMOVE3:
+	case OP_RMDIR3:
+		ns_unlink(pcap, &c->fh, c->name);
+		break;
+	case OP_RENAME3:
+		ns_rename(pcap, &c->fh, c->name, &c->fh2, c->name2);
+		break;
+	}
+}
+
+static void process_reply(struct trace_pcap *pcap, uint32_t xid, struct xdr *x,
+			  const struct endpoint *client)
+{
+	struct pcall *c;
+	uint32_t len, status = 0;
+	char status_str[16];
+	int accepted = 0;
+	struct dbench_op *op;
+	struct trace_fh fh;
+
+	c = pcall_find(pcap, xid, client);
+	if (c == NULL) {
+		pcap->unmatched++;
+		return;
+	}
+	pcall_unlink(pcap, c);
+	pcap->replies++;
+
+	if (xdr_u32(x) == 0) {			/* MSG_ACCEPTED */
+		xdr_u32(x);			/* verf */
+		xdr_opaque(x, 400, &len);
+		if (xdr_u32(x) == 0 && !x->err) {	/* SUCCESS */
+			accepted = 1;
+		}
+	}
+
+	if (accepted && c->prog == PROG_NLM) {
+		xdr_opaque(x, 1024, &len);	/* cookie */
+	}
+	if (accepted) {
+		status = xdr_u32(x);
+		accepted = !x->err;
+	}
+
+	if (c->prog == PROG_MOUNT) {
+		if (accepted && status == 0) {
+			xdr_fh(x, &fh);
+			if (!x->err) {
+				ns_set(pcap, &fh, NULL, NULL);
+			}
+		}
+		pcall_free(c);
+		return;
+	}
+
+	if (accepted) {
+		snprintf(status_str, sizeof(status_str), "0x%08x", status);
+	} else {
+		strcpy(status_str, "*");
+	}
+	if (accepted && status == 0 && c->prog == PROG_NFS) {
+		nfs3_res_fh(pcap, c, x);
+	}
+	/* paths are those from before the call changed the namespace */
+	op = emit_op(pcap, c, status_str, pcap->now - c->time);
+
+	if (accepted && status == 0 && c->prog == PROG_NFS) {
+		process_nfs3_reply(pcap, c, x, op);
+	}
+	pcall_free(c);
+}
+
+static void process_rpc(struct trace_pcap *pcap, const unsigned char *msg, size_t len,
+			const struct endpoint *src, const struct endpoint *dst)
+{
+	struct xdr x = { msg, msg + len, 0 };
+	uint32_t xid, type;
+
+	xid  = xdr_u32(&x);
+	type = xdr_u32(&x);
+	if (x.err) {
+		return;
+	}
+	if (type == 0) {
+		process_call(pcap, xid, &x, src);
+	} else if (type == 1) {
+		process_reply(pcap, xid, &x, dst);
+	}
+}
+
+
+/*
+ * TCP streams. Each direction of a connection is a flow that feeds RPC
+ * record fragments into flow->msg.
+ */
+static uint32_t flow_hash(const struct endpoint *src, const struct endpoint *dst)
+{
+	return hash_bytes(hash_bytes(HASH_INIT, src, sizeof(*src)), dst, sizeof(*dst));
+}
+
+static void flow_lru_unlink(struct trace_pcap *pcap, struct flow *fl)
+{
+	if (fl->lru_prev) {
+		fl->lru_prev->lru_next = fl->lru_next;
+	} else {
+		pcap->lru_head = fl->lru_next;
+	}
+	if (fl->lru_next) {
+		fl->lru_next->lru_prev = fl->lru_prev;
+	} else {
+		pcap->lru_tail = fl->lru_prev;
+	}
+}
+
+static void flow_lru_push(struct trace_pcap *pcap, struct flow *fl)
+{
+	fl->lru_prev = NULL;
+	fl->lru_next = pcap->lru_head;
+	if (pcap->lru_head) {
+		pcap->lru_head->lru_prev = fl;
+	} else {
+		pcap->lru_tail = fl;
+	}
+	pcap->lru_head = fl;
+}
+
+static void flow_drop_ooo(struct flow *fl)
+{
+	struct segment *s;
+
+	while ((s = fl->ooo) != NULL) {
+		fl->ooo = s->next;
+		free(s);
+	}
+	fl->ooo_count = 0;
+}
+
+static void flow_free(struct trace_pcap *pcap, struct flow *fl)
+{
+	struct flow **pp;
+
+	pp = &pcap->flows[flow_hash(&fl->src, &fl->dst) % MAX_FLOWS];
+	for (; *pp; pp = &(*pp)->next) {
+		if (*pp == fl) {
+			*pp = fl->next;
+			break;
+		}
+	}
+	flow_lru_unlink(pcap, fl);
+	flow_drop_ooo(fl);
+	free(fl->msg);
+	free(fl);
+	pcap->nflows--;
+}
+
+static struct flow *flow_get(struct trace_pcap *pcap, const struct endpoint *src,
+			     const struct endpoint *dst)
+{
+	struct flow *fl;
+	uint32_t h = flow_hash(src, dst) % MAX_FLOWS;
+
+	for (fl = pcap->flows[h]; fl; fl = fl->next) {
+		if (!memcmp(&fl->src, src, sizeof(*src)) &&
+		    !memcmp(&fl->dst, dst, sizeof(*dst))) {
+			flow_lru_unlink(pcap, fl);
+			flow_lru_push(pcap, fl);
+			return fl;
+		}
+	}
+
+	if (pcap->nflows >= MAX_FLOWS) {
+		flow_free(pcap, pcap->lru_tail);
+	}
+
+	fl = xcalloc(1, sizeof(struct flow));
+	fl->src = *src;
+	fl->dst = *dst;
+	fl->msg = xmalloc(MSG_MAX);
+	fl->next = pcap->flows[h];
+	pcap->flows[h] = fl;
+	flow_lru_push(pcap, fl);
+	pcap->nflows++;
+	return fl;
+}
+
+static void flow_reset_record(struct flow *fl)
+{
+	fl->mark_have = 0;
+	fl->frag_left = 0;
+	fl->last_frag = 0;
+	fl->msg_len   = 0;
+	fl->msg_total = 0;
+}
+
+/*
+ * Does an RPC record plausibly start at p? Used to find our way back into
+ * a stream after joining it midway or losing part of it.
+ */
+static int rpc_record_start(const unsigned char *p)
+{
+	uint32_t mark = get_be32(p);
+	uint32_t len = mark & 0x7fffffff;
+
+	if (!(mark & 0x80000000) || len < 24 || len > 64 * 1024 * 1024) {
+		return 0;
+	}
+	switch (get_be32(p + 8)) {
+	case 0:
+		if (get_be32(p + 12) != 2) {
+			return 0;
+		}
+		switch (get_be32(p + 16)) {
+		case PROG_NFS:
+		case PROG_MOUNT:
+		case PROG_NLM:
+			return 1;
+		}
+		return 0;
+	case 1:
+		return get_be32(p + 12) == 0 && get_be32(p + 16) <= 6;
+	}
+	return 0;
+}
+
+#define RESYNC_LEN 20
+
+static void flow_feed(struct trace_pcap *pcap, struct flow *fl,
+		      const unsigned char *data, size_t len)
+{
+	size_t n, i;
+
+	if (!fl->synced) {
+		/* scan for a record start, carrying a partial header over in msg */
+		while (len > 0) {
+			n = len < MSG_MAX - fl->msg_len ? len : MSG_MAX - fl->msg_len;
+			memcpy(&fl->msg[fl->msg_len], data, n);
+			fl->msg_len += n;
+			data += n;
+			len  -= n;
+
+			for (i = 0; i + RESYNC_LEN <= fl->msg_len; i++) {
+				if (rpc_record_start(&fl->msg[i])) {
+					break;
+				}
+			}
+			if (i + RESYNC_LEN <= fl->msg_len) {
+				unsigned char *rest = xmalloc(fl->msg_len - i + len);
+
+				memcpy(rest, &fl->msg[i], fl->msg_len - i);
+				memcpy(&rest[fl->msg_len - i], data, len);
+				n = fl->msg_len - i + len;
+				fl->synced = 1;
+				flow_reset_record(fl);
+				pcap->resyncs++;
+				flow_feed(pcap, fl, rest, n);
+				free(rest);
+				return;
+			}
+			memmove(fl->msg, &fl->msg[i], fl->msg_len - i);
+			fl->msg_len -= i;
+		}
+		return;
+	}
+
+	while (len > 0) {
+		if (fl->frag_left == 0) {
+			while (fl->mark_have < 4 && len > 0) {
+				fl->mark[fl->mark_have++] = *data++;
+				len--;
+			}
+			if (fl->mark_have < 4) {
+				return;
+			}
+			fl->mark_have = 0;
+			fl->last_frag = fl->mark[0] & 0x80;
+			fl->frag_left = get_be32(fl->mark) & 0x7fffffff;
+			if (fl->frag_left > 64 * 1024 * 1024) {
+				fl->synced = 0;
+				flow_reset_record(fl);
+				flow_feed(pcap, fl, data, len);
+				return;
+			}
+		} else {
+			n = len < fl->frag_left ? len : fl->frag_left;
+			if (fl->msg_len < MSG_MAX) {
+				i = n < MSG_MAX - fl->msg_len ? n : MSG_MAX - fl->msg_len;
+				memcpy(&fl->msg[fl->msg_len], data, i);
+				fl->msg_len += i;
+			}
+			fl->msg_total += n;
+			fl->frag_left -= n;
+			data += n;
+			len  -= n;
+		}
+
+		if (fl->frag_left == 0 && fl->last_frag) {
+			process_rpc(pcap, fl->msg, fl->msg_len, &fl->src, &fl->dst);
+			flow_reset_record(fl);
+		}
+	}
+}
+
+/*
+ * Bytes that were on the wire but not in the capture. Inside the body of
+ * a fragment (typically a WRITE payload cut off by the snaplen) they can
+ * be skipped, anywhere else we have lost track of the records.
+ */
+static void flow_skip(struct trace_pcap *pcap, struct flow *fl, uint32_t len)
+{
+	if (fl->synced && fl->mark_have == 0 && len < fl->frag_left) {
+		fl->frag_left -= len;
+		fl->msg_total += len;
+		return;
+	}
+	if (fl->synced && fl->mark_have == 0 && len == fl->frag_left) {
+		fl->frag_left = 0;
+		fl->msg_total += len;
+		if (fl->last_frag) {
+			process_rpc(pcap, fl->msg, fl->msg_len, &fl->src, &fl->dst);
+			flow_reset_record(fl);
+		}
+		return;
+	}
+	fl->synced = 0;
+	flow_reset_record(fl);
+}
+
+static void flow_segment(struct trace_pcap *pcap, struct flow *fl, uint32_t seq,
+			 const unsigned char *data, uint32_t caplen, uint32_t len)
+{
+	struct segment *s, **pp;
+	int32_t diff;
+
+	if (!fl->seq_known) {
+		fl->seq_known = 1;
+		fl->next_seq  = seq;
+	}
+
+	diff = seq - fl->next_seq;
+	if (diff < 0) {
+		/* retransmission of data we already have */
+		if ((uint32_t)-diff >= len) {
+			return;
+		}
+		if ((uint32_t)-diff >= caplen) {
+			caplen = 0;
+		} else {
+			data   += -diff;
+			caplen -= -diff;
+		}
+		len -= -diff;
+		seq  = fl->next_seq;
+		diff = 0;
+	}
+
+	if (diff > 0 && !fl->synced) {
+		/* no record boundary to lose yet, just skip ahead */
+		flow_reset_record(fl);
+		fl->next_seq = seq;
+		diff = 0;
+	}
+
+	if (diff > 0) {
+		if (fl->ooo_count < MAX_OOO) {
+			s = xmalloc(sizeof(struct segment) + caplen);
+			s->seq = seq;
+			s->len = caplen;
+			memcpy(s->data, data, caplen);
+			for (pp = &fl->ooo; *pp && (int32_t)((*pp)->seq - seq) < 0;
+			     pp = &(*pp)->next)
+				;
+			s->next = *pp;
+			*pp = s;
+			fl->ooo_count++;
+			return;
+		}
+		/* the gap is never going to be filled, start over after it */
+		fl->synced   = 0;
+		flow_reset_record(fl);
+		fl->next_seq = fl->ooo->seq;
+	} else {
+		flow_feed(pcap, fl, data, caplen);
+		if (len > caplen) {
+			flow_skip(pcap, fl, len - caplen);
+		}
+		fl->next_seq = seq + len;
+	}
+
+	while ((s = fl->ooo) != NULL) {
+		diff = s->seq - fl->next_seq;
+		if (diff > 0) {
+			break;
+		}
+		fl->ooo = s->next;
+		fl->ooo_count--;
+		if ((uint32_t)-diff < s->len) {
+			flow_feed(pcap, fl, s->data + -diff, s->len + diff);
+			fl->next_seq = s->seq + s->len;
+		}
+		free(s);
+	}
+}
+
+
+static void process_tcp(struct trace_pcap *pcap, struct endpoint *src, struct endpoint *dst,
+			const unsigned char *p, uint32_t caplen, uint32_t len)
+{
+	struct flow *fl;
+	uint32_t seq, off;
+	int flags;
+
+	if (caplen < 20) {
+		return;
+	}
+	src->port = get_be16(p);
+	dst->port = get_be16(p + 2);
+	seq   = get_be32(p + 4);
+	off   = (p[12] >> 4) * 4;
+	flags = p[13];
+	if (off < 20 || off > caplen) {
+		return;
+	}
+
+	fl = flow_get(pcap, src, dst);
+	if (flags & 0x02) {			/* SYN */
+		flow_drop_ooo(fl);
+		flow_reset_record(fl);
+		fl->seq_known = 1;
+		fl->synced    = 1;
+		fl->next_seq  = seq + 1;
+		seq++;
+	}
+
+	if (len > off) {
+		flow_segment(pcap, fl, seq, p + off, caplen - off, len - off);
+	}
+
+	if (flags & 0x05) {			/* FIN or RST */
+		flow_free(pcap, fl);
+	}
+}
+
+static void process_udp(struct trace_pcap *pcap, struct endpoint *src, struct endpoint *dst,
+			const unsigned char *p, uint32_t caplen)
+{
+	if (caplen < 8) {
+		return;
+	}
+	src->port = get_be16(p);
+	dst->port = get_be16(p + 2);
+	process_rpc(pcap, p + 8, caplen - 8, src, dst);
+}
+
+static void process_ip(struct trace_pcap *pcap, const unsigned char *p, uint32_t caplen)
+{
+	struct endpoint src, dst;
+	uint32_t hlen, len;
+	int proto;
+
+	memset(&src, 0, sizeof(src));
+	memset(&dst, 0, sizeof(dst));
+
+	if (caplen < 1) {
+		return;
+	}
+	if ((p[0] >> 4) == 4) {
+		if (caplen < 20) {
+			return;
+		}
+		hlen  = (p[0] & 0x0f) * 4;
+		len   = get_be16(p + 2);
+		proto = p[9];
+		if (hlen < 20 || len < hlen || caplen < hlen) {
+			return;
+		}
+		if (get_be16(p + 6) & 0x3fff) {
+			/* fragments are not reassembled */
+			return;
+		}
+		src.addr[10] = src.addr[11] = 0xff;
+		dst.addr[10] = dst.addr[11] = 0xff;
+		memcpy(&src.addr[12], p + 12, 4);
+		memcpy(&dst.addr[12], p + 16, 4);
+	} else if ((p[0] >> 4) == 6) {
+		if (caplen < 40) {
+			return;
+		}
+		hlen  = 40;
+		len   = 40 + get_be16(p + 4);
+		proto = p[6];
+		memcpy(src.addr, p + 8, 16);
+		memcpy(dst.addr, p + 24, 16);
+		/* hop-by-hop, routing and destination options */
+		while ((proto == 0 || proto == 43 || proto == 60) && hlen + 8 <= caplen) {
+			proto = p[hlen];
+			hlen += (p[hlen + 1] + 1) * 8;
+		}
+		if (hlen > caplen) {
+			return;
+		}
+	} else {
+		return;
+	}
+
+	if (caplen > len) {
+		caplen = len;
+	}
+	if (proto == 6) {
+		process_tcp(pcap, &src, &dst, p + hlen, caplen - hlen, len - hlen);
+	} else if (proto == 17) {
+		process_udp(pcap, &src, &dst, p + hlen, caplen - hlen);
+	}
+}
+
+static void process_packet(struct trace_pcap *pcap, const unsigned char *p, uint32_t caplen)
+{
+	uint32_t off;
+	uint16_t type;
+
+	pcap->packets++;
+
+	switch (pcap->linktype) {
+	case LINKTYPE_ETHERNET:
+		if (caplen < 14) {
+			return;
+		}
+		off  = 14;
+		type = get_be16(p + 12);
+		while ((type == 0x8100 || type == 0x88a8) && caplen >= off + 4) {
+			type = get_be16(p + off + 2);
+			off += 4;
+		}
+		break;
+	case LINKTYPE_LINUX_SLL:
+		if (caplen < 16) {
+			return;
+		}
+		off  = 16;
+		type = get_be16(p + 14);
+		break;
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		process_ip(pcap, p, caplen);
+		return;
+	default:
+		return;
+	}
+
+	if (type == 0x0800 || type == 0x86dd) {
+		process_ip(pcap, p + off, caplen - off);
+	}
+}
+
+/* read and process one packet, returns 0 at the end of the capture */
+static int read_packet(struct trace_pcap *pcap)
+{
+	uint32_t hdr[4], caplen, skip;
+	uint64_t t;
+
+	if (fread(hdr, sizeof(hdr), 1, pcap->f) != 1) {
+		if (ferror(pcap->f)) {
+			fprintf(stderr, "Failed to read %s. %s\n", pcap->path, strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+	if (pcap->swapped) {
+		hdr[0] = swap32(hdr[0]);
+		hdr[1] = swap32(hdr[1]);
+		hdr[2] = swap32(hdr[2]);
+	}
+
+	caplen = hdr[2];
+	skip   = 0;
+	if (caplen > MAX_PACKET) {
+		skip   = caplen - MAX_PACKET;
+		caplen = MAX_PACKET;
+	}
+	if (fread(pcap->packet, 1, caplen, pcap->f) != caplen ||
+	    (skip && fseeko(pcap->f, skip, SEEK_CUR) != 0)) {
+		fprintf(stderr, "Truncated packet in %s\n", pcap->path);
+		return 0;
+	}
+
+	t = (uint64_t)hdr[0] * 1000000 + (pcap->nsec ? hdr[1] / 1000 : hdr[1]);
+	if (!pcap->have_time) {
+		pcap->first_time = t;
+		pcap->have_time  = 1;
+	}
+	pcap->now = t > pcap->first_time ? t - pcap->first_time : 0;
+
+	process_packet(pcap, pcap->packet, caplen);
+	return 1;
+}
+
+
+int trace_pcap_probe(const char *magic, int len)
+{
+	uint32_t m;
+
+	if (len < 4) {
+		return 0;
+	}
+	memcpy(&m, magic, 4);
+	return m == PCAP_MAGIC_USEC || m == PCAP_MAGIC_NSEC ||
+	       m == swap32(PCAP_MAGIC_USEC) || m == swap32(PCAP_MAGIC_NSEC);
+}
+
+struct trace_pcap *trace_pcap_open(const char *path)
+{
+	struct trace_pcap *pcap;
+	uint32_t hdr[6];
+
+	pcap = xcalloc(1, sizeof(struct trace_pcap));
+	pcap->path = path;
+
+	pcap->f = fopen(path, "r");
+	if (pcap->f == NULL) {
+		fprintf(stderr, "Failed to open %s. %s\n", path, strerror(errno));
+		free(pcap);
+		return NULL;
+	}
+	setvbuf(pcap->f, NULL, _IOFBF, 1024 * 1024);
+
+	if (fread(hdr, sizeof(hdr), 1, pcap->f) != 1) {
+		fprintf(stderr, "Failed to read pcap header from %s\n", path);
+		fclose(pcap->f);
+		free(pcap);
+		return NULL;
+	}
+	if (hdr[0] == swap32(PCAP_MAGIC_USEC) || hdr[0] == swap32(PCAP_MAGIC_NSEC)) {
+		pcap->swapped = 1;
+		hdr[0] = swap32(hdr[0]);
+		hdr[5] = swap32(hdr[5]);
+	}
+	pcap->nsec     = hdr[0] == PCAP_MAGIC_NSEC;
+	pcap->linktype = hdr[5] & 0x0fffffff;
+
+	switch (pcap->linktype) {
+	case LINKTYPE_ETHERNET:
+	case LINKTYPE_RAW:
+	case LINKTYPE_LINUX_SLL:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		break;
+	default:
+		fprintf(stderr, "Unsupported link type %u in %s\n", pcap->linktype, path);
+		fclose(pcap->f);
+		free(pcap);
+		return NULL;
+	}
+
+	pcap->packet = xmalloc(MAX_PACKET);
+	pcap->pending_size = MAX_PENDING;
+	pcap->pending = xcalloc(pcap->pending_size, sizeof(struct pcall *));
+	ns_resize(pcap);
+
+	return pcap;
+}
+
+int trace_pcap_next(struct trace_pcap *pcap, struct dbench_op *op)
+{
+	int ret;
+
+	while (pcap->q_count == 0) {
+		if (pcap->eof) {
+			return 0;
+		}
+		ret = read_packet(pcap);
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret == 0) {
+			/* calls still waiting for a reply never got one */
+			while (pcap->age_head != NULL) {
+				pcall_expire(pcap, pcap->age_head);
+			}
+			pcap->eof = 1;
+		}
+	}
+
+	*op = pcap->queue[pcap->q_head];
+	pcap->q_head = (pcap->q_head + 1) % pcap->q_size;
+	pcap->q_count--;
+	return 1;
+}
+
+void trace_pcap_close(struct trace_pcap *pcap)
+{
+	struct str_chunk *c;
+	struct pentry *e, *next;
+	uint32_t i;
+
+	fprintf(stderr, "%s: %lu packets, %lu calls, %lu replies, %lu unmatched replies, "
+		"%lu calls without reply, %lu unsupported calls, %lu stream resyncs\n",
+		pcap->path, pcap->packets, pcap->calls, pcap->replies, pcap->unmatched,
+		pcap->timeouts, pcap->skipped, pcap->resyncs);
+
+	while (pcap->lru_head != NULL) {
+		flow_free(pcap, pcap->lru_head);
+	}
+	while (pcap->age_head != NULL) {
+		struct pcall *pc = pcap->age_head;
+
+		pcall_unlink(pcap, pc);
+		pcall_free(pc);
+	}
+	for (i = 0; i < pcap->ns_size; i++) {
+		for (e = pcap->by_fh[i]; e; e = next) {
+			next = e->next_fh;
+			free(e->name);
+			free(e);
+		}
+	}
+	while ((c = pcap->str_head) != NULL) {
+		pcap->str_head = c->next;
+		free(c);
+	}
+
+	free(pcap->str_spare);
+	free(pcap->by_fh);
+	free(pcap->by_name);
+	free(pcap->pending);
+	free(pcap->clients);
+	free(pcap->queue);
+	free(pcap->packet);
+	fclose(pcap->f);
+	free(pcap);
+}
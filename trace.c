@@ -0,0 +1,492 @@
+/*
+   NFS trace reader
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/*
+ * Text traces use the dbench loadfile syntax, one op per line:
+ *
+ *   [timestamp [client]] OP ["fname" ["fname2"]] [params...] status
+ *
+ * The file is mapped privately and parsed in place: separators and closing
+ * quotes are overwritten with NULs so the ops can point straight into the
+ * mapping. Consumed parts of the mapping are given back with MADV_DONTNEED
+ * once the caller has released them, so RSS stays bounded no matter how
+ * large the trace is.
+ */
+
+#define TRACE_CHUNK (32 * 1024 * 1024)
+#define TRACE_CHECKPOINTS 256
+
+struct trace_checkpoint {
+	unsigned long line;
+	size_t offset;
+};
+
+struct trace {
+	const char *path;
+	struct trace_bin *bin;
+	struct trace_pcap *pcap;
+	int fd;
+	char *map;
+	size_t map_len;
+	size_t size;
+	char *pos;
+	char *end;
+	char *tail;		/* copy of an unterminated last line */
+	int tail_done;
+	unsigned long line;
+
+	size_t released;
+	size_t next_checkpoint;
+	struct trace_checkpoint checkpoints[TRACE_CHECKPOINTS];
+	int cp_head, cp_count;
+};
+
+static const char *op_names[OP_MAX] = {
+	[OP_DELTREE]      = "Deltree",
+	[OP_GETATTR3]     = "GETATTR3",
+	[OP_LOOKUP3]      = "LOOKUP3",
+	[OP_CREATE3]      = "CREATE3",
+	[OP_WRITE3]       = "WRITE3",
+	[OP_COMMIT3]      = "COMMIT3",
+	[OP_READ3]        = "READ3",
+	[OP_ACCESS3]      = "ACCESS3",
+	[OP_MKDIR3]       = "MKDIR3",
+	[OP_RMDIR3]       = "RMDIR3",
+	[OP_FSSTAT3]      = "FSSTAT3",
+	[OP_FSINFO3]      = "FSINFO3",
+	[OP_SYMLINK3]     = "SYMLINK3",
+	[OP_REMOVE3]      = "REMOVE3",
+	[OP_READDIRPLUS3] = "READDIRPLUS3",
+	[OP_RENAME3]      = "RENAME3",
+	[OP_LINK3]        = "LINK3",
+	[OP_PATHCONF3]    = "PATHCONF3",
+	[OP_READLINK3]    = "READLINK3",
+	[OP_SETATTR3]     = "SETATTR3",
+	[OP_LOCK4]        = "LOCK4",
+	[OP_UNLOCK4]      = "UNLOCK4",
+	[OP_TEST4]        = "TEST4",
+};
+
+const char *trace_op_name(int opcode)
+{
+	if (opcode < 0 || opcode >= OP_MAX) {
+		return "UNKNOWN";
+	}
+	return op_names[opcode];
+}
+
+int trace_op_lookup(const char *name, int len)
+{
+	int i;
+
+	for (i = 0; i < OP_MAX; i++) {
+		if (name[0] == op_names[i][0] &&
+		    strncmp(name, op_names[i], len) == 0 &&
+		    op_names[i][len] == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int trace_check_status(int status, const char *expected)
+{
+	if (strcmp(expected, "*") == 0) {
+		return 1;
+	}
+	if (strncmp(expected, "0x", 2) == 0) {
+		return status == strtol(expected, NULL, 16);
+	}
+	return 0;
+}
+
+static void trace_checkpoint(struct trace *trace, unsigned long line, char *p)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct trace_checkpoint *cp;
+	size_t offset = p - trace->map;
+
+	trace->next_checkpoint = offset + TRACE_CHUNK;
+	if (trace->cp_count == TRACE_CHECKPOINTS) {
+		return;
+	}
+
+	cp = &trace->checkpoints[(trace->cp_head + trace->cp_count) % TRACE_CHECKPOINTS];
+	cp->line   = line;
+	cp->offset = offset & ~(page - 1);
+	trace->cp_count++;
+}
+
+void trace_release(struct trace *trace, unsigned long line)
+{
+	struct trace_checkpoint *cp;
+	size_t offset = trace->released;
+
+	if (trace->pcap != NULL) {
+		trace_pcap_release(trace->pcap, line);
+		return;
+	}
+	if (trace->bin != NULL) {
+		trace_bin_release(trace->bin, line);
+		return;
+	}
+
+	while (trace->cp_count > 0) {
+		cp = &trace->checkpoints[trace->cp_head];
+		if (cp->line > line) {
+			break;
+		}
+		offset = cp->offset;
+		trace->cp_head = (trace->cp_head + 1) % TRACE_CHECKPOINTS;
+		trace->cp_count--;
+	}
+
+	if (offset > trace->released) {
+		madvise(trace->map + trace->released, offset - trace->released,
+			MADV_DONTNEED);
+		trace->released = offset;
+	}
+}
+
+struct trace *trace_open(const char *path)
+{
+	struct trace *trace;
+	struct stat st;
+	char magic[8];
+	char *last;
+	int len;
+
+	trace = malloc(sizeof(struct trace));
+	if (trace == NULL) {
+		fprintf(stderr, "Failed to malloc trace\n");
+		return NULL;
+	}
+	memset(trace, 0, sizeof(struct trace));
+	trace->path = path;
+
+	trace->fd = open(path, O_RDONLY);
+	if (trace->fd == -1) {
+		fprintf(stderr, "Failed to open trace %s. %s\n", path, strerror(errno));
+		free(trace);
+		return NULL;
+	}
+	if (fstat(trace->fd, &st) != 0) {
+		fprintf(stderr, "Failed to stat trace %s. %s\n", path, strerror(errno));
+		close(trace->fd);
+		free(trace);
+		return NULL;
+	}
+	trace->size = st.st_size;
+	if (trace->size == 0) {
+		return trace;
+	}
+
+	len = pread(trace->fd, magic, sizeof(magic), 0);
+	if (trace_bin_probe(magic, len)) {
+		trace->bin = trace_bin_open(path);
+		if (trace->bin == NULL) {
+			close(trace->fd);
+			free(trace);
+			return NULL;
+		}
+		return trace;
+	}
+	if (trace_pcap_probe(magic, len)) {
+		trace->pcap = trace_pcap_open(path);
+		if (trace->pcap == NULL) {
+			close(trace->fd);
+			free(trace);
+			return NULL;
+		}
+		return trace;
+	}
+
+	trace->map_len = trace->size;
+	trace->map = mmap(NULL, trace->map_len, PROT_READ|PROT_WRITE,
+			  MAP_PRIVATE, trace->fd, 0);
+	if (trace->map == MAP_FAILED) {
+		fprintf(stderr, "Failed to mmap trace %s. %s\n", path, strerror(errno));
+		close(trace->fd);
+		free(trace);
+		return NULL;
+	}
+	madvise(trace->map, trace->map_len, MADV_SEQUENTIAL);
+
+	trace->pos = trace->map;
+	trace->end = trace->map + trace->size;
+
+	/*
+	 * The parser needs every line to end in a newline it can overwrite.
+	 * If the last one does not, parse that line from a private copy.
+	 */
+	if (trace->end[-1] != '\n') {
+		last = memrchr(trace->map, '\n', trace->size);
+		last = last ? last + 1 : trace->map;
+		trace->tail = strndup(last, trace->end - last);
+		if (trace->tail == NULL) {
+			fprintf(stderr, "Failed to strdup trace tail\n");
+			exit(10);
+		}
+		trace->end = last;
+	}
+
+	return trace;
+}
+
+void trace_close(struct trace *trace)
+{
+	if (trace->bin != NULL) {
+		trace_bin_close(trace->bin);
+	}
+	if (trace->pcap != NULL) {
+		trace_pcap_close(trace->pcap);
+	}
+	if (trace->map != NULL) {
+		munmap(trace->map, trace->map_len);
+	}
+	close(trace->fd);
+	free(trace->tail);
+	free(trace);
+}
+
+static inline int is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline int is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/* "12.345678" -> usec, without going through strtod */
+static uint64_t parse_timestamp(const char *p)
+{
+	uint64_t sec = 0, usec = 0;
+	int digits = 0;
+
+	while (is_digit(*p)) {
+		sec = sec * 10 + (*p++ - '0');
+	}
+	if (*p == '.') {
+		p++;
+		while (is_digit(*p) && digits < 6) {
+			usec = usec * 10 + (*p++ - '0');
+			digits++;
+		}
+	}
+	while (digits++ < 6) {
+		usec *= 10;
+	}
+	return sec * 1000000 + usec;
+}
+
+static int64_t parse_param(const char *p)
+{
+	int64_t v = 0;
+	int neg = 0;
+
+	if (*p == '-') {
+		neg = 1;
+		p++;
+	}
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+		return neg ? -strtoll(p, NULL, 16) : strtoll(p, NULL, 16);
+	}
+	while (is_digit(*p)) {
+		v = v * 10 + (*p++ - '0');
+	}
+	return neg ? -v : v;
+}
+
+/*
+ * Split one NUL-terminated line into tokens in place. Returns the number of
+ * tokens, or -1 if a quoted string is not terminated.
+ */
+#define MAX_TOKENS 16
+
+static int tokenize(char *p, char **tok, int *quoted)
+{
+	int n = 0;
+
+	for (;;) {
+		while (is_blank(*p)) {
+			p++;
+		}
+		if (*p == 0 || *p == '#') {
+			return n;
+		}
+		if (n == MAX_TOKENS) {
+			return -1;
+		}
+		if (*p == '"') {
+			tok[n] = ++p;
+			quoted[n++] = 1;
+			p = strchr(p, '"');
+			if (p == NULL) {
+				return -1;
+			}
+			*p++ = 0;
+			continue;
+		}
+		tok[n] = p;
+		quoted[n++] = 0;
+		while (*p && !is_blank(*p)) {
+			p++;
+		}
+		if (*p == 0) {
+			return n;
+		}
+		*p++ = 0;
+	}
+}
+
+static int parse_line(struct trace *trace, char *line, struct dbench_op *op)
+{
+	char *tok[MAX_TOKENS];
+	int quoted[MAX_TOKENS];
+	int n, i, np;
+	const char *status;
+
+	n = tokenize(line, tok, quoted);
+	if (n == 0) {
+		return 0;
+	}
+	if (n < 0) {
+		goto bad;
+	}
+
+	op->child     = NULL;
+	op->fname     = NULL;
+	op->fname2    = NULL;
+	op->fh        = NULL;
+	op->fh2       = NULL;
+	op->res_fh    = NULL;
+	op->dirents   = NULL;
+	op->ndirents  = 0;
+	op->client    = 0;
+	op->timestamp = 0;
+	op->latency   = 0;
+	op->line      = trace->line;
+
+	i = 0;
+	if (!quoted[i] && is_digit(tok[i][0])) {
+		op->timestamp = parse_timestamp(tok[i++]);
+		if (i < n && !quoted[i] && is_digit(tok[i][0])) {
+			op->client = atoi(tok[i++]);
+		}
+	}
+	if (i >= n - 1) {
+		goto bad;
+	}
+
+	op->op = tok[i];
+	op->opcode = trace_op_lookup(tok[i], strlen(tok[i]));
+	if (op->opcode < 0) {
+		fprintf(stderr, "Unknown operation %s at line %lu of %s\n",
+			tok[i], trace->line, trace->path);
+		return -1;
+	}
+	i++;
+
+	status = tok[n - 1];
+	if (quoted[n - 1] || !(status[0] == '*' ||
+	    (status[0] == '0' && (status[1] == 'x' || status[1] == 'X')))) {
+		goto bad;
+	}
+	op->status = status;
+
+	for (np = 0; i < n - 1; i++) {
+		if (quoted[i] || tok[i][0] == '/') {
+			if (op->fname == NULL) {
+				op->fname = tok[i];
+			} else if (op->fname2 == NULL) {
+				op->fname2 = tok[i];
+			} else {
+				goto bad;
+			}
+			continue;
+		}
+		if (np == 10) {
+			goto bad;
+		}
+		op->params[np++] = parse_param(tok[i]);
+	}
+	while (np < 10) {
+		op->params[np++] = 0;
+	}
+
+	return 1;
+
+bad:
+	fprintf(stderr, "Badly formed line %lu in %s\n", trace->line, trace->path);
+	return -1;
+}
+
+/*
+ * Returns 1 and fills in op for the next operation, 0 at the end of the
+ * trace and -1 on a parse error.
+ */
+int trace_next(struct trace *trace, struct dbench_op *op)
+{
+	char *line, *nl;
+	int ret;
+
+	if (trace->bin != NULL) {
+		return trace_bin_next(trace->bin, op);
+	}
+	if (trace->pcap != NULL) {
+		return trace_pcap_next(trace->pcap, op);
+	}
+
+	while (trace->pos < trace->end) {
+		line = trace->pos;
+		nl = memchr(line, '\n', trace->end - line);
+		*nl = 0;
+		trace->pos = nl + 1;
+		trace->line++;
+
+		if ((size_t)(line - trace->map) >= trace->next_checkpoint) {
+			trace_checkpoint(trace, trace->line, line);
+		}
+
+		ret = parse_line(trace, line, op);
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	/* the tail stays allocated until trace_close() */
+	if (trace->tail != NULL && !trace->tail_done) {
+		trace->tail_done = 1;
+		trace->line++;
+		return parse_line(trace, trace->tail, op);
+	}
+
+	return 0;
+}
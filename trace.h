@@ -0,0 +1,138 @@
+/*
+   NFS trace reader
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Operations understood by the replayer. The names are the ones used in
+ * dbench nfs loadfiles and the values are what binary traces store, so
+ * only ever append to this list.
+ */
+enum trace_opcode {
+	OP_DELTREE = 0,
+	OP_GETATTR3,
+	OP_LOOKUP3,
+	OP_CREATE3,
+	OP_WRITE3,
+	OP_COMMIT3,
+	OP_READ3,
+	OP_ACCESS3,
+	OP_MKDIR3,
+	OP_RMDIR3,
+	OP_FSSTAT3,
+	OP_FSINFO3,
+	OP_SYMLINK3,
+	OP_REMOVE3,
+	OP_READDIRPLUS3,
+	OP_RENAME3,
+	OP_LINK3,
+	OP_PATHCONF3,
+	OP_READLINK3,
+	OP_SETATTR3,
+	OP_LOCK4,
+	OP_UNLOCK4,
+	OP_TEST4,
+	OP_MAX
+};
+
+struct child_struct;
+
+/* a file handle as it appeared in the traced traffic */
+struct trace_fh {
+	uint32_t len;
+	unsigned char data[64];
+};
+
+/* an entry a traced READDIRPLUS3 reply listed, with its handle */
+struct trace_dirent {
+	const char *name;
+	const struct trace_fh *fh;
+};
+
+/* the most entries of a READDIRPLUS3 reply an op carries */
+#define TRACE_MAX_DIRENTS 1024
+
+struct dbench_op {
+	struct child_struct *child;
+	const char *op;
+	const char *fname;
+	const char *fname2;
+	const char *status;
+	int64_t params[10];
+
+	/*
+	 * Traced handles, NULL when the trace does not have them. fh is the
+	 * object or, for ops that take a name, its directory (the existing
+	 * file for LINK3). fh2 is the second directory of RENAME3 and LINK3.
+	 * res_fh is the object the op created, looked up or removed.
+	 * dirents are the entries of a READDIRPLUS3 reply.
+	 */
+	const struct trace_fh *fh;
+	const struct trace_fh *fh2;
+	const struct trace_fh *res_fh;
+	const struct trace_dirent *dirents;
+	int ndirents;
+
+	int opcode;
+	int client;		/* traced client, 0 if the trace has none */
+	unsigned long line;	/* line (or record) number in the trace */
+	uint64_t timestamp;	/* usec since the start of the trace */
+	uint64_t latency;	/* usec the traced call took, 0 if the trace does not say */
+};
+
+struct trace;
+
+/*
+ * A trace is read one op at a time. The strings an op points to stay valid
+ * until trace_release() is called with a line past the op's line, or until
+ * the trace is closed.
+ */
+struct trace *trace_open(const char *path);
+int trace_next(struct trace *trace, struct dbench_op *op);
+void trace_release(struct trace *trace, unsigned long line);
+void trace_close(struct trace *trace);
+
+const char *trace_op_name(int opcode);
+int trace_op_lookup(const char *name, int len);
+
+/* does status match the expected status of an op, "0x..." or "*" */
+int trace_check_status(int status, const char *expected);
+
+/* binary traces, see trace-bin.c */
+struct trace_writer;
+
+struct trace_writer *trace_writer_open(const char *path, int level);
+int trace_writer_add(struct trace_writer *w, const struct dbench_op *op);
+int trace_writer_close(struct trace_writer *w);
+
+struct trace_bin;
+
+int trace_bin_probe(const char *magic, int len);
+struct trace_bin *trace_bin_open(const char *path);
+int trace_bin_next(struct trace_bin *bin, struct dbench_op *op);
+void trace_bin_release(struct trace_bin *bin, unsigned long line);
+void trace_bin_close(struct trace_bin *bin);
+
+/* NFSv3 traffic captured with tcpdump, see trace-pcap.c */
+struct trace_pcap;
+
+int trace_pcap_probe(const char *magic, int len);
+struct trace_pcap *trace_pcap_open(const char *path);
+int trace_pcap_next(struct trace_pcap *pcap, struct dbench_op *op);
+void trace_pcap_release(struct trace_pcap *pcap, unsigned long line);
+void trace_pcap_close(struct trace_pcap *pcap);
+
+#endif /* _TRACE_H_ */
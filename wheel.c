@@ -0,0 +1,228 @@
+/*
+   Hierarchical timer wheel
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+/*
+ * The timer of a tick lands in the level of the highest byte in which
+ * its due time differs from now, in the slot given by that byte of its
+ * due time. Whenever now crosses into a slot that has timers, they are
+ * moved down to the levels below, so adding a timer, expiring it and
+ * finding the next one to expire all take a few bitmap operations and
+ * do not depend on the number of timers. The only exception is
+ * wheel_next(), which looks for the earliest timer of a slot above level
+ * 0, but that slot is at least 256 ticks away.
+ */
+
+#include <string.h>
+
+#include "wheel.h"
+
+static void list_init(struct wheel_list *l)
+{
+	l->first = NULL;
+	l->last  = &l->first;
+}
+
+static void list_append(struct wheel_list *l, struct wheel_timer *t)
+{
+	t->next  = NULL;
+	*l->last = t;
+	l->last  = &t->next;
+}
+
+static void list_splice(struct wheel_list *l, struct wheel_list *from)
+{
+	if (from->first == NULL) {
+		return;
+	}
+	*l->last = from->first;
+	l->last  = from->last;
+	list_init(from);
+}
+
+void wheel_init(struct wheel *w, uint64_t now)
+{
+	int l, s;
+
+	memset(w, 0, sizeof(struct wheel));
+	w->now = now;
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		for (s = 0; s < WHEEL_SLOTS; s++) {
+			list_init(&w->slot[l][s]);
+		}
+	}
+	list_init(&w->far);
+	list_init(&w->expired);
+}
+
+static void wheel_place(struct wheel *w, struct wheel_timer *t)
+{
+	uint64_t diff = t->due ^ w->now;
+	int level, slot;
+
+	if (t->due <= w->now) {
+		list_append(&w->expired, t);
+		return;
+	}
+	if (diff >> (WHEEL_BITS * WHEEL_LEVELS)) {
+		list_append(&w->far, t);
+		return;
+	}
+	level = (63 - __builtin_clzll(diff)) / WHEEL_BITS;
+	slot  = (t->due >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+	list_append(&w->slot[level][slot], t);
+	w->used[level][slot / 64] |= 1ULL << (slot % 64);
+}
+
+void wheel_add(struct wheel *w, struct wheel_timer *t)
+{
+	w->count++;
+	wheel_place(w, t);
+}
+
+/* the first used slot of level after slot, or -1 */
+static int next_used(const struct wheel *w, int level, int slot)
+{
+	uint64_t bits;
+	int i;
+
+	if (slot >= WHEEL_SLOTS) {
+		return -1;
+	}
+	i    = slot / 64;
+	bits = w->used[level][i] & (~0ULL << (slot % 64));
+	for (;;) {
+		if (bits) {
+			return i * 64 + __builtin_ctzll(bits);
+		}
+		if (++i == WHEEL_SLOTS / 64) {
+			return -1;
+		}
+		bits = w->used[level][i];
+	}
+}
+
+/*
+ * The next tick the wheel has to stop at, to expire a level 0 slot or
+ * move a higher one down, and which slot that is. Level WHEEL_LEVELS is
+ * the far list.
+ */
+static uint64_t wheel_event(const struct wheel *w, int *level, int *slot)
+{
+	int l, s, shift;
+
+	for (l = 0; l < WHEEL_LEVELS; l++) {
+		shift = l * WHEEL_BITS;
+		s = next_used(w, l, ((w->now >> shift) & (WHEEL_SLOTS - 1)) + 1);
+		if (s >= 0) {
+			*level = l;
+			*slot  = s;
+			return ((w->now >> (shift + WHEEL_BITS)) << (shift + WHEEL_BITS)) |
+			       ((uint64_t)s << shift);
+		}
+	}
+	if (w->far.first != NULL) {
+		*level = WHEEL_LEVELS;
+		*slot  = 0;
+		return ((w->now >> (WHEEL_BITS * WHEEL_LEVELS)) + 1) <<
+		       (WHEEL_BITS * WHEEL_LEVELS);
+	}
+	return UINT64_MAX;
+}
+
+/* the due time of the earliest timer, now if some have expired */
+uint64_t wheel_next(const struct wheel *w)
+{
+	const struct wheel_list *l;
+	const struct wheel_timer *t;
+	uint64_t next;
+	int level, slot;
+
+	if (w->expired.first != NULL) {
+		return w->now;
+	}
+	next = wheel_event(w, &level, &slot);
+	if (next == UINT64_MAX || level == 0) {
+		return next;
+	}
+
+	l = level < WHEEL_LEVELS ? &w->slot[level][slot] : &w->far;
+	for (next = UINT64_MAX, t = l->first; t; t = t->next) {
+		if (t->due < next) {
+			next = t->due;
+		}
+	}
+	return next;
+}
+
+static void wheel_cascade(struct wheel *w, int level, int slot)
+{
+	struct wheel_list *l = &w->slot[level][slot];
+	struct wheel_timer *t, *next;
+
+	t = l->first;
+	list_init(l);
+	w->used[level][slot / 64] &= ~(1ULL << (slot % 64));
+	for (; t; t = next) {
+		next = t->next;
+		wheel_place(w, t);
+	}
+}
+
+/* move the wheel forward to now, expiring every timer due by then */
+void wheel_advance(struct wheel *w, uint64_t now)
+{
+	struct wheel_timer *t, *next;
+	uint64_t tick;
+	int level, slot, l;
+
+	while ((tick = wheel_event(w, &level, &slot)) <= now) {
+		w->now = tick;
+
+		if (level == WHEEL_LEVELS) {
+			t = w->far.first;
+			list_init(&w->far);
+			for (; t; t = next) {
+				next = t->next;
+				wheel_place(w, t);
+			}
+			level = WHEEL_LEVELS - 1;
+		}
+		for (l = level; l > 0; l--) {
+			wheel_cascade(w, l, (tick >> (l * WHEEL_BITS)) & (WHEEL_SLOTS - 1));
+		}
+
+		slot = tick & (WHEEL_SLOTS - 1);
+		list_splice(&w->expired, &w->slot[0][slot]);
+		w->used[0][slot / 64] &= ~(1ULL << (slot % 64));
+	}
+	if (now > w->now) {
+		w->now = now;
+	}
+}
+
+/* the next expired timer, or NULL */
+struct wheel_timer *wheel_expire(struct wheel *w)
+{
+	struct wheel_timer *t = w->expired.first;
+
+	if (t == NULL) {
+		return NULL;
+	}
+	w->expired.first = t->next;
+	if (w->expired.first == NULL) {
+		w->expired.last = &w->expired.first;
+	}
+	w->count--;
+	return t;
+}
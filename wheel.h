@@ -0,0 +1,56 @@
+/*
+   Hierarchical timer wheel
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include <stdint.h>
+
+#define WHEEL_BITS	8
+#define WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define WHEEL_LEVELS	4
+
+/* a timer, embedded in whatever is waiting for it */
+struct wheel_timer {
+	struct wheel_timer *next;
+	uint64_t due;
+};
+
+struct wheel_list {
+	struct wheel_timer *first;
+	struct wheel_timer **last;
+};
+
+/*
+ * Timers are kept in ticks of whatever unit the caller uses, all of them
+ * relative to the same origin. Level l holds the timers due in the
+ * current level l+1 slot, 256^l ticks per slot; the ones further out than
+ * the top level wait in far. A timer moves down a level each time the
+ * wheel reaches its slot, and is expired when it reaches level 0.
+ */
+struct wheel {
+	uint64_t now;
+	struct wheel_list slot[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t used[WHEEL_LEVELS][WHEEL_SLOTS / 64];
+	struct wheel_list far;
+	struct wheel_list expired;
+	unsigned long count;
+};
+
+void wheel_init(struct wheel *w, uint64_t now);
+void wheel_add(struct wheel *w, struct wheel_timer *t);
+uint64_t wheel_next(const struct wheel *w);
+void wheel_advance(struct wheel *w, uint64_t now);
+struct wheel_timer *wheel_expire(struct wheel *w);
+
+#endif /* _WHEEL_H_ */